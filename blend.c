@@ -0,0 +1,267 @@
+#include "blend.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INFOTO_BLEND_X86 1
+#endif
+
+/* Pixels blended per chunk, bounds the expanded coverage buffer */
+#define CHUNK_PIXELS 64
+#define CHUNK_BYTES (CHUNK_PIXELS * 4)
+
+/**
+ * Function pointer type for blending color bytes over destination bytes with
+ * a per byte alpha.
+ */
+typedef void (*blend_bytes_fn)(uint8_t *, const uint8_t *, const uint8_t *,
+                               size_t);
+
+/**
+ * Divide by 255 with rounding, exact for x <= 255 * 255.
+ *
+ * @param[in] x The value to divide.
+ * @returns The rounded quotient.
+ */
+static inline uint8_t div255(unsigned x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+/**
+ * Blend color bytes over destination bytes, one byte at a time.
+ *
+ * @param[in,out] dst The destination bytes.
+ * @param[in] alpha The alpha for each byte.
+ * @param[in] color The color for each byte.
+ * @param[in] len The number of bytes.
+ */
+static void blend_bytes_scalar(uint8_t *dst, const uint8_t *alpha,
+                               const uint8_t *color, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    const unsigned a = alpha[i];
+    dst[i] = div255(dst[i] * (255 - a) + color[i] * a);
+  }
+}
+
+#ifdef INFOTO_BLEND_X86
+/**
+ * Blend eight 16-bit lanes, the same math as div255.
+ *
+ * @param[in] d The destination lanes.
+ * @param[in] a The alpha lanes.
+ * @param[in] c The color lanes.
+ * @returns The blended lanes.
+ */
+__attribute__((target("sse2"))) static inline __m128i
+blend_lanes_sse2(__m128i d, __m128i a, __m128i c) {
+  const __m128i max = _mm_set1_epi16(255);
+  const __m128i half = _mm_set1_epi16(128);
+  __m128i x = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(max, a)),
+                            _mm_mullo_epi16(c, a));
+  x = _mm_add_epi16(x, half);
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/**
+ * Blend color bytes over destination bytes, 16 bytes at a time.
+ *
+ * @param[in,out] dst The destination bytes.
+ * @param[in] alpha The alpha for each byte.
+ * @param[in] color The color for each byte.
+ * @param[in] len The number of bytes.
+ */
+__attribute__((target("sse2"))) static void
+blend_bytes_sse2(uint8_t *dst, const uint8_t *alpha, const uint8_t *color,
+                 size_t len) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    const __m128i d = _mm_loadu_si128((const __m128i *)&dst[i]);
+    const __m128i a = _mm_loadu_si128((const __m128i *)&alpha[i]);
+    const __m128i c = _mm_loadu_si128((const __m128i *)&color[i]);
+    const __m128i lo = blend_lanes_sse2(_mm_unpacklo_epi8(d, zero),
+                                        _mm_unpacklo_epi8(a, zero),
+                                        _mm_unpacklo_epi8(c, zero));
+    const __m128i hi = blend_lanes_sse2(_mm_unpackhi_epi8(d, zero),
+                                        _mm_unpackhi_epi8(a, zero),
+                                        _mm_unpackhi_epi8(c, zero));
+    _mm_storeu_si128((__m128i *)&dst[i], _mm_packus_epi16(lo, hi));
+  }
+  blend_bytes_scalar(&dst[i], &alpha[i], &color[i], len - i);
+}
+
+/**
+ * Blend sixteen 16-bit lanes, the same math as div255.
+ *
+ * @param[in] d The destination lanes.
+ * @param[in] a The alpha lanes.
+ * @param[in] c The color lanes.
+ * @returns The blended lanes.
+ */
+__attribute__((target("avx2"))) static inline __m256i
+blend_lanes_avx2(__m256i d, __m256i a, __m256i c) {
+  const __m256i max = _mm256_set1_epi16(255);
+  const __m256i half = _mm256_set1_epi16(128);
+  __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_sub_epi16(max, a)),
+                               _mm256_mullo_epi16(c, a));
+  x = _mm256_add_epi16(x, half);
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+/**
+ * Blend color bytes over destination bytes, 32 bytes at a time.
+ * Unpack and pack both work within 128-bit lanes, so byte order is kept.
+ *
+ * @param[in,out] dst The destination bytes.
+ * @param[in] alpha The alpha for each byte.
+ * @param[in] color The color for each byte.
+ * @param[in] len The number of bytes.
+ */
+__attribute__((target("avx2"))) static void
+blend_bytes_avx2(uint8_t *dst, const uint8_t *alpha, const uint8_t *color,
+                 size_t len) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    const __m256i d = _mm256_loadu_si256((const __m256i *)&dst[i]);
+    const __m256i a = _mm256_loadu_si256((const __m256i *)&alpha[i]);
+    const __m256i c = _mm256_loadu_si256((const __m256i *)&color[i]);
+    const __m256i lo = blend_lanes_avx2(_mm256_unpacklo_epi8(d, zero),
+                                        _mm256_unpacklo_epi8(a, zero),
+                                        _mm256_unpacklo_epi8(c, zero));
+    const __m256i hi = blend_lanes_avx2(_mm256_unpackhi_epi8(d, zero),
+                                        _mm256_unpackhi_epi8(a, zero),
+                                        _mm256_unpackhi_epi8(c, zero));
+    _mm256_storeu_si256((__m256i *)&dst[i], _mm256_packus_epi16(lo, hi));
+  }
+  blend_bytes_sse2(&dst[i], &alpha[i], &color[i], len - i);
+}
+#endif
+
+static blend_bytes_fn blend_bytes = blend_bytes_scalar;
+static infoto_blend_impl blend_impl = INFOTO_BLEND_SCALAR;
+
+/**
+ * Pick the fastest blend kernel the CPU supports.
+ * Until this is called the scalar kernel is used.
+ */
+void infoto_blend_init(void) {
+  if (!infoto_blend_select(INFOTO_BLEND_AVX2) &&
+      !infoto_blend_select(INFOTO_BLEND_SSE2)) {
+    infoto_blend_select(INFOTO_BLEND_SCALAR);
+  }
+}
+
+/**
+ * Force the given blend kernel.
+ *
+ * @param[in] impl The kernel to use.
+ * @returns 1 if the CPU supports the kernel and it was selected, 0 otherwise.
+ */
+int infoto_blend_select(infoto_blend_impl impl) {
+  switch (impl) {
+  case INFOTO_BLEND_SCALAR:
+    blend_bytes = blend_bytes_scalar;
+    break;
+#ifdef INFOTO_BLEND_X86
+  case INFOTO_BLEND_SSE2:
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse2")) {
+      return 0;
+    }
+    blend_bytes = blend_bytes_sse2;
+    break;
+  case INFOTO_BLEND_AVX2:
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2")) {
+      return 0;
+    }
+    blend_bytes = blend_bytes_avx2;
+    break;
+#endif
+  default:
+    return 0;
+  }
+  blend_impl = impl;
+  return 1;
+}
+
+/**
+ * Get the name of the selected blend kernel.
+ *
+ * @returns The kernel name.
+ */
+const char *infoto_blend_name(void) {
+  switch (blend_impl) {
+  case INFOTO_BLEND_SSE2:
+    return "sse2";
+  case INFOTO_BLEND_AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+/**
+ * Alpha blend a color over a span of pixels using 8-bit coverage.
+ * Each channel becomes dst + (color - dst) * coverage / 255, rounded.
+ *
+ * @param[in,out] dst The first pixel of the span.
+ * @param[in] coverage One coverage value per pixel.
+ * @param[in] pixels The number of pixels in the span.
+ * @param[in] num_components The number of components per pixel (1 to 4).
+ * @param[in] color The color's components, num_components values.
+ */
+void infoto_blend_span(uint8_t *dst, const uint8_t *coverage, size_t pixels,
+                       int num_components, const uint8_t color[4]) {
+  uint8_t alpha[CHUNK_BYTES];
+  uint8_t pattern[CHUNK_BYTES];
+  // the color repeats every pixel and every chunk starts on a pixel
+  const size_t chunk = pixels < CHUNK_PIXELS ? pixels : CHUNK_PIXELS;
+  for (size_t i = 0; i < chunk; ++i) {
+    for (int c = 0; c < num_components; ++c) {
+      pattern[i * num_components + c] = color[c];
+    }
+  }
+  for (size_t p = 0; p < pixels; p += CHUNK_PIXELS) {
+    const size_t n = pixels - p < CHUNK_PIXELS ? pixels - p : CHUNK_PIXELS;
+    const uint8_t *chunk_alpha = &coverage[p];
+    // every component of a pixel uses the pixel's coverage
+    if (num_components > 1) {
+      for (size_t i = 0; i < n; ++i) {
+        for (int c = 0; c < num_components; ++c) {
+          alpha[i * num_components + c] = coverage[p + i];
+        }
+      }
+      chunk_alpha = alpha;
+    }
+    blend_bytes(&dst[p * num_components], chunk_alpha, pattern,
+                n * num_components);
+  }
+}
+
+/**
+ * Composite premultiplied pixels over a span of pixels.
+ * Each channel becomes src + dst * (255 - alpha) / 255, rounded.
+ *
+ * @param[in,out] dst The first pixel of the span.
+ * @param[in] src The premultiplied pixels, num_components values each.
+ * @param[in] alpha One alpha value per pixel.
+ * @param[in] pixels The number of pixels in the span.
+ * @param[in] num_components The number of components per pixel (1 to 4).
+ */
+void infoto_blend_premultiplied(uint8_t *dst, const uint8_t *src,
+                                const uint8_t *alpha, size_t pixels,
+                                int num_components) {
+  for (size_t i = 0; i < pixels; ++i) {
+    const unsigned inv = 255 - alpha[i];
+    // fully transparent logo pixels are common, leave them alone
+    if (inv == 255) {
+      continue;
+    }
+    for (int c = 0; c < num_components; ++c) {
+      const size_t idx = i * num_components + c;
+      dst[idx] = src[idx] + div255(dst[idx] * inv);
+    }
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef INFOTO_BLEND_H
+#define INFOTO_BLEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Blend kernel implementations.
+ */
+typedef enum {
+  INFOTO_BLEND_SCALAR,
+  INFOTO_BLEND_SSE2,
+  INFOTO_BLEND_AVX2
+} infoto_blend_impl;
+
+/**
+ * Pick the fastest blend kernel the CPU supports.
+ * Until this is called the scalar kernel is used.
+ */
+void infoto_blend_init(void);
+
+/**
+ * Force the given blend kernel.
+ *
+ * @param[in] impl The kernel to use.
+ * @returns 1 if the CPU supports the kernel and it was selected, 0 otherwise.
+ */
+int infoto_blend_select(infoto_blend_impl impl);
+
+/**
+ * Get the name of the selected blend kernel.
+ *
+ * @returns The kernel name.
+ */
+const char *infoto_blend_name(void);
+
+/**
+ * Alpha blend a color over a span of pixels using 8-bit coverage.
+ * Each channel becomes dst + (color - dst) * coverage / 255, rounded.
+ *
+ * @param[in,out] dst The first pixel of the span.
+ * @param[in] coverage One coverage value per pixel.
+ * @param[in] pixels The number of pixels in the span.
+ * @param[in] num_components The number of components per pixel (1 to 4).
+ * @param[in] color The color's components, num_components values.
+ */
+void infoto_blend_span(uint8_t *dst, const uint8_t *coverage, size_t pixels,
+                       int num_components, const uint8_t color[4]);
+
+/**
+ * Composite premultiplied pixels over a span of pixels.
+ * Each channel becomes src + dst * (255 - alpha) / 255, rounded.
+ *
+ * @param[in,out] dst The first pixel of the span.
+ * @param[in] src The premultiplied pixels, num_components values each.
+ * @param[in] alpha One alpha value per pixel.
+ * @param[in] pixels The number of pixels in the span.
+ * @param[in] num_components The number of components per pixel (1 to 4).
+ */
+void infoto_blend_premultiplied(uint8_t *dst, const uint8_t *src,
+                                const uint8_t *alpha, size_t pixels,
+                                int num_components);
+
+#endif
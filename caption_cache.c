@@ -0,0 +1,218 @@
+#include "caption_cache.h"
+#include "hash_util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A cached strip along with the key it was rendered for.
+ */
+struct caption_entry {
+  uint64_t hash;
+  // owned copies of the key strings
+  char *caption;
+  char *ttf_file;
+  infoto_caption_key key;
+  uint8_t *strip;
+  size_t strip_len;
+  size_t strip_cap;
+  // tick of the last use, 0 when the entry is empty
+  uint64_t last_used;
+};
+
+/**
+ * Least recently used cache of fully composited caption strips.
+ */
+struct infoto_caption_cache {
+  struct caption_entry *entries;
+  size_t cap;
+  uint64_t tick;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/**
+ * Hash every field of the caption key.
+ *
+ * @param[in] key The caption key.
+ * @returns The hash value.
+ */
+static uint64_t hash_key(const infoto_caption_key *key) {
+  const int layout[] = {key->point,  key->font_color,  key->background_color,
+                        key->border, key->image_width, key->num_components};
+  uint64_t hash = infoto_hash64(layout, sizeof(layout), 0);
+  hash = infoto_hash64(key->caption, strlen(key->caption), hash);
+  return infoto_hash64(key->ttf_file, strlen(key->ttf_file), hash);
+}
+
+/**
+ * Check if the entry was rendered for the given key.
+ *
+ * @param[in] entry The cache entry.
+ * @param[in] hash The hash of the key.
+ * @param[in] key The caption key.
+ * @returns 1 if the entry matches, 0 otherwise.
+ */
+static int entry_matches(const struct caption_entry *entry, uint64_t hash,
+                         const infoto_caption_key *key) {
+  return entry->last_used != 0 && entry->hash == hash &&
+         entry->key.point == key->point &&
+         entry->key.font_color == key->font_color &&
+         entry->key.background_color == key->background_color &&
+         entry->key.border == key->border &&
+         entry->key.image_width == key->image_width &&
+         entry->key.num_components == key->num_components &&
+         strcmp(entry->caption, key->caption) == 0 &&
+         strcmp(entry->ttf_file, key->ttf_file) == 0;
+}
+
+/**
+ * Replace the owned copy of a key string, reusing its memory if it fits.
+ *
+ * @param[in,out] dst The owned string.
+ * @param[in] src The string to copy.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum copy_key_str(char **dst, const char *src) {
+  const size_t len = strlen(src);
+  if (*dst == NULL || strlen(*dst) < len) {
+    char *tmp = (char *)realloc(*dst, len + 1);
+    if (tmp == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    *dst = tmp;
+  }
+  memcpy(*dst, src, len + 1);
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Initialize a caption cache.
+ *
+ * @param[in] capacity The max number of strips to keep.
+ * @param[out] cache The cache to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_caption_cache_init(size_t capacity,
+                                            infoto_caption_cache **cache) {
+  if (capacity == 0) {
+    capacity = 1;
+  }
+  struct infoto_caption_cache *local =
+      (struct infoto_caption_cache *)calloc(1, sizeof(struct infoto_caption_cache));
+  if (local == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  local->entries =
+      (struct caption_entry *)calloc(capacity, sizeof(struct caption_entry));
+  if (local->entries == NULL) {
+    free(local);
+    return INFOTO_ERR_MALLOC;
+  }
+  local->cap = capacity;
+  *cache = local;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Get the strip rendered for the given key.
+ *
+ * @param[in,out] cache The cache, hit/miss counters are updated.
+ * @param[in] key The caption key.
+ * @returns The strip, border * image_width * num_components bytes, or NULL
+ * if the strip is not cached. Valid until the next put.
+ */
+const uint8_t *infoto_caption_cache_get(infoto_caption_cache *cache,
+                                        const infoto_caption_key *key) {
+  const uint64_t hash = hash_key(key);
+  for (size_t i = 0; i < cache->cap; ++i) {
+    struct caption_entry *entry = &cache->entries[i];
+    if (entry_matches(entry, hash, key)) {
+      entry->last_used = ++cache->tick;
+      ++cache->hits;
+      return entry->strip;
+    }
+  }
+  ++cache->misses;
+  return NULL;
+}
+
+/**
+ * Store a copy of the strip rendered for the given key, evicting the least
+ * recently used strip when the cache is full.
+ *
+ * @param[in,out] cache The cache.
+ * @param[in] key The caption key.
+ * @param[in] strip The rendered strip.
+ * @param[in] len The length of the strip in bytes.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_caption_cache_put(infoto_caption_cache *cache,
+                                           const infoto_caption_key *key,
+                                           const uint8_t *strip, size_t len) {
+  const uint64_t hash = hash_key(key);
+  // an empty entry has the lowest tick so it is always picked first
+  struct caption_entry *victim = &cache->entries[0];
+  for (size_t i = 0; i < cache->cap; ++i) {
+    struct caption_entry *entry = &cache->entries[i];
+    if (entry_matches(entry, hash, key)) {
+      victim = entry;
+      break;
+    }
+    if (entry->last_used < victim->last_used) {
+      victim = entry;
+    }
+  }
+  // mark empty until the copy is complete
+  victim->last_used = 0;
+  if (victim->strip_cap < len) {
+    uint8_t *tmp = (uint8_t *)realloc(victim->strip, len);
+    if (tmp == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    victim->strip = tmp;
+    victim->strip_cap = len;
+  }
+  if (copy_key_str(&victim->caption, key->caption) != INFOTO_SUCCESS ||
+      copy_key_str(&victim->ttf_file, key->ttf_file) != INFOTO_SUCCESS) {
+    return INFOTO_ERR_MALLOC;
+  }
+  memcpy(victim->strip, strip, len);
+  victim->strip_len = len;
+  victim->key = *key;
+  victim->key.caption = victim->caption;
+  victim->key.ttf_file = victim->ttf_file;
+  victim->hash = hash;
+  victim->last_used = ++cache->tick;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Get the number of lookups that were hits and misses.
+ *
+ * @param[in] cache The cache.
+ * @param[out] hits The number of hits.
+ * @param[out] misses The number of misses.
+ */
+void infoto_caption_cache_stats(const infoto_caption_cache *cache,
+                                uint64_t *hits, uint64_t *misses) {
+  *hits = cache->hits;
+  *misses = cache->misses;
+}
+
+/**
+ * Free the cache and every strip in it.
+ *
+ * @param[in,out] cache The cache to free.
+ */
+void infoto_caption_cache_free(infoto_caption_cache **cache) {
+  struct infoto_caption_cache *local = *cache;
+  for (size_t i = 0; i < local->cap; ++i) {
+    free(local->entries[i].caption);
+    free(local->entries[i].ttf_file);
+    free(local->entries[i].strip);
+  }
+  free(local->entries);
+  free(local);
+  *cache = NULL;
+}
@@ -0,0 +1,87 @@
+#ifndef INFOTO_CAPTION_CACHE_H
+#define INFOTO_CAPTION_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "error_codes.h"
+
+/* Default number of caption strips kept */
+#define INFOTO_CAPTION_CACHE_DEFAULT_CAP 16
+
+/**
+ * Everything that determines the pixels of a rendered caption strip.
+ */
+typedef struct {
+  const char *caption;
+  const char *ttf_file;
+  int point;
+  background_color font_color;
+  background_color background_color;
+  // border height in pixels
+  int border;
+  int image_width;
+  int num_components;
+} infoto_caption_key;
+
+/**
+ * Least recently used cache of fully composited caption strips.
+ * Consecutive images with the same caption and layout reuse the strip
+ * instead of laying out and compositing the glyphs again.
+ */
+typedef struct infoto_caption_cache infoto_caption_cache;
+
+/**
+ * Initialize a caption cache.
+ *
+ * @param[in] capacity The max number of strips to keep.
+ * @param[out] cache The cache to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_caption_cache_init(size_t capacity,
+                                            infoto_caption_cache **cache);
+
+/**
+ * Get the strip rendered for the given key.
+ *
+ * @param[in,out] cache The cache, hit/miss counters are updated.
+ * @param[in] key The caption key.
+ * @returns The strip, border * image_width * num_components bytes, or NULL
+ * if the strip is not cached. Valid until the next put.
+ */
+const uint8_t *infoto_caption_cache_get(infoto_caption_cache *cache,
+                                        const infoto_caption_key *key);
+
+/**
+ * Store a copy of the strip rendered for the given key, evicting the least
+ * recently used strip when the cache is full.
+ *
+ * @param[in,out] cache The cache.
+ * @param[in] key The caption key.
+ * @param[in] strip The rendered strip.
+ * @param[in] len The length of the strip in bytes.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_caption_cache_put(infoto_caption_cache *cache,
+                                           const infoto_caption_key *key,
+                                           const uint8_t *strip, size_t len);
+
+/**
+ * Get the number of lookups that were hits and misses.
+ *
+ * @param[in] cache The cache.
+ * @param[out] hits The number of hits.
+ * @param[out] misses The number of misses.
+ */
+void infoto_caption_cache_stats(const infoto_caption_cache *cache,
+                                uint64_t *hits, uint64_t *misses);
+
+/**
+ * Free the cache and every strip in it.
+ *
+ * @param[in,out] cache The cache to free.
+ */
+void infoto_caption_cache_free(infoto_caption_cache **cache);
+
+#endif
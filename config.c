@@ -3,11 +3,19 @@
 #include <stdio.h>
 #include <string.h>
 
-void infoto_init_config(config *cfg) { init_metadata_array(&cfg->metadata, 1); }
+void infoto_init_config(config *cfg) {
+  init_metadata_array(&cfg->metadata, 1);
+  cfg->watermark.png_file = NULL;
+  cfg->watermark.opacity = 1.0f;
+  cfg->watermark.scale = 0.15f;
+  cfg->watermark.anchor = WATERMARK_BOTTOM_RIGHT;
+  cfg->watermark.placement = WATERMARK_ON_BORDER;
+}
 
 void infoto_free_config(config *cfg) {
   free(cfg->target);
   free(cfg->font.ttf_file);
+  free(cfg->watermark.png_file);
   free_metadata_array(&cfg->metadata);
 }
 
@@ -26,11 +34,21 @@ void infoto_print_config(const config *cfg) {
   printf("\tttf_file: %s\n", cfg->font.ttf_file);
   printf("\tcolor: %d\n", cfg->font.color);
   printf("\tpoint: %d\n", cfg->font.point);
+  printf("\tauto_fit: %d\n", cfg->font.auto_fit);
   printf("}\n");
   printf("background: {\n");
   printf("\tcolor: %d\n", cfg->background.color);
   printf("\tpixels: %d\n", cfg->background.pixels);
   printf("}\n");
+  if (cfg->watermark.png_file != NULL) {
+    printf("watermark: {\n");
+    printf("\tpng_file: %s\n", cfg->watermark.png_file);
+    printf("\topacity: %f\n", cfg->watermark.opacity);
+    printf("\tscale: %f\n", cfg->watermark.scale);
+    printf("\tanchor: %d\n", cfg->watermark.anchor);
+    printf("\tplacement: %d\n", cfg->watermark.placement);
+    printf("}\n");
+  }
   printf("metadata: [\n");
   for (int i = 0; i < cfg->metadata.len; ++i) {
     metadata_info info;
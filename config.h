@@ -46,8 +46,10 @@ typedef enum {
  * structure defining font info.
  */
 typedef struct {
-  // font point size
+  // font point size, the max size when auto_fit is set
   int point;
+  // shrink the font until the caption fits the border
+  int auto_fit;
   // color value
   background_color color;
   // file name for TTF file
@@ -64,12 +66,48 @@ typedef struct {
   int pixels;
 } background_info;
 
+/**
+ * Enumeration of watermark anchors.
+ */
+typedef enum {
+  WATERMARK_BOTTOM_RIGHT,
+  WATERMARK_BOTTOM_LEFT,
+  WATERMARK_TOP_RIGHT,
+  WATERMARK_TOP_LEFT,
+  WATERMARK_CENTER
+} watermark_anchor;
+
+/**
+ * Enumeration of where the watermark is placed.
+ */
+typedef enum {
+  // inside the border, next to the image
+  WATERMARK_ON_BORDER,
+  // over the image
+  WATERMARK_ON_IMAGE
+} watermark_placement;
+
+/**
+ * structure defining watermark info
+ */
+typedef struct {
+  // file name for the PNG logo, NULL for no watermark
+  char *png_file;
+  // 0 to 1, multiplies the logo's alpha
+  float opacity;
+  // logo width as a fraction of the image width
+  float scale;
+  watermark_anchor anchor;
+  watermark_placement placement;
+} watermark_info;
+
 /**
  * Configuration object to handle infoto logic
  */
 typedef struct {
   font_info font;
   background_info background;
+  watermark_info watermark;
   metadata_array metadata;
   char *target;
 } config;
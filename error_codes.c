@@ -78,6 +78,9 @@ const char *infoto_err_code_to_str(const infoto_error_enum code) {
   case INFOTO_ERR_GLYPH_STR_ADD:
     result = "INFOTO_ERR_GLYPH_STR_ADD";
     break;
+  case INFOTO_ERR_EXIF_UNKNOWN_TAG:
+    result = "INFOTO_ERR_EXIF_UNKNOWN_TAG";
+    break;
   }
   return result;
 }
@@ -26,7 +26,8 @@ typedef enum {
   INFOTO_ERR_TTF_LOAD_CHAR,
   INFOTO_ERR_TTF_GET_GLYPH,
   INFOTO_ERR_GLYPH_STR_INIT,
-  INFOTO_ERR_GLYPH_STR_ADD
+  INFOTO_ERR_GLYPH_STR_ADD,
+  INFOTO_ERR_EXIF_UNKNOWN_TAG
 } infoto_error_enum;
 
 /**
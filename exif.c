@@ -1,183 +1,405 @@
 #include "exif.h"
 #include "config.h"
+#include "hash_util.h"
 #include "str_utils.h"
 
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
 #include <libexif/exif-content.h>
 #include <libexif/exif-data.h>
+#include <libexif/exif-entry.h>
 #include <libexif/exif-format.h>
 #include <libexif/exif-tag.h>
 #include <libexif/exif-utils.h>
 
-#define FORMATTED_STRING_LEN (CONFIG_INFO_FIX_LEN * 2)
 
+/* Bump when formatter output changes so cached values are invalidated */
+#define PLAN_HASH_VERSION 1
 /**
- * Get the value from the entry object into a string.
+ * Format a SHORT entry value.
  *
  * @param[in] entry The ExifEntry object
  * @param[in] order The ExifData byte order
- * @param[out] out The char array to populate
- */
-static void get_entry_value_str(ExifEntry *entry, ExifByteOrder order,
-                                char *out) {
-  switch (entry->format) {
-  case EXIF_FORMAT_SHORT: {
-    ExifShort tmp = exif_get_short(entry->data, order);
-    sprintf(out, "%d", tmp);
-  } break;
-  case EXIF_FORMAT_SSHORT: {
-    ExifSShort tmp = exif_get_sshort(entry->data, order);
-    sprintf(out, "%d", tmp);
-  } break;
-  case EXIF_FORMAT_LONG: {
-    ExifLong tmp = exif_get_long(entry->data, order);
-    sprintf(out, "%d", tmp);
-  } break;
-  case EXIF_FORMAT_SLONG: {
-    ExifSLong tmp = exif_get_slong(entry->data, order);
-    sprintf(out, "%d", tmp);
-  } break;
-  case EXIF_FORMAT_RATIONAL: {
-    ExifRational tmp = exif_get_rational(entry->data, order);
-    // TODO may need to handle special cases, not sure yet
-    if (tmp.numerator > 1) {
-      sprintf(out, "%.1f", (double)tmp.numerator / (double)tmp.denominator);
-    } else {
-      sprintf(out, "%d/%d", tmp.numerator, tmp.denominator);
-    }
-  } break;
-  case EXIF_FORMAT_SRATIONAL: {
-    ExifSRational tmp = exif_get_srational(entry->data, order);
-    // TODO may need to handle special cases, not sure yet
-    if (tmp.numerator > 1) {
-      sprintf(out, "%.1f", (double)tmp.numerator / (double)tmp.denominator);
-    } else {
-      sprintf(out, "%d/%d", tmp.numerator, tmp.denominator);
-    }
-  } break;
-  default: {
+ * @param[out] out The info text to append the value to
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum format_short(const ExifEntry *entry, ExifByteOrder order,
+                                      info_text *out) {
+  return infoto_info_text_append_int(out, exif_get_short(entry->data, order));
+}
+
+/**
+ * Format a SSHORT entry value.
+ *
+ * @param[in] entry The ExifEntry object
+ * @param[in] order The ExifData byte order
+ * @param[out] out The info text to append the value to
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum format_sshort(const ExifEntry *entry, ExifByteOrder order,
+                                       info_text *out) {
+  return infoto_info_text_append_int(out, exif_get_sshort(entry->data, order));
+}
+
+/**
+ * Format a LONG entry value.
+ *
+ * @param[in] entry The ExifEntry object
+ * @param[in] order The ExifData byte order
+ * @param[out] out The info text to append the value to
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum format_long(const ExifEntry *entry, ExifByteOrder order,
+                                     info_text *out) {
+  return infoto_info_text_append_uint(out, exif_get_long(entry->data, order));
+}
+
+/**
+ * Format a SLONG entry value.
+ *
+ * @param[in] entry The ExifEntry object
+ * @param[in] order The ExifData byte order
+ * @param[out] out The info text to append the value to
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum format_slong(const ExifEntry *entry, ExifByteOrder order,
+                                      info_text *out) {
+  return infoto_info_text_append_int(out, exif_get_slong(entry->data, order));
+}
+
+/**
+ * Format a RATIONAL entry value.
+ *
+ * @param[in] entry The ExifEntry object
+ * @param[in] order The ExifData byte order
+ * @param[out] out The info text to append the value to
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum format_rational(const ExifEntry *entry, ExifByteOrder order,
+                                         info_text *out) {
+  ExifRational tmp = exif_get_rational(entry->data, order);
+  // TODO may need to handle special cases, not sure yet
+  if (tmp.numerator > 1) {
+    return infoto_info_text_append_decimal(out, tmp.numerator, tmp.denominator);
+  }
+  return infoto_info_text_append_fraction(out, tmp.numerator, tmp.denominator);
+}
+
+/**
+ * Format a SRATIONAL entry value.
+ *
+ * @param[in] entry The ExifEntry object
+ * @param[in] order The ExifData byte order
+ * @param[out] out The info text to append the value to
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum format_srational(const ExifEntry *entry, ExifByteOrder order,
+                                          info_text *out) {
+  ExifSRational tmp = exif_get_srational(entry->data, order);
+  // TODO may need to handle special cases, not sure yet
+  if (tmp.numerator > 1) {
+    return infoto_info_text_append_decimal(out, tmp.numerator, tmp.denominator);
+  }
+  return infoto_info_text_append_fraction(out, tmp.numerator, tmp.denominator);
+}
+
+/**
+ * Format an ASCII (or BYTE/SBYTE) entry value, forced to uppercase.
+ *
+ * @param[in] entry The ExifEntry object
+ * @param[in] order The ExifData byte order
+ * @param[out] out The info text to append the value to
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum format_ascii(const ExifEntry *entry,
+                                      ExifByteOrder order, info_text *out) {
+  // entry data is not guaranteed to be null terminated
+  size_t len = strnlen((const char *)entry->data, entry->size);
+  return infoto_info_text_append_upper(out, (const char *)entry->data, len);
+}
+
+/**
+ * Get the formatter function for the given EXIF format.
+ *
+ * @param[in] format The EXIF format.
+ * @returns The formatter function.
+ */
+static infoto_exif_formatter formatter_for_format(ExifFormat format) {
+  switch (format) {
+  case EXIF_FORMAT_SHORT:
+    return format_short;
+  case EXIF_FORMAT_SSHORT:
+    return format_sshort;
+  case EXIF_FORMAT_LONG:
+    return format_long;
+  case EXIF_FORMAT_SLONG:
+    return format_slong;
+  case EXIF_FORMAT_RATIONAL:
+    return format_rational;
+  case EXIF_FORMAT_SRATIONAL:
+    return format_srational;
+  default:
     // handles EXIF_FORMAT_{ASCII|BYTE|SBYTE}
-    sprintf(out, "%s", entry->data);
-  } break;
+    return format_ascii;
   }
 }
 
 /**
- * Get EXIF data object from file if file exists.
+ * The format the EXIF spec defines for commonly captioned tags.
+ */
+static const struct {
+  ExifTag tag;
+  ExifFormat format;
+} known_tag_formats[] = {
+    {EXIF_TAG_MAKE, EXIF_FORMAT_ASCII},
+    {EXIF_TAG_MODEL, EXIF_FORMAT_ASCII},
+    {EXIF_TAG_DATE_TIME_ORIGINAL, EXIF_FORMAT_ASCII},
+    {EXIF_TAG_LENS_MODEL, EXIF_FORMAT_ASCII},
+    {EXIF_TAG_EXPOSURE_TIME, EXIF_FORMAT_RATIONAL},
+    {EXIF_TAG_FNUMBER, EXIF_FORMAT_RATIONAL},
+    {EXIF_TAG_FOCAL_LENGTH, EXIF_FORMAT_RATIONAL},
+    {EXIF_TAG_ISO_SPEED_RATINGS, EXIF_FORMAT_SHORT},
+    {EXIF_TAG_EXPOSURE_BIAS_VALUE, EXIF_FORMAT_SRATIONAL},
+};
+
+/**
+ * Resolve the IFD the given tag is recorded in.
  *
- * @param[in] file_name The file to access
- * @param[out] exif The EXIF data object to populate
+ * @param[in] tag The EXIF tag.
+ * @returns The IFD, or EXIF_IFD_COUNT if the tag is not recorded in any IFD.
+ */
+static ExifIfd resolve_tag_ifd(ExifTag tag) {
+  for (int i = EXIF_IFD_0; i < EXIF_IFD_COUNT; ++i) {
+    if (exif_tag_get_name_in_ifd(tag, (ExifIfd)i) != NULL) {
+      return (ExifIfd)i;
+    }
+  }
+  return EXIF_IFD_COUNT;
+}
+
+/**
+ * Copy the {pre|post}fix into the plan entry field folded to uppercase.
+ *
+ * @param[in] src The config value, not guaranteed to be null terminated.
+ * @param[out] dst The plan entry field.
+ * @returns The length of the copied value.
+ */
+static size_t fold_fix(const char *src, char *dst) {
+  size_t len = strnlen(src, CONFIG_INFO_FIX_LEN);
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] = toupper(src[i]);
+  }
+  dst[len] = '\0';
+  return len;
+}
+
+/**
+ * Compile the metadata config into an extraction plan.
+ *
+ * @param[in] metadata The array of metadata info.
+ * @param[out] plan The plan to populate.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
-static infoto_error_enum get_exif_data(const char *file_name, ExifData **exif) {
-  // check the access of the file
-  if (access(file_name, F_OK) != 0) {
-    fprintf(stderr, "file is not accessible: %s\n", file_name);
-    return INFOTO_ERR_NO_FILE_ACCESS;
+infoto_error_enum infoto_exif_plan_init(const metadata_array *metadata,
+                                        infoto_exif_plan *plan) {
+  plan->len = 0;
+  plan->entries = (infoto_exif_plan_entry *)calloc(
+      metadata->len > 0 ? metadata->len : 1, sizeof(infoto_exif_plan_entry));
+  if (plan->entries == NULL) {
+    return INFOTO_ERR_MALLOC;
   }
-  // read out EXIF data
-  *exif = exif_data_new_from_file(file_name);
-  if (exif == NULL) {
-    fprintf(stderr, "could not read exif data for file: %s\n", file_name);
-    return INFOTO_ERR_EXIF_READ;
+  for (int i = 0; i < metadata->len; ++i) {
+    metadata_info mi;
+    get_metadata_array(metadata, i, &mi);
+    infoto_exif_plan_entry *pe = &plan->entries[i];
+    memcpy(pe->name, mi.name, CONFIG_INFO_NAME_LEN);
+    pe->name[CONFIG_INFO_NAME_LEN] = '\0';
+    // resolve the tag once instead of per image
+    pe->tag = exif_tag_from_name(pe->name);
+    pe->ifd = pe->tag == 0 ? EXIF_IFD_COUNT : resolve_tag_ifd(pe->tag);
+    if (pe->ifd == EXIF_IFD_COUNT) {
+      fprintf(stderr, "unknown EXIF tag in config: %s\n", pe->name);
+      infoto_exif_plan_free(plan);
+      return INFOTO_ERR_EXIF_UNKNOWN_TAG;
+    }
+    pe->prefix_len = fold_fix(mi.prefix, pe->prefix);
+    pe->postfix_len = fold_fix(mi.postfix, pe->postfix);
+    // pick the formatter for the tag's defined format, entries with an
+    // unexpected format fall back to formatting by their actual format.
+    pe->format = EXIF_FORMAT_ASCII;
+    for (size_t j = 0;
+         j < sizeof(known_tag_formats) / sizeof(known_tag_formats[0]); ++j) {
+      if (known_tag_formats[j].tag == pe->tag) {
+        pe->format = known_tag_formats[j].format;
+        break;
+      }
+    }
+    pe->formatter = formatter_for_format(pe->format);
+    ++plan->len;
   }
   return INFOTO_SUCCESS;
 }
 
-static char *get_info_text_buffer(const ExifEntry *entry, const char *value,
-                                  const metadata_info mi) {
-  const int buffer_size = (FORMATTED_STRING_LEN + entry->size);
-  const size_t char_size = sizeof(char);
-  char *buffer = (char *)malloc((char_size * buffer_size) + char_size);
-  if (buffer == NULL) {
-    fprintf(stderr, "malloc of buffer failed.\n");
-    return NULL;
+/**
+ * Hash the extraction plan, used to tie cached values to the plan that
+ * produced them.
+ *
+ * @param[in] plan The extraction plan.
+ * @returns The hash of the plan.
+ */
+uint64_t infoto_exif_plan_hash(const infoto_exif_plan *plan) {
+  uint64_t hash = infoto_hash64(&plan->len, sizeof(plan->len),
+                                PLAN_HASH_VERSION);
+  for (size_t i = 0; i < plan->len; ++i) {
+    const infoto_exif_plan_entry *pe = &plan->entries[i];
+    const uint32_t ids[3] = {pe->tag, pe->ifd, pe->format};
+    hash = infoto_hash64(ids, sizeof(ids), hash);
+    hash = infoto_hash64(pe->prefix, pe->prefix_len, hash);
+    hash = infoto_hash64(pe->postfix, pe->postfix_len, hash);
   }
-  // get formated string
-  // buffer_N is number of characters in buffer, not including null character
-  const int buffer_N = snprintf(buffer, buffer_size + 1, "%s%s%s", mi.prefix, value, mi.postfix);
-  if (buffer_N < 0) {
-    fprintf(stderr, "sprintf failed\n");
-    return NULL;
+  return hash;
+}
+
+/**
+ * Free the extraction plan.
+ *
+ * @param[in,out] plan The plan to free.
+ */
+void infoto_exif_plan_free(infoto_exif_plan *plan) {
+  free(plan->entries);
+  plan->entries = NULL;
+  plan->len = 0;
+}
+
+/**
+ * Find the EXIF APP1 segment within the JPEG bytes.
+ * Only the marker headers are walked, the entropy coded data is never touched.
+ *
+ * @param[in] data The JPEG file bytes.
+ * @param[in] size The number of bytes in data.
+ * @param[out] segment The start of the APP1 payload ("Exif\0\0" header).
+ * @param[out] segment_len The length of the APP1 payload.
+ * @returns 1 if the segment was found, 0 otherwise.
+ */
+static int find_exif_segment(const uint8_t *data, size_t size,
+                             const uint8_t **segment, size_t *segment_len) {
+  // must start with SOI marker
+  if (size < 4 || data[0] != 0xFF || data[1] != INFOTO_JPEG_MARKER_SOI) {
+    return 0;
+  }
+  size_t pos = 2;
+  while (pos + 4 <= size) {
+    if (data[pos] != 0xFF) {
+      return 0;
+    }
+    const uint8_t marker = data[pos + 1];
+    // fill bytes
+    if (marker == 0xFF) {
+      ++pos;
+      continue;
+    }
+    // no more metadata segments once image data starts
+    if (marker == INFOTO_JPEG_MARKER_SOS ||
+        marker == INFOTO_JPEG_MARKER_EOI) {
+      return 0;
+    }
+    const size_t len = (data[pos + 2] << 8) | data[pos + 3];
+    if (len < 2 || pos + 2 + len > size) {
+      return 0;
+    }
+    const uint8_t *payload = &data[pos + 4];
+    const size_t payload_len = len - 2;
+    if (marker == INFOTO_JPEG_MARKER_APP1 &&
+        payload_len >= INFOTO_EXIF_HEADER_LEN &&
+        memcmp(payload, INFOTO_EXIF_HEADER, INFOTO_EXIF_HEADER_LEN) == 0) {
+      *segment = payload;
+      *segment_len = payload_len;
+      return 1;
+    }
+    pos += 2 + len;
+  }
+  return 0;
+}
+
+/**
+ * Get EXIF data object from the image file's bytes.
+ *
+ * @param[in] img The image file object
+ * @param[out] exif The EXIF data object to populate
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum get_exif_data(const infoto_img_file *img,
+                                       ExifData **exif) {
+  const uint8_t *segment = NULL;
+  size_t segment_len = 0;
+  if (!find_exif_segment(img->data, img->size, &segment, &segment_len)) {
+    fprintf(stderr, "could not find exif data for file: %s\n", img->name);
+    return INFOTO_ERR_EXIF_READ;
   }
-  // force uppercase
-  for (int j = 0; j <= buffer_N; ++j) {
-    buffer[j] = toupper(buffer[j]);
+  // read out EXIF data
+  *exif = exif_data_new_from_data(segment, segment_len);
+  if (*exif == NULL) {
+    fprintf(stderr, "could not read exif data for file: %s\n", img->name);
+    return INFOTO_ERR_EXIF_READ;
   }
-  // ensure null terminated
-  buffer[buffer_N + 1] = '\0';
-  return buffer;
+  return INFOTO_SUCCESS;
 }
 
 /**
  * Read EXIF data from JPEG file.
  *
- * @param[in] image_name The image to read EXIF data from.
- * @param[in] metadata The array of metadata info.
+ * @param[in] img The image file to read EXIF data from.
+ * @param[in] plan The compiled extraction plan.
  * @param[out] output An info text buffer object
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
-infoto_error_enum infoto_read_exif_data(const char *image_name,
-                                        const metadata_array *metadata,
+infoto_error_enum infoto_read_exif_data(const infoto_img_file *img,
+                                        const infoto_exif_plan *plan,
                                         info_text *output) {
   ExifData *exif = NULL;
-  infoto_error_enum err_code = get_exif_data(image_name, &exif);
+  infoto_error_enum err_code = get_exif_data(img, &exif);
   if (err_code != INFOTO_SUCCESS) {
     return err_code;
   }
   ExifByteOrder byte_order = exif_data_get_byte_order(exif);
-  // have a reusable value buffer
-  char *value = NULL;
-  size_t value_len = 0;
-  // initialize buffers
-  for (int i = 0; i < metadata->len; ++i) {
-    // get metadata info object
-    metadata_info mi;
-    get_metadata_array(metadata, i, &mi);
-    // grab the tag name
-    ExifTag tag = exif_tag_from_name(mi.name);
-    if (tag == 0) {
-      fprintf(stderr, "tag not found. searching for: %s\n", mi.name);
-      continue;
-    }
-    // grab the entry
+  for (size_t i = 0; i < plan->len; ++i) {
+    const infoto_exif_plan_entry *pe = &plan->entries[i];
+    // grab the entry from the resolved IFD first
     // this object is owned by the EXIF data object, do not unref
-    ExifEntry *entry = exif_data_get_entry(exif, tag);
+    ExifEntry *entry = exif_content_get_entry(exif->ifd[pe->ifd], pe->tag);
+    if (entry == NULL) {
+      entry = exif_data_get_entry(exif, pe->tag);
+    }
     if (entry == NULL) {
-      fprintf(stderr, "failed to get %s entry\n", mi.name);
+      fprintf(stderr, "failed to get %s entry\n", pe->name);
       err_code = INFOTO_ERR_EXIF_DATA;
       break;
     }
-    // allocate more memory for our buffer if it's not big enough
-    if (value_len <= entry->size) {
-      // value_len is size + sizeof(char) for null character
-      value_len = infoto_inc_string_size(&value, entry->size);
-      if (value_len == -1) {
-        fprintf(stderr, "inc_string_size failed.\n");
-        err_code = INFOTO_ERR_INC_STR_SIZE;
-        break;
-      }
+    // the value is formatted straight into the caption,
+    // prefix and postfix are already uppercase
+    infoto_exif_formatter formatter = entry->format == pe->format
+                                          ? pe->formatter
+                                          : formatter_for_format(entry->format);
+    err_code = infoto_info_text_begin_value(output);
+    if (err_code == INFOTO_SUCCESS) {
+      err_code = infoto_info_text_append(output, pe->prefix, pe->prefix_len);
+    }
+    if (err_code == INFOTO_SUCCESS) {
+      err_code = formatter(entry, byte_order, output);
+    }
+    if (err_code == INFOTO_SUCCESS) {
+      err_code = infoto_info_text_append(output, pe->postfix, pe->postfix_len);
     }
-    // clear out value buffer
-    memset(value, 0, value_len - 1);
-    // get entry value
-    get_entry_value_str(entry, byte_order, value);
-    // get buffer for info text
-    char *buffer = get_info_text_buffer(entry, value, mi);
-    if (buffer == NULL) {
+    if (err_code != INFOTO_SUCCESS) {
       fprintf(stderr, "info text buffer failed.\n");
       err_code = INFOTO_ERR_INFO_TEXT_BUFF;
       break;
     }
-    output->buffer[i] = buffer;
   }
-  // free value buffer
-  free(value);
+  exif_data_unref(exif);
   return err_code;
 }
 
@@ -194,23 +416,24 @@ void read_exif_data(ExifEntry *entry, void *user_data) {
       (infoto_exif_tag_info_array *)user_data;
   infoto_exif_tag_info exif_data;
   exif_data.value = entry->tag;
-  exif_data.name =
-      exif_tag_get_name_in_ifd(entry->tag, exif_content_get_ifd(entry->parent));
+  exif_data.ifd = exif_content_get_ifd(entry->parent);
+  exif_data.name = exif_tag_get_name_in_ifd(entry->tag, exif_data.ifd);
+  exif_entry_get_value(entry, exif_data.str_value, INFOTO_EXIF_VALUE_LEN);
   insert_infoto_exif_tag_info_array(data_arr, exif_data);
 }
 
 /**
  * Read all EXIF tag names the given image has.
  *
- * @param[in] image_name The image to read EXIF tags from.
+ * @param[in] img The image file to read EXIF tags from.
  * @param[in,out] info_arr The EXIF tag info array to populate.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
 infoto_error_enum
-infoto_read_all_exif_tags(const char *image_name,
+infoto_read_all_exif_tags(const infoto_img_file *img,
                           infoto_exif_tag_info_array *info_arr) {
   ExifData *exif = NULL;
-  infoto_error_enum err_code = get_exif_data(image_name, &exif);
+  infoto_error_enum err_code = get_exif_data(img, &exif);
   if (err_code != INFOTO_SUCCESS) {
     return err_code;
   }
@@ -218,5 +441,6 @@ infoto_read_all_exif_tags(const char *image_name,
   for (int i = EXIF_IFD_0; i < EXIF_IFD_COUNT; ++i) {
     exif_content_foreach_entry(exif->ifd[i], read_exif_data, info_arr);
   }
+  exif_data_unref(exif);
   return INFOTO_SUCCESS;
 }
@@ -4,40 +4,114 @@
 #include "config.h"
 #include "deps/array_template/array_template.h"
 #include "error_codes.h"
+#include "img_file.h"
 #include "info_text.h"
+#include <libexif/exif-data.h>
 #include <libexif/exif-tag.h>
 
+/* Max length of a formatted EXIF value in infoto_exif_tag_info */
+#define INFOTO_EXIF_VALUE_LEN 256
+
 /**
  * Simple EXIF data structure to hold EXIF tag info.
  */
 typedef struct infoto_exif_tag_info {
   const char *name;
   ExifTag value;
+  // IFD the tag was found in
+  ExifIfd ifd;
+  // human readable value of the tag
+  char str_value[INFOTO_EXIF_VALUE_LEN];
 } infoto_exif_tag_info;
 
 generate_array_template(infoto_exif_tag_info, infoto_exif_tag_info);
 
 /**
- * Read EXIF data from JPEG file.
+ * Function pointer type for appending an EXIF entry value to info text.
+ * Returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+typedef infoto_error_enum (*infoto_exif_formatter)(const ExifEntry *,
+                                                   ExifByteOrder, info_text *);
+
+/**
+ * A single metadata info entry resolved for extraction.
+ */
+typedef struct {
+  // EXIF tag name, used for reporting
+  char name[CONFIG_INFO_NAME_LEN + 1];
+  // resolved tag ID
+  ExifTag tag;
+  // IFD the tag is recorded in
+  ExifIfd ifd;
+  // format the tag is expected to be stored as
+  ExifFormat format;
+  // formatter for the expected format
+  infoto_exif_formatter formatter;
+  // uppercase folded prefix value
+  char prefix[CONFIG_INFO_FIX_LEN + 1];
+  size_t prefix_len;
+  // uppercase folded postfix value
+  char postfix[CONFIG_INFO_FIX_LEN + 1];
+  size_t postfix_len;
+} infoto_exif_plan_entry;
+
+/**
+ * Extraction plan compiled once from the metadata config and reused for
+ * every image.
+ */
+typedef struct {
+  infoto_exif_plan_entry *entries;
+  size_t len;
+} infoto_exif_plan;
+
+/**
+ * Compile the metadata config into an extraction plan.
  *
- * @param[in] image_name The image to read EXIF data from.
  * @param[in] metadata The array of metadata info.
+ * @param[out] plan The plan to populate.
+ * @returns INFOTO_SUCCESS if successful, INFOTO_ERR_EXIF_UNKNOWN_TAG if a tag
+ * name cannot be resolved, otherwise an error code.
+ */
+infoto_error_enum infoto_exif_plan_init(const metadata_array *metadata,
+                                        infoto_exif_plan *plan);
+
+/**
+ * Hash the extraction plan, used to tie cached values to the plan that
+ * produced them.
+ *
+ * @param[in] plan The extraction plan.
+ * @returns The hash of the plan.
+ */
+uint64_t infoto_exif_plan_hash(const infoto_exif_plan *plan);
+
+/**
+ * Free the extraction plan.
+ *
+ * @param[in,out] plan The plan to free.
+ */
+void infoto_exif_plan_free(infoto_exif_plan *plan);
+
+/**
+ * Read EXIF data from JPEG file.
+ *
+ * @param[in] img The image file to read EXIF data from.
+ * @param[in] plan The compiled extraction plan.
  * @param[out] output An info text buffer object
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
-infoto_error_enum infoto_read_exif_data(const char *image_name,
-                                        const metadata_array *metadata,
+infoto_error_enum infoto_read_exif_data(const infoto_img_file *img,
+                                        const infoto_exif_plan *plan,
                                         info_text *output);
 
 /**
  * Read all EXIF tag names the given image has.
  *
- * @param[in] image_name The image to read EXIF tags from.
+ * @param[in] img The image file to read EXIF tags from.
  * @param[in,out] info_arr The EXIF tag info array to populate.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
 infoto_error_enum
-infoto_read_all_exif_tags(const char *image_name,
+infoto_read_all_exif_tags(const infoto_img_file *img,
                           infoto_exif_tag_info_array *info_arr);
 
 #endif
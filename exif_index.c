@@ -0,0 +1,574 @@
+#include "exif_index.h"
+#include "hash_util.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "INFOIDX"
+#define INDEX_MAGIC_LEN 8
+#define INDEX_VERSION 1
+/* smallest bucket table written out */
+#define INDEX_MIN_BUCKETS 64
+
+/**
+ * Header at the start of the index file.
+ * Followed by bucket_count buckets and then the strings area.
+ */
+struct index_header {
+  char magic[INDEX_MAGIC_LEN];
+  uint32_t version;
+  // sizeof(struct index_bucket), guards against layout changes
+  uint32_t bucket_size;
+  uint64_t plan_hash;
+  // always a power of two
+  uint64_t bucket_count;
+  uint64_t entry_count;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+};
+
+/**
+ * Open addressing hash table slot.
+ * The text record at text_offset holds a value count followed by
+ * (length, bytes) pairs.
+ */
+struct index_bucket {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t text_offset;
+  uint32_t text_len;
+  uint32_t used;
+};
+
+/**
+ * Structure for the persistent info text index.
+ */
+struct infoto_exif_index {
+  char *path;
+  uint64_t plan_hash;
+  // mapping of the existing index file, NULL if there was none
+  uint8_t *map;
+  size_t map_size;
+  const struct index_header *header;
+  const struct index_bucket *buckets;
+  const uint8_t *strings;
+  // entries added during this run
+  struct index_bucket *added;
+  size_t added_len;
+  size_t added_cap;
+  uint8_t *added_strings;
+  size_t added_strings_len;
+  size_t added_strings_cap;
+  // guards the entries added during this run, the mapped file is read-only
+  pthread_mutex_t added_lock;
+  atomic_uint_least64_t hits;
+  atomic_uint_least64_t misses;
+};
+
+/**
+ * Fill in the key fields of a bucket from the file status.
+ *
+ * @param[in] st The file status.
+ * @param[out] bucket The bucket to populate.
+ */
+static void key_from_stat(const struct stat *st, struct index_bucket *bucket) {
+  bucket->dev = st->st_dev;
+  bucket->ino = st->st_ino;
+  bucket->size = st->st_size;
+  bucket->mtime_sec = st->st_mtim.tv_sec;
+  bucket->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/**
+ * Hash the key fields of a bucket.
+ *
+ * @param[in] bucket The bucket.
+ * @returns The hash of the key.
+ */
+static uint64_t key_hash(const struct index_bucket *bucket) {
+  // key fields are laid out first and contiguously
+  return infoto_hash64(bucket, offsetof(struct index_bucket, text_offset), 0);
+}
+
+/**
+ * Check if two buckets have the same key.
+ *
+ * @param[in] a The first bucket.
+ * @param[in] b The second bucket.
+ * @returns 1 if the keys match, 0 otherwise.
+ */
+static int key_equal(const struct index_bucket *a,
+                     const struct index_bucket *b) {
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+         a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/**
+ * Validate the mapped index file and set up the table pointers.
+ *
+ * @param[in,out] index The index with map and map_size set.
+ * @returns 1 if the file is usable for this plan, 0 otherwise.
+ */
+static int validate_map(infoto_exif_index *index) {
+  if (index->map_size < sizeof(struct index_header)) {
+    return 0;
+  }
+  const struct index_header *header = (const struct index_header *)index->map;
+  if (memcmp(header->magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0 ||
+      header->version != INDEX_VERSION ||
+      header->bucket_size != sizeof(struct index_bucket) ||
+      header->plan_hash != index->plan_hash) {
+    return 0;
+  }
+  const uint64_t count = header->bucket_count;
+  // a full table would leave a lookup of a missing key without a free bucket
+  if (count == 0 || (count & (count - 1)) != 0 ||
+      count > (index->map_size / sizeof(struct index_bucket)) ||
+      header->entry_count >= count) {
+    return 0;
+  }
+  const uint64_t buckets_end =
+      sizeof(struct index_header) + (count * sizeof(struct index_bucket));
+  if (header->strings_offset < buckets_end ||
+      header->strings_offset > index->map_size ||
+      header->strings_size > index->map_size - header->strings_offset) {
+    return 0;
+  }
+  index->header = header;
+  index->buckets =
+      (const struct index_bucket *)&index->map[sizeof(struct index_header)];
+  index->strings = &index->map[header->strings_offset];
+  return 1;
+}
+
+/**
+ * Open (or create) the index file for the given extraction plan.
+ * A missing, corrupt or mismatched (different plan or version) index file is
+ * treated as empty and replaced on save.
+ *
+ * @param[in] path The index file path.
+ * @param[in] plan_hash The hash of the extraction plan.
+ * @param[out] index The index to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_exif_index_open(const char *path, uint64_t plan_hash,
+                                         infoto_exif_index **index) {
+  infoto_exif_index *local =
+      (infoto_exif_index *)calloc(1, sizeof(infoto_exif_index));
+  if (local == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  local->path = strdup(path);
+  if (local->path == NULL) {
+    free(local);
+    return INFOTO_ERR_MALLOC;
+  }
+  local->plan_hash = plan_hash;
+  pthread_mutex_init(&local->added_lock, NULL);
+  atomic_init(&local->hits, 0);
+  atomic_init(&local->misses, 0);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map != MAP_FAILED) {
+        local->map = (uint8_t *)map;
+        local->map_size = st.st_size;
+      }
+    }
+    close(fd);
+  }
+  if (local->map != NULL && !validate_map(local)) {
+    fprintf(stderr, "ignoring stale or invalid index file: %s\n", path);
+    munmap(local->map, local->map_size);
+    local->map = NULL;
+    local->map_size = 0;
+  }
+  *index = local;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Look up the info text values for the given file.
+ *
+ * @param[in,out] index The index, hit/miss counters are updated.
+ * @param[in] st The file status of the image.
+ * @param[out] info The info text object to populate on a hit.
+ * @returns 1 if the file was found, 0 otherwise.
+ */
+int infoto_exif_index_lookup(infoto_exif_index *index, const struct stat *st,
+                             info_text *info) {
+  if (index->header == NULL) {
+    atomic_fetch_add(&index->misses, 1);
+    return 0;
+  }
+  struct index_bucket key;
+  key_from_stat(st, &key);
+  const uint64_t mask = index->header->bucket_count - 1;
+  uint64_t i = key_hash(&key) & mask;
+  // bounded, a corrupt file may use every bucket whatever its entry count
+  for (uint64_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+    const struct index_bucket *bucket = &index->buckets[i];
+    if (!bucket->used) {
+      break;
+    }
+    if (!key_equal(bucket, &key)) {
+      continue;
+    }
+    if (bucket->text_offset > index->header->strings_size ||
+        bucket->text_len > index->header->strings_size - bucket->text_offset ||
+        bucket->text_len < sizeof(uint32_t)) {
+      break;
+    }
+    const uint8_t *record = &index->strings[bucket->text_offset];
+    const uint8_t *record_end = record + bucket->text_len;
+    uint32_t count;
+    memcpy(&count, record, sizeof(count));
+    record += sizeof(count);
+    // the value count is fixed by the plan, which the header hash covers
+    infoto_info_text_reset(info);
+    for (uint32_t v = 0; v < count; ++v) {
+      uint32_t len = UINT32_MAX;
+      if ((size_t)(record_end - record) >= sizeof(len)) {
+        memcpy(&len, record, sizeof(len));
+      }
+      if (len + sizeof(len) > (size_t)(record_end - record) ||
+          infoto_info_text_begin_value(info) != INFOTO_SUCCESS ||
+          infoto_info_text_append(info, (const char *)record + sizeof(len),
+                                  len) != INFOTO_SUCCESS) {
+        // drop the values copied so far
+        infoto_info_text_reset(info);
+        atomic_fetch_add(&index->misses, 1);
+        return 0;
+      }
+      record += sizeof(len) + len;
+    }
+    atomic_fetch_add(&index->hits, 1);
+    return 1;
+  }
+  atomic_fetch_add(&index->misses, 1);
+  return 0;
+}
+
+/**
+ * Append an entry to the entries added during this run.
+ *
+ * @param[in,out] index The index, with added_lock held.
+ * @param[in] st The file status of the image.
+ * @param[in] info The info text values to store.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum add_entry(infoto_exif_index *index,
+                                   const struct stat *st,
+                                   const info_text *info) {
+  uint32_t count = info->len;
+  size_t record_len = sizeof(count);
+  for (size_t i = 0; i < info->len; ++i) {
+    record_len += sizeof(uint32_t) + info->lengths[i];
+  }
+  if (index->added_len == index->added_cap) {
+    size_t cap = index->added_cap == 0 ? 16 : index->added_cap * 2;
+    struct index_bucket *tmp = (struct index_bucket *)realloc(
+        index->added, cap * sizeof(struct index_bucket));
+    if (tmp == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    index->added = tmp;
+    index->added_cap = cap;
+  }
+  if (index->added_strings_len + record_len > index->added_strings_cap) {
+    size_t cap = index->added_strings_cap == 0 ? 4096
+                                               : index->added_strings_cap;
+    while (cap < index->added_strings_len + record_len) {
+      cap *= 2;
+    }
+    uint8_t *tmp = (uint8_t *)realloc(index->added_strings, cap);
+    if (tmp == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    index->added_strings = tmp;
+    index->added_strings_cap = cap;
+  }
+  struct index_bucket *bucket = &index->added[index->added_len];
+  key_from_stat(st, bucket);
+  bucket->text_offset = index->added_strings_len;
+  bucket->text_len = record_len;
+  bucket->used = 1;
+  uint8_t *record = &index->added_strings[index->added_strings_len];
+  memcpy(record, &count, sizeof(count));
+  record += sizeof(count);
+  for (size_t i = 0; i < info->len; ++i) {
+    size_t value_len;
+    const char *value = infoto_info_text_value(info, i, &value_len);
+    uint32_t len = value_len;
+    memcpy(record, &len, sizeof(len));
+    record += sizeof(len);
+    memcpy(record, value, len);
+    record += len;
+  }
+  index->added_strings_len += record_len;
+  ++index->added_len;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Add the info text values for the given file to the index.
+ * New entries are written out with infoto_exif_index_save.
+ * Safe to call from several threads, along with lookups.
+ *
+ * @param[in,out] index The index.
+ * @param[in] st The file status of the image.
+ * @param[in] info The info text values to store.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_exif_index_insert(infoto_exif_index *index,
+                                           const struct stat *st,
+                                           const info_text *info) {
+  pthread_mutex_lock(&index->added_lock);
+  infoto_error_enum err_code = add_entry(index, st, info);
+  pthread_mutex_unlock(&index->added_lock);
+  return err_code;
+}
+
+/**
+ * Place a bucket into the new table with linear probing.
+ *
+ * @param[in,out] table The new bucket table.
+ * @param[in] mask The table size - 1.
+ * @param[in] bucket The bucket to insert.
+ * @returns 1 if inserted, 0 if the key was already present or the table is
+ * full.
+ */
+static int table_place(struct index_bucket *table, uint64_t mask,
+                       const struct index_bucket *bucket) {
+  uint64_t i = key_hash(bucket) & mask;
+  for (uint64_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+    if (!table[i].used) {
+      table[i] = *bucket;
+      return 1;
+    }
+    if (key_equal(&table[i], bucket)) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Hash the (dev, inode) identity of a bucket, ignoring size and mtime.
+ *
+ * @param[in] bucket The bucket.
+ * @returns The hash of the file identity.
+ */
+static uint64_t file_id_hash(const struct index_bucket *bucket) {
+  return infoto_hash64(bucket, offsetof(struct index_bucket, size), 0);
+}
+
+/**
+ * Build a set of the (dev, inode) identities added during this run.
+ * Slots hold the added entry index + 1, 0 marks an empty slot.
+ *
+ * @param[in] index The index.
+ * @param[out] mask The set size - 1.
+ * @returns The set, NULL if allocation failed.
+ */
+static size_t *build_added_set(const infoto_exif_index *index,
+                               uint64_t *mask) {
+  uint64_t size = INDEX_MIN_BUCKETS;
+  while (size < index->added_len * 2) {
+    size *= 2;
+  }
+  size_t *set = (size_t *)calloc(size, sizeof(size_t));
+  if (set == NULL) {
+    return NULL;
+  }
+  *mask = size - 1;
+  for (size_t i = 0; i < index->added_len; ++i) {
+    uint64_t slot = file_id_hash(&index->added[i]) & *mask;
+    while (set[slot] != 0) {
+      slot = (slot + 1) & *mask;
+    }
+    set[slot] = i + 1;
+  }
+  return set;
+}
+
+/**
+ * Check if a file (dev, inode) has a new entry from this run.
+ *
+ * @param[in] index The index.
+ * @param[in] set The set from build_added_set.
+ * @param[in] mask The set size - 1.
+ * @param[in] bucket The existing bucket.
+ * @returns 1 if the file was re-indexed, 0 otherwise.
+ */
+static int replaced_by_added(const infoto_exif_index *index, const size_t *set,
+                             uint64_t mask, const struct index_bucket *bucket) {
+  for (uint64_t slot = file_id_hash(bucket) & mask; set[slot] != 0;
+       slot = (slot + 1) & mask) {
+    const struct index_bucket *added = &index->added[set[slot] - 1];
+    if (added->dev == bucket->dev && added->ino == bucket->ino) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Write the index back to disk if new entries were added.
+ * Existing entries are carried over, entries replaced by a newer version of
+ * the same file are dropped. The file is replaced atomically.
+ *
+ * @param[in,out] index The index.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_exif_index_save(infoto_exif_index *index) {
+  if (index->added_len == 0) {
+    return INFOTO_SUCCESS;
+  }
+  const uint64_t old_count =
+      index->header != NULL ? index->header->entry_count : 0;
+  const uint64_t old_buckets =
+      index->header != NULL ? index->header->bucket_count : 0;
+  const uint64_t old_strings =
+      index->header != NULL ? index->header->strings_size : 0;
+  // keep the load factor at or below one half
+  uint64_t bucket_count = INDEX_MIN_BUCKETS;
+  while (bucket_count < (old_count + index->added_len) * 2) {
+    bucket_count *= 2;
+  }
+  struct index_bucket *table =
+      (struct index_bucket *)calloc(bucket_count, sizeof(struct index_bucket));
+  uint8_t *strings =
+      (uint8_t *)malloc(old_strings + index->added_strings_len + 1);
+  uint64_t set_mask = 0;
+  size_t *added_set = build_added_set(index, &set_mask);
+  if (table == NULL || strings == NULL || added_set == NULL) {
+    free(table);
+    free(strings);
+    free(added_set);
+    return INFOTO_ERR_MALLOC;
+  }
+  const uint64_t mask = bucket_count - 1;
+  uint64_t entry_count = 0;
+  uint64_t strings_len = 0;
+  for (size_t i = 0; i < index->added_len; ++i) {
+    struct index_bucket bucket = index->added[i];
+    bucket.text_offset += strings_len;
+    if (table_place(table, mask, &bucket)) {
+      ++entry_count;
+    }
+  }
+  memcpy(strings, index->added_strings, index->added_strings_len);
+  strings_len += index->added_strings_len;
+  for (uint64_t i = 0; i < old_buckets; ++i) {
+    struct index_bucket bucket = index->buckets[i];
+    if (!bucket.used ||
+        replaced_by_added(index, added_set, set_mask, &bucket) ||
+        bucket.text_offset > old_strings ||
+        bucket.text_len > old_strings - bucket.text_offset) {
+      continue;
+    }
+    const uint64_t src = bucket.text_offset;
+    bucket.text_offset = strings_len;
+    if (table_place(table, mask, &bucket)) {
+      memcpy(&strings[strings_len], &index->strings[src], bucket.text_len);
+      strings_len += bucket.text_len;
+      ++entry_count;
+    }
+  }
+  free(added_set);
+  struct index_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, INDEX_MAGIC_LEN);
+  header.version = INDEX_VERSION;
+  header.bucket_size = sizeof(struct index_bucket);
+  header.plan_hash = index->plan_hash;
+  header.bucket_count = bucket_count;
+  header.entry_count = entry_count;
+  header.strings_offset =
+      sizeof(struct index_header) + (bucket_count * sizeof(struct index_bucket));
+  header.strings_size = strings_len;
+
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  // write to a temp file and rename so readers never see a partial index
+  size_t path_len = strlen(index->path);
+  char *tmp_path = (char *)malloc(path_len + 32);
+  if (tmp_path == NULL) {
+    err_code = INFOTO_ERR_MALLOC;
+  } else {
+    snprintf(tmp_path, path_len + 32, "%s.tmp.%d", index->path, getpid());
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+      fprintf(stderr, "can't open index file: %s\n", tmp_path);
+      err_code = INFOTO_ERR_OPEN_FILE;
+    } else {
+      int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+               fwrite(table, sizeof(struct index_bucket), bucket_count,
+                      file) == bucket_count &&
+               fwrite(strings, 1, strings_len, file) == strings_len;
+      ok = (fflush(file) == 0) && ok;
+      ok = (fsync(fileno(file)) == 0) && ok;
+      ok = (fclose(file) == 0) && ok;
+      if (!ok || rename(tmp_path, index->path) != 0) {
+        fprintf(stderr, "failed writing index file: %s\n", index->path);
+        unlink(tmp_path);
+        err_code = INFOTO_ERR_OPEN_FILE;
+      }
+    }
+    free(tmp_path);
+  }
+  free(table);
+  free(strings);
+  if (err_code == INFOTO_SUCCESS) {
+    index->added_len = 0;
+    index->added_strings_len = 0;
+  }
+  return err_code;
+}
+
+/**
+ * Get the number of lookups that were hits and misses.
+ *
+ * @param[in] index The index.
+ * @param[out] hits The number of hits.
+ * @param[out] misses The number of misses.
+ */
+void infoto_exif_index_stats(const infoto_exif_index *index, uint64_t *hits,
+                             uint64_t *misses) {
+  *hits = atomic_load(&index->hits);
+  *misses = atomic_load(&index->misses);
+}
+
+/**
+ * Free the index, unmapping the index file.
+ * This does not save new entries.
+ *
+ * @param[in,out] index The index to free.
+ */
+void infoto_exif_index_free(infoto_exif_index **index) {
+  infoto_exif_index *local = *index;
+  if (local == NULL) {
+    return;
+  }
+  if (local->map != NULL) {
+    munmap(local->map, local->map_size);
+  }
+  pthread_mutex_destroy(&local->added_lock);
+  free(local->added);
+  free(local->added_strings);
+  free(local->path);
+  free(local);
+  *index = NULL;
+}
@@ -0,0 +1,84 @@
+#ifndef INFOTO_EXIF_INDEX_H
+#define INFOTO_EXIF_INDEX_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "error_codes.h"
+#include "info_text.h"
+
+/**
+ * Persistent on-disk index of extracted info text values.
+ * Entries are keyed by (dev, inode, size, mtime) of the source image, so a
+ * modified or replaced file never matches a stale entry. The index is only
+ * valid for the extraction plan it was built with.
+ */
+typedef struct infoto_exif_index infoto_exif_index;
+
+/**
+ * Open (or create) the index file for the given extraction plan.
+ * A missing, corrupt or mismatched (different plan or version) index file is
+ * treated as empty and replaced on save.
+ *
+ * @param[in] path The index file path.
+ * @param[in] plan_hash The hash of the extraction plan.
+ * @param[out] index The index to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_exif_index_open(const char *path, uint64_t plan_hash,
+                                         infoto_exif_index **index);
+
+/**
+ * Look up the info text values for the given file.
+ *
+ * @param[in,out] index The index, hit/miss counters are updated.
+ * @param[in] st The file status of the image.
+ * @param[out] info The info text object to populate on a hit.
+ * @returns 1 if the file was found, 0 otherwise.
+ */
+int infoto_exif_index_lookup(infoto_exif_index *index, const struct stat *st,
+                             info_text *info);
+
+/**
+ * Add the info text values for the given file to the index.
+ * New entries are written out with infoto_exif_index_save.
+ * Safe to call from several threads, along with lookups.
+ *
+ * @param[in,out] index The index.
+ * @param[in] st The file status of the image.
+ * @param[in] info The info text values to store.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_exif_index_insert(infoto_exif_index *index,
+                                           const struct stat *st,
+                                           const info_text *info);
+
+/**
+ * Write the index back to disk if new entries were added.
+ * Existing entries are carried over, entries replaced by a newer version of
+ * the same file are dropped. The file is replaced atomically.
+ *
+ * @param[in,out] index The index.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_exif_index_save(infoto_exif_index *index);
+
+/**
+ * Get the number of lookups that were hits and misses.
+ *
+ * @param[in] index The index.
+ * @param[out] hits The number of hits.
+ * @param[out] misses The number of misses.
+ */
+void infoto_exif_index_stats(const infoto_exif_index *index, uint64_t *hits,
+                             uint64_t *misses);
+
+/**
+ * Free the index, unmapping the index file.
+ * This does not save new entries.
+ *
+ * @param[in,out] index The index to free.
+ */
+void infoto_exif_index_free(infoto_exif_index **index);
+
+#endif
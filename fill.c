@@ -0,0 +1,273 @@
+#include "fill.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INFOTO_FILL_X86 1
+#endif
+
+/* Bytes in a repeating RGB pattern that fill whole 16 and 32 byte stores */
+#define RGB_PATTERN_SSE2 48
+#define RGB_PATTERN_AVX2 96
+
+/**
+ * Function pointer type for filling pixels of one component count.
+ */
+typedef void (*fill_fn)(uint8_t *, size_t, const uint8_t *);
+
+/**
+ * Fill by writing the first pixel and doubling the filled prefix with memcpy.
+ * The prefix is always whole pixels so every copy stays aligned to them.
+ *
+ * @param[out] dst The first byte to fill.
+ * @param[in] len The number of bytes to fill.
+ * @param[in] pattern The first bytes of the fill.
+ * @param[in] pattern_len The number of pattern bytes, at most len.
+ */
+static void fill_doubling(uint8_t *dst, size_t len, const uint8_t *pattern,
+                          size_t pattern_len) {
+  memcpy(dst, pattern, pattern_len);
+  size_t filled = pattern_len;
+  while (filled < len) {
+    const size_t n = filled < len - filled ? filled : len - filled;
+    memcpy(&dst[filled], dst, n);
+    filled += n;
+  }
+}
+
+/**
+ * Fill RGB pixels by doubling memcpy.
+ *
+ * @param[out] dst The first pixel.
+ * @param[in] pixels The number of pixels.
+ * @param[in] color The color's components.
+ */
+static void fill_rgb_scalar(uint8_t *dst, size_t pixels,
+                            const uint8_t *color) {
+  if (pixels > 0) {
+    fill_doubling(dst, pixels * 3, color, 3);
+  }
+}
+
+/**
+ * Fill RGBA pixels by doubling memcpy.
+ *
+ * @param[out] dst The first pixel.
+ * @param[in] pixels The number of pixels.
+ * @param[in] color The color's components.
+ */
+static void fill_rgba_scalar(uint8_t *dst, size_t pixels,
+                             const uint8_t *color) {
+  if (pixels > 0) {
+    fill_doubling(dst, pixels * 4, color, 4);
+  }
+}
+
+/**
+ * Build a repeating RGB pattern of the given length.
+ *
+ * @param[out] pattern The pattern, len bytes.
+ * @param[in] len The length, a multiple of 3.
+ * @param[in] color The color's components.
+ */
+static void build_rgb_pattern(uint8_t *pattern, size_t len,
+                              const uint8_t *color) {
+  for (size_t i = 0; i < len; i += 3) {
+    pattern[i] = color[0];
+    pattern[i + 1] = color[1];
+    pattern[i + 2] = color[2];
+  }
+}
+
+#ifdef INFOTO_FILL_X86
+/**
+ * Fill RGB pixels 16 at a time with three rotated 16 byte stores.
+ *
+ * @param[out] dst The first pixel.
+ * @param[in] pixels The number of pixels.
+ * @param[in] color The color's components.
+ */
+__attribute__((target("sse2"))) static void
+fill_rgb_sse2(uint8_t *dst, size_t pixels, const uint8_t *color) {
+  uint8_t pattern[RGB_PATTERN_SSE2];
+  build_rgb_pattern(pattern, RGB_PATTERN_SSE2, color);
+  const __m128i a = _mm_loadu_si128((const __m128i *)&pattern[0]);
+  const __m128i b = _mm_loadu_si128((const __m128i *)&pattern[16]);
+  const __m128i c = _mm_loadu_si128((const __m128i *)&pattern[32]);
+  const size_t len = pixels * 3;
+  size_t i = 0;
+  for (; i + RGB_PATTERN_SSE2 <= len; i += RGB_PATTERN_SSE2) {
+    _mm_storeu_si128((__m128i *)&dst[i], a);
+    _mm_storeu_si128((__m128i *)&dst[i + 16], b);
+    _mm_storeu_si128((__m128i *)&dst[i + 32], c);
+  }
+  // the loop ends on a pattern boundary, so the tail starts with red
+  memcpy(&dst[i], pattern, len - i);
+}
+
+/**
+ * Fill RGBA pixels 4 at a time with 16 byte stores.
+ *
+ * @param[out] dst The first pixel.
+ * @param[in] pixels The number of pixels.
+ * @param[in] color The color's components.
+ */
+__attribute__((target("sse2"))) static void
+fill_rgba_sse2(uint8_t *dst, size_t pixels, const uint8_t *color) {
+  int32_t value;
+  memcpy(&value, color, 4);
+  const __m128i v = _mm_set1_epi32(value);
+  size_t i = 0;
+  for (; i + 4 <= pixels; i += 4) {
+    _mm_storeu_si128((__m128i *)&dst[i * 4], v);
+  }
+  fill_rgba_scalar(&dst[i * 4], pixels - i, color);
+}
+
+/**
+ * Fill RGB pixels 32 at a time with three rotated 32 byte stores.
+ *
+ * @param[out] dst The first pixel.
+ * @param[in] pixels The number of pixels.
+ * @param[in] color The color's components.
+ */
+__attribute__((target("avx2"))) static void
+fill_rgb_avx2(uint8_t *dst, size_t pixels, const uint8_t *color) {
+  uint8_t pattern[RGB_PATTERN_AVX2];
+  build_rgb_pattern(pattern, RGB_PATTERN_AVX2, color);
+  const __m256i a = _mm256_loadu_si256((const __m256i *)&pattern[0]);
+  const __m256i b = _mm256_loadu_si256((const __m256i *)&pattern[32]);
+  const __m256i c = _mm256_loadu_si256((const __m256i *)&pattern[64]);
+  const size_t len = pixels * 3;
+  size_t i = 0;
+  for (; i + RGB_PATTERN_AVX2 <= len; i += RGB_PATTERN_AVX2) {
+    _mm256_storeu_si256((__m256i *)&dst[i], a);
+    _mm256_storeu_si256((__m256i *)&dst[i + 32], b);
+    _mm256_storeu_si256((__m256i *)&dst[i + 64], c);
+  }
+  // the loop ends on a pattern boundary, so the tail starts with red
+  memcpy(&dst[i], pattern, len - i);
+}
+
+/**
+ * Fill RGBA pixels 8 at a time with 32 byte stores.
+ *
+ * @param[out] dst The first pixel.
+ * @param[in] pixels The number of pixels.
+ * @param[in] color The color's components.
+ */
+__attribute__((target("avx2"))) static void
+fill_rgba_avx2(uint8_t *dst, size_t pixels, const uint8_t *color) {
+  int32_t value;
+  memcpy(&value, color, 4);
+  const __m256i v = _mm256_set1_epi32(value);
+  size_t i = 0;
+  for (; i + 8 <= pixels; i += 8) {
+    _mm256_storeu_si256((__m256i *)&dst[i * 4], v);
+  }
+  fill_rgba_sse2(&dst[i * 4], pixels - i, color);
+}
+#endif
+
+static fill_fn fill_rgb = fill_rgb_scalar;
+static fill_fn fill_rgba = fill_rgba_scalar;
+static infoto_fill_impl fill_impl = INFOTO_FILL_SCALAR;
+
+/**
+ * Pick the fastest fill kernels the CPU supports.
+ * Until this is called the scalar kernels are used.
+ */
+void infoto_fill_init(void) {
+  if (!infoto_fill_select(INFOTO_FILL_AVX2) &&
+      !infoto_fill_select(INFOTO_FILL_SSE2)) {
+    infoto_fill_select(INFOTO_FILL_SCALAR);
+  }
+}
+
+/**
+ * Force the given fill kernels.
+ *
+ * @param[in] impl The kernels to use.
+ * @returns 1 if the CPU supports the kernels and they were selected, 0
+ * otherwise.
+ */
+int infoto_fill_select(infoto_fill_impl impl) {
+  switch (impl) {
+  case INFOTO_FILL_SCALAR:
+    fill_rgb = fill_rgb_scalar;
+    fill_rgba = fill_rgba_scalar;
+    break;
+#ifdef INFOTO_FILL_X86
+  case INFOTO_FILL_SSE2:
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse2")) {
+      return 0;
+    }
+    fill_rgb = fill_rgb_sse2;
+    fill_rgba = fill_rgba_sse2;
+    break;
+  case INFOTO_FILL_AVX2:
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2")) {
+      return 0;
+    }
+    fill_rgb = fill_rgb_avx2;
+    fill_rgba = fill_rgba_avx2;
+    break;
+#endif
+  default:
+    return 0;
+  }
+  fill_impl = impl;
+  return 1;
+}
+
+/**
+ * Get the name of the selected fill kernels.
+ *
+ * @returns The kernel name.
+ */
+const char *infoto_fill_name(void) {
+  switch (fill_impl) {
+  case INFOTO_FILL_SSE2:
+    return "sse2";
+  case INFOTO_FILL_AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+/**
+ * Fill a span of pixels with one color.
+ * Gray images and colors with equal components are a memset, RGB and RGBA
+ * colors use the selected kernel.
+ *
+ * @param[out] dst The first pixel of the span.
+ * @param[in] pixels The number of pixels in the span.
+ * @param[in] num_components The number of components per pixel (1 to 4).
+ * @param[in] color The color's components, num_components values.
+ */
+void infoto_fill_pixels(uint8_t *dst, size_t pixels, int num_components,
+                        const uint8_t color[4]) {
+  if (pixels == 0) {
+    return;
+  }
+  int uniform = 1;
+  for (int c = 1; c < num_components; ++c) {
+    if (color[c] != color[0]) {
+      uniform = 0;
+    }
+  }
+  // black and white borders are the common case
+  if (uniform) {
+    memset(dst, color[0], pixels * num_components);
+  } else if (num_components == 3) {
+    fill_rgb(dst, pixels, color);
+  } else if (num_components == 4) {
+    fill_rgba(dst, pixels, color);
+  } else {
+    fill_doubling(dst, pixels * num_components, color, num_components);
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef INFOTO_FILL_H
+#define INFOTO_FILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Fill kernel implementations.
+ */
+typedef enum {
+  INFOTO_FILL_SCALAR,
+  INFOTO_FILL_SSE2,
+  INFOTO_FILL_AVX2
+} infoto_fill_impl;
+
+/**
+ * Pick the fastest fill kernels the CPU supports.
+ * Until this is called the scalar kernels are used.
+ */
+void infoto_fill_init(void);
+
+/**
+ * Force the given fill kernels.
+ *
+ * @param[in] impl The kernels to use.
+ * @returns 1 if the CPU supports the kernels and they were selected, 0
+ * otherwise.
+ */
+int infoto_fill_select(infoto_fill_impl impl);
+
+/**
+ * Get the name of the selected fill kernels.
+ *
+ * @returns The kernel name.
+ */
+const char *infoto_fill_name(void);
+
+/**
+ * Fill a span of pixels with one color.
+ * Gray images and colors with equal components are a memset, RGB and RGBA
+ * colors use the selected kernel.
+ *
+ * @param[out] dst The first pixel of the span.
+ * @param[in] pixels The number of pixels in the span.
+ * @param[in] num_components The number of components per pixel (1 to 4).
+ * @param[in] color The color's components, num_components values.
+ */
+void infoto_fill_pixels(uint8_t *dst, size_t pixels, int num_components,
+                        const uint8_t color[4]);
+
+#endif
@@ -0,0 +1,71 @@
+#include "handler_set.h"
+#include "jpeg_handler.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Initialize a handler set writing JPEG images.
+ *
+ * @param[in] opts The shared resources, must outlive the set.
+ * @param[out] set The handler set to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_handler_set_init(const infoto_handler_set_options *opts,
+                        infoto_handler_set *set) {
+  memset(set, 0, sizeof(infoto_handler_set));
+  infoto_error_enum err_code = infoto_font_handler_init(&set->font_handler);
+  if (err_code != INFOTO_SUCCESS) {
+    fprintf(stderr, "failed to initialize font library\n");
+    return err_code;
+  }
+  if (opts->glyph_atlas != NULL) {
+    infoto_font_handler_use_atlas(set->font_handler, opts->glyph_atlas);
+  }
+  err_code = infoto_font_handler_load_font_file(set->font_handler,
+                                                opts->font_file, opts->point);
+  if (err_code != INFOTO_SUCCESS) {
+    fprintf(stderr, "failed to load ttf file.\n");
+    infoto_handler_set_free(set);
+    return err_code;
+  }
+  if (opts->caption_cache_cap > 0) {
+    err_code =
+        infoto_caption_cache_init(opts->caption_cache_cap, &set->caption_cache);
+    if (err_code != INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to initialize caption cache\n");
+      infoto_handler_set_free(set);
+      return err_code;
+    }
+  }
+  if (opts->watermark != NULL) {
+    err_code = infoto_watermark_copy(opts->watermark, &set->watermark);
+    if (err_code != INFOTO_SUCCESS) {
+      infoto_handler_set_free(set);
+      return err_code;
+    }
+  }
+  infoto_jpeg_handler_init(&set->handler, set->font_handler,
+                           set->caption_cache, set->watermark);
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Free the handler set and everything it owns.
+ *
+ * @param[in,out] set The handler set to free.
+ */
+void infoto_handler_set_free(infoto_handler_set *set) {
+  if (set->handler._internal != NULL) {
+    infoto_jpeg_handler_free(&set->handler);
+    set->handler._internal = NULL;
+  }
+  if (set->font_handler != NULL) {
+    infoto_font_handler_free(&set->font_handler);
+  }
+  if (set->caption_cache != NULL) {
+    infoto_caption_cache_free(&set->caption_cache);
+  }
+  infoto_watermark_free(&set->watermark);
+}
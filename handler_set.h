@@ -0,0 +1,56 @@
+#ifndef INFOTO_HANDLER_SET_H
+#define INFOTO_HANDLER_SET_H
+
+#include "caption_cache.h"
+#include "config.h"
+#include "error_codes.h"
+#include "img_utils.h"
+#include "ttf_util.h"
+#include "watermark.h"
+
+/**
+ * Shared, read-only resources every handler set is built from.
+ */
+typedef struct {
+  // the mapped font, every set loads its own face from it
+  const infoto_font_file *font_file;
+  // optional glyph atlas file, NULL for none
+  const infoto_glyph_atlas *glyph_atlas;
+  // font point size to load
+  int point;
+  // max number of caption strips each set keeps, 0 for no cache
+  int caption_cache_cap;
+  // optional decoded logo, each set places it with its own copy
+  const infoto_watermark *watermark;
+} infoto_handler_set_options;
+
+/**
+ * An image handler along with the font handler, caption cache and watermark
+ * it owns. A set is only ever used by one thread at a time.
+ */
+typedef struct {
+  infoto_font_handler *font_handler;
+  infoto_caption_cache *caption_cache;
+  infoto_watermark *watermark;
+  infoto_img_handler handler;
+} infoto_handler_set;
+
+/**
+ * Initialize a handler set writing JPEG images.
+ *
+ * @param[in] opts The shared resources, must outlive the set.
+ * @param[out] set The handler set to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_handler_set_init(const infoto_handler_set_options *opts,
+                        infoto_handler_set *set);
+
+/**
+ * Free the handler set and everything it owns.
+ *
+ * @param[in,out] set The handler set to free.
+ */
+void infoto_handler_set_free(infoto_handler_set *set);
+
+#endif
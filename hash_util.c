@@ -0,0 +1,76 @@
+#include "hash_util.h"
+
+#include <string.h>
+
+/* odd constants from the golden ratio and splitmix64 */
+#define HASH_PRIME_1 0x9E3779B97F4A7C15ULL
+#define HASH_PRIME_2 0xBF58476D1CE4E5B9ULL
+#define HASH_PRIME_3 0x94D049BB133111EBULL
+/* linear congruential step of jump consistent hashing */
+#define JUMP_HASH_MULTIPLIER 2862933555777941757ULL
+
+/**
+ * Finalize a 64 bit value so every input bit affects every output bit.
+ *
+ * @param[in] v The value to mix.
+ * @returns The mixed value.
+ */
+uint64_t infoto_hash_mix64(uint64_t v) {
+  v ^= v >> 30;
+  v *= HASH_PRIME_2;
+  v ^= v >> 27;
+  v *= HASH_PRIME_3;
+  v ^= v >> 31;
+  return v;
+}
+
+/**
+ * Fast non-cryptographic 64 bit hash of the given bytes.
+ * Processes 8 bytes per step, the result is stable across runs and machines
+ * of the same endianness so it can be persisted.
+ *
+ * @param[in] data The bytes to hash.
+ * @param[in] len The number of bytes.
+ * @param[in] seed The seed (or previous hash when hashing in chunks).
+ * @returns The hash value.
+ */
+uint64_t infoto_hash64(const void *data, size_t len, uint64_t seed) {
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t h = seed ^ (len * HASH_PRIME_1);
+  while (len >= 8) {
+    uint64_t word;
+    // memcpy keeps unaligned loads well defined, compiles to a single load
+    memcpy(&word, p, sizeof(word));
+    h ^= infoto_hash_mix64(word + HASH_PRIME_1);
+    h = (h << 27 | h >> 37) * HASH_PRIME_1;
+    p += 8;
+    len -= 8;
+  }
+  if (len > 0) {
+    uint64_t word = 0;
+    memcpy(&word, p, len);
+    h ^= infoto_hash_mix64(word + HASH_PRIME_1 + len);
+  }
+  return infoto_hash_mix64(h);
+}
+
+/**
+ * Map a key to one of the buckets with jump consistent hashing. Growing the
+ * number of buckets from n to n + 1 only moves 1 / (n + 1) of the keys, all
+ * of them into the new bucket.
+ *
+ * @param[in] key The key, a hash value.
+ * @param[in] buckets The number of buckets, at least 1.
+ * @returns The bucket of the key, from 0 to buckets - 1.
+ */
+int32_t infoto_jump_hash(uint64_t key, int32_t buckets) {
+  int64_t bucket = -1;
+  int64_t next = 0;
+  while (next < buckets) {
+    bucket = next;
+    key = key * JUMP_HASH_MULTIPLIER + 1;
+    next = (int64_t)((bucket + 1) *
+                     ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+  }
+  return (int32_t)bucket;
+}
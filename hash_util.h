@@ -0,0 +1,38 @@
+#ifndef INFOTO_HASH_UTIL_H
+#define INFOTO_HASH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Finalize a 64 bit value so every input bit affects every output bit.
+ *
+ * @param[in] v The value to mix.
+ * @returns The mixed value.
+ */
+uint64_t infoto_hash_mix64(uint64_t v);
+
+/**
+ * Fast non-cryptographic 64 bit hash of the given bytes.
+ * Processes 8 bytes per step, the result is stable across runs and machines
+ * of the same endianness so it can be persisted.
+ *
+ * @param[in] data The bytes to hash.
+ * @param[in] len The number of bytes.
+ * @param[in] seed The seed (or previous hash when hashing in chunks).
+ * @returns The hash value.
+ */
+uint64_t infoto_hash64(const void *data, size_t len, uint64_t seed);
+
+/**
+ * Map a key to one of the buckets with jump consistent hashing. Growing the
+ * number of buckets from n to n + 1 only moves 1 / (n + 1) of the keys, all
+ * of them into the new bucket.
+ *
+ * @param[in] key The key, a hash value.
+ * @param[in] buckets The number of buckets, at least 1.
+ * @returns The bucket of the key, from 0 to buckets - 1.
+ */
+int32_t infoto_jump_hash(uint64_t key, int32_t buckets);
+
+#endif
@@ -0,0 +1,292 @@
+#include "img_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Ways of bringing a file's contents into memory.
+ */
+enum load_mode {
+  // map the file, pages are read in on first use
+  LOAD_MAP,
+  // map the file and read every page in right away
+  LOAD_MAP_POPULATE,
+  // copy the file into a heap buffer, a later truncation can't fault it
+  LOAD_COPY,
+};
+
+/**
+ * Read the whole file into a heap buffer.
+ * Used for files another process may truncate, and as a fallback for file
+ * systems that do not support mmap.
+ *
+ * @param[in] fd The open file descriptor.
+ * @param[in,out] file The image file object with size populated.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum read_whole_file(int fd, infoto_img_file *file) {
+  uint8_t *buffer = (uint8_t *)malloc(file->size);
+  if (buffer == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  size_t pos = 0;
+  while (pos < file->size) {
+    ssize_t n = pread(fd, &buffer[pos], file->size - pos, pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      free(buffer);
+      return INFOTO_ERR_IMG_READ;
+    }
+    pos += n;
+  }
+  file->data = buffer;
+  file->mapped = 0;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Map (or read) the contents of an open file into memory.
+ *
+ * @param[in] fd The open file descriptor.
+ * @param[in] file_name The name to report the file by.
+ * @param[in] mode How the contents are brought into memory.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum map_fd(int fd, const char *file_name,
+                                enum load_mode mode, infoto_img_file *file) {
+  memset(file, 0, sizeof(infoto_img_file));
+  file->name = file_name;
+  if (fstat(fd, &file->st) != 0 || !S_ISREG(file->st.st_mode) ||
+      file->st.st_size == 0) {
+    fprintf(stderr, "could not read file: %s\n", file_name);
+    return INFOTO_ERR_IMG_READ;
+  }
+  file->size = file->st.st_size;
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  void *map = MAP_FAILED;
+  if (mode != LOAD_COPY) {
+    map = mmap(NULL, file->size, PROT_READ,
+               MAP_PRIVATE | (mode == LOAD_MAP_POPULATE ? MAP_POPULATE : 0),
+               fd, 0);
+  }
+  if (map != MAP_FAILED) {
+    // the whole file is consumed front to back
+    madvise(map, file->size, MADV_SEQUENTIAL);
+    file->data = (uint8_t *)map;
+    file->mapped = 1;
+  } else {
+    err_code = read_whole_file(fd, file);
+  }
+  if (err_code != INFOTO_SUCCESS) {
+    fprintf(stderr, "could not read file: %s\n", file_name);
+  }
+  return err_code;
+}
+
+/**
+ * Open the given file and map (or read) its contents into memory.
+ *
+ * @param[in] file_name The file to open.
+ * @param[in] mode How the contents are brought into memory.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum open_file(const char *file_name, enum load_mode mode,
+                                   infoto_img_file *file) {
+  memset(file, 0, sizeof(infoto_img_file));
+  file->name = file_name;
+  int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "file is not accessible: %s\n", file_name);
+    return errno == ENOENT ? INFOTO_ERR_NO_FILE_ACCESS : INFOTO_ERR_OPEN_FILE;
+  }
+  infoto_error_enum err_code = map_fd(fd, file_name, mode, file);
+  // the mapping stays valid after the descriptor is closed
+  close(fd);
+  return err_code;
+}
+
+/**
+ * Copy the contents of an open file into a heap buffer. The file is never
+ * mapped, so whoever handed over the descriptor can't fault the process by
+ * truncating the file. The descriptor stays open and owned by the caller.
+ *
+ * @param[in] fd The open file descriptor of a regular file.
+ * @param[in] file_name The name to report the file by.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_open_fd(int fd, const char *file_name,
+                                          infoto_img_file *file) {
+  return map_fd(fd, file_name, LOAD_COPY, file);
+}
+
+/**
+ * Open the given file and copy its contents into a heap buffer. The file is
+ * never mapped, so another process truncating it can't fault this one.
+ *
+ * @param[in] file_name The file to open.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_copy(const char *file_name,
+                                       infoto_img_file *file) {
+  return open_file(file_name, LOAD_COPY, file);
+}
+
+/**
+ * Open the given file and map (or read) its contents into memory.
+ *
+ * @param[in] file_name The file to open.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_open(const char *file_name,
+                                       infoto_img_file *file) {
+  return open_file(file_name, LOAD_MAP, file);
+}
+
+/**
+ * Open the given file and read all of its contents into memory before
+ * returning, so later reads of the bytes never wait on the disk.
+ *
+ * @param[in] file_name The file to open.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_load(const char *file_name,
+                                       infoto_img_file *file) {
+  return open_file(file_name, LOAD_MAP_POPULATE, file);
+}
+
+/**
+ * Read exactly len bytes at the given offset.
+ *
+ * @param[in] fd The open file descriptor.
+ * @param[out] buf The buffer to read into.
+ * @param[in] len The number of bytes to read.
+ * @param[in] offset The file offset to read from.
+ * @returns 1 if all bytes were read, 0 otherwise.
+ */
+static int pread_full(int fd, uint8_t *buf, size_t len, off_t offset) {
+  size_t pos = 0;
+  while (pos < len) {
+    ssize_t n = pread(fd, &buf[pos], len - pos, offset + pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    pos += n;
+  }
+  return 1;
+}
+
+/**
+ * Read only the EXIF metadata of the given JPEG file.
+ * The marker headers are walked with positioned reads and only the EXIF
+ * APP1 segment is read, the image data is never touched. The resulting
+ * object holds a minimal JPEG prefix (SOI + APP1) that the EXIF functions
+ * accept like a full file.
+ *
+ * @param[in] file_name The file to read.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, INFOTO_ERR_EXIF_READ if the file has
+ * no EXIF segment, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_open_metadata(const char *file_name,
+                                                infoto_img_file *file) {
+  memset(file, 0, sizeof(infoto_img_file));
+  file->name = file_name;
+  int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno == ENOENT ? INFOTO_ERR_NO_FILE_ACCESS : INFOTO_ERR_OPEN_FILE;
+  }
+  if (fstat(fd, &file->st) != 0) {
+    close(fd);
+    return INFOTO_ERR_IMG_READ;
+  }
+  infoto_error_enum err_code = INFOTO_ERR_EXIF_READ;
+  uint8_t header[4];
+  off_t pos = 2;
+  if (!pread_full(fd, header, 2, 0) || header[0] != 0xFF ||
+      header[1] != INFOTO_JPEG_MARKER_SOI) {
+    close(fd);
+    return err_code;
+  }
+  while (pread_full(fd, header, 4, pos)) {
+    if (header[0] != 0xFF) {
+      break;
+    }
+    // fill bytes
+    if (header[1] == 0xFF) {
+      ++pos;
+      continue;
+    }
+    // no more metadata segments once image data starts
+    if (header[1] == INFOTO_JPEG_MARKER_SOS ||
+        header[1] == INFOTO_JPEG_MARKER_EOI) {
+      break;
+    }
+    const size_t len = (header[2] << 8) | header[3];
+    if (len < 2) {
+      break;
+    }
+    if (header[1] == INFOTO_JPEG_MARKER_APP1) {
+      // keep the SOI and marker header so the bytes look like a JPEG prefix
+      uint8_t *buffer = (uint8_t *)malloc(len + 4);
+      if (buffer == NULL) {
+        err_code = INFOTO_ERR_MALLOC;
+        break;
+      }
+      buffer[0] = 0xFF;
+      buffer[1] = INFOTO_JPEG_MARKER_SOI;
+      memcpy(&buffer[2], header, 4);
+      if (!pread_full(fd, &buffer[6], len - 2, pos + 4)) {
+        free(buffer);
+        err_code = INFOTO_ERR_IMG_READ;
+        break;
+      }
+      // APP1 can also hold XMP data, keep looking if this is not EXIF
+      if (len - 2 >= INFOTO_EXIF_HEADER_LEN &&
+          memcmp(&buffer[6], INFOTO_EXIF_HEADER, INFOTO_EXIF_HEADER_LEN) ==
+              0) {
+        file->data = buffer;
+        file->size = len + 4;
+        err_code = INFOTO_SUCCESS;
+        break;
+      }
+      free(buffer);
+    }
+    pos += 2 + len;
+  }
+  close(fd);
+  return err_code;
+}
+
+/**
+ * Release the memory held by the image file object.
+ *
+ * @param[in,out] file The image file object to close.
+ */
+void infoto_img_file_close(infoto_img_file *file) {
+  if (file->data != NULL) {
+    if (file->mapped) {
+      munmap(file->data, file->size);
+    } else {
+      free(file->data);
+    }
+  }
+  file->data = NULL;
+  file->size = 0;
+}
@@ -0,0 +1,104 @@
+#ifndef INFOTO_IMG_FILE_H
+#define INFOTO_IMG_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "error_codes.h"
+
+/* JPEG markers needed to locate the EXIF segment */
+#define INFOTO_JPEG_MARKER_SOI 0xD8
+#define INFOTO_JPEG_MARKER_EOI 0xD9
+#define INFOTO_JPEG_MARKER_SOS 0xDA
+#define INFOTO_JPEG_MARKER_APP1 0xE1
+/* EXIF APP1 header */
+#define INFOTO_EXIF_HEADER "Exif\0\0"
+#define INFOTO_EXIF_HEADER_LEN 6
+
+/**
+ * Structure to hold the raw bytes of an input image.
+ * The file is opened and read once, the same bytes are used for EXIF
+ * extraction and for decoding the image.
+ */
+typedef struct {
+  // the file name the bytes were read from
+  const char *name;
+  // the raw file bytes
+  uint8_t *data;
+  // the number of bytes in data
+  size_t size;
+  // flag for if data is a memory mapping or a heap buffer
+  uint8_t mapped;
+  // file status at the time it was opened
+  struct stat st;
+} infoto_img_file;
+
+/**
+ * Open the given file and map (or read) its contents into memory.
+ *
+ * @param[in] file_name The file to open.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_open(const char *file_name,
+                                       infoto_img_file *file);
+
+/**
+ * Open the given file and read all of its contents into memory before
+ * returning, so later reads of the bytes never wait on the disk.
+ *
+ * @param[in] file_name The file to open.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_load(const char *file_name,
+                                       infoto_img_file *file);
+
+/**
+ * Copy the contents of an open file into a heap buffer. The file is never
+ * mapped, so whoever handed over the descriptor can't fault the process by
+ * truncating the file. The descriptor stays open and owned by the caller.
+ *
+ * @param[in] fd The open file descriptor of a regular file.
+ * @param[in] file_name The name to report the file by.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_open_fd(int fd, const char *file_name,
+                                          infoto_img_file *file);
+
+/**
+ * Open the given file and copy its contents into a heap buffer. The file is
+ * never mapped, so another process truncating it can't fault this one.
+ *
+ * @param[in] file_name The file to open.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_copy(const char *file_name,
+                                       infoto_img_file *file);
+
+/**
+ * Read only the EXIF metadata of the given JPEG file.
+ * The marker headers are walked with positioned reads and only the EXIF
+ * APP1 segment is read, the image data is never touched. The resulting
+ * object holds a minimal JPEG prefix (SOI + APP1) that the EXIF functions
+ * accept like a full file.
+ *
+ * @param[in] file_name The file to read.
+ * @param[out] file The image file object to populate.
+ * @returns INFOTO_SUCCESS if successful, INFOTO_ERR_EXIF_READ if the file has
+ * no EXIF segment, otherwise an error code.
+ */
+infoto_error_enum infoto_img_file_open_metadata(const char *file_name,
+                                                infoto_img_file *file);
+
+/**
+ * Release the memory held by the image file object.
+ *
+ * @param[in,out] file The image file object to close.
+ */
+void infoto_img_file_close(infoto_img_file *file);
+
+#endif
@@ -1,8 +1,14 @@
 #include "img_utils.h"
 
+#include "blend.h"
+#include "fill.h"
+
 #include <stdlib.h>
 #include <string.h>
 
+/* Rows handed to the writer per call when writing a strip */
+#define STRIP_WRITE_ROWS 64
+
 #define INFOTO_BACKGROUND_BLACK "black"
 #define INFOTO_BACKGROUND_BLUE "blue"
 #define INFOTO_BACKGROUND_GREEN "green"
@@ -103,8 +109,28 @@ int infoto_write_pixel_to_buffer(const pixel p, const int i, uint8_t *buf) {
   return 3;
 }
 
+/**
+ * Get the components of a pixel for an image with the given component count.
+ * Gray images get the pixel's luma.
+ *
+ * @param[in] p The pixel.
+ * @param[in] num_components The number of components per pixel (1, 3 or 4).
+ * @param[out] components The pixel's components.
+ */
+void infoto_pixel_components(const pixel p, int num_components,
+                             uint8_t components[4]) {
+  components[0] = p.r;
+  components[1] = p.g;
+  components[2] = p.b;
+  components[3] = p.alpha;
+  if (num_components == 1) {
+    components[0] = (p.r * 77 + p.g * 150 + p.b * 29) >> 8;
+  }
+}
+
 /**
  * Write out glyph string to the given matrix buffer.
+ * Glyph coverage is alpha blended between the buffer and the font color.
  *
  * @param[out] matrix_buf The matrix buffer to populate.
  * @param[in] num_components The number of pixel components.
@@ -122,69 +148,67 @@ infoto_error_enum infoto_write_glyph_str(uint8_t **matrix_buf,
     return INFOTO_ERR_NULL;
   }
   infoto_error_enum err_code = INFOTO_SUCCESS;
-  int glyph_width = infoto_glyph_str_get_width(glyph_str) * num_components;
-  int glyph_height = infoto_glyph_str_get_height(glyph_str);
-  int glyph_left_pos = (row_size / 2) - (glyph_width / 2);
-  int glyph_top_pos = (height / 2) - (glyph_height / 2);
+  // center the glyph string's bounding box, in pixels
+  const int width = row_size / num_components;
+  const int origin_x = (width - infoto_glyph_str_get_width(glyph_str)) / 2;
+  const int origin_y = (height - infoto_glyph_str_get_height(glyph_str)) / 2;
+  // font color as the buffer's components, gray images use its luma
+  uint8_t color[4];
+  infoto_pixel_components(font_color, num_components, color);
   size_t glyph_len = infoto_glyph_str_len(glyph_str);
   for (int glyph_idx = 0; glyph_idx < glyph_len; ++glyph_idx) {
-    FT_BitmapGlyph bitmap_glyph;
-    FT_Glyph glyph = infoto_glyph_str_get_glyph(glyph_str, glyph_idx);
-    switch (glyph->format) {
-    case FT_GLYPH_FORMAT_BITMAP:
-      bitmap_glyph = (FT_BitmapGlyph)glyph;
-      break;
-    default:
-      fprintf(stderr, "cannot handle other formats from bitmap\n");
-      err_code = INFOTO_ERR_TTF_WRONG_FORMAT;
-      break;
-    }
-    if (err_code != INFOTO_SUCCESS) {
+    infoto_glyph glyph;
+    if (!infoto_glyph_str_get_glyph(glyph_str, glyph_idx, &glyph)) {
+      err_code = INFOTO_ERR_NULL;
       break;
     }
-    FT_Int x_max = bitmap_glyph->bitmap.width;
-    FT_Int y_max = bitmap_glyph->bitmap.rows;
-    // get height difference to see if we need to offset where the glyph is
-    // drawn
-    FT_Int height_difference = (glyph_height - y_max) - KERN_SIZE;
-    FT_Int adjusted_height = glyph_top_pos;
-    if (height_difference > 0) {
-      adjusted_height += height_difference;
-    }
-    for (int i = adjusted_height, q = 0; q < y_max; ++i, ++q) {
-      for (int j = glyph_left_pos, p = 0; p < x_max; j += num_components, ++p) {
-        if (i < 0 || j < 0 || i >= height || j >= row_size) {
-          continue;
-        }
-        uint8_t bit = bitmap_glyph->bitmap.buffer[q * x_max + p];
-        if (bit > 0) {
-          infoto_write_pixel_to_buffer(font_color, j, matrix_buf[i]);
-        }
-      }
+    // clip the glyph to the buffer once, not per pixel
+    const int left = origin_x + glyph.x;
+    const int top = origin_y + glyph.y;
+    const int x0 = left < 0 ? -left : 0;
+    const int y0 = top < 0 ? -top : 0;
+    const int x1 = left + glyph.width > width ? width - left : glyph.width;
+    const int y1 = top + glyph.rows > height ? height - top : glyph.rows;
+    if (x0 >= x1) {
+      continue;
     }
-    if (x_max == 0) {
-      x_max = WHITE_SPACE_SIZE;
+    for (int q = y0; q < y1; ++q) {
+      infoto_blend_span(&matrix_buf[top + q][(left + x0) * num_components],
+                        &glyph.buffer[q * glyph.width + x0], x1 - x0,
+                        num_components, color);
     }
-    glyph_left_pos += ((x_max + KERN_SIZE) * num_components);
   }
   return err_code;
 }
 
 /**
- * Write out background border of given color to image writer.
+ * Get the size in bytes of a background strip for the given writer.
  *
  * @param[in] writer The writer.
- * @param[in,out] image The object that manages image data.
+ * @param[in] background The background information.
+ * @returns The size of the strip.
+ */
+size_t infoto_background_strip_size(const infoto_img_writer *writer,
+                                    const background_info background) {
+  return (size_t)background.pixels * writer->image_width *
+         writer->num_components;
+}
+
+/**
+ * Render a background border of given color, and optionally a glyph string,
+ * into a contiguous strip.
+ *
+ * @param[in] writer The writer the strip is for.
  * @param[in] background The background information.
  * @param[in] font The font information.
  * @param[in] glyph_str The glyph string to write out to the background. Pass
  * NULL if nothing should be written out.
+ * @param[out] strip The strip to populate, infoto_background_strip_size bytes.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
-infoto_error_enum infoto_write_background_rows(
-    infoto_img_writer *writer, void *data, const background_info background,
-    const font_info font, const infoto_glyph_str *glyph_str) {
-
+infoto_error_enum infoto_render_background_strip(
+    const infoto_img_writer *writer, const background_info background,
+    const font_info font, const infoto_glyph_str *glyph_str, uint8_t *strip) {
   infoto_error_enum err_code = INFOTO_SUCCESS;
   const uint8_t use_alpha = writer->num_components == 4 ? 1 : 0;
   const pixel background_color =
@@ -197,24 +221,144 @@ infoto_error_enum infoto_write_background_rows(
   }
   int row_size = writer->image_width * writer->num_components;
   for (int i = 0; i < background.pixels; ++i) {
-    matrix_buf[i] = (uint8_t *)malloc(row_size * sizeof(uint8_t));
-    for (int j = 0; j < row_size; j += writer->num_components) {
-      infoto_write_pixel_to_buffer(background_color, j, matrix_buf[i]);
-    }
+    matrix_buf[i] = &strip[(size_t)i * row_size];
   }
+  // the rows are contiguous so the whole strip is one span of pixels
+  uint8_t color[4];
+  infoto_pixel_components(background_color, writer->num_components, color);
+  infoto_fill_pixels(strip, (size_t)background.pixels * writer->image_width,
+                     writer->num_components, color);
   if (glyph_str != NULL) {
     const pixel font_color = infoto_get_colored_pixel(font.color, use_alpha);
     err_code =
         infoto_write_glyph_str(matrix_buf, writer->num_components, row_size,
                                background.pixels, font_color, glyph_str);
   }
-  if (err_code == INFOTO_SUCCESS) {
-    err_code = writer->write_matrix(background, matrix_buf, data);
+  free(matrix_buf);
+  return err_code;
+}
+
+/**
+ * Write out a rendered background strip to image writer.
+ *
+ * @param[in] writer The writer.
+ * @param[in,out] data The object that manages image data.
+ * @param[in] background The background information.
+ * @param[in] strip The strip from infoto_render_background_strip.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_write_background_strip(infoto_img_writer *writer,
+                                                void *data,
+                                                const background_info background,
+                                                const uint8_t *strip) {
+  uint8_t *matrix_buf[STRIP_WRITE_ROWS];
+  const size_t row_size = (size_t)writer->image_width * writer->num_components;
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  for (int row = 0; row < background.pixels && err_code == INFOTO_SUCCESS;
+       row += STRIP_WRITE_ROWS) {
+    background_info chunk = background;
+    chunk.pixels = background.pixels - row < STRIP_WRITE_ROWS
+                       ? background.pixels - row
+                       : STRIP_WRITE_ROWS;
+    for (int i = 0; i < chunk.pixels; ++i) {
+      // writers only read the rows
+      matrix_buf[i] = (uint8_t *)&strip[(row + i) * row_size];
+    }
+    err_code = writer->write_matrix(chunk, matrix_buf, data);
   }
-  // free arrays
-  for (int i = 0; i < background.pixels; ++i) {
-    free(matrix_buf[i]);
+  return err_code;
+}
+
+/**
+ * Initialize a reusable background strip.
+ *
+ * @param[out] strip The strip to initialize.
+ */
+void infoto_background_strip_init(infoto_background_strip *strip) {
+  memset(strip, 0, sizeof(infoto_background_strip));
+}
+
+/**
+ * Get a plain background strip for the given writer, filling it only when
+ * the width, component count, height or color changed since the last call.
+ *
+ * @param[in,out] strip The reusable strip.
+ * @param[in] writer The writer the strip is for.
+ * @param[in] background The background information.
+ * @param[out] data The strip, infoto_background_strip_size bytes. Valid until
+ * the next call.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_background_strip_get(infoto_background_strip *strip,
+                                              const infoto_img_writer *writer,
+                                              const background_info background,
+                                              const uint8_t **data) {
+  if (strip->filled && strip->image_width == writer->image_width &&
+      strip->num_components == writer->num_components &&
+      strip->pixels == background.pixels &&
+      strip->color == background.color) {
+    *data = strip->data;
+    return INFOTO_SUCCESS;
   }
-  free(matrix_buf);
+  const size_t len = infoto_background_strip_size(writer, background);
+  if (strip->cap < len) {
+    uint8_t *tmp = (uint8_t *)realloc(strip->data, len);
+    if (tmp == NULL) {
+      strip->filled = 0;
+      return INFOTO_ERR_MALLOC;
+    }
+    strip->data = tmp;
+    strip->cap = len;
+  }
+  const pixel background_color = infoto_get_colored_pixel(
+      background.color, writer->num_components == 4 ? 1 : 0);
+  uint8_t color[4];
+  infoto_pixel_components(background_color, writer->num_components, color);
+  infoto_fill_pixels(strip->data, (size_t)background.pixels * writer->image_width,
+                     writer->num_components, color);
+  strip->image_width = writer->image_width;
+  strip->num_components = writer->num_components;
+  strip->pixels = background.pixels;
+  strip->color = background.color;
+  strip->filled = 1;
+  *data = strip->data;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Free the reusable background strip.
+ *
+ * @param[in,out] strip The strip to free.
+ */
+void infoto_background_strip_free(infoto_background_strip *strip) {
+  free(strip->data);
+  infoto_background_strip_init(strip);
+}
+
+/**
+ * Write out background border of given color to image writer.
+ *
+ * @param[in] writer The writer.
+ * @param[in,out] image The object that manages image data.
+ * @param[in] background The background information.
+ * @param[in] font The font information.
+ * @param[in] glyph_str The glyph string to write out to the background. Pass
+ * NULL if nothing should be written out.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_write_background_rows(
+    infoto_img_writer *writer, void *data, const background_info background,
+    const font_info font, const infoto_glyph_str *glyph_str) {
+  uint8_t *strip =
+      (uint8_t *)malloc(infoto_background_strip_size(writer, background));
+  if (strip == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  infoto_error_enum err_code = infoto_render_background_strip(
+      writer, background, font, glyph_str, strip);
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = infoto_write_background_strip(writer, data, background, strip);
+  }
+  free(strip);
   return err_code;
 }
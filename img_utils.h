@@ -6,6 +6,7 @@
 
 #include "config.h"
 #include "error_codes.h"
+#include "img_file.h"
 #include "info_text.h"
 #include "ttf_util.h"
 
@@ -15,9 +16,16 @@
  */
 struct infoto_img_handler {
   void *_internal;
-  infoto_error_enum (*write_image)(struct infoto_img_handler *, const char *,
+  // write the edited image next to the original, returning its name
+  infoto_error_enum (*write_image)(struct infoto_img_handler *,
+                                   const infoto_img_file *,
                                    const background_info, const font_info,
                                    const info_text *, char **);
+  // encode the edited image into a malloc'd buffer, returning its size
+  infoto_error_enum (*encode_image)(struct infoto_img_handler *,
+                                    const infoto_img_file *,
+                                    const background_info, const font_info,
+                                    const info_text *, uint8_t **, size_t *);
 };
 typedef struct infoto_img_handler infoto_img_handler;
 
@@ -47,6 +55,21 @@ typedef struct {
   write_matrix_fn write_matrix;
 } infoto_img_writer;
 
+/**
+ * A contiguous background strip owned by an image handler and reused across
+ * images. It is only filled again when the layout or color changes.
+ */
+typedef struct {
+  uint8_t *data;
+  size_t cap;
+  // layout and color the data was filled for
+  int image_width;
+  int num_components;
+  int pixels;
+  background_color color;
+  uint8_t filled;
+} infoto_background_strip;
+
 /**
  * Get background_color enum from the given string.
  *
@@ -83,6 +106,87 @@ pixel infoto_pixel_from_single_value(const uint8_t v);
  */
 int infoto_write_pixel_to_buffer(const pixel p, const int i, uint8_t *buf);
 
+/**
+ * Get the components of a pixel for an image with the given component count.
+ * Gray images get the pixel's luma.
+ *
+ * @param[in] p The pixel.
+ * @param[in] num_components The number of components per pixel (1, 3 or 4).
+ * @param[out] components The pixel's components.
+ */
+void infoto_pixel_components(const pixel p, int num_components,
+                             uint8_t components[4]);
+
+/**
+ * Get the size in bytes of a background strip for the given writer.
+ *
+ * @param[in] writer The writer.
+ * @param[in] background The background information.
+ * @returns The size of the strip.
+ */
+size_t infoto_background_strip_size(const infoto_img_writer *writer,
+                                    const background_info background);
+
+/**
+ * Render a background border of given color, and optionally a glyph string,
+ * into a contiguous strip.
+ *
+ * @param[in] writer The writer the strip is for.
+ * @param[in] background The background information.
+ * @param[in] font The font information.
+ * @param[in] glyph_str The glyph string to write out to the background. Pass
+ * NULL if nothing should be written out.
+ * @param[out] strip The strip to populate, infoto_background_strip_size bytes.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_render_background_strip(
+    const infoto_img_writer *writer, const background_info background,
+    const font_info font, const infoto_glyph_str *glyph_str, uint8_t *strip);
+
+/**
+ * Write out a rendered background strip to image writer.
+ *
+ * @param[in] writer The writer.
+ * @param[in,out] data The object that manages image data.
+ * @param[in] background The background information.
+ * @param[in] strip The strip from infoto_render_background_strip.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_write_background_strip(infoto_img_writer *writer,
+                                                void *data,
+                                                const background_info background,
+                                                const uint8_t *strip);
+
+/**
+ * Initialize a reusable background strip.
+ *
+ * @param[out] strip The strip to initialize.
+ */
+void infoto_background_strip_init(infoto_background_strip *strip);
+
+/**
+ * Get a plain background strip for the given writer, filling it only when
+ * the width, component count, height or color changed since the last call.
+ *
+ * @param[in,out] strip The reusable strip.
+ * @param[in] writer The writer the strip is for.
+ * @param[in] background The background information.
+ * @param[out] data The strip, infoto_background_strip_size bytes. Valid until
+ * the next call.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_background_strip_get(infoto_background_strip *strip,
+                                              const infoto_img_writer *writer,
+                                              const background_info background,
+                                              const uint8_t **data);
+
+/**
+ * Free the reusable background strip.
+ *
+ * @param[in,out] strip The strip to free.
+ */
+void infoto_background_strip_free(infoto_background_strip *strip);
+
 /**
  * Write out background border of given color to image writer.
  *
@@ -1,68 +1,325 @@
 #include "info_text.h"
 
+#include <ctype.h>
+#include <math.h>
 #include <string.h>
 
+/* Initial caption capacity, enough for a typical caption without growing */
+#define INFO_TEXT_INITIAL_CAP 256
+/* Max characters of a 64-bit integer in decimal, including the sign */
+#define INT_STR_LEN 20
+
+/**
+ * Ensure the buffer has room for the given number of characters plus the
+ * null character.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] extra The number of characters to make room for
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum reserve(info_text *info, size_t extra) {
+  const size_t needed = info->buffer_len + extra + 1;
+  if (needed <= info->buffer_cap) {
+    return INFOTO_SUCCESS;
+  }
+  size_t cap = info->buffer_cap == 0 ? INFO_TEXT_INITIAL_CAP : info->buffer_cap;
+  while (cap < needed) {
+    cap *= 2;
+  }
+  char *tmp = (char *)realloc(info->buffer, cap);
+  if (tmp == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  info->buffer = tmp;
+  info->buffer_cap = cap;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Mark the given number of characters as part of the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] len The number of characters written past buffer_len
+ */
+static void commit_chars(info_text *info, size_t len) {
+  info->buffer_len += len;
+  info->buffer[info->buffer_len] = '\0';
+  if (info->len > 0) {
+    info->lengths[info->len - 1] += len;
+  }
+}
+
+/**
+ * Write the decimal digits of the given value to the end of out.
+ *
+ * @param[in] value The value to write
+ * @param[out] out The char array to populate, at least INT_STR_LEN long
+ * @returns The index of the first digit in out.
+ */
+static size_t write_digits(uint64_t value, char out[INT_STR_LEN]) {
+  size_t pos = INT_STR_LEN;
+  do {
+    out[--pos] = '0' + (value % 10);
+    value /= 10;
+  } while (value != 0);
+  return pos;
+}
+
 /**
  * Initialize Info Text object.
  *
  * @param[in] info Info text object to initialize
- * @param[in] size The size to initialize to
+ * @param[in] size The number of values to reserve space for
  * @param[in] sep The separator for each value
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
 infoto_error_enum infoto_info_text_init(info_text *info, size_t size,
-                                        char *sep) {
-  char **tmp = (char **)malloc(sizeof(char *) * size);
-  if (tmp == NULL) {
+                                        const char *sep) {
+  memset(info, 0, sizeof(info_text));
+  info->separator = sep;
+  info->separator_len = strlen(sep);
+  info->cap = size == 0 ? 1 : size;
+  info->offsets = (size_t *)malloc(sizeof(size_t) * info->cap);
+  info->lengths = (size_t *)malloc(sizeof(size_t) * info->cap);
+  if (info->offsets == NULL || info->lengths == NULL ||
+      reserve(info, 0) != INFOTO_SUCCESS) {
+    infoto_info_text_free(info);
     return INFOTO_ERR_MALLOC;
   }
-  info->buffer = tmp;
-  info->separator = sep;
-  info->size = size;
+  info->buffer[0] = '\0';
   return INFOTO_SUCCESS;
 }
 
+/**
+ * Clear the values while keeping the allocated memory for reuse.
+ *
+ * @param[in,out] info The info text object
+ */
+void infoto_info_text_reset(info_text *info) {
+  info->buffer_len = 0;
+  info->len = 0;
+  if (info->buffer != NULL) {
+    info->buffer[0] = '\0';
+  }
+}
+
+/**
+ * Start a new value, appending the separator if it is not the first.
+ * Following append calls add to this value.
+ *
+ * @param[in,out] info The info text object
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_begin_value(info_text *info) {
+  if (info->len == info->cap) {
+    const size_t cap = info->cap * 2;
+    size_t *offsets = (size_t *)realloc(info->offsets, sizeof(size_t) * cap);
+    if (offsets == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    info->offsets = offsets;
+    size_t *lengths = (size_t *)realloc(info->lengths, sizeof(size_t) * cap);
+    if (lengths == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    info->lengths = lengths;
+    info->cap = cap;
+  }
+  if (info->len > 0) {
+    if (reserve(info, info->separator_len) != INFOTO_SUCCESS) {
+      return INFOTO_ERR_MALLOC;
+    }
+    memcpy(&info->buffer[info->buffer_len], info->separator,
+           info->separator_len);
+    info->buffer_len += info->separator_len;
+    info->buffer[info->buffer_len] = '\0';
+  }
+  info->offsets[info->len] = info->buffer_len;
+  info->lengths[info->len] = 0;
+  ++info->len;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Append characters to the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] str The characters to append
+ * @param[in] len The number of characters
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append(info_text *info, const char *str,
+                                          size_t len) {
+  if (reserve(info, len) != INFOTO_SUCCESS) {
+    return INFOTO_ERR_MALLOC;
+  }
+  memcpy(&info->buffer[info->buffer_len], str, len);
+  commit_chars(info, len);
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Append characters to the current value, forced to uppercase.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] str The characters to append
+ * @param[in] len The number of characters
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_upper(info_text *info,
+                                                const char *str, size_t len) {
+  if (reserve(info, len) != INFOTO_SUCCESS) {
+    return INFOTO_ERR_MALLOC;
+  }
+  char *out = &info->buffer[info->buffer_len];
+  for (size_t i = 0; i < len; ++i) {
+    out[i] = toupper((unsigned char)str[i]);
+  }
+  commit_chars(info, len);
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Append a signed integer in decimal to the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] value The value to append
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_int(info_text *info, int64_t value) {
+  char digits[INT_STR_LEN];
+  // negate as unsigned so INT64_MIN does not overflow
+  const uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  size_t pos = write_digits(magnitude, digits);
+  if (value < 0) {
+    digits[--pos] = '-';
+  }
+  return infoto_info_text_append(info, &digits[pos], INT_STR_LEN - pos);
+}
+
+/**
+ * Append an unsigned integer in decimal to the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] value The value to append
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_uint(info_text *info,
+                                               uint64_t value) {
+  char digits[INT_STR_LEN];
+  const size_t pos = write_digits(value, digits);
+  return infoto_info_text_append(info, &digits[pos], INT_STR_LEN - pos);
+}
+
+/**
+ * Append a rational as a fraction, e.g. "1/250", to the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] numerator The numerator
+ * @param[in] denominator The denominator
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_fraction(info_text *info,
+                                                   int64_t numerator,
+                                                   int64_t denominator) {
+  infoto_error_enum err_code = infoto_info_text_append_int(info, numerator);
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = infoto_info_text_append(info, "/", 1);
+  }
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = infoto_info_text_append_int(info, denominator);
+  }
+  return err_code;
+}
+
+/**
+ * Append a rational as a decimal rounded to one fractional digit, e.g. "5.6",
+ * to the current value. A zero denominator is appended as "INF".
+ *
+ * @param[in,out] info The info text object
+ * @param[in] numerator The numerator
+ * @param[in] denominator The denominator
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_decimal(info_text *info,
+                                                  int64_t numerator,
+                                                  int64_t denominator) {
+  if (denominator == 0) {
+    return infoto_info_text_append(info, "INF", 3);
+  }
+  const int negative = (numerator < 0) != (denominator < 0);
+  const uint64_t num =
+      numerator < 0 ? -(uint64_t)numerator : (uint64_t)numerator;
+  const uint64_t den =
+      denominator < 0 ? -(uint64_t)denominator : (uint64_t)denominator;
+  // work in tenths, rounding the way printf's "%.1f" rounds the double
+  uint64_t tenths = (num * 10) / den;
+  const uint64_t rem = (num * 10) % den;
+  if (rem * 2 > den) {
+    ++tenths;
+  } else if (rem * 2 == den) {
+    // an exact tie usually is not one in the double, printf rounds the double
+    // to the side it landed on, fma gives the sign of that error exactly
+    const double side =
+        fma((double)num / (double)den, 20.0, -(double)(tenths * 2 + 1));
+    if (side > 0 || (side == 0 && (tenths & 1))) {
+      ++tenths;
+    }
+  }
+  char digits[INT_STR_LEN + 2];
+  size_t pos = INT_STR_LEN + 2;
+  digits[--pos] = '0' + (tenths % 10);
+  digits[--pos] = '.';
+  uint64_t whole = tenths / 10;
+  do {
+    digits[--pos] = '0' + (whole % 10);
+    whole /= 10;
+  } while (whole != 0);
+  if (negative) {
+    digits[--pos] = '-';
+  }
+  return infoto_info_text_append(info, &digits[pos], INT_STR_LEN + 2 - pos);
+}
+
+/**
+ * Get the value at the given index.
+ *
+ * @param[in] info The info text object
+ * @param[in] i The value index
+ * @param[out] len The length of the value
+ * @returns The start of the value, not null terminated.
+ */
+const char *infoto_info_text_value(const info_text *info, size_t i,
+                                   size_t *len) {
+  *len = info->lengths[i];
+  return &info->buffer[info->offsets[i]];
+}
+
 /**
  * Get the formatted string for the info text object.
+ * The string is owned by the info text object and valid until it is changed.
  *
  * @param[in] info The info text object
  * @return The formatted string
  */
-char *infoto_info_text_to_string(const info_text *info) {
-  char *buffer = NULL;
-  size_t sep_len = strlen(info->separator);
-  size_t length = 0;
-  for (int i = 0; i < info->size; ++i) {
-    length += strlen(info->buffer[i]);
-    length += sep_len;
-  }
-  // take off ending separator length, then add null character
-  length = length - sep_len + 1;
-  buffer = (char *)malloc(sizeof(char) * length);
-  size_t str_pos = 0;
-  for (int i = 0; i < info->size; ++i) {
-    char *value = info->buffer[i];
-    size_t value_len = strlen(value);
-    memcpy(&buffer[str_pos], value, value_len);
-    str_pos += value_len;
-    char *sep = info->separator;
-    size_t sep_len = strlen(sep);
-    memcpy(&buffer[str_pos], sep, sep_len);
-    str_pos += sep_len;
-  }
-  buffer[length - 1] = '\0';
-  return buffer;
+const char *infoto_info_text_str(const info_text *info) {
+  return info->buffer;
 }
 
 /**
- * Free the internal strings and array.
+ * Free the internal buffers.
  *
- * @param[in] info The info text object
+ * @param[in,out] info The info text object
  */
 void infoto_info_text_free(info_text *info) {
-  for (int i = 0; i < info->size; ++i) {
-    free(info->buffer[i]);
-  }
   free(info->buffer);
+  free(info->offsets);
+  free(info->lengths);
   info->buffer = NULL;
+  info->offsets = NULL;
+  info->lengths = NULL;
+  info->buffer_len = 0;
+  info->buffer_cap = 0;
+  info->len = 0;
+  info->cap = 0;
 }
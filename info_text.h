@@ -1,37 +1,148 @@
 #ifndef INFOTO_INFO_TEXT_H
 #define INFOTO_INFO_TEXT_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "error_codes.h"
 
+/**
+ * Caption text built in a single contiguous buffer.
+ * Values are appended in place, joined by the separator, so the buffer is
+ * always the final null terminated caption. The offset and length of each
+ * value are kept for callers that need the values individually.
+ * Reset the object to reuse its memory for the next image.
+ */
 typedef struct {
-  char **buffer;
-  size_t size;
-  char *separator;
+  // the caption, always null terminated
+  char *buffer;
+  size_t buffer_len;
+  size_t buffer_cap;
+  // start offset and length of each value in buffer
+  size_t *offsets;
+  size_t *lengths;
+  // number of values started and number of value slots
+  size_t len;
+  size_t cap;
+  const char *separator;
+  size_t separator_len;
 } info_text;
 
 /**
  * Initialize Info Text object.
  *
  * @param[in] info Info text object to initialize
- * @param[in] size The size to initialize to
+ * @param[in] size The number of values to reserve space for
  * @param[in] sep The separator for each value
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
 infoto_error_enum infoto_info_text_init(info_text *info, size_t size,
-                                        char *sep);
+                                        const char *sep);
+
+/**
+ * Clear the values while keeping the allocated memory for reuse.
+ *
+ * @param[in,out] info The info text object
+ */
+void infoto_info_text_reset(info_text *info);
+
+/**
+ * Start a new value, appending the separator if it is not the first.
+ * Following append calls add to this value.
+ *
+ * @param[in,out] info The info text object
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_begin_value(info_text *info);
+
+/**
+ * Append characters to the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] str The characters to append
+ * @param[in] len The number of characters
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append(info_text *info, const char *str,
+                                          size_t len);
+
+/**
+ * Append characters to the current value, forced to uppercase.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] str The characters to append
+ * @param[in] len The number of characters
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_upper(info_text *info,
+                                                const char *str, size_t len);
+
+/**
+ * Append a signed integer in decimal to the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] value The value to append
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_int(info_text *info, int64_t value);
+
+/**
+ * Append an unsigned integer in decimal to the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] value The value to append
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_uint(info_text *info,
+                                               uint64_t value);
+
+/**
+ * Append a rational as a fraction, e.g. "1/250", to the current value.
+ *
+ * @param[in,out] info The info text object
+ * @param[in] numerator The numerator
+ * @param[in] denominator The denominator
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_fraction(info_text *info,
+                                                   int64_t numerator,
+                                                   int64_t denominator);
+
+/**
+ * Append a rational as a decimal rounded to one fractional digit, e.g. "5.6",
+ * to the current value. A zero denominator is appended as "INF".
+ *
+ * @param[in,out] info The info text object
+ * @param[in] numerator The numerator
+ * @param[in] denominator The denominator
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_info_text_append_decimal(info_text *info,
+                                                  int64_t numerator,
+                                                  int64_t denominator);
+
+/**
+ * Get the value at the given index.
+ *
+ * @param[in] info The info text object
+ * @param[in] i The value index
+ * @param[out] len The length of the value
+ * @returns The start of the value, not null terminated.
+ */
+const char *infoto_info_text_value(const info_text *info, size_t i,
+                                   size_t *len);
 
 /**
  * Get the formatted string for the info text object.
+ * The string is owned by the info text object and valid until it is changed.
  *
  * @param[in] info The info text object
  * @return The formatted string
  */
-char *infoto_info_text_to_string(const info_text *info);
+const char *infoto_info_text_str(const info_text *info);
 
 /**
- * Free the internal strings and array.
+ * Free the internal buffers.
  *
  * @param[in,out] info The info text object
  */
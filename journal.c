@@ -0,0 +1,325 @@
+#include "journal.h"
+#include "hash_util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef PATH_MAX
+    #define PATH_MAX 4096
+#endif
+
+/* smallest table of finished images */
+#define JOURNAL_MIN_SLOTS 64
+/* longest journal line, size and modification time plus the path */
+#define JOURNAL_LINE_LEN (64 + PATH_MAX)
+
+/**
+ * An image finished by an earlier run.
+ */
+struct journal_entry {
+  // points into the journal's contents, NULL for an empty slot
+  const char *path;
+  size_t path_len;
+  uint64_t hash;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+/**
+ * Structure for the journal of finished images.
+ */
+struct infoto_journal {
+  int fd;
+  // contents of the journal when it was opened for a resume
+  char *contents;
+  // open addressing table of finished images, slots is a power of two
+  struct journal_entry *entries;
+  size_t slots;
+  // serializes appends so lines never interleave
+  pthread_mutex_t lock;
+};
+
+/**
+ * Hash an image path.
+ *
+ * @param[in] path The path.
+ * @param[in] len The length of the path.
+ * @returns The hash of the path.
+ */
+static uint64_t path_hash(const char *path, size_t len) {
+  return infoto_hash64(path, len, 0);
+}
+
+/**
+ * Read the whole journal file.
+ *
+ * @param[in] fd The journal file descriptor.
+ * @param[out] contents The null terminated contents.
+ * @param[out] len The length of the contents.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum read_contents(int fd, char **contents, size_t *len) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return INFOTO_ERR_NO_FILE_ACCESS;
+  }
+  char *buf = (char *)malloc(st.st_size + 1);
+  if (buf == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  size_t pos = 0;
+  while (pos < (size_t)st.st_size) {
+    ssize_t n = pread(fd, &buf[pos], st.st_size - pos, pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    pos += n;
+  }
+  buf[pos] = '\0';
+  *contents = buf;
+  *len = pos;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Add a finished image to the table.
+ *
+ * @param[in,out] journal The journal.
+ * @param[in] entry The finished image.
+ */
+static void add_entry(infoto_journal *journal,
+                      const struct journal_entry *entry) {
+  size_t mask = journal->slots - 1;
+  size_t i = entry->hash & mask;
+  while (journal->entries[i].path != NULL) {
+    struct journal_entry *slot = &journal->entries[i];
+    if (slot->hash == entry->hash && slot->path_len == entry->path_len &&
+        memcmp(slot->path, entry->path, entry->path_len) == 0) {
+      // the image was finished again, the latest line wins
+      *slot = *entry;
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  journal->entries[i] = *entry;
+}
+
+/**
+ * Parse a journal line into an entry.
+ *
+ * @param[in,out] line The line, without its newline. Null terminated.
+ * @param[out] entry The entry to populate.
+ * @returns 1 if the line is valid, 0 otherwise.
+ */
+static int parse_line(char *line, struct journal_entry *entry) {
+  char *end;
+  errno = 0;
+  entry->size = strtoull(line, &end, 10);
+  if (errno != 0 || end == line || *end != ' ') {
+    return 0;
+  }
+  line = end + 1;
+  entry->mtime_sec = strtoll(line, &end, 10);
+  if (errno != 0 || end == line || *end != '.') {
+    return 0;
+  }
+  line = end + 1;
+  entry->mtime_nsec = strtoll(line, &end, 10);
+  if (errno != 0 || end == line || *end != ' ' || end[1] == '\0') {
+    return 0;
+  }
+  entry->path = end + 1;
+  entry->path_len = strlen(entry->path);
+  entry->hash = path_hash(entry->path, entry->path_len);
+  return 1;
+}
+
+/**
+ * Load the finished images from the journal's contents. A last line without
+ * a newline was torn by a crash, it is ignored and cut from the file so new
+ * lines start clean.
+ *
+ * @param[in,out] journal The journal with fd set.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum load_entries(infoto_journal *journal) {
+  size_t len;
+  infoto_error_enum result = read_contents(journal->fd, &journal->contents,
+                                           &len);
+  if (result != INFOTO_SUCCESS) {
+    return result;
+  }
+  char *contents = journal->contents;
+  size_t complete = len;
+  while (complete > 0 && contents[complete - 1] != '\n') {
+    --complete;
+  }
+  if (complete != len && ftruncate(journal->fd, complete) != 0) {
+    return INFOTO_ERR_IMG_WRITER;
+  }
+  size_t lines = 0;
+  for (size_t i = 0; i < complete; ++i) {
+    lines += contents[i] == '\n';
+  }
+  // keep the table at most half full
+  journal->slots = JOURNAL_MIN_SLOTS;
+  while (journal->slots < lines * 2) {
+    journal->slots <<= 1;
+  }
+  journal->entries = (struct journal_entry *)calloc(
+      journal->slots, sizeof(struct journal_entry));
+  if (journal->entries == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  char *line = contents;
+  char *end = contents + complete;
+  while (line < end) {
+    char *newline = (char *)memchr(line, '\n', end - line);
+    *newline = '\0';
+    struct journal_entry entry;
+    if (parse_line(line, &entry)) {
+      add_entry(journal, &entry);
+    }
+    line = newline + 1;
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Open the journal file.
+ *
+ * @param[in] path The journal file path.
+ * @param[in] resume 1 to keep and load the finished images, 0 to start over.
+ * @param[out] journal The journal to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_journal_open(const char *path, int resume,
+                                      infoto_journal **journal) {
+  infoto_journal *local =
+      (infoto_journal *)calloc(1, sizeof(struct infoto_journal));
+  if (local == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC;
+  if (!resume) {
+    flags |= O_TRUNC;
+  }
+  local->fd = open(path, flags, 0666);
+  if (local->fd < 0) {
+    fprintf(stderr, "can't open journal file: %s\n", path);
+    free(local);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  if (resume) {
+    infoto_error_enum result = load_entries(local);
+    if (result != INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to read journal file: %s\n", path);
+      close(local->fd);
+      free(local->contents);
+      free(local->entries);
+      free(local);
+      return result;
+    }
+  }
+  pthread_mutex_init(&local->lock, NULL);
+  *journal = local;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Check if the image was finished by an earlier run.
+ *
+ * @param[in] journal The journal.
+ * @param[in] path The image path.
+ * @param[in] st The file status of the image.
+ * @returns 1 if the unchanged image was finished, 0 otherwise.
+ */
+int infoto_journal_is_done(const infoto_journal *journal, const char *path,
+                           const struct stat *st) {
+  if (journal->entries == NULL) {
+    return 0;
+  }
+  const size_t len = strlen(path);
+  const uint64_t hash = path_hash(path, len);
+  size_t mask = journal->slots - 1;
+  for (size_t i = hash & mask; journal->entries[i].path != NULL;
+       i = (i + 1) & mask) {
+    const struct journal_entry *slot = &journal->entries[i];
+    if (slot->hash == hash && slot->path_len == len &&
+        memcmp(slot->path, path, len) == 0) {
+      // a changed image has to be processed again
+      return slot->size == (uint64_t)st->st_size &&
+             slot->mtime_sec == st->st_mtim.tv_sec &&
+             slot->mtime_nsec == st->st_mtim.tv_nsec;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Record the image as finished. Safe to call from several threads.
+ *
+ * @param[in,out] journal The journal.
+ * @param[in] path The image path.
+ * @param[in] st The file status of the image when it was read.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_journal_append(infoto_journal *journal,
+                                        const char *path,
+                                        const struct stat *st) {
+  // a newline would split the line, such images are always processed again
+  if (strchr(path, '\n') != NULL) {
+    return INFOTO_SUCCESS;
+  }
+  char line[JOURNAL_LINE_LEN];
+  int len = snprintf(line, sizeof(line), "%" PRIu64 " %" PRId64 ".%09" PRId64
+                     " %s\n", (uint64_t)st->st_size,
+                     (int64_t)st->st_mtim.tv_sec, (int64_t)st->st_mtim.tv_nsec,
+                     path);
+  if (len < 0 || (size_t)len >= sizeof(line)) {
+    return INFOTO_SUCCESS;
+  }
+  infoto_error_enum result = INFOTO_SUCCESS;
+  // one write per line, O_APPEND keeps each line whole at the end
+  pthread_mutex_lock(&journal->lock);
+  ssize_t n;
+  do {
+    n = write(journal->fd, line, len);
+  } while (n < 0 && errno == EINTR);
+  if (n != len) {
+    result = INFOTO_ERR_IMG_WRITER;
+  }
+  pthread_mutex_unlock(&journal->lock);
+  return result;
+}
+
+/**
+ * Close the journal, flushing it to disk.
+ *
+ * @param[in,out] journal The journal to close.
+ */
+void infoto_journal_close(infoto_journal **journal) {
+  infoto_journal *local = *journal;
+  if (local == NULL) {
+    return;
+  }
+  fsync(local->fd);
+  close(local->fd);
+  pthread_mutex_destroy(&local->lock);
+  free(local->entries);
+  free(local->contents);
+  free(local);
+  *journal = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef INFOTO_JOURNAL_H
+#define INFOTO_JOURNAL_H
+
+#include <sys/stat.h>
+
+#include "error_codes.h"
+
+/**
+ * Append-only journal of the images a bulk run finished.
+ * Each finished image is one line holding its size, modification time and
+ * path, appended with a single write once its edited image is written. A
+ * crash can only lose or tear the last line, which is ignored when the
+ * journal is read back. A resumed run skips every image whose path, size
+ * and modification time are in the journal without reading it.
+ */
+typedef struct infoto_journal infoto_journal;
+
+/**
+ * Open the journal file.
+ *
+ * @param[in] path The journal file path.
+ * @param[in] resume 1 to keep and load the finished images, 0 to start over.
+ * @param[out] journal The journal to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_journal_open(const char *path, int resume,
+                                      infoto_journal **journal);
+
+/**
+ * Check if the image was finished by an earlier run.
+ *
+ * @param[in] journal The journal.
+ * @param[in] path The image path.
+ * @param[in] st The file status of the image.
+ * @returns 1 if the unchanged image was finished, 0 otherwise.
+ */
+int infoto_journal_is_done(const infoto_journal *journal, const char *path,
+                           const struct stat *st);
+
+/**
+ * Record the image as finished. Safe to call from several threads.
+ *
+ * @param[in,out] journal The journal.
+ * @param[in] path The image path.
+ * @param[in] st The file status of the image when it was read.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_journal_append(infoto_journal *journal,
+                                        const char *path,
+                                        const struct stat *st);
+
+/**
+ * Close the journal, flushing it to disk.
+ *
+ * @param[in,out] journal The journal to close.
+ */
+void infoto_journal_close(infoto_journal **journal);
+
+#endif
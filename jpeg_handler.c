@@ -1,25 +1,41 @@
 #include <stdio.h>
 
+#include "caption_cache.h"
 #include "config.h"
 #include "error_codes.h"
 #include "info_text.h"
 #include "jpeg_handler.h"
+#include "row_pipeline.h"
 #include "str_utils.h"
+#include "watermark.h"
 
 #include <jpeglib.h>
+#include <jerror.h>
 #include <setjmp.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-// temp file name constant values
-#define TMP_FILE_NAME "-edited.tmp"
-#define TMP_FILE_NAME_LEN strlen(TMP_FILE_NAME)
+// first size of the buffer an image is compressed into
+#define MEM_DEST_INITIAL_CAP (64 * 1024)
 
 /**
  * JPEG handler structure.
  */
 struct infoto_jpeg_handler {
   infoto_font_handler *font_handler;
+  // optional cache of rendered caption strips, not owned
+  infoto_caption_cache *caption_cache;
+  // optional logo blended into every image, not owned
+  infoto_watermark *watermark;
+  // reusable buffer the caption strip is rendered into on a cache miss
+  uint8_t *strip;
+  size_t strip_cap;
+  // plain border, reused while the layout and color stay the same
+  infoto_background_strip top_border;
+  // row batches, reused across images
+  infoto_row_pipeline pipeline;
 };
 
 /**
@@ -50,39 +66,94 @@ static void handle_read_error(j_common_ptr cinfo) {
 struct decomp_img {
   struct jpeg_decompress_struct cinfo;
   struct jpeg_err err;
-  FILE *file;
 };
 
 /**
  * Structure to hold compression jpeg image info.
  */
 struct comp_img {
+  // must stay first, the memory destination callbacks cast cinfo back
   struct jpeg_compress_struct cinfo;
   struct jpeg_err err;
   FILE *file;
+  // the file is written here and renamed over the output once complete
+  char *tmp_name;
+  // memory destination, used when there is no file. mem always points at
+  // the live buffer so it can be freed from the error path.
+  struct jpeg_destination_mgr mem_dest;
+  unsigned char *mem;
+  size_t mem_size;
+  size_t mem_cap;
 };
 
+/**
+ * Start compressing into memory, allocating the first buffer.
+ *
+ * @param[in,out] cinfo The compress object of a comp_img.
+ */
+static void init_mem_dest(j_compress_ptr cinfo) {
+  struct comp_img *comp = (struct comp_img *)cinfo;
+  if (comp->mem == NULL) {
+    comp->mem = (unsigned char *)malloc(MEM_DEST_INITIAL_CAP);
+    if (comp->mem == NULL) {
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    }
+    comp->mem_cap = MEM_DEST_INITIAL_CAP;
+  }
+  comp->mem_dest.next_output_byte = comp->mem;
+  comp->mem_dest.free_in_buffer = comp->mem_cap;
+}
+
+/**
+ * Grow the memory buffer once it is full.
+ *
+ * @param[in,out] cinfo The compress object of a comp_img.
+ * @returns TRUE, the buffer always has room after growing.
+ */
+static boolean grow_mem_dest(j_compress_ptr cinfo) {
+  struct comp_img *comp = (struct comp_img *)cinfo;
+  unsigned char *grown =
+      (unsigned char *)realloc(comp->mem, comp->mem_cap * 2);
+  if (grown == NULL) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+  comp->mem = grown;
+  comp->mem_dest.next_output_byte = &grown[comp->mem_cap];
+  comp->mem_dest.free_in_buffer = comp->mem_cap;
+  comp->mem_cap *= 2;
+  return TRUE;
+}
+
+/**
+ * Record how many bytes were compressed into memory.
+ *
+ * @param[in,out] cinfo The compress object of a comp_img.
+ */
+static void term_mem_dest(j_compress_ptr cinfo) {
+  struct comp_img *comp = (struct comp_img *)cinfo;
+  comp->mem_size = comp->mem_cap - comp->mem_dest.free_in_buffer;
+}
+
 /**
  * Initialize decomp_img.
  *
- * @param[in] file_name The filename the decompressed image should open.
+ * @param[in] img The image file whose bytes should be decompressed.
  * @param[out] decomp The decompressed image to initialize.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
-static infoto_error_enum init_decomp_img(const char *file_name,
+static infoto_error_enum init_decomp_img(const infoto_img_file *img,
                                          struct decomp_img *decomp) {
-  // open file
-  if ((decomp->file = fopen(file_name, "rb")) == NULL) {
-    fprintf(stderr, "can't open %s\n", file_name);
-    return INFOTO_ERR_OPEN_FILE;
+  if (img->data == NULL) {
+    fprintf(stderr, "image data was null for %s\n", img->name);
+    return INFOTO_ERR_NULL;
   }
   // set up error handler
   decomp->cinfo.err = jpeg_std_error(&decomp->err.pub);
   decomp->err.pub.error_exit = handle_read_error;
   // create decompress object
   jpeg_create_decompress(&decomp->cinfo);
-  // set up the std in source (our file)
-  jpeg_stdio_src(&decomp->cinfo, decomp->file);
+  // read from the bytes already in memory, no second open/read of the file
+  jpeg_mem_src(&decomp->cinfo, img->data, img->size);
   // read in and populate the header files
   jpeg_read_header(&decomp->cinfo, 1);
   return INFOTO_SUCCESS;
@@ -91,7 +162,8 @@ static infoto_error_enum init_decomp_img(const char *file_name,
 /**
  * Initialize comp_img.
  *
- * @param[in] file_name The filename the compressed image should open.
+ * @param[in] file_name The filename the compressed image should open, NULL
+ * to compress into memory.
  * @param[out] comp The compressed image to initialize.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
@@ -99,11 +171,23 @@ static infoto_error_enum init_comp_img(const char *file_name,
                                        struct comp_img *comp) {
   // set up the error handler
   comp->cinfo.err = jpeg_std_error(&comp->err.pub);
+  comp->err.pub.error_exit = handle_read_error;
   // create the compress object
   jpeg_create_compress(&comp->cinfo);
-  // open the file to write to
-  if ((comp->file = fopen(file_name, "wb")) == NULL) {
-    fprintf(stderr, "can't open file: %s\n", file_name);
+  if (file_name == NULL) {
+    // our own destination, the buffer stays reachable if compressing fails
+    comp->mem_dest.init_destination = init_mem_dest;
+    comp->mem_dest.empty_output_buffer = grow_mem_dest;
+    comp->mem_dest.term_destination = term_mem_dest;
+    comp->cinfo.dest = &comp->mem_dest;
+    return INFOTO_SUCCESS;
+  }
+  // open the temp file to write to, a failed image never replaces the output
+  if ((comp->tmp_name = infoto_get_tmp_file_name(file_name)) == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  if ((comp->file = fopen(comp->tmp_name, "wb")) == NULL) {
+    fprintf(stderr, "can't open file: %s\n", comp->tmp_name);
     return INFOTO_ERR_OPEN_FILE;
   }
   // set our std out destination (the file)
@@ -128,27 +212,57 @@ static void close_jpeg_img(j_common_ptr info) {
 }
 
 /**
- * Convenience function to clean up comp_img, decomp_img, and edited file name.
+ * Convenience function to clean up comp_img and decomp_img, moving a
+ * finished file into place.
  *
  * @param[out] comp The compressed image.
  * @param[out] decomp The decompressed image.
- * @param[out] edit_name The filename for the edited image.
+ * @param[in] file_name The filename of the output, NULL for memory.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
-static void clean_up(struct comp_img *comp, struct decomp_img *decomp,
-                     char *edit_name) {
+static infoto_error_enum clean_up(struct comp_img *comp,
+                                  struct decomp_img *decomp,
+                                  const char *file_name) {
   // close jpen imgs
   close_jpeg_img((j_common_ptr)&comp->cinfo);
   close_jpeg_img((j_common_ptr)&decomp->cinfo);
   // close the files if they are open
+  if (comp->file == NULL) {
+    return INFOTO_SUCCESS;
+  }
+  const int failed = fclose(comp->file) != 0;
+  comp->file = NULL;
+  // renaming also never writes through a hard link into the output cache
+  if (failed || rename(comp->tmp_name, file_name) != 0) {
+    fprintf(stderr, "failed writing file: %s\n", file_name);
+    unlink(comp->tmp_name);
+    free(comp->tmp_name);
+    return INFOTO_ERR_IMG_WRITER;
+  }
+  free(comp->tmp_name);
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Clean up comp_img and decomp_img after libjpeg reported an error.
+ * Nothing is finished, finishing a failed object would raise another error.
+ *
+ * @param[out] comp The compressed image.
+ * @param[out] decomp The decompressed image.
+ */
+static void abort_jpeg_objects(struct comp_img *comp,
+                               struct decomp_img *decomp) {
+  jpeg_destroy((j_common_ptr)&comp->cinfo);
+  jpeg_destroy((j_common_ptr)&decomp->cinfo);
   if (comp->file != NULL) {
     fclose(comp->file);
   }
-  if (decomp->file != NULL) {
-    fclose(decomp->file);
-  }
-  if (edit_name != NULL) {
-    free(edit_name);
+  // drop the unfinished file
+  if (comp->tmp_name != NULL) {
+    unlink(comp->tmp_name);
+    free(comp->tmp_name);
   }
+  free(comp->mem);
 }
 
 /**
@@ -177,71 +291,66 @@ static void sync_settings(const int added_pixels,
   jpeg_set_quality(&comp->cinfo, 100, 1);
 }
 
-// TODO rework this to be generic using infoto_img_file objects
 /**
- * Copy image data from decomp into comp and handle border creation.
+ * Decode JPEG rows into the pipeline's rows.
  *
- * @param[in] background The background info.
- * @param[in] border_color The border color to use.
- * @param[in] decomp The decompressed image to read from.
- * @param[in,out] comp The compressed image to write to.
+ * @param[in,out] ctx The decomp_img.
+ * @param[in,out] rows The rows to decode into.
+ * @param[in] count The max number of rows to decode.
+ * @param[in] offset The byte offset in each row to decode to.
+ * @param[out] read The number of rows decoded.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
-static void copy_read_data_to_write_buffer(const background_info background,
-                                           struct decomp_img *decomp,
-                                           struct comp_img *comp) {
-  int num_comp = comp->cinfo.input_components;
-  int row_size = comp->cinfo.image_width * num_comp;
-  uint8_t use_alpha = num_comp == 4 ? 1 : 0;
-  const pixel background_color =
-      infoto_get_colored_pixel(background.color, use_alpha);
-
-  JSAMPROW row_stride = (JSAMPLE *)malloc(row_size * sizeof(JSAMPLE));
-  JSAMPARRAY row_array = &row_stride;
-
-  int read_width = decomp->cinfo.image_width * decomp->cinfo.num_components;
-  int border_side_width = background.pixels * num_comp;
-  int border_and_read_width = read_width + border_side_width;
-
-  // this buffer gets cleaned up when decomp's cinfo gets cleaned up.
-  JSAMPARRAY buffer = (*(decomp->cinfo).mem->alloc_sarray)(
-      (j_common_ptr)&decomp->cinfo, JPOOL_IMAGE, read_width, 1);
-
-  while (decomp->cinfo.output_scanline < decomp->cinfo.output_height) {
-    // writing side border
-    for (int i = 0; i < border_side_width; i += num_comp) {
-      infoto_write_pixel_to_buffer(background_color, i, row_stride);
-    }
-    // read in data from decompressed jpeg file
-    jpeg_read_scanlines(&decomp->cinfo, buffer, 1);
-    memcpy(&row_stride[border_side_width], buffer[0], read_width);
-    // writing other side border
-    for (int i = border_and_read_width;
-         i < (border_and_read_width + border_side_width); i += num_comp) {
-      infoto_write_pixel_to_buffer(background_color, i, row_stride);
+static infoto_error_enum read_jpeg_rows(void *ctx, uint8_t **rows, int count,
+                                        size_t offset, int *read) {
+  struct decomp_img *decomp = (struct decomp_img *)ctx;
+  int n = 0;
+  while (n < count &&
+         decomp->cinfo.output_scanline < decomp->cinfo.output_height) {
+    // decode straight into the row, between the side borders
+    JSAMPROW row = &rows[n][offset];
+    const JDIMENSION got = jpeg_read_scanlines(&decomp->cinfo, &row, 1);
+    if (got == 0) {
+      break;
     }
-    // write out to comressed jpeg file
-    jpeg_write_scanlines(&comp->cinfo, row_array, 1);
+    n += got;
   }
-  free(row_stride);
+  *read = n;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Encode the pipeline's rows to the JPEG file.
+ *
+ * @param[in,out] ctx The comp_img.
+ * @param[in] rows The rows to encode.
+ * @param[in] count The number of rows.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum write_jpeg_rows(void *ctx, uint8_t **rows,
+                                         int count) {
+  struct comp_img *comp = (struct comp_img *)ctx;
+  jpeg_write_scanlines(&comp->cinfo, rows, count);
+  return INFOTO_SUCCESS;
 }
 
 /**
  * Initialize JPEG objects.
  *
- * @param[in] filename The original filename.
+ * @param[in] img The original image file.
  * @param[in] pixel_count The pixel count for the border.
  * @param[in] out_file Filename of file to write out to.
  * @param[out] decomp The decomp_img object to initialize.
  * @param[out] comp The comp_img object to initialize.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
-static infoto_error_enum init_jpeg_objects(const char *filename,
+static infoto_error_enum init_jpeg_objects(const infoto_img_file *img,
                                            const int pixel_count,
                                            const char *out_file,
                                            struct decomp_img *decomp,
                                            struct comp_img *comp) {
   // initialize decomp
-  if (init_decomp_img(filename, decomp) != INFOTO_SUCCESS) {
+  if (init_decomp_img(img, decomp) != INFOTO_SUCCESS) {
     fprintf(stderr, "failed to read jpeg image\n");
     return INFOTO_ERR_IMG_READ;
   }
@@ -286,99 +395,274 @@ static void init_jpeg_writer(struct comp_img *comp, infoto_img_writer *writer) {
 }
 
 /**
- * Handle generating the new JPEG file from the given info.
+ * Stream the decoded JPEG through the border, caption and watermark stages
+ * into the compressed JPEG.
  *
+ * @param[in,out] jpeg_handler The JPEG handler, owns the border and pipeline.
  * @param[in] background_writer The writer for the background color.
  * @param[in,out] comp The compressed JPEG image.
- * @param[in] decomp The decompressed JPEG image.
+ * @param[in,out] decomp The decompressed JPEG image.
  * @param[in] background The background info.
- * @param[in] border_color The color to use for the border.
- * @param[in] glyph_str The glyph string to write out.
+ * @param[in] caption_strip The rendered bottom border with the caption.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
 static infoto_error_enum
-handle_jpeg_copying(infoto_img_writer *background_writer, struct comp_img *comp,
+handle_jpeg_copying(struct infoto_jpeg_handler *jpeg_handler,
+                    infoto_img_writer *background_writer, struct comp_img *comp,
                     struct decomp_img *decomp, const background_info background,
-                    const font_info font, const infoto_glyph_str *glyph_str) {
-  // don't write out glyph string on top border
-  infoto_error_enum err_code = INFOTO_SUCCESS;
-  err_code = infoto_write_background_rows(background_writer, comp, background,
-                                          font, NULL);
+                    const uint8_t *caption_strip) {
+  infoto_border_stage border;
+  infoto_error_enum err_code = infoto_background_strip_get(
+      &jpeg_handler->top_border, background_writer, background, &border.strip);
   if (err_code != INFOTO_SUCCESS) {
     return err_code;
   }
-  copy_read_data_to_write_buffer(background, decomp, comp);
-  // write out glyph string on bottom border
-  return infoto_write_background_rows(background_writer, comp, background, font,
-                                      glyph_str);
+  const int num_comp = comp->cinfo.input_components;
+  infoto_pixel_components(
+      infoto_get_colored_pixel(background.color, num_comp == 4 ? 1 : 0),
+      num_comp, border.color);
+  infoto_caption_stage caption;
+  caption.strip = caption_strip;
+  // the logo is scaled once per image size, then only blended
+  infoto_watermark_stage watermark;
+  if (jpeg_handler->watermark != NULL) {
+    err_code = infoto_watermark_place(
+        jpeg_handler->watermark, decomp->cinfo.output_width,
+        decomp->cinfo.output_height, background.pixels, num_comp, &watermark);
+    if (err_code != INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to place the watermark.\n");
+      return err_code;
+    }
+  }
+
+  infoto_row_source source;
+  source.ctx = decomp;
+  source.width = decomp->cinfo.output_width;
+  source.height = decomp->cinfo.output_height;
+  source.num_components = num_comp;
+  source.read_rows = read_jpeg_rows;
+  infoto_row_sink sink;
+  sink.ctx = comp;
+  sink.write_rows = write_jpeg_rows;
+
+  infoto_row_pipeline *pipeline = &jpeg_handler->pipeline;
+  infoto_row_pipeline_clear_stages(pipeline);
+  infoto_row_pipeline_set_margins(pipeline, background.pixels,
+                                  background.pixels, background.pixels,
+                                  background.pixels);
+  err_code = infoto_row_pipeline_add_stage(pipeline,
+                                           infoto_border_stage_get(&border));
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = infoto_row_pipeline_add_stage(
+        pipeline, infoto_caption_stage_get(&caption));
+  }
+  if (err_code == INFOTO_SUCCESS && jpeg_handler->watermark != NULL) {
+    err_code = infoto_row_pipeline_add_stage(
+        pipeline, infoto_watermark_stage_get(&watermark));
+  }
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = infoto_row_pipeline_run(pipeline, &source, &sink);
+  }
+  return err_code;
 }
 
 /**
- * Write out border and text info to a given JPEG image.
- * This function does not overwrite the original image but makes a new edited
- * image file.
+ * Get the bottom border strip with the caption, rendering it only when the
+ * caption cache does not have it. With auto fit the font size is picked for
+ * the caption first.
  *
- * @param[in] handler The image handler interface object.
- * @param[in] filename The original filename.
+ * @param[in,out] jpeg_handler The JPEG handler.
+ * @param[in] writer The writer the strip is for.
  * @param[in] background The background info.
  * @param[in] font The font info.
- * @param[in] info The info text object
- * @param[out] edited_img The edited image's filename.
+ * @param[in] caption The caption text.
+ * @param[out] strip The rendered strip.
  * @returns INFOTO_SUCCESS if successful, otherwise an error code.
  */
 static infoto_error_enum
-write_jpeg_image(infoto_img_handler *handler, const char *filename,
-                 const background_info background, const font_info font,
-                 const info_text *info, char **edited_img) {
+get_caption_strip(struct infoto_jpeg_handler *jpeg_handler,
+                  const infoto_img_writer *writer,
+                  const background_info background, const font_info font,
+                  const char *caption, const uint8_t **strip) {
+  int point = font.point;
+  if (font.auto_fit) {
+    // fit the caption between the side borders, within the bottom border
+    const int max_width = writer->image_width - (background.pixels * 2);
+    infoto_error_enum err_code = infoto_font_handler_fit(
+        jpeg_handler->font_handler, caption, max_width, background.pixels,
+        font.point, &point);
+    if (err_code != INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to fit caption to the border.\n");
+      return err_code;
+    }
+  }
+  infoto_caption_key key;
+  key.caption = caption;
+  key.ttf_file = font.ttf_file;
+  key.point = point;
+  key.font_color = font.color;
+  key.background_color = background.color;
+  key.border = background.pixels;
+  key.image_width = writer->image_width;
+  key.num_components = writer->num_components;
+  if (jpeg_handler->caption_cache != NULL) {
+    *strip = infoto_caption_cache_get(jpeg_handler->caption_cache, &key);
+    if (*strip != NULL) {
+      return INFOTO_SUCCESS;
+    }
+  }
+  const size_t strip_len = infoto_background_strip_size(writer, background);
+  if (jpeg_handler->strip_cap < strip_len) {
+    uint8_t *tmp = (uint8_t *)realloc(jpeg_handler->strip, strip_len);
+    if (tmp == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    jpeg_handler->strip = tmp;
+    jpeg_handler->strip_cap = strip_len;
+  }
+  // generate glyph string from info text
+  infoto_glyph_str *glyph_str;
+  infoto_error_enum err_code = infoto_glyph_str_init(&glyph_str);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  err_code = infoto_create_glyph_str_from_text(jpeg_handler->font_handler,
+                                               glyph_str, caption);
+  if (err_code == INFOTO_SUCCESS) {
+    if (infoto_glyph_str_get_width(glyph_str) > writer->image_width ||
+        infoto_glyph_str_get_height(glyph_str) > background.pixels) {
+      fprintf(stderr, "caption is larger than the border and will be clipped, "
+                      "lower the font point or set auto_fit.\n");
+    }
+    err_code = infoto_render_background_strip(writer, background, font,
+                                              glyph_str, jpeg_handler->strip);
+  } else {
+    fprintf(stderr, "failed to create glyph string from text.\n");
+  }
+  infoto_glyph_str_free(glyph_str);
+  if (err_code == INFOTO_SUCCESS && jpeg_handler->caption_cache != NULL) {
+    err_code = infoto_caption_cache_put(jpeg_handler->caption_cache, &key,
+                                        jpeg_handler->strip, strip_len);
+  }
+  *strip = jpeg_handler->strip;
+  return err_code;
+}
 
-  struct infoto_jpeg_handler *jpeg_handler =
-      (struct infoto_jpeg_handler *)handler->_internal;
+/**
+ * Caption the given JPEG image into a file or into memory.
+ *
+ * @param[in] jpeg_handler The JPEG handler.
+ * @param[in] img The original image file.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] info The info text object
+ * @param[in] out_file The file to write, NULL to compress into memory.
+ * @param[out] data The compressed image when out_file is NULL, malloc'd.
+ * @param[out] len The size of data.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum
+caption_jpeg(struct infoto_jpeg_handler *jpeg_handler,
+             const infoto_img_file *img, const background_info background,
+             const font_info font, const info_text *info, const char *out_file,
+             uint8_t **data, size_t *len) {
   // create reader for img
   struct decomp_img decomp;
   memset(&decomp, 0, sizeof(decomp));
   // create writer for img
   struct comp_img comp;
   memset(&comp, 0, sizeof(comp));
-  // create edit file name
-  char *edit_file_name = infoto_get_edit_file_name(filename);
   // set up error handling for decomp and comp structs
   if (setjmp(decomp.err.jmp_to_err_handler) ||
       setjmp(comp.err.jmp_to_err_handler)) {
-    clean_up(&comp, &decomp, edit_file_name);
+    abort_jpeg_objects(&comp, &decomp);
     return INFOTO_ERR_JPEG_HANDLER;
   }
-  infoto_error_enum err_code = init_jpeg_objects(
-      filename, background.pixels, edit_file_name, &decomp, &comp);
+  infoto_error_enum err_code =
+      init_jpeg_objects(img, background.pixels, out_file, &decomp, &comp);
   if (err_code != INFOTO_SUCCESS) {
-    clean_up(&comp, &decomp, edit_file_name);
+    abort_jpeg_objects(&comp, &decomp);
     return err_code;
   }
-  // generate glyph string from info text
-  infoto_glyph_str *glyph_str;
-  infoto_glyph_str_init(&glyph_str);
-  char *info_str = infoto_info_text_to_string(info);
-  err_code = infoto_create_glyph_str_from_text(jpeg_handler->font_handler,
-                                               glyph_str, info_str);
-  // free the info_str
-  free(info_str);
-
+  infoto_img_writer background_writer;
+  init_jpeg_writer(&comp, &background_writer);
+  const uint8_t *caption_strip = NULL;
+  err_code = get_caption_strip(jpeg_handler, &background_writer, background,
+                               font, infoto_info_text_str(info),
+                               &caption_strip);
   if (err_code == INFOTO_SUCCESS) {
-    infoto_img_writer background_writer;
-    init_jpeg_writer(&comp, &background_writer);
+    err_code = handle_jpeg_copying(jpeg_handler, &background_writer, &comp,
+                                   &decomp, background, caption_strip);
+  }
+  if (err_code != INFOTO_SUCCESS) {
+    // the image is incomplete, finishing it would fail
+    abort_jpeg_objects(&comp, &decomp);
+    return err_code;
+  }
+  // save new image
+  // clean up writer and reader
+  err_code = clean_up(&comp, &decomp, out_file);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  if (out_file == NULL) {
+    *data = comp.mem;
+    *len = comp.mem_size;
+  }
+  return INFOTO_SUCCESS;
+}
 
-    err_code = handle_jpeg_copying(&background_writer, &comp, &decomp,
-                                   background, font, glyph_str);
-  } else {
-    fprintf(stderr, "failed to create glyph string from text.\n");
+/**
+ * Write out border and text info to a given JPEG image.
+ * This function does not overwrite the original image but makes a new edited
+ * image file.
+ *
+ * @param[in] handler The image handler interface object.
+ * @param[in] img The original image file.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] info The info text object
+ * @param[out] edited_img The edited image's filename.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum
+write_jpeg_image(infoto_img_handler *handler, const infoto_img_file *img,
+                 const background_info background, const font_info font,
+                 const info_text *info, char **edited_img) {
+  struct infoto_jpeg_handler *jpeg_handler =
+      (struct infoto_jpeg_handler *)handler->_internal;
+  // create edit file name
+  char *edit_file_name = infoto_get_edit_file_name(img->name);
+  infoto_error_enum err_code = caption_jpeg(
+      jpeg_handler, img, background, font, info, edit_file_name, NULL, NULL);
+  if (err_code != INFOTO_SUCCESS) {
+    free(edit_file_name);
+    return err_code;
   }
-  // free the glyph string
-  infoto_glyph_str_free(glyph_str);
-  glyph_str = NULL;
   *edited_img = edit_file_name;
-  // save new image
-  // clean up writer, reader, and edit file name
-  clean_up(&comp, &decomp, NULL);
-  return err_code;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Encode the JPEG image with border and text info into memory.
+ *
+ * @param[in] handler The image handler interface object.
+ * @param[in] img The original image file.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] info The info text object
+ * @param[out] data The encoded image, malloc'd.
+ * @param[out] len The size of the encoded image.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum
+encode_jpeg_image(infoto_img_handler *handler, const infoto_img_file *img,
+                  const background_info background, const font_info font,
+                  const info_text *info, uint8_t **data, size_t *len) {
+  struct infoto_jpeg_handler *jpeg_handler =
+      (struct infoto_jpeg_handler *)handler->_internal;
+  return caption_jpeg(jpeg_handler, img, background, font, info, NULL, data,
+                      len);
 }
 
 /**
@@ -386,19 +670,32 @@ write_jpeg_image(infoto_img_handler *handler, const char *filename,
  *
  * @param[out] img_handler The image handler interface to populate.
  * @param[in] font_handler The font handler for the JPEG handler to reference.
+ * @param[in] caption_cache The caption strip cache to reference, NULL to
+ * render every caption.
+ * @param[in] watermark The watermark to reference, NULL for no watermark.
  */
 void infoto_jpeg_handler_init(infoto_img_handler *img_handler,
-                              infoto_font_handler *font_handler) {
+                              infoto_font_handler *font_handler,
+                              infoto_caption_cache *caption_cache,
+                              infoto_watermark *watermark) {
   struct infoto_jpeg_handler *local =
       (struct infoto_jpeg_handler *)malloc(sizeof(struct infoto_jpeg_handler));
   local->font_handler = font_handler;
+  local->caption_cache = caption_cache;
+  local->watermark = watermark;
+  local->strip = NULL;
+  local->strip_cap = 0;
+  infoto_background_strip_init(&local->top_border);
+  infoto_row_pipeline_init(&local->pipeline);
   img_handler->_internal = local;
   img_handler->write_image = write_jpeg_image;
+  img_handler->encode_image = encode_jpeg_image;
 }
 
 /**
  * Free the internal JPEG handler.
- * This function does not free the font handler given at initialization.
+ * This function does not free the font handler, caption cache or watermark
+ * given at initialization.
  *
  * @param[out] img_handler The img handler to free.
  */
@@ -406,5 +703,10 @@ void infoto_jpeg_handler_free(infoto_img_handler *img_handler) {
   struct infoto_jpeg_handler *local =
       (struct infoto_jpeg_handler *)img_handler->_internal;
   local->font_handler = NULL;
+  local->caption_cache = NULL;
+  local->watermark = NULL;
+  free(local->strip);
+  infoto_background_strip_free(&local->top_border);
+  infoto_row_pipeline_free(&local->pipeline);
   free(local);
 }
@@ -1,21 +1,29 @@
 #ifndef INFOTO_JPEG_HANDLER_H
 #define INFOTO_JPEG_HANDLER_H
 
+#include "caption_cache.h"
 #include "img_utils.h"
 #include "ttf_util.h"
+#include "watermark.h"
 
 /**
  * Initialize a infoto JPEG handler in the given img handler interface.
  *
  * @param[out] img_handler The image handler interface to populate.
  * @param[in] font_handler The font handler for the JPEG handler to reference.
+ * @param[in] caption_cache The caption strip cache to reference, NULL to
+ * render every caption.
+ * @param[in] watermark The watermark to reference, NULL for no watermark.
  */
 void infoto_jpeg_handler_init(infoto_img_handler *img_handler,
-                              infoto_font_handler *font_handler);
+                              infoto_font_handler *font_handler,
+                              infoto_caption_cache *caption_cache,
+                              infoto_watermark *watermark);
 
 /**
  * Free the internal JPEG handler.
- * This function does not free the font handler given at initialization.
+ * This function does not free the font handler, caption cache or watermark
+ * given at initialization.
  *
  * @param[out] img_handler The img handler to free.
  */
@@ -4,12 +4,15 @@
 
 #include "img_utils.h"
 #include "json_parsing.h"
+#include "watermark.h"
 
 /* Main JSON file format */
 static const char *INFOTO_JSON_FORMAT = "{"
                                         " metadata:[%M],"
                                         " font:%M,"
                                         " background:%M,"
+                                        /* optional, no watermark if missing */
+                                        " watermark:%M,"
                                         " target:%Q"
                                         "}";
 
@@ -27,7 +30,9 @@ static const char *METADATA_JSON_FORMAT =
 static const char *FONT_JSON_FORMAT = "{"
                                       " point:%d,"
                                       " ttf_file:%Q,"
-                                      " color:%s"
+                                      " color:%s,"
+                                      /* optional, defaults to false */
+                                      " auto_fit:%B"
                                       "}";
 
 /* Background info JSON format */
@@ -36,6 +41,19 @@ static const char *BACKGROUND_JSON_FORMAT = "{"
                                             " pixels:%d"
                                             "}";
 
+/* Watermark info JSON format */
+static const char *WATERMARK_JSON_FORMAT = "{"
+                                           " png_file:%Q,"
+                                           /* optional, defaults to 1 */
+                                           " opacity:%f,"
+                                           /* optional, defaults to 0.15 */
+                                           " scale:%f,"
+                                           /* optional, bottom_right */
+                                           " anchor:%s,"
+                                           /* optional, border */
+                                           " placement:%s"
+                                           "}";
+
 /**
  * Callback function for parsing metadata list in json.
  */
@@ -78,9 +96,10 @@ static void parse_metadata_list(const char *str, int len, void *user_data) {
 static void parse_font_info(const char *str, int len, void *user_data) {
   config *out_cfg = (config *)user_data;
   font_info info;
+  info.auto_fit = 0;
   char font_color[CONFIG_COLOR_LEN];
   if (json_scanf(str, len, FONT_JSON_FORMAT, &info.point, &info.ttf_file,
-                 &font_color) < 0) {
+                 &font_color, &info.auto_fit) < 0) {
     fprintf(stderr, "json scanf error: parse_font_info\n");
     return;
   }
@@ -104,6 +123,28 @@ static void parse_background_info(const char *str, int len, void *user_data) {
   out_cfg->background = info;
 }
 
+/**
+ * Callback function for parsing watermark info in json.
+ */
+static void parse_watermark_info(const char *str, int len, void *user_data) {
+  config *out_cfg = (config *)user_data;
+  watermark_info info = out_cfg->watermark;
+  char anchor[CONFIG_COLOR_LEN] = "";
+  char placement[CONFIG_COLOR_LEN] = "";
+  if (json_scanf(str, len, WATERMARK_JSON_FORMAT, &info.png_file,
+                 &info.opacity, &info.scale, &anchor, &placement) < 0) {
+    fprintf(stderr, "json scanf error: parse_watermark_info\n");
+    return;
+  }
+  if (anchor[0] != '\0') {
+    info.anchor = infoto_get_watermark_anchor_from_string(anchor);
+  }
+  if (placement[0] != '\0') {
+    info.placement = infoto_get_watermark_placement_from_string(placement);
+  }
+  out_cfg->watermark = info;
+}
+
 /**
  * Populate config object with JSON file.
  *
@@ -124,7 +165,8 @@ infoto_error_enum config_from_json_file(const char *file_name, config *cfg) {
   // %M format is (callback, user_data)
   if (json_scanf(json_data, strlen(json_data), INFOTO_JSON_FORMAT,
                  &parse_metadata_list, cfg, &parse_font_info, cfg,
-                 &parse_background_info, cfg, &cfg->target) <= 0) {
+                 &parse_background_info, cfg, &parse_watermark_info, cfg,
+                 &cfg->target) <= 0) {
     fprintf(stderr, "json scanf error: config_from_json_file.\n");
     return INFOTO_ERR_JSON_GENERIC;
   };
@@ -1,94 +1,664 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "blend.h"
+#include "caption_cache.h"
 #include "config.h"
 #include "exif.h"
+#include "exif_index.h"
 #include "file_util.h"
+#include "handler_set.h"
+#include "fill.h"
+#include "hash_util.h"
+#include "img_file.h"
 #include "info_text.h"
-#include "jpeg_handler.h"
+#include "journal.h"
 #include "json_parsing.h"
+#include "manifest.h"
+#include "output_cache.h"
 #include "process.h"
+#include "scan.h"
+#include "serve.h"
 #include "ttf_util.h"
+#include "walk.h"
+#include "watch.h"
+#include "watermark.h"
 
 #ifndef INFOTO_VERSION
     #define INFOTO_VERSION "no_version"
 #endif
 
-int main(int argc, const char *argv[]) {
+/* Bump when the edited images change for the same settings */
+#define OUTPUT_CACHE_FORMAT 1
+
+/**
+ * Print the command line usage.
+ */
+static void usage(void) {
+  fprintf(stderr, "usage: infoto [--index FILE] [--caption-cache N] "
+                  "[--glyph-atlas FILE] [--jobs N]\n"
+                  "              [--io-jobs N] [--max-in-flight MIB] "
+                  "[--journal FILE [--resume]]\n"
+                  "              [--incremental] [--output-cache DIR] "
+                  "[--recursive] [--max-depth N]\n"
+                  "              [--include GLOB] [--exclude GLOB] "
+                  "[--follow-symlinks] [--magic]\n"
+                  "              [--walk-jobs N] [--shard I/N] "
+                  "[--manifest FILE]\n"
+                  "              [--watch [--debounce MS]] <config.json>\n"
+                  "       infoto serve --socket PATH [--socket-mode MODE] "
+                  "[--idle-timeout MS]\n"
+                  "              [--jobs N] [--index FILE] [--caption-cache N] "
+                  "[--glyph-atlas FILE]\n"
+                  "              <config.json>\n"
+                  "       infoto scan [--format ndjson|csv] [--jobs N] "
+                  "<directory>\n");
+}
+
+/* Set by SIGINT and SIGTERM to stop watching or serving */
+static volatile sig_atomic_t stop_requested = 0;
+
+/**
+ * Signal handler asking a watch run or the server to stop.
+ *
+ * @param[in] sig The signal.
+ */
+static void request_stop(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+/**
+ * Drop the edited images made by earlier runs from a directory listing.
+ *
+ * @param[in,out] filenames The filenames, the dropped ones are freed.
+ */
+static void drop_edited_files(string_array *filenames) {
+  size_t kept = 0;
+  for (size_t i = 0; i < filenames->len; ++i) {
+    if (infoto_is_edit_file_name(filenames->string_data[i])) {
+      free(filenames->string_data[i]);
+      continue;
+    }
+    filenames->string_data[kept++] = filenames->string_data[i];
+  }
+  filenames->len = kept;
+}
+
+/**
+ * Get the modification time of the newest of the given files.
+ *
+ * @param[in] paths The file paths, NULL entries are ignored.
+ * @param[in] len The number of paths.
+ * @param[out] newest The newest modification time.
+ * @returns 0 if every file could be read, 1 otherwise.
+ */
+static int newest_mtime(const char *const *paths, size_t len,
+                        struct timespec *newest) {
+  newest->tv_sec = 0;
+  newest->tv_nsec = 0;
+  for (size_t i = 0; i < len; ++i) {
+    struct stat st;
+    if (paths[i] == NULL) {
+      continue;
+    }
+    if (fstatat(AT_FDCWD, paths[i], &st, 0) != 0) {
+      return 1;
+    }
+    if (st.st_mtim.tv_sec > newest->tv_sec ||
+        (st.st_mtim.tv_sec == newest->tv_sec &&
+         st.st_mtim.tv_nsec > newest->tv_nsec)) {
+      *newest = st.st_mtim;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Hash every setting that changes an edited image.
+ *
+ * @param[in] cfg The config.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] font_file The font file.
+ * @param[in] watermark The watermark, NULL if there is none.
+ * @returns The hash of the settings.
+ */
+static uint64_t settings_hash(const config *cfg, const infoto_exif_plan *plan,
+                              const infoto_font_file *font_file,
+                              const infoto_watermark *watermark) {
+  const int64_t values[] = {OUTPUT_CACHE_FORMAT,
+                            cfg->background.color,
+                            cfg->background.pixels,
+                            cfg->font.point,
+                            cfg->font.auto_fit,
+                            cfg->font.color,
+                            (int64_t)infoto_exif_plan_hash(plan),
+                            (int64_t)infoto_font_file_hash(font_file),
+                            watermark != NULL
+                                ? (int64_t)infoto_watermark_hash(watermark)
+                                : 0};
+  return infoto_hash64(values, sizeof(values), 0);
+}
+
+/**
+ * Handle the scan subcommand, report EXIF tags of every file in a tree.
+ *
+ * @param[in] argc The argument count, starting at the subcommand.
+ * @param[in] argv The arguments, starting at the subcommand.
+ * @returns The process exit code.
+ */
+static int run_scan(int argc, char *argv[]) {
+  static const struct option long_options[] = {
+      {"format", required_argument, NULL, 'f'},
+      {"jobs", required_argument, NULL, 'j'},
+      {NULL, 0, NULL, 0}};
+  infoto_scan_options opts;
+  opts.format = INFOTO_SCAN_NDJSON;
+  opts.jobs = 0;
+  opts.out = stdout;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "f:j:", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'f':
+      if (!infoto_scan_format_from_string(optarg, &opts.format)) {
+        fprintf(stderr, "unknown scan format: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'j':
+      opts.jobs = atoi(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    usage();
+    return 1;
+  }
+  if (infoto_scan_tree(argv[optind], &opts) != INFOTO_SUCCESS) {
+    fprintf(stderr, "scanning failed.\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1 && strcmp(argv[1], "scan") == 0) {
+    return run_scan(argc - 1, &argv[1]);
+  }
+  // the server takes every other option, after its subcommand
+  const int serve = argc > 1 && strcmp(argv[1], "serve") == 0;
+  if (serve) {
+    --argc;
+    ++argv;
+  }
   printf("version: %s\n", INFOTO_VERSION);
-  if (argc < 2) {
+  // pick the SIMD kernels for caption blending and border fills once
+  infoto_blend_init();
+  infoto_fill_init();
+  static const struct option long_options[] = {
+      {"index", required_argument, NULL, 'i'},
+      {"caption-cache", required_argument, NULL, 'c'},
+      {"glyph-atlas", required_argument, NULL, 'g'},
+      {"jobs", required_argument, NULL, 'j'},
+      {"io-jobs", required_argument, NULL, 'o'},
+      {"max-in-flight", required_argument, NULL, 'm'},
+      {"journal", required_argument, NULL, 'J'},
+      {"resume", no_argument, NULL, 'r'},
+      {"incremental", no_argument, NULL, 'u'},
+      {"output-cache", required_argument, NULL, 'C'},
+      {"recursive", no_argument, NULL, 'R'},
+      {"max-depth", required_argument, NULL, 'D'},
+      {"include", required_argument, NULL, 'I'},
+      {"exclude", required_argument, NULL, 'X'},
+      {"follow-symlinks", no_argument, NULL, 'L'},
+      {"magic", no_argument, NULL, 'M'},
+      {"walk-jobs", required_argument, NULL, 'W'},
+      {"watch", no_argument, NULL, 'w'},
+      {"debounce", required_argument, NULL, 'B'},
+      {"socket", required_argument, NULL, 'S'},
+      {"socket-mode", required_argument, NULL, 'P'},
+      {"idle-timeout", required_argument, NULL, 'T'},
+      {"shard", required_argument, NULL, 's'},
+      {"manifest", required_argument, NULL, 'F'},
+      {NULL, 0, NULL, 0}};
+  const char *index_path = NULL;
+  const char *journal_path = NULL;
+  const char *output_cache_path = NULL;
+  int resume = 0;
+  int incremental = 0;
+  const char *atlas_path = NULL;
+  int caption_cache_cap = INFOTO_CAPTION_CACHE_DEFAULT_CAP;
+  int jobs = 0;
+  int io_jobs = 0;
+  size_t max_in_flight = 0;
+  int recursive = 0;
+  int watch = 0;
+  const char *socket_path = NULL;
+  const char *manifest_path = NULL;
+  infoto_watch_options watch_opts;
+  infoto_watch_options_init(&watch_opts);
+  infoto_serve_options serve_opts;
+  infoto_serve_options_init(&serve_opts);
+  // the patterns point into argv
+  string_array include;
+  string_array exclude;
+  init_string_array(&include, 1);
+  init_string_array(&exclude, 1);
+  infoto_walk_options walk_opts;
+  infoto_walk_options_init(&walk_opts);
+  walk_opts.include = &include;
+  walk_opts.exclude = &exclude;
+  int opt;
+  while ((opt = getopt_long(argc, argv,
+                            "i:c:g:j:o:m:J:ruC:RD:I:X:LMW:wB:S:P:T:s:F:",
+                            long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'i':
+      index_path = optarg;
+      break;
+    case 'c':
+      caption_cache_cap = atoi(optarg);
+      break;
+    case 'g':
+      atlas_path = optarg;
+      break;
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 'o':
+      io_jobs = atoi(optarg);
+      break;
+    case 'm':
+      // given in MiB
+      max_in_flight = strtoull(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'J':
+      journal_path = optarg;
+      break;
+    case 'r':
+      resume = 1;
+      break;
+    case 'u':
+      incremental = 1;
+      break;
+    case 'C':
+      output_cache_path = optarg;
+      break;
+    case 'R':
+      recursive = 1;
+      break;
+    case 'D':
+      walk_opts.max_depth = atoi(optarg);
+      recursive = 1;
+      break;
+    case 'I':
+      insert_string_array(&include, optarg);
+      break;
+    case 'X':
+      insert_string_array(&exclude, optarg);
+      break;
+    case 'L':
+      walk_opts.follow_symlinks = 1;
+      break;
+    case 'M':
+      walk_opts.check_magic = 1;
+      break;
+    case 'W':
+      walk_opts.jobs = atoi(optarg);
+      break;
+    case 'w':
+      watch = 1;
+      break;
+    case 'B':
+      watch_opts.debounce_ms = atoi(optarg);
+      break;
+    case 'S':
+      socket_path = optarg;
+      break;
+    case 'P': {
+      char *end;
+      const long mode = strtol(optarg, &end, 8);
+      if (end == optarg || *end != '\0' || mode < 0 || mode > 0777) {
+        fprintf(stderr, "--socket-mode takes an octal mode: %s\n", optarg);
+        return 1;
+      }
+      serve_opts.socket_mode = (mode_t)mode;
+      break;
+    }
+    case 'T':
+      serve_opts.idle_timeout_ms = atoi(optarg);
+      break;
+    case 's':
+      if (sscanf(optarg, "%d/%d", &walk_opts.shard_index,
+                 &walk_opts.shard_count) != 2 ||
+          walk_opts.shard_count < 1 || walk_opts.shard_index < 0 ||
+          walk_opts.shard_index >= walk_opts.shard_count) {
+        fprintf(stderr, "--shard takes I/N with 0 <= I < N: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'F':
+      manifest_path = optarg;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (optind >= argc) {
     fprintf(stderr, "please supply a jpeg file.\n");
+    usage();
+    return 1;
+  }
+  if (resume && journal_path == NULL) {
+    fprintf(stderr, "--resume needs a --journal file.\n");
+    usage();
+    return 1;
+  }
+  if (serve && socket_path == NULL) {
+    fprintf(stderr, "serve needs a --socket path.\n");
+    usage();
+    return 1;
+  }
+  if (serve_opts.idle_timeout_ms < 0) {
+    fprintf(stderr, "--idle-timeout can't be negative.\n");
+    return 1;
+  }
+  if (watch_opts.debounce_ms < 0) {
+    fprintf(stderr, "--debounce can't be negative.\n");
     return 1;
   }
-  info_text info;
   // read in config values
   config cfg;
-  if (config_from_json_file(argv[1], &cfg) != INFOTO_SUCCESS) {
+  if (config_from_json_file(argv[optind], &cfg) != INFOTO_SUCCESS) {
     fprintf(stderr, "generating config object from json file failed\n");
     return 1;
   }
-  // initialize and load our font
-  infoto_font_handler *font_handler;
-  if (infoto_font_handler_init(&font_handler) != INFOTO_SUCCESS) {
-    fprintf(stderr, "failed to initialize font library\n");
+  // resolve the metadata tags once for every image
+  infoto_exif_plan plan;
+  if (infoto_exif_plan_init(&cfg.metadata, &plan) != INFOTO_SUCCESS) {
+    fprintf(stderr, "invalid metadata config.\n");
     return 1;
   }
-  if (infoto_font_handler_load_font(font_handler, cfg.font.ttf_file,
-                                    cfg.font.point) != INFOTO_SUCCESS) {
-    fprintf(stderr, "failed to load ttf file.\n");
+  infoto_process_options process_opts;
+  process_opts.index = NULL;
+  process_opts.max_in_flight = max_in_flight;
+  process_opts.io_jobs = io_jobs;
+  process_opts.journal = NULL;
+  process_opts.incremental = incremental;
+  process_opts.output_cache = NULL;
+  // edited images older than any of these were made with other settings
+  const char *settings_files[] = {argv[optind], cfg.font.ttf_file,
+                                  cfg.watermark.png_file};
+  if (newest_mtime(settings_files,
+                   sizeof(settings_files) / sizeof(settings_files[0]),
+                   &process_opts.settings_mtime) != 0) {
+    fprintf(stderr, "failed to read settings file times.\n");
     return 1;
   }
-  // initialize and write out the edited jpeg file
-  infoto_img_handler handler;
-  infoto_jpeg_handler_init(&handler, font_handler);
-  // handle for directory
-  if (is_dir(cfg.target)) {
+  if (index_path != NULL &&
+      infoto_exif_index_open(index_path, infoto_exif_plan_hash(&plan),
+                             &process_opts.index) != INFOTO_SUCCESS) {
+    fprintf(stderr, "failed to open index file: %s\n", index_path);
+    return 1;
+  }
+  // map the font once, every font handler loads its face from it
+  infoto_font_file *font_file;
+  if (infoto_font_file_open(cfg.font.ttf_file, &font_file) != INFOTO_SUCCESS) {
+    fprintf(stderr, "failed to open ttf file.\n");
+    return 1;
+  }
+  // glyphs rendered by earlier runs are mapped instead of rendered again
+  infoto_glyph_atlas *glyph_atlas = NULL;
+  if (atlas_path != NULL &&
+      infoto_glyph_atlas_open(atlas_path, font_file, &glyph_atlas) !=
+          INFOTO_SUCCESS) {
+    fprintf(stderr, "failed to open glyph atlas file: %s\n", atlas_path);
+    return 1;
+  }
+  // decode the logo once, every handler set scales its own copy
+  infoto_watermark *watermark = NULL;
+  if (cfg.watermark.png_file != NULL &&
+      infoto_watermark_init(&cfg.watermark, &watermark) != INFOTO_SUCCESS) {
+    fprintf(stderr, "failed to load watermark file: %s\n",
+            cfg.watermark.png_file);
+    return 1;
+  }
+  const int target_is_dir = is_dir(cfg.target);
+  // only a directory run looks images up in the output cache
+  if (output_cache_path != NULL && (serve || watch || !target_is_dir)) {
+    fprintf(stderr, "--output-cache needs a directory target and can't be "
+                    "used with --watch or serve.\n");
+    return 1;
+  }
+  // only a directory run has a list of outcomes to write
+  if (manifest_path != NULL && (serve || watch || !target_is_dir)) {
+    fprintf(stderr, "--manifest needs a directory target and can't be used "
+                    "with --watch or serve.\n");
+    return 1;
+  }
+  if (jobs <= 0) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (jobs <= 0 || (!target_is_dir && !serve)) {
+    jobs = 1;
+  }
+  // one set of handlers per worker, each with its own face and buffers
+  infoto_handler_set_options set_opts;
+  set_opts.font_file = font_file;
+  set_opts.glyph_atlas = glyph_atlas;
+  set_opts.point = cfg.font.point;
+  set_opts.caption_cache_cap = caption_cache_cap;
+  set_opts.watermark = watermark;
+  infoto_handler_set *sets =
+      (infoto_handler_set *)calloc(jobs, sizeof(infoto_handler_set));
+  infoto_img_handler *handlers =
+      (infoto_img_handler *)calloc(jobs, sizeof(infoto_img_handler));
+  if (sets == NULL || handlers == NULL) {
+    fprintf(stderr, "failed to allocate handlers\n");
+    return 1;
+  }
+  for (int i = 0; i < jobs; ++i) {
+    if (infoto_handler_set_init(&set_opts, &sets[i]) != INFOTO_SUCCESS) {
+      return 1;
+    }
+    handlers[i] = sets[i].handler;
+  }
+  int exit_code = 0;
+  if (serve || watch) {
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = request_stop;
+    sigemptyset(&stop_action.sa_mask);
+    // no SA_RESTART, the signal has to interrupt the wait for events
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+  }
+  if (serve) {
+    // fonts, glyphs and caches stay warm across every job
+    if (infoto_serve_run(handlers, jobs, cfg.background, cfg.font, &plan,
+                         &process_opts, socket_path, &serve_opts,
+                         &stop_requested) != INFOTO_SUCCESS) {
+      fprintf(stderr, "serving failed.\n");
+      exit_code = 1;
+    }
+  } else if (watch) {
+    if (!target_is_dir) {
+      fprintf(stderr, "--watch needs a directory target: %s\n", cfg.target);
+      return 1;
+    }
+    // landed images are appended to the journal as they are captioned
+    if (journal_path != NULL &&
+        infoto_journal_open(journal_path, resume, &process_opts.journal) !=
+            INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to open journal file: %s\n", journal_path);
+      return 1;
+    }
+    watch_opts.recursive = recursive;
+    // landed files are filtered the same as a walk of the tree
+    watch_opts.walk = &walk_opts;
+    if (infoto_watch_run(handlers, jobs, cfg.background, cfg.font, &plan,
+                         &process_opts, cfg.target, &watch_opts,
+                         &stop_requested) != INFOTO_SUCCESS) {
+      fprintf(stderr, "watching directory failed.\n");
+      exit_code = 1;
+    }
+    infoto_journal_close(&process_opts.journal);
+  } else if (target_is_dir) {
+    // handle for directory
     string_array filenames;
     init_string_array(&filenames, 1);
-    if (grab_files_from_dir(cfg.target, &filenames) != 0) {
-      fprintf(stderr, "reading images from directory failed.\n");
+    if (!recursive) {
+      // only the target's own files, listed in directory order
+      walk_opts.max_depth = 0;
+      walk_opts.jobs = 1;
+      if (infoto_walk_collect(cfg.target, &walk_opts, &filenames) !=
+          INFOTO_SUCCESS) {
+        fprintf(stderr, "reading images from directory failed.\n");
+        return 1;
+      }
+      // never caption our own outputs
+      drop_edited_files(&filenames);
+    }
+    // identical inputs under any path share one edited image
+    if (output_cache_path != NULL &&
+        infoto_output_cache_open(
+            output_cache_path,
+            settings_hash(&cfg, &plan, font_file, watermark),
+            &process_opts.output_cache) != INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to open output cache: %s\n", output_cache_path);
+      return 1;
+    }
+    // images finished by an earlier run are skipped when resuming
+    if (journal_path != NULL &&
+        infoto_journal_open(journal_path, resume, &process_opts.journal) !=
+            INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to open journal file: %s\n", journal_path);
       return 1;
     }
     string_array out_names;
     init_string_array(&out_names, 1);
-    if (
-        infoto_process_bulk(
-                &handler, cfg.background,
-                cfg.font, &cfg.metadata, &filenames, &out_names) != INFOTO_SUCCESS) {
-      fprintf(stderr, "processing bulk images failed.\n");
+    infoto_process_summary summary;
+    if (infoto_process_summary_init(&summary) != INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to allocate summary\n");
       return 1;
     }
+    // images found walking a tree are processed while the walk goes on
+    const infoto_error_enum bulk_result =
+        recursive ? infoto_process_tree(handlers, jobs, cfg.background,
+                                        cfg.font, &plan, &process_opts,
+                                        cfg.target, &walk_opts, &filenames,
+                                        &out_names, &summary)
+                  : infoto_process_bulk(handlers, jobs, cfg.background,
+                                        cfg.font, &plan, &process_opts,
+                                        &filenames, &out_names, &summary);
+    if (bulk_result != INFOTO_SUCCESS) {
+      fprintf(stderr, "processing bulk images failed.\n");
+      exit_code = 1;
+    }
     for (int i = 0; i < out_names.len; ++i) {
       fprintf(stdout, "Created file: %s\n", out_names.string_data[i]);
     }
-    for (int i = 0; i < filenames.len; ++i) {
-        free(filenames.string_data[i]);
-        if (i < out_names.len) {
-          free(out_names.string_data[i]);
-        }
+    for (size_t i = 0; i < summary.failures.len; ++i) {
+      const infoto_process_failure *failure =
+          &summary.failures.infoto_process_failure_data[i];
+      fprintf(stderr, "failed: %s (%s): %s\n", failure->file,
+              infoto_process_stage_to_str(failure->stage),
+              infoto_err_code_to_str(failure->code));
+    }
+    const double seconds = summary.seconds > 0 ? summary.seconds : 1e-9;
+    fprintf(stderr,
+            "summary: %zu succeeded (%zu cached), %zu failed, %zu skipped "
+            "in %.2fs (%.1f files/s, %.1f MiB/s)\n",
+            summary.succeeded, summary.cached, summary.failed, summary.skipped,
+            summary.seconds, (summary.succeeded + summary.failed) / seconds,
+            summary.bytes_read / seconds / (1024 * 1024));
+    // shards of one tree write manifests that merge by a sorted merge
+    if (manifest_path != NULL &&
+        infoto_manifest_write(manifest_path, cfg.target, &summary.outcomes) !=
+            INFOTO_SUCCESS) {
+      exit_code = 1;
+    }
+    infoto_process_summary_free(&summary);
+    infoto_journal_close(&process_opts.journal);
+    infoto_output_cache_close(&process_opts.output_cache);
+    if (caption_cache_cap > 0) {
+      uint64_t hits = 0, misses = 0;
+      for (int i = 0; i < jobs; ++i) {
+        uint64_t set_hits, set_misses;
+        infoto_caption_cache_stats(sets[i].caption_cache, &set_hits,
+                                   &set_misses);
+        hits += set_hits;
+        misses += set_misses;
+      }
+      fprintf(stderr, "caption cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+              hits, misses);
     }
+    infoto_string_array_free_strs(&filenames);
+    infoto_string_array_free_strs(&out_names);
     free_string_array(&filenames);
     free_string_array(&out_names);
   } else {
     // handle for single file.
-    // generate info text for img
-    infoto_info_text_init(&info, cfg.metadata.len, " | ");
-    if (infoto_read_exif_data(cfg.target, &cfg.metadata, &info) != INFOTO_SUCCESS) {
-      fprintf(stderr, "reading exif data failed.\n");
-      return 1;
-    }
     char *edited_img;
-    if (handler.write_image(&handler, cfg.target, cfg.background, cfg.font, &info,
-                            &edited_img) != INFOTO_SUCCESS) {
+    if (infoto_process_image(&handlers[0], cfg.background, cfg.font, &plan,
+                             &process_opts, cfg.target,
+                             &edited_img) != INFOTO_SUCCESS) {
       fprintf(stderr, "failed adding text to image.\n");
-      return 1;
+      exit_code = 1;
+    } else {
+      printf("created edited image: %s\n", edited_img);
+      free(edited_img);
     }
-    printf("created edited image: %s\n", edited_img);
-    free(edited_img);
+  }
+  // keep the values extracted so far, even if a later image failed
+  if (process_opts.index != NULL) {
+    uint64_t hits, misses;
+    infoto_exif_index_stats(process_opts.index, &hits, &misses);
+    fprintf(stderr, "index: %" PRIu64 " hits, %" PRIu64 " misses\n", hits,
+            misses);
+    if (infoto_exif_index_save(process_opts.index) != INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to save index file: %s\n", index_path);
+    }
+    infoto_exif_index_free(&process_opts.index);
+  }
+  if (glyph_atlas != NULL) {
+    infoto_font_handler **font_handlers = (infoto_font_handler **)malloc(
+        jobs * sizeof(infoto_font_handler *));
+    for (int i = 0; font_handlers != NULL && i < jobs; ++i) {
+      font_handlers[i] = sets[i].font_handler;
+    }
+    if (font_handlers == NULL ||
+        infoto_glyph_atlas_save(glyph_atlas, font_handlers, jobs) !=
+            INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to save glyph atlas file: %s\n", atlas_path);
+    }
+    free(font_handlers);
   }
   // clean up
-  infoto_info_text_free(&info);
-  infoto_font_handler_free(&font_handler);
-  infoto_jpeg_handler_free(&handler);
+  for (int i = 0; i < jobs; ++i) {
+    infoto_handler_set_free(&sets[i]);
+  }
+  free(sets);
+  free(handlers);
+  if (glyph_atlas != NULL) {
+    infoto_glyph_atlas_close(&glyph_atlas);
+  }
+  infoto_font_file_close(&font_file);
+  infoto_watermark_free(&watermark);
+  infoto_exif_plan_free(&plan);
   infoto_free_config(&cfg);
-  return 0;
+  free_string_array(&include);
+  free_string_array(&exclude);
+  return exit_code;
 }
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+
+#include "manifest.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef PATH_MAX
+    #define PATH_MAX 4096
+#endif
+
+/**
+ * Get a path relative to the root.
+ *
+ * @param[in] root The root directory.
+ * @param[in] root_len The length of the root.
+ * @param[in] path The path, found under the root.
+ * @returns The part of the path below the root, the whole path when it is
+ * not under the root.
+ */
+static const char *relative_to(const char *root, size_t root_len,
+                               const char *path) {
+  if (path == NULL || strncmp(path, root, root_len) != 0) {
+    return path;
+  }
+  const char *rel = &path[root_len];
+  while (*rel == '/') {
+    ++rel;
+  }
+  return rel;
+}
+
+/**
+ * An outcome and the relative path it is sorted by.
+ */
+struct manifest_line {
+  const char *rel;
+  const infoto_process_outcome *outcome;
+};
+
+/**
+ * Compare manifest lines by relative path, bytewise.
+ */
+static int compare_lines(const void *a, const void *b) {
+  return strcmp(((const struct manifest_line *)a)->rel,
+                ((const struct manifest_line *)b)->rel);
+}
+
+/**
+ * Write the outcome of every image of a run to a manifest file, one line
+ * per image sorted by its path relative to the root:
+ *   PATH<TAB>ok<TAB>OUTPUT
+ *   PATH<TAB>cached<TAB>OUTPUT
+ *   PATH<TAB>skipped<TAB>
+ *   PATH<TAB>failed<TAB>STAGE:ERROR
+ * Paths are relative to the root and sorted bytewise, so the manifests of
+ * the shards of one tree merge with a sorted merge (LC_ALL=C sort -m). The
+ * file is replaced at once, a reader never sees a partial manifest.
+ *
+ * @param[in] file_name The manifest file.
+ * @param[in] root The directory the images were found in.
+ * @param[in] outcomes The outcome of every image.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_manifest_write(const char *file_name, const char *root,
+                      const infoto_process_outcome_array *outcomes) {
+  const size_t root_len = strlen(root);
+  struct manifest_line *lines = (struct manifest_line *)malloc(
+      (outcomes->len + 1) * sizeof(struct manifest_line));
+  if (lines == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  size_t lines_len = 0;
+  for (size_t i = 0; i < outcomes->len; ++i) {
+    const infoto_process_outcome *outcome =
+        &outcomes->infoto_process_outcome_data[i];
+    // a line per image, the fields can't hold separators
+    if (strpbrk(outcome->file, "\t\n") != NULL ||
+        (outcome->out != NULL && strpbrk(outcome->out, "\t\n") != NULL)) {
+      fprintf(stderr, "leaving out of the manifest: %s\n", outcome->file);
+      continue;
+    }
+    lines[lines_len].rel = relative_to(root, root_len, outcome->file);
+    lines[lines_len].outcome = outcome;
+    ++lines_len;
+  }
+  qsort(lines, lines_len, sizeof(struct manifest_line), compare_lines);
+  char tmp_name[PATH_MAX];
+  if (snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", file_name,
+               (long)getpid()) >= (int)sizeof(tmp_name)) {
+    free(lines);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  FILE *file = fopen(tmp_name, "w");
+  if (file == NULL) {
+    fprintf(stderr, "can't open manifest file: %s\n", tmp_name);
+    free(lines);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  for (size_t i = 0; i < lines_len; ++i) {
+    const infoto_process_outcome *outcome = lines[i].outcome;
+    if (outcome->skipped) {
+      fprintf(file, "%s\tskipped\t\n", lines[i].rel);
+    } else if (outcome->code != INFOTO_SUCCESS) {
+      fprintf(file, "%s\tfailed\t%s:%s\n", lines[i].rel,
+              infoto_process_stage_to_str(outcome->stage),
+              infoto_err_code_to_str(outcome->code));
+    } else {
+      fprintf(file, "%s\t%s\t%s\n", lines[i].rel,
+              outcome->cached ? "cached" : "ok",
+              outcome->out != NULL
+                  ? relative_to(root, root_len, outcome->out)
+                  : "");
+    }
+  }
+  free(lines);
+  // the manifest is only in place once all of it is on disk
+  const int failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+  if (fclose(file) != 0 || failed || rename(tmp_name, file_name) != 0) {
+    fprintf(stderr, "failed writing manifest file: %s\n", file_name);
+    unlink(tmp_name);
+    return INFOTO_ERR_IMG_WRITER;
+  }
+  return INFOTO_SUCCESS;
+}
@@ -0,0 +1,27 @@
+#ifndef INFOTO_MANIFEST_H
+#define INFOTO_MANIFEST_H
+
+#include "error_codes.h"
+#include "process.h"
+
+/**
+ * Write the outcome of every image of a run to a manifest file, one line
+ * per image sorted by its path relative to the root:
+ *   PATH<TAB>ok<TAB>OUTPUT
+ *   PATH<TAB>cached<TAB>OUTPUT
+ *   PATH<TAB>skipped<TAB>
+ *   PATH<TAB>failed<TAB>STAGE:ERROR
+ * Paths are relative to the root and sorted bytewise, so the manifests of
+ * the shards of one tree merge with a sorted merge (LC_ALL=C sort -m). The
+ * file is replaced at once, a reader never sees a partial manifest.
+ *
+ * @param[in] file_name The manifest file.
+ * @param[in] root The directory the images were found in.
+ * @param[in] outcomes The outcome of every image.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_manifest_write(const char *file_name, const char *root,
+                      const infoto_process_outcome_array *outcomes);
+
+#endif
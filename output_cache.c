@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+
+#include "output_cache.h"
+#include "hash_util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+    #include <linux/fs.h>
+#endif
+
+/* Length of an entry name, two hex hashes and the extension */
+#define ENTRY_NAME_LEN (32 + 4)
+/* Length of a temporary entry name */
+#define TMP_NAME_LEN (ENTRY_NAME_LEN + 48)
+/* Seed of the second key hash, keeps the two hashes independent */
+#define KEY_LO_SEED 0x9e3779b97f4a7c15ULL
+/* Bytes copied per step when the kernel can't copy the file */
+#define COPY_BUF_LEN (64 * 1024)
+
+/**
+ * Structure for the cache of edited images.
+ */
+struct infoto_output_cache {
+  int dir_fd;
+  uint64_t settings_hash;
+  // makes temporary entry names unique within the process
+  atomic_uint_least64_t tmp_count;
+};
+
+/**
+ * Format the entry name of a key.
+ *
+ * @param[in] key The key.
+ * @param[out] name The buffer of at least ENTRY_NAME_LEN + 1 bytes.
+ */
+static void entry_name(const infoto_output_key *key, char *name) {
+  snprintf(name, ENTRY_NAME_LEN + 1, "%016llx%016llx.jpg",
+           (unsigned long long)key->hi, (unsigned long long)key->lo);
+}
+
+/**
+ * Write all bytes to a file descriptor.
+ *
+ * @param[in] fd The file descriptor.
+ * @param[in] data The bytes.
+ * @param[in] len The number of bytes.
+ * @returns 0 if successful, -1 otherwise.
+ */
+static int write_all(int fd, const uint8_t *data, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    ssize_t n = write(fd, &data[pos], len - pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    pos += n;
+  }
+  return 0;
+}
+
+/**
+ * Copy the rest of one file into another, in the kernel when it can.
+ *
+ * @param[in] src The file descriptor to copy from.
+ * @param[in] dst The file descriptor to copy to.
+ * @returns 0 if successful, -1 otherwise.
+ */
+static int copy_all(int src, int dst) {
+  for (;;) {
+    ssize_t n = copy_file_range(src, NULL, dst, NULL, 1 << 30, 0);
+    if (n == 0) {
+      return 0;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      break;
+    }
+  }
+  // file systems without copy_file_range support, copy through a buffer
+  uint8_t buf[COPY_BUF_LEN];
+  for (;;) {
+    ssize_t n = read(src, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0 ? 0 : -1;
+    }
+    if (write_all(dst, buf, n) != 0) {
+      return -1;
+    }
+  }
+}
+
+/**
+ * Open the cache directory, creating it if missing.
+ *
+ * @param[in] dir The cache directory.
+ * @param[in] settings_hash The hash of every setting that changes an edited
+ * image (config, font and watermark).
+ * @param[out] cache The cache to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_output_cache_open(const char *dir,
+                                           uint64_t settings_hash,
+                                           infoto_output_cache **cache) {
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "can't create output cache directory: %s\n", dir);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    fprintf(stderr, "can't open output cache directory: %s\n", dir);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  struct infoto_output_cache *local = (struct infoto_output_cache *)calloc(
+      1, sizeof(struct infoto_output_cache));
+  if (local == NULL) {
+    close(dir_fd);
+    return INFOTO_ERR_MALLOC;
+  }
+  local->dir_fd = dir_fd;
+  local->settings_hash = settings_hash;
+  atomic_init(&local->tmp_count, 0);
+  *cache = local;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Compute the key of an input image.
+ *
+ * @param[in] cache The cache.
+ * @param[in] data The input image's bytes.
+ * @param[in] len The number of bytes.
+ * @param[out] key The key to populate.
+ */
+void infoto_output_cache_key(const infoto_output_cache *cache,
+                             const uint8_t *data, size_t len,
+                             infoto_output_key *key) {
+  key->hi = infoto_hash64(data, len, cache->settings_hash);
+  key->lo = infoto_hash64(data, len,
+                          infoto_hash_mix64(cache->settings_hash ^ KEY_LO_SEED));
+}
+
+/**
+ * Check if the cache has the edited image of a key.
+ *
+ * @param[in] cache The cache.
+ * @param[in] key The key.
+ * @returns 1 if the edited image is cached, 0 otherwise.
+ */
+int infoto_output_cache_has(const infoto_output_cache *cache,
+                            const infoto_output_key *key) {
+  char name[ENTRY_NAME_LEN + 1];
+  entry_name(key, name);
+  struct stat st;
+  return fstatat(cache->dir_fd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * Create a file holding the cached edited image of a key, replacing an
+ * existing file. A reflink is tried first, then a hard link, then a copy.
+ *
+ * @param[in] cache The cache.
+ * @param[in] key The key.
+ * @param[in] file_name The file to create.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_output_cache_serve(const infoto_output_cache *cache,
+                                            const infoto_output_key *key,
+                                            const char *file_name) {
+  char name[ENTRY_NAME_LEN + 1];
+  entry_name(key, name);
+  int src = openat(cache->dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (src < 0) {
+    fprintf(stderr, "can't open output cache entry: %s\n", name);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  // the file may be a hard link to an entry, truncating it would clobber it
+  unlink(file_name);
+  int dst = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (dst < 0) {
+    fprintf(stderr, "can't open file: %s\n", file_name);
+    close(src);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+#ifdef FICLONE
+  // shares the cached blocks, copy on write
+  if (ioctl(dst, FICLONE, src) == 0) {
+    close(src);
+    return close(dst) == 0 ? INFOTO_SUCCESS : INFOTO_ERR_IMG_WRITER;
+  }
+#endif
+  close(dst);
+  // a hard link is fresh to incremental runs once its time is updated
+  if (unlink(file_name) == 0 &&
+      linkat(cache->dir_fd, name, AT_FDCWD, file_name, 0) == 0) {
+    close(src);
+    utimensat(AT_FDCWD, file_name, NULL, 0);
+    return INFOTO_SUCCESS;
+  }
+  // the cache is on another file system
+  dst = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (dst < 0) {
+    fprintf(stderr, "can't open file: %s\n", file_name);
+    close(src);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  int copied = copy_all(src, dst);
+  close(src);
+  if (close(dst) != 0 || copied != 0) {
+    fprintf(stderr, "failed writing file: %s\n", file_name);
+    return INFOTO_ERR_IMG_WRITER;
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Store the edited image of a key. Safe to call from several threads and
+ * processes, the entry only appears once it is complete.
+ *
+ * @param[in,out] cache The cache.
+ * @param[in] key The key.
+ * @param[in] data The edited image's bytes.
+ * @param[in] len The number of bytes.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_output_cache_store(infoto_output_cache *cache,
+                                            const infoto_output_key *key,
+                                            const uint8_t *data, size_t len) {
+  char name[ENTRY_NAME_LEN + 1];
+  entry_name(key, name);
+  char tmp_name[TMP_NAME_LEN];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.%llu.tmp", name, (long)getpid(),
+           (unsigned long long)atomic_fetch_add(&cache->tmp_count, 1));
+  int fd = openat(cache->dir_fd, tmp_name,
+                  O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  int written = write_all(fd, data, len);
+  if (close(fd) != 0 || written != 0) {
+    unlinkat(cache->dir_fd, tmp_name, 0);
+    return INFOTO_ERR_IMG_WRITER;
+  }
+  // readers only ever see whole entries
+  if (renameat(cache->dir_fd, tmp_name, cache->dir_fd, name) != 0) {
+    unlinkat(cache->dir_fd, tmp_name, 0);
+    return INFOTO_ERR_IMG_WRITER;
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Close the cache.
+ *
+ * @param[in,out] cache The cache to close.
+ */
+void infoto_output_cache_close(infoto_output_cache **cache) {
+  struct infoto_output_cache *local = *cache;
+  if (local == NULL) {
+    return;
+  }
+  close(local->dir_fd);
+  free(local);
+  *cache = NULL;
+}
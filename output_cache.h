@@ -0,0 +1,95 @@
+#ifndef INFOTO_OUTPUT_CACHE_H
+#define INFOTO_OUTPUT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error_codes.h"
+
+/**
+ * Content addressed cache of edited images.
+ * Each edited image is stored once in the cache directory under the hash of
+ * its input's bytes and the settings it was made with. An input with the
+ * same bytes, under any path, is served from the cache as a reflink, a hard
+ * link or a copy instead of being decoded and encoded again.
+ */
+typedef struct infoto_output_cache infoto_output_cache;
+
+/**
+ * Key of a cached edited image, two independent 64 bit hashes.
+ */
+typedef struct {
+  uint64_t hi;
+  uint64_t lo;
+} infoto_output_key;
+
+/**
+ * Open the cache directory, creating it if missing.
+ *
+ * @param[in] dir The cache directory.
+ * @param[in] settings_hash The hash of every setting that changes an edited
+ * image (config, font and watermark).
+ * @param[out] cache The cache to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_output_cache_open(const char *dir,
+                                           uint64_t settings_hash,
+                                           infoto_output_cache **cache);
+
+/**
+ * Compute the key of an input image.
+ *
+ * @param[in] cache The cache.
+ * @param[in] data The input image's bytes.
+ * @param[in] len The number of bytes.
+ * @param[out] key The key to populate.
+ */
+void infoto_output_cache_key(const infoto_output_cache *cache,
+                             const uint8_t *data, size_t len,
+                             infoto_output_key *key);
+
+/**
+ * Check if the cache has the edited image of a key.
+ *
+ * @param[in] cache The cache.
+ * @param[in] key The key.
+ * @returns 1 if the edited image is cached, 0 otherwise.
+ */
+int infoto_output_cache_has(const infoto_output_cache *cache,
+                            const infoto_output_key *key);
+
+/**
+ * Create a file holding the cached edited image of a key, replacing an
+ * existing file. A reflink is tried first, then a hard link, then a copy.
+ *
+ * @param[in] cache The cache.
+ * @param[in] key The key.
+ * @param[in] file_name The file to create.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_output_cache_serve(const infoto_output_cache *cache,
+                                            const infoto_output_key *key,
+                                            const char *file_name);
+
+/**
+ * Store the edited image of a key. Safe to call from several threads and
+ * processes, the entry only appears once it is complete.
+ *
+ * @param[in,out] cache The cache.
+ * @param[in] key The key.
+ * @param[in] data The edited image's bytes.
+ * @param[in] len The number of bytes.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_output_cache_store(infoto_output_cache *cache,
+                                            const infoto_output_key *key,
+                                            const uint8_t *data, size_t len);
+
+/**
+ * Close the cache.
+ *
+ * @param[in,out] cache The cache to close.
+ */
+void infoto_output_cache_close(infoto_output_cache **cache);
+
+#endif
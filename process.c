@@ -1,46 +1,1236 @@
+#define _GNU_SOURCE
+
 #include "process.h"
 #include "exif.h"
+#include "img_file.h"
+#include "queue.h"
+#include "str_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Default bytes of images held in memory by a bulk run */
+#define DEFAULT_MAX_IN_FLIGHT (256 * 1024 * 1024)
+/* Items each stage queue holds per worker */
+#define QUEUE_ITEMS_PER_WORKER 2
+/* Found images waiting to be read while a tree is walked */
+#define PATHS_QUEUE_CAP 1024
+/* Outcomes held before the first growth while a tree is walked */
+#define INITIAL_RESULTS_CAP 64
 
 /**
- * Process a bulk of images with the given background and font info.
+ * Build the caption of an image in the given info text, from the index when
+ * it has the file, otherwise from the EXIF data.
+ *
+ * @param[in] img The image file.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in,out] info The info text object.
+ * @returns INFOTO_SUCCESS if successful, otherwise infoto_error_enum error.
+ */
+static infoto_error_enum read_caption(const infoto_img_file *img,
+                                      const infoto_exif_plan *plan,
+                                      const infoto_process_options *opts,
+                                      info_text *info) {
+  infoto_exif_index *index = opts != NULL ? opts->index : NULL;
+  infoto_info_text_reset(info);
+  // only parse EXIF data when the index has nothing for this file
+  if (index != NULL && infoto_exif_index_lookup(index, &img->st, info)) {
+    return INFOTO_SUCCESS;
+  }
+  infoto_error_enum result = infoto_read_exif_data(img, plan, info);
+  if (result == INFOTO_SUCCESS && index != NULL) {
+    result = infoto_exif_index_insert(index, &img->st, info);
+  }
+  return result;
+}
+
+/**
+ * Process a single image, building the caption in the given info text.
  *
  * @param[in] handler The image handler.
  * @param[in] background The background info.
  * @param[in] font The font info.
- * @param[in] metadata The array of metadata info.
- * @param[in] imgs The array of image filenames.
- * @param[out] edited_imgs The array of edited image filenames.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] image_name The image filename.
+ * @param[in,out] info The reusable info text object.
+ * @param[out] edited_img The edited image filename.
  * @returns INFOTO_SUCCESS if successful, otherwise infoto_error_enum error.
  */
-infoto_error_enum infoto_process_bulk(struct infoto_img_handler *handler,
-                                      const background_info background,
-                                      const font_info font,
-                                      const metadata_array *metadata,
-                                      const string_array *imgs,
-                                      string_array *edited_imgs) {
-  infoto_error_enum result = INFOTO_SUCCESS;
-  for (int i = 0; i < imgs->len; ++i) {
-    const char *image_name = imgs->string_data[i];
-    // TODO evaluate glyph size compared to background border size
-    // possibly return early with warning
-    info_text info;
-    infoto_info_text_init(&info, metadata->len, " | ");
-    result = infoto_read_exif_data(image_name, metadata, &info);
+static infoto_error_enum
+process_image_with(struct infoto_img_handler *handler,
+                   const background_info background, const font_info font,
+                   const infoto_exif_plan *plan,
+                   const infoto_process_options *opts, const char *image_name,
+                   info_text *info, char **edited_img) {
+  // read the file once, EXIF and pixel data come from the same bytes
+  infoto_img_file img;
+  infoto_error_enum result = infoto_img_file_open(image_name, &img);
+  if (result != INFOTO_SUCCESS) {
+    return result;
+  }
+  result = read_caption(&img, plan, opts, info);
+  if (result == INFOTO_SUCCESS) {
+    result = handler->write_image(handler, &img, background, font, info,
+                                  edited_img);
+  }
+  infoto_img_file_close(&img);
+  return result;
+}
+
+/**
+ * Get the name of a bulk stage.
+ *
+ * @param[in] stage The stage.
+ * @returns The name of the stage.
+ */
+const char *infoto_process_stage_to_str(infoto_process_stage stage) {
+  switch (stage) {
+  case INFOTO_STAGE_READ:
+    return "read";
+  case INFOTO_STAGE_CAPTION:
+    return "caption";
+  case INFOTO_STAGE_ENCODE:
+    return "encode";
+  case INFOTO_STAGE_WRITE:
+    return "write";
+  }
+  return "unknown";
+}
+
+/**
+ * Initialize a bulk run summary.
+ *
+ * @param[out] summary The summary to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_process_summary_init(infoto_process_summary *summary) {
+  memset(summary, 0, sizeof(infoto_process_summary));
+  if (!init_infoto_process_failure_array(&summary->failures, 1)) {
+    return INFOTO_ERR_MALLOC;
+  }
+  if (!init_infoto_process_outcome_array(&summary->outcomes, 1)) {
+    free_infoto_process_failure_array(&summary->failures);
+    return INFOTO_ERR_MALLOC;
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Free a bulk run summary.
+ *
+ * @param[in,out] summary The summary to free.
+ */
+void infoto_process_summary_free(infoto_process_summary *summary) {
+  free_infoto_process_failure_array(&summary->failures);
+  free_infoto_process_outcome_array(&summary->outcomes);
+}
+
+/**
+ * Process a single image with the given background and font info.
+ *
+ * @param[in] handler The image handler.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] image_name The image filename.
+ * @param[out] edited_img The edited image filename.
+ * @returns INFOTO_SUCCESS if successful, otherwise infoto_error_enum error.
+ */
+infoto_error_enum infoto_process_image(struct infoto_img_handler *handler,
+                                       const background_info background,
+                                       const font_info font,
+                                       const infoto_exif_plan *plan,
+                                       const infoto_process_options *opts,
+                                       const char *image_name,
+                                       char **edited_img) {
+  info_text info;
+  infoto_error_enum result = infoto_info_text_init(&info, plan->len, " | ");
+  if (result != INFOTO_SUCCESS) {
+    return result;
+  }
+  result = process_image_with(handler, background, font, plan, opts,
+                              image_name, &info, edited_img);
+  infoto_info_text_free(&info);
+  return result;
+}
+
+/**
+ * An image to process and its size, for ordering the work.
+ */
+struct bulk_order {
+  size_t idx;
+  off_t size;
+};
+
+/**
+ * An image moving through the stages of a bulk run.
+ */
+struct bulk_item {
+  size_t idx;
+  // the input image filename, owned by the image list
+  const char *name;
+  infoto_img_file img;
+  // file status of the input when it was read, kept for the journal
+  struct stat st;
+  // the caption, taken from the state's spare texts until encoded
+  info_text *info;
+  // the encoded edited image
+  uint8_t *data;
+  size_t len;
+  // bytes of this item counted against the in flight budget
+  size_t charged;
+  // output cache key of the input's bytes
+  infoto_output_key key;
+  // flag for if the edited image is served from the output cache
+  uint8_t cached;
+};
+
+/**
+ * The outcome of an image of a bulk run.
+ */
+struct bulk_result {
+  // the edited image filename on success
+  char *out;
+  infoto_error_enum code;
+  // the stage the image failed in
+  infoto_process_stage stage;
+  // flag for if the journal had the image as finished
+  uint8_t skipped;
+  // flag for if the edited image came from the output cache
+  uint8_t cached;
+};
+
+/**
+ * State shared by every stage of a bulk run.
+ */
+struct bulk_state {
+  const background_info *background;
+  const font_info *font;
+  const infoto_exif_plan *plan;
+  const infoto_process_options *opts;
+  const string_array *imgs;
+  // images in the order they are read, largest first. Unused while a tree
+  // is walked.
+  const struct bulk_order *order;
+  size_t order_len;
+  atomic_size_t next;
+  // image list that grows while a tree is walked, NULL for a fixed list
+  string_array *found;
+  // indices of found images waiting to be read
+  infoto_queue paths;
+  // outcome per image, in input order
+  struct bulk_result *results;
+  size_t results_cap;
+  // guards results, and the image list while a tree is walked
+  pthread_mutex_t results_lock;
+  atomic_uint_least64_t bytes_read;
+  // read -> caption -> encode -> write
+  infoto_queue loaded;
+  infoto_queue captioned;
+  infoto_queue encoded;
+  // bytes of input and output images held in memory
+  pthread_mutex_t budget_lock;
+  pthread_cond_t budget_cond;
+  size_t in_flight;
+  size_t max_in_flight;
+  // info texts handed back by the encode stage, reused by the caption stage
+  pthread_mutex_t texts_lock;
+  info_text **texts;
+  size_t texts_len;
+  size_t texts_cap;
+};
+
+/**
+ * A thread of one of the stages.
+ */
+struct bulk_worker {
+  struct bulk_state *state;
+  // the handler of an encode worker, NULL for the other stages
+  struct infoto_img_handler *handler;
+  pthread_t thread;
+};
+
+/**
+ * Compare bulk orders, largest first and then in input order.
+ */
+static int compare_orders(const void *a, const void *b) {
+  const struct bulk_order *oa = (const struct bulk_order *)a;
+  const struct bulk_order *ob = (const struct bulk_order *)b;
+  if (oa->size != ob->size) {
+    return oa->size < ob->size ? 1 : -1;
+  }
+  return oa->idx < ob->idx ? -1 : (oa->idx > ob->idx);
+}
+
+/**
+ * Wait until the bytes fit in the in flight budget and count them.
+ * A single image larger than the budget is let through when nothing else is
+ * in flight.
+ *
+ * @param[in,out] state The bulk state.
+ * @param[in] bytes The number of bytes.
+ */
+static void budget_acquire(struct bulk_state *state, size_t bytes) {
+  pthread_mutex_lock(&state->budget_lock);
+  while (state->in_flight > 0 &&
+         state->in_flight + bytes > state->max_in_flight) {
+    pthread_cond_wait(&state->budget_cond, &state->budget_lock);
+  }
+  state->in_flight += bytes;
+  pthread_mutex_unlock(&state->budget_lock);
+}
+
+/**
+ * Swap bytes counted against the in flight budget for another amount,
+ * without waiting. Only the read stage waits on the budget so the later
+ * stages always drain.
+ *
+ * @param[in,out] state The bulk state.
+ * @param[in] released The number of bytes no longer held.
+ * @param[in] charged The number of bytes now held.
+ */
+static void budget_swap(struct bulk_state *state, size_t released,
+                        size_t charged) {
+  pthread_mutex_lock(&state->budget_lock);
+  state->in_flight = state->in_flight - released + charged;
+  if (released > charged) {
+    pthread_cond_broadcast(&state->budget_cond);
+  }
+  pthread_mutex_unlock(&state->budget_lock);
+}
+
+/**
+ * Take a spare info text, or make a new one when none is left.
+ *
+ * @param[in,out] state The bulk state.
+ * @returns The info text, NULL if allocation failed.
+ */
+static info_text *text_acquire(struct bulk_state *state) {
+  info_text *info = NULL;
+  pthread_mutex_lock(&state->texts_lock);
+  if (state->texts_len > 0) {
+    info = state->texts[--state->texts_len];
+  }
+  pthread_mutex_unlock(&state->texts_lock);
+  if (info != NULL) {
+    return info;
+  }
+  info = (info_text *)malloc(sizeof(info_text));
+  if (info != NULL &&
+      infoto_info_text_init(info, state->plan->len, " | ") != INFOTO_SUCCESS) {
+    free(info);
+    info = NULL;
+  }
+  return info;
+}
+
+/**
+ * Hand an info text back for a later image, keeping its buffers.
+ *
+ * @param[in,out] state The bulk state.
+ * @param[in] info The info text, NULL for none.
+ */
+static void text_release(struct bulk_state *state, info_text *info) {
+  if (info == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&state->texts_lock);
+  if (state->texts_len == state->texts_cap) {
+    const size_t cap = state->texts_cap == 0 ? 16 : state->texts_cap * 2;
+    info_text **grown =
+        (info_text **)realloc(state->texts, cap * sizeof(info_text *));
+    if (grown != NULL) {
+      state->texts = grown;
+      state->texts_cap = cap;
+    }
+  }
+  if (state->texts_len < state->texts_cap) {
+    state->texts[state->texts_len++] = info;
+    info = NULL;
+  }
+  pthread_mutex_unlock(&state->texts_lock);
+  // no room to keep it
+  if (info != NULL) {
+    infoto_info_text_free(info);
+    free(info);
+  }
+}
+
+/**
+ * Record the outcome of an image.
+ *
+ * @param[in,out] state The bulk state.
+ * @param[in] idx The image's index in the image list.
+ * @param[in] outcome The outcome.
+ */
+static void set_result(struct bulk_state *state, size_t idx,
+                       const struct bulk_result *outcome) {
+  pthread_mutex_lock(&state->results_lock);
+  state->results[idx] = *outcome;
+  pthread_mutex_unlock(&state->results_lock);
+}
+
+/**
+ * Record the result of an item that left the stages and free it.
+ *
+ * @param[in,out] state The bulk state.
+ * @param[in,out] item The item.
+ * @param[in] stage The stage the item left in.
+ * @param[in] result The item's result.
+ * @param[in] edited_img The edited image filename on success.
+ */
+static void finish_item(struct bulk_state *state, struct bulk_item *item,
+                        infoto_process_stage stage, infoto_error_enum result,
+                        char *edited_img) {
+  struct bulk_result outcome;
+  memset(&outcome, 0, sizeof(outcome));
+  outcome.code = result;
+  outcome.stage = stage;
+  outcome.out = edited_img;
+  outcome.cached = item->cached;
+  set_result(state, item->idx, &outcome);
+  if (item->img.data != NULL) {
+    infoto_img_file_close(&item->img);
+  }
+  text_release(state, item->info);
+  free(item->data);
+  budget_swap(state, item->charged, 0);
+  free(item);
+}
+
+/**
+ * Check if the first time is later than the second.
+ *
+ * @param[in] a The first time.
+ * @param[in] b The second time.
+ * @returns 1 if a is later than b, 0 otherwise.
+ */
+static int time_after(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec != b->tv_sec ? a->tv_sec > b->tv_sec
+                                : a->tv_nsec > b->tv_nsec;
+}
+
+/**
+ * Check if the edited image of an input is newer than the input and the
+ * settings. Only file status is read, never image bytes.
+ *
+ * @param[in] opts The process options.
+ * @param[in] image_name The input image filename.
+ * @param[in] st The file status of the input image.
+ * @returns 1 if the edited image is up to date, 0 otherwise.
+ */
+static int is_up_to_date(const infoto_process_options *opts,
+                         const char *image_name, const struct stat *st) {
+  char *edited_img = infoto_get_edit_file_name(image_name);
+  if (edited_img == NULL) {
+    return 0;
+  }
+  struct stat edited_st;
+  const int up_to_date =
+      fstatat(AT_FDCWD, edited_img, &edited_st, 0) == 0 &&
+      S_ISREG(edited_st.st_mode) &&
+      time_after(&edited_st.st_mtim, &st->st_mtim) &&
+      time_after(&edited_st.st_mtim, &opts->settings_mtime);
+  free(edited_img);
+  return up_to_date;
+}
+
+/**
+ * Check if an image can be skipped, because the journal has it as finished
+ * or, in incremental mode, its edited image is up to date.
+ *
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] image_name The input image filename.
+ * @param[in] st The file status of the input image.
+ * @returns 1 if the image is skipped, 0 otherwise.
+ */
+static int should_skip(const infoto_process_options *opts,
+                       const char *image_name, const struct stat *st) {
+  if (opts == NULL) {
+    return 0;
+  }
+  return (opts->journal != NULL &&
+          infoto_journal_is_done(opts->journal, image_name, st)) ||
+         (opts->incremental && is_up_to_date(opts, image_name, st));
+}
+
+/**
+ * Get the next image to read, from the ordered list or from the images a
+ * tree walk found. Found images are checked for skipping here, so the check
+ * overlaps with the walk.
+ *
+ * @param[in,out] state The bulk state.
+ * @param[out] idx The image's index in the image list.
+ * @param[out] name The image filename.
+ * @param[out] size The image's size.
+ * @returns 1 if there is an image, 0 once every image was handed out.
+ */
+static int next_input(struct bulk_state *state, size_t *idx, const char **name,
+                      size_t *size) {
+  if (state->found == NULL) {
+    size_t next = atomic_fetch_add(&state->next, 1);
+    if (next >= state->order_len) {
+      return 0;
+    }
+    *idx = state->order[next].idx;
+    *name = state->imgs->string_data[*idx];
+    *size = state->order[next].size;
+    return 1;
+  }
+  void *next;
+  while (infoto_queue_pop(&state->paths, &next)) {
+    *idx = (size_t)(uintptr_t)next;
+    // the list's storage moves as the walk grows it, the strings don't
+    pthread_mutex_lock(&state->results_lock);
+    *name = state->found->string_data[*idx];
+    pthread_mutex_unlock(&state->results_lock);
+    struct stat st;
+    if (fstatat(AT_FDCWD, *name, &st, 0) != 0) {
+      // the read reports the error
+      *size = 0;
+      return 1;
+    }
+    if (should_skip(state->opts, *name, &st)) {
+      struct bulk_result outcome;
+      memset(&outcome, 0, sizeof(outcome));
+      outcome.skipped = 1;
+      set_result(state, *idx, &outcome);
+      continue;
+    }
+    *size = st.st_size;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Read stage thread, loads the images' bytes into memory in order, waiting
+ * on the in flight budget.
+ *
+ * @param[in,out] arg The bulk worker.
+ * @returns NULL
+ */
+static void *read_stage_run(void *arg) {
+  struct bulk_worker *worker = (struct bulk_worker *)arg;
+  struct bulk_state *state = worker->state;
+  size_t idx;
+  const char *name;
+  size_t size;
+  while (next_input(state, &idx, &name, &size)) {
+    struct bulk_item *item =
+        (struct bulk_item *)calloc(1, sizeof(struct bulk_item));
+    if (item == NULL) {
+      struct bulk_result outcome;
+      memset(&outcome, 0, sizeof(outcome));
+      outcome.code = INFOTO_ERR_MALLOC;
+      outcome.stage = INFOTO_STAGE_READ;
+      set_result(state, idx, &outcome);
+      continue;
+    }
+    item->idx = idx;
+    item->name = name;
+    item->charged = size;
+    budget_acquire(state, item->charged);
+    infoto_error_enum result = infoto_img_file_load(name, &item->img);
+    if (result != INFOTO_SUCCESS) {
+      finish_item(state, item, INFOTO_STAGE_READ, result, NULL);
+      continue;
+    }
+    item->st = item->img.st;
+    atomic_fetch_add(&state->bytes_read, item->img.size);
+    // hash while the bytes are hot, a cached image skips decoding and
+    // encoding
+    infoto_output_cache *cache =
+        state->opts != NULL ? state->opts->output_cache : NULL;
+    if (cache != NULL) {
+      infoto_output_cache_key(cache, item->img.data, item->img.size,
+                              &item->key);
+      if (infoto_output_cache_has(cache, &item->key)) {
+        item->cached = 1;
+        infoto_img_file_close(&item->img);
+        budget_swap(state, item->charged, 0);
+        item->charged = 0;
+        infoto_queue_push(&state->encoded, item);
+        continue;
+      }
+    }
+    infoto_queue_push(&state->loaded, item);
+  }
+  infoto_queue_producer_done(&state->loaded);
+  return NULL;
+}
+
+/**
+ * Caption stage thread, builds the caption of each loaded image in a spare
+ * info text.
+ *
+ * @param[in,out] arg The bulk worker.
+ * @returns NULL
+ */
+static void *caption_stage_run(void *arg) {
+  struct bulk_worker *worker = (struct bulk_worker *)arg;
+  struct bulk_state *state = worker->state;
+  void *next;
+  while (infoto_queue_pop(&state->loaded, &next)) {
+    struct bulk_item *item = (struct bulk_item *)next;
+    item->info = text_acquire(state);
+    infoto_error_enum result = INFOTO_ERR_MALLOC;
+    if (item->info != NULL) {
+      result = read_caption(&item->img, state->plan, state->opts, item->info);
+    }
     if (result != INFOTO_SUCCESS) {
+      finish_item(state, item, INFOTO_STAGE_CAPTION, result, NULL);
+      continue;
+    }
+    infoto_queue_push(&state->captioned, item);
+  }
+  infoto_queue_producer_done(&state->captioned);
+  return NULL;
+}
+
+/**
+ * Encode stage thread, decodes, composites and encodes each captioned image
+ * into memory with the worker's own handler.
+ *
+ * @param[in,out] arg The bulk worker.
+ * @returns NULL
+ */
+static void *encode_stage_run(void *arg) {
+  struct bulk_worker *worker = (struct bulk_worker *)arg;
+  struct bulk_state *state = worker->state;
+  void *next;
+  while (infoto_queue_pop(&state->captioned, &next)) {
+    struct bulk_item *item = (struct bulk_item *)next;
+    infoto_error_enum result = worker->handler->encode_image(
+        worker->handler, &item->img, *state->background, *state->font,
+        item->info, &item->data, &item->len);
+    if (result != INFOTO_SUCCESS) {
+      finish_item(state, item, INFOTO_STAGE_ENCODE, result, NULL);
+      continue;
+    }
+    // the input is done with, only the output is held until written
+    infoto_img_file_close(&item->img);
+    text_release(state, item->info);
+    item->info = NULL;
+    budget_swap(state, item->charged, item->len);
+    item->charged = item->len;
+    infoto_queue_push(&state->encoded, item);
+  }
+  infoto_queue_producer_done(&state->encoded);
+  return NULL;
+}
+
+/**
+ * Write all bytes to a new file, replacing an existing one only once all of
+ * them are on disk.
+ *
+ * @param[in] file_name The file name.
+ * @param[in] data The bytes.
+ * @param[in] len The number of bytes.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum write_file(const char *file_name, const uint8_t *data,
+                                    size_t len) {
+  char *tmp_name = infoto_get_tmp_file_name(file_name);
+  if (tmp_name == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "can't open file: %s\n", tmp_name);
+    free(tmp_name);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  int failed = 0;
+  size_t pos = 0;
+  while (pos < len) {
+    ssize_t n = write(fd, &data[pos], len - pos);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      failed = 1;
       break;
     }
-    char *out;
-    result = handler->write_image(handler, image_name, background, font, &info,
-                                  &out);
+    pos += n;
+  }
+  // renaming also never writes through a hard link into the output cache
+  if (close(fd) != 0 || failed || rename(tmp_name, file_name) != 0) {
+    fprintf(stderr, "failed writing file: %s\n", file_name);
+    unlink(tmp_name);
+    free(tmp_name);
+    return INFOTO_ERR_IMG_WRITER;
+  }
+  free(tmp_name);
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Write stage thread, writes each encoded image next to its original.
+ *
+ * @param[in,out] arg The bulk worker.
+ * @returns NULL
+ */
+static void *write_stage_run(void *arg) {
+  struct bulk_worker *worker = (struct bulk_worker *)arg;
+  struct bulk_state *state = worker->state;
+  void *next;
+  while (infoto_queue_pop(&state->encoded, &next)) {
+    struct bulk_item *item = (struct bulk_item *)next;
+    char *edited_img = infoto_get_edit_file_name(item->name);
+    infoto_output_cache *cache =
+        state->opts != NULL ? state->opts->output_cache : NULL;
+    infoto_error_enum result = INFOTO_ERR_MALLOC;
+    if (edited_img != NULL && item->cached) {
+      result = infoto_output_cache_serve(cache, &item->key, edited_img);
+    } else if (edited_img != NULL) {
+      result = write_file(edited_img, item->data, item->len);
+      // a failed store only costs a later encode
+      if (result == INFOTO_SUCCESS && cache != NULL &&
+          infoto_output_cache_store(cache, &item->key, item->data,
+                                    item->len) != INFOTO_SUCCESS) {
+        fprintf(stderr, "failed to store in output cache: %s\n",
+                edited_img);
+      }
+    }
     if (result != INFOTO_SUCCESS) {
+      free(edited_img);
+      edited_img = NULL;
+    }
+    // only record the image once its edited image is on disk
+    infoto_journal *journal = state->opts != NULL ? state->opts->journal : NULL;
+    if (result == INFOTO_SUCCESS && journal != NULL &&
+        infoto_journal_append(journal, item->name, &item->st) !=
+            INFOTO_SUCCESS) {
+      fprintf(stderr, "failed to append to journal: %s\n", item->name);
+    }
+    finish_item(state, item, INFOTO_STAGE_WRITE, result, edited_img);
+  }
+  return NULL;
+}
+
+/**
+ * Start the threads of one stage. Missing producers of the stage's output
+ * queue are marked done so its consumers never wait on them.
+ *
+ * @param[in,out] workers The stage's workers, with state and handler set.
+ * @param[in] count The number of workers.
+ * @param[in] run The stage's thread function.
+ * @param[in,out] out The stage's output queue, NULL for the last stage.
+ * @param[in] allowed Flag for if the stage may start, 0 when nothing would
+ * consume its output.
+ * @returns The number of threads started.
+ */
+static int start_stage(struct bulk_worker *workers, int count,
+                       void *(*run)(void *), infoto_queue *out, int allowed) {
+  int started = 0;
+  for (; allowed && started < count; ++started) {
+    if (pthread_create(&workers[started].thread, NULL, run,
+                       &workers[started]) != 0) {
       break;
     }
-    if (edited_imgs != NULL) {
-      insert_string_array(edited_imgs, out);
+  }
+  for (int i = started; out != NULL && i < count; ++i) {
+    infoto_queue_producer_done(out);
+  }
+  return started;
+}
+
+/**
+ * Walk callback, adds a found image to the list and queues it for reading.
+ *
+ * @param[in,out] ctx The bulk state.
+ * @param[in] path The found file, owned by the list once added.
+ */
+static void walk_found(void *ctx, char *path) {
+  struct bulk_state *state = (struct bulk_state *)ctx;
+  // never caption our own outputs
+  if (infoto_is_edit_file_name(path)) {
+    free(path);
+    return;
+  }
+  pthread_mutex_lock(&state->results_lock);
+  const size_t idx = state->found->len;
+  if (idx == state->results_cap) {
+    const size_t cap = state->results_cap * 2;
+    struct bulk_result *grown = (struct bulk_result *)realloc(
+        state->results, cap * sizeof(struct bulk_result));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&state->results_lock);
+      fprintf(stderr, "out of memory, leaving out: %s\n", path);
+      free(path);
+      return;
+    }
+    memset(&grown[idx], 0, (cap - idx) * sizeof(struct bulk_result));
+    state->results = grown;
+    state->results_cap = cap;
+  }
+  if (!insert_string_array(state->found, path)) {
+    pthread_mutex_unlock(&state->results_lock);
+    fprintf(stderr, "out of memory, leaving out: %s\n", path);
+    free(path);
+    return;
+  }
+  pthread_mutex_unlock(&state->results_lock);
+  infoto_queue_push(&state->paths, (void *)(uintptr_t)idx);
+}
+
+/**
+ * Run the stages over the images of the state, walking a tree for them
+ * when given one.
+ *
+ * @param[in,out] state The bulk state, with its images or found list set.
+ * @param[in] handlers The image handlers, one per encode thread.
+ * @param[in] jobs The number of encode threads.
+ * @param[in] root The directory to walk, NULL for the ordered list.
+ * @param[in] walk The walk options, NULL for the ordered list.
+ * @returns INFOTO_SUCCESS if the stages ran, otherwise an error code.
+ */
+static infoto_error_enum run_stages(struct bulk_state *state,
+                                    struct infoto_img_handler *handlers,
+                                    int jobs, const char *root,
+                                    const infoto_walk_options *walk) {
+  const infoto_process_options *opts = state->opts;
+  const int io_jobs = opts != NULL && opts->io_jobs > 0 ? opts->io_jobs : 1;
+  const size_t queue_cap = (size_t)jobs * QUEUE_ITEMS_PER_WORKER;
+  // read, caption, encode and write threads
+  const int workers_len = io_jobs + jobs + jobs + io_jobs;
+  struct bulk_worker *workers =
+      (struct bulk_worker *)calloc(workers_len, sizeof(struct bulk_worker));
+  // the paths queue counts as made when no tree is walked
+  int queues = 0;
+  infoto_error_enum result = INFOTO_ERR_MALLOC;
+  if (workers != NULL &&
+      (root == NULL ||
+       infoto_queue_init(&state->paths, PATHS_QUEUE_CAP, 1) ==
+           INFOTO_SUCCESS) &&
+      ++queues &&
+      infoto_queue_init(&state->loaded, queue_cap, io_jobs) == INFOTO_SUCCESS &&
+      ++queues &&
+      infoto_queue_init(&state->captioned, queue_cap, jobs) ==
+          INFOTO_SUCCESS &&
+      ++queues &&
+      infoto_queue_init(&state->encoded, queue_cap, jobs) == INFOTO_SUCCESS &&
+      ++queues) {
+    result = INFOTO_SUCCESS;
+  }
+  if (result == INFOTO_SUCCESS) {
+    for (int i = 0; i < workers_len; ++i) {
+      workers[i].state = state;
+    }
+    struct bulk_worker *readers = workers;
+    struct bulk_worker *captioners = &readers[io_jobs];
+    struct bulk_worker *encoders = &captioners[jobs];
+    struct bulk_worker *writers = &encoders[jobs];
+    for (int i = 0; i < jobs; ++i) {
+      encoders[i].handler = &handlers[i];
+    }
+    // start consumers first, a stage only starts once its consumers run
+    int started[4];
+    started[3] = start_stage(writers, io_jobs, write_stage_run, NULL, 1);
+    started[2] = start_stage(encoders, jobs, encode_stage_run, &state->encoded,
+                             started[3] > 0);
+    started[1] = start_stage(captioners, jobs, caption_stage_run,
+                             &state->captioned, started[2] > 0);
+    started[0] = start_stage(readers, io_jobs, read_stage_run, &state->loaded,
+                             started[1] > 0);
+    if (started[0] == 0) {
+      fprintf(stderr, "failed to start the bulk stages.\n");
+      result = INFOTO_ERR_MALLOC;
+    }
+    // found images are read while the rest of the tree is still walked
+    if (root != NULL) {
+      if (started[0] > 0) {
+        result = infoto_walk_tree(root, walk, walk_found, state);
+      }
+      infoto_queue_producer_done(&state->paths);
+    }
+    struct bulk_worker *stages[4] = {readers, captioners, encoders, writers};
+    for (int s = 0; s < 4; ++s) {
+      for (int i = 0; i < started[s]; ++i) {
+        pthread_join(stages[s][i].thread, NULL);
+      }
+    }
+  }
+  if (queues > 3) {
+    infoto_queue_free(&state->encoded);
+  }
+  if (queues > 2) {
+    infoto_queue_free(&state->captioned);
+  }
+  if (queues > 1) {
+    infoto_queue_free(&state->loaded);
+  }
+  if (queues > 0 && root != NULL) {
+    infoto_queue_free(&state->paths);
+  }
+  free(workers);
+  return result;
+}
+
+/**
+ * Compare the images behind two indices by filename.
+ */
+static int compare_listing(const void *a, const void *b, void *arg) {
+  const string_array *imgs = (const string_array *)arg;
+  return strcmp(imgs->string_data[*(const size_t *)a],
+                imgs->string_data[*(const size_t *)b]);
+}
+
+/**
+ * Hand out the edited image names and fill in the report of a bulk run
+ * from the images' outcomes.
+ *
+ * @param[in,out] state The bulk state after every stage finished.
+ * @param[in] listing The image indices in reporting order, NULL for input
+ * order.
+ * @param[in] start The time the run started.
+ * @param[in] result The result of running the stages.
+ * @param[out] edited_imgs The array of every edited image filename.
+ * @param[out] summary The summary to fill in, NULL to not report.
+ * @returns The run's result, the first failure in reporting order.
+ */
+static infoto_error_enum finish_bulk(struct bulk_state *state,
+                                     const size_t *listing,
+                                     const struct timespec *start,
+                                     infoto_error_enum result,
+                                     string_array *edited_imgs,
+                                     infoto_process_summary *summary) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (summary != NULL) {
+    summary->seconds =
+        (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    summary->bytes_read = atomic_load(&state->bytes_read);
+  }
+  for (size_t n = 0; n < state->imgs->len; ++n) {
+    const size_t i = listing != NULL ? listing[n] : n;
+    const struct bulk_result *outcome = &state->results[i];
+    if (result == INFOTO_SUCCESS && !outcome->skipped) {
+      result = outcome->code;
+    }
+    const char *out = NULL;
+    if (outcome->out != NULL) {
+      if (edited_imgs != NULL &&
+          insert_string_array(edited_imgs, outcome->out)) {
+        out = outcome->out;
+      } else {
+        free(outcome->out);
+      }
+    }
+    if (summary == NULL) {
+      continue;
+    }
+    infoto_process_outcome report;
+    report.file = state->imgs->string_data[i];
+    report.out = out;
+    report.stage = outcome->stage;
+    report.code = outcome->code;
+    report.skipped = outcome->skipped;
+    report.cached = outcome->cached;
+    insert_infoto_process_outcome_array(&summary->outcomes, report);
+    if (outcome->skipped) {
+      ++summary->skipped;
+    } else if (outcome->code == INFOTO_SUCCESS) {
+      ++summary->succeeded;
+      summary->cached += outcome->cached;
     } else {
-      free(out);
+      ++summary->failed;
+      infoto_process_failure failure;
+      failure.file = state->imgs->string_data[i];
+      failure.stage = outcome->stage;
+      failure.code = outcome->code;
+      insert_infoto_process_failure_array(&summary->failures, failure);
+    }
+  }
+  return result;
+}
+
+/**
+ * Initialize the parts of the bulk state every run shares.
+ *
+ * @param[out] state The bulk state.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ */
+static void init_state(struct bulk_state *state,
+                       const background_info *background,
+                       const font_info *font, const infoto_exif_plan *plan,
+                       const infoto_process_options *opts) {
+  memset(state, 0, sizeof(struct bulk_state));
+  state->background = background;
+  state->font = font;
+  state->plan = plan;
+  state->opts = opts;
+  state->max_in_flight = opts != NULL && opts->max_in_flight > 0
+                             ? opts->max_in_flight
+                             : DEFAULT_MAX_IN_FLIGHT;
+  atomic_init(&state->next, 0);
+  atomic_init(&state->bytes_read, 0);
+  pthread_mutex_init(&state->results_lock, NULL);
+  pthread_mutex_init(&state->budget_lock, NULL);
+  pthread_cond_init(&state->budget_cond, NULL);
+  pthread_mutex_init(&state->texts_lock, NULL);
+}
+
+/**
+ * Free the parts of the bulk state every run shares.
+ *
+ * @param[in,out] state The bulk state.
+ */
+static void free_state(struct bulk_state *state) {
+  pthread_cond_destroy(&state->budget_cond);
+  pthread_mutex_destroy(&state->budget_lock);
+  pthread_mutex_destroy(&state->results_lock);
+  free(state->results);
+  for (size_t i = 0; i < state->texts_len; ++i) {
+    infoto_info_text_free(state->texts[i]);
+    free(state->texts[i]);
+  }
+  free(state->texts);
+  pthread_mutex_destroy(&state->texts_lock);
+}
+
+/**
+ * Process a bulk of images with the given background and font info.
+ * The work runs as stages connected by bounded queues, so disk and codec
+ * work overlap: read threads load the images' bytes (largest first), one
+ * caption and one encode thread per handler build the captions and
+ * composite and encode into memory, and write threads write the edited
+ * images. Read threads wait while the images held in memory exceed the in
+ * flight budget. Handlers must not share state. The edited image names are
+ * stored in input order. A failed image is recorded and the run goes on
+ * with the others. Images the journal has as finished, and in incremental
+ * mode images whose edited image is newer than them and the settings, are
+ * skipped without being read. Written images are appended to the journal.
+ * With an output cache read threads hash each image's bytes, cached images
+ * go straight to the write threads and new edited images are stored.
+ *
+ * @param[in] handlers The image handlers, one per encode thread.
+ * @param[in] handlers_len The number of image handlers.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] imgs The array of image filenames.
+ * @param[out] edited_imgs The array of every edited image filename.
+ * @param[out] summary The report of the run, NULL to not report.
+ * @returns INFOTO_SUCCESS if successful, otherwise the error of the first
+ * failed image in input order.
+ */
+infoto_error_enum infoto_process_bulk(struct infoto_img_handler *handlers,
+                                      int handlers_len,
+                                      const background_info background,
+                                      const font_info font,
+                                      const infoto_exif_plan *plan,
+                                      const infoto_process_options *opts,
+                                      const string_array *imgs,
+                                      string_array *edited_imgs,
+                                      infoto_process_summary *summary) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (imgs->len == 0) {
+    return INFOTO_SUCCESS;
+  }
+  if (handlers_len <= 0) {
+    return INFOTO_ERR_NULL;
+  }
+  struct bulk_state state;
+  init_state(&state, &background, &font, plan, opts);
+  state.imgs = imgs;
+  struct bulk_order *order =
+      (struct bulk_order *)malloc(imgs->len * sizeof(struct bulk_order));
+  state.results =
+      (struct bulk_result *)calloc(imgs->len, sizeof(struct bulk_result));
+  if (order == NULL || state.results == NULL) {
+    free(order);
+    free_state(&state);
+    return INFOTO_ERR_MALLOC;
+  }
+  // skip images a previous run finished or that are up to date, then read
+  // the largest images first so no encoder is left with one at the end
+  for (size_t i = 0; i < imgs->len; ++i) {
+    struct stat st;
+    const int have_st =
+        fstatat(AT_FDCWD, imgs->string_data[i], &st, 0) == 0;
+    if (have_st && should_skip(opts, imgs->string_data[i], &st)) {
+      state.results[i].skipped = 1;
+      continue;
+    }
+    order[state.order_len].idx = i;
+    order[state.order_len].size = have_st ? st.st_size : 0;
+    ++state.order_len;
+  }
+  qsort(order, state.order_len, sizeof(struct bulk_order), compare_orders);
+  state.order = order;
+  const int jobs = (size_t)handlers_len < state.order_len
+                       ? handlers_len
+                       : (int)state.order_len;
+  infoto_error_enum result = INFOTO_SUCCESS;
+  if (jobs > 0) {
+    result = run_stages(&state, handlers, jobs, NULL, NULL);
+  }
+  if (result != INFOTO_SUCCESS) {
+    // nothing was read, every image failed with the run
+    for (size_t i = 0; i < state.order_len; ++i) {
+      state.results[order[i].idx].code = result;
+      state.results[order[i].idx].stage = INFOTO_STAGE_READ;
     }
-    infoto_info_text_free(&info);
   }
+  // every image is processed, report the first failure in input order
+  result = finish_bulk(&state, NULL, &start, result, edited_imgs, summary);
+  free(order);
+  free_state(&state);
+  return result;
+}
+
+/**
+ * Process every image found walking a directory tree. The same stages as
+ * infoto_process_bulk run while the tree is walked, each image is read as
+ * soon as it is found. Edited images of earlier runs are left out. The
+ * edited image names and failures are reported in filename order.
+ *
+ * @param[in] handlers The image handlers, one per encode thread.
+ * @param[in] handlers_len The number of image handlers.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] root The directory to walk.
+ * @param[in] walk The walk options.
+ * @param[out] imgs The empty array every found image filename is added to,
+ * the failures in the summary point into it.
+ * @param[out] edited_imgs The array of every edited image filename.
+ * @param[out] summary The report of the run, NULL to not report.
+ * @returns INFOTO_SUCCESS if successful, otherwise the error of the first
+ * failed image in filename order.
+ */
+infoto_error_enum infoto_process_tree(struct infoto_img_handler *handlers,
+                                      int handlers_len,
+                                      const background_info background,
+                                      const font_info font,
+                                      const infoto_exif_plan *plan,
+                                      const infoto_process_options *opts,
+                                      const char *root,
+                                      const infoto_walk_options *walk,
+                                      string_array *imgs,
+                                      string_array *edited_imgs,
+                                      infoto_process_summary *summary) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (handlers_len <= 0) {
+    return INFOTO_ERR_NULL;
+  }
+  struct bulk_state state;
+  init_state(&state, &background, &font, plan, opts);
+  state.imgs = imgs;
+  state.found = imgs;
+  // the list is only ever filled by the walk
+  if (imgs->len > 0) {
+    free_state(&state);
+    return INFOTO_ERR_NULL;
+  }
+  // grows with the list while walking
+  state.results_cap = INITIAL_RESULTS_CAP;
+  state.results =
+      (struct bulk_result *)calloc(state.results_cap, sizeof(struct bulk_result));
+  if (state.results == NULL) {
+    free_state(&state);
+    return INFOTO_ERR_MALLOC;
+  }
+  infoto_error_enum result =
+      run_stages(&state, handlers, handlers_len, root, walk);
+  size_t *listing = (size_t *)malloc((imgs->len + 1) * sizeof(size_t));
+  if (listing != NULL) {
+    for (size_t i = 0; i < imgs->len; ++i) {
+      listing[i] = i;
+    }
+    qsort_r(listing, imgs->len, sizeof(size_t), compare_listing, imgs);
+  }
+  result = finish_bulk(&state, listing, &start, result, edited_imgs, summary);
+  free(listing);
+  free_state(&state);
+  return result;
+}
+
+/**
+ * Get the milliseconds from a time until now.
+ *
+ * @param[in,out] since The earlier time, set to now.
+ * @returns The milliseconds between the times.
+ */
+static double lap_ms(struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const double ms = (now.tv_sec - since->tv_sec) * 1e3 +
+                    (now.tv_nsec - since->tv_nsec) / 1e6;
+  *since = now;
+  return ms;
+}
+
+/**
+ * Caption an already read image and write it to the given file, timing each
+ * step. Used to serve single jobs on warm handlers.
+ *
+ * @param[in] handler The image handler.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] img The input image.
+ * @param[in] out_name The file to write the edited image to.
+ * @param[out] timings The time spent in each step.
+ * @param[out] stage The stage the job failed in.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_process_job(struct infoto_img_handler *handler,
+                                     const background_info background,
+                                     const font_info font,
+                                     const infoto_exif_plan *plan,
+                                     const infoto_process_options *opts,
+                                     const infoto_img_file *img,
+                                     const char *out_name,
+                                     infoto_process_timings *timings,
+                                     infoto_process_stage *stage) {
+  memset(timings, 0, sizeof(infoto_process_timings));
+  struct timespec lap;
+  clock_gettime(CLOCK_MONOTONIC, &lap);
+  *stage = INFOTO_STAGE_CAPTION;
+  info_text info;
+  infoto_error_enum result = infoto_info_text_init(&info, plan->len, " | ");
+  if (result != INFOTO_SUCCESS) {
+    return result;
+  }
+  result = read_caption(img, plan, opts, &info);
+  timings->caption_ms = lap_ms(&lap);
+  uint8_t *data = NULL;
+  size_t len = 0;
+  if (result == INFOTO_SUCCESS) {
+    *stage = INFOTO_STAGE_ENCODE;
+    result = handler->encode_image(handler, img, background, font, &info,
+                                   &data, &len);
+    timings->encode_ms = lap_ms(&lap);
+  }
+  if (result == INFOTO_SUCCESS) {
+    *stage = INFOTO_STAGE_WRITE;
+    result = write_file(out_name, data, len);
+    timings->write_ms = lap_ms(&lap);
+  }
+  free(data);
+  infoto_info_text_free(&info);
   return result;
 }
@@ -3,25 +3,244 @@
 
 #include "config.h"
 #include "error_codes.h"
+#include "exif.h"
+#include "exif_index.h"
 #include "img_utils.h"
+#include "journal.h"
+#include "output_cache.h"
 #include "str_utils.h"
+#include "walk.h"
+
+#include <stdint.h>
+#include <time.h>
 
 /**
- * Process a bulk of images with the given background and font info.
+ * Optional settings for processing images.
+ */
+typedef struct {
+  // persistent index of info text values, NULL to always read EXIF data
+  infoto_exif_index *index;
+  // bytes of images a bulk run holds in memory, 0 for the default
+  size_t max_in_flight;
+  // threads reading and threads writing images in a bulk run, 0 for 1
+  int io_jobs;
+  // journal of finished images, NULL to not record them
+  infoto_journal *journal;
+  // cache of edited images by input content, NULL to always encode
+  infoto_output_cache *output_cache;
+  // flag to skip images whose edited image is up to date in a bulk run
+  int incremental;
+  // modification time of the newest config, font or watermark file, edited
+  // images older than it are out of date
+  struct timespec settings_mtime;
+} infoto_process_options;
+
+/**
+ * The stages an image goes through in a bulk run.
+ */
+typedef enum {
+  INFOTO_STAGE_READ = 0,
+  INFOTO_STAGE_CAPTION,
+  INFOTO_STAGE_ENCODE,
+  INFOTO_STAGE_WRITE
+} infoto_process_stage;
+
+/**
+ * An image that failed in a bulk run.
+ */
+typedef struct {
+  // points into the input image filenames
+  const char *file;
+  infoto_process_stage stage;
+  infoto_error_enum code;
+} infoto_process_failure;
+
+generate_array_template(infoto_process_failure, infoto_process_failure);
+
+/**
+ * The outcome of an image of a bulk run.
+ */
+typedef struct {
+  // the input image, owned by the image list
+  const char *file;
+  // the edited image, owned by the edited image list, NULL unless it
+  // succeeded
+  const char *out;
+  infoto_process_stage stage;
+  infoto_error_enum code;
+  // flag for if the image was skipped
+  uint8_t skipped;
+  // flag for if the edited image came from the output cache
+  uint8_t cached;
+} infoto_process_outcome;
+
+generate_array_template(infoto_process_outcome, infoto_process_outcome);
+
+/**
+ * Time spent in each step of a single job, in milliseconds.
+ */
+typedef struct {
+  double caption_ms;
+  double encode_ms;
+  double write_ms;
+} infoto_process_timings;
+
+/**
+ * Report of a bulk run.
+ */
+typedef struct {
+  size_t succeeded;
+  size_t failed;
+  // succeeded images served from the output cache
+  size_t cached;
+  // images the journal had as finished or whose edited image is up to date
+  size_t skipped;
+  // bytes of input images read
+  uint64_t bytes_read;
+  // wall clock time of the run
+  double seconds;
+  // failed images in input order
+  infoto_process_failure_array failures;
+  // every image, in the same order as the failures
+  infoto_process_outcome_array outcomes;
+} infoto_process_summary;
+
+/**
+ * Get the name of a bulk stage.
+ *
+ * @param[in] stage The stage.
+ * @returns The name of the stage.
+ */
+const char *infoto_process_stage_to_str(infoto_process_stage stage);
+
+/**
+ * Initialize a bulk run summary.
+ *
+ * @param[out] summary The summary to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_process_summary_init(infoto_process_summary *summary);
+
+/**
+ * Free a bulk run summary.
+ *
+ * @param[in,out] summary The summary to free.
+ */
+void infoto_process_summary_free(infoto_process_summary *summary);
+
+/**
+ * Process a single image with the given background and font info.
  *
  * @param[in] handler The image handler.
  * @param[in] background The background info.
  * @param[in] font The font info.
- * @param[in] metadata The array of metadata info.
- * @param[in] imgs The array of image filenames.
- * @param[out] edited_imgs The array of edited image filenames.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] image_name The image filename.
+ * @param[out] edited_img The edited image filename.
  * @returns INFOTO_SUCCESS if successful, otherwise infoto_error_enum error.
  */
-infoto_error_enum infoto_process_bulk(struct infoto_img_handler *handler,
+infoto_error_enum infoto_process_image(struct infoto_img_handler *handler,
+                                       const background_info background,
+                                       const font_info font,
+                                       const infoto_exif_plan *plan,
+                                       const infoto_process_options *opts,
+                                       const char *image_name,
+                                       char **edited_img);
+
+/**
+ * Process a bulk of images with the given background and font info.
+ * The work runs as stages connected by bounded queues, so disk and codec
+ * work overlap: read threads load the images' bytes (largest first), one
+ * caption and one encode thread per handler build the captions and
+ * composite and encode into memory, and write threads write the edited
+ * images. Read threads wait while the images held in memory exceed the in
+ * flight budget. Handlers must not share state. The edited image names are
+ * stored in input order. A failed image is recorded and the run goes on
+ * with the others. Images the journal has as finished, and in incremental
+ * mode images whose edited image is newer than them and the settings, are
+ * skipped without being read. Written images are appended to the journal.
+ * With an output cache read threads hash each image's bytes, cached images
+ * go straight to the write threads and new edited images are stored.
+ *
+ * @param[in] handlers The image handlers, one per encode thread.
+ * @param[in] handlers_len The number of image handlers.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] imgs The array of image filenames.
+ * @param[out] edited_imgs The array of every edited image filename.
+ * @param[out] summary The report of the run, NULL to not report.
+ * @returns INFOTO_SUCCESS if successful, otherwise the error of the first
+ * failed image in input order.
+ */
+infoto_error_enum infoto_process_bulk(struct infoto_img_handler *handlers,
+                                      int handlers_len,
                                       const background_info background,
                                       const font_info font,
-                                      const metadata_array *metadata,
+                                      const infoto_exif_plan *plan,
+                                      const infoto_process_options *opts,
                                       const string_array *imgs,
-                                      string_array *edited_imgs);
+                                      string_array *edited_imgs,
+                                      infoto_process_summary *summary);
+
+/**
+ * Process every image found walking a directory tree. The same stages as
+ * infoto_process_bulk run while the tree is walked, each image is read as
+ * soon as it is found. Edited images of earlier runs are left out. The
+ * edited image names and failures are reported in filename order.
+ *
+ * @param[in] handlers The image handlers, one per encode thread.
+ * @param[in] handlers_len The number of image handlers.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] root The directory to walk.
+ * @param[in] walk The walk options.
+ * @param[out] imgs The empty array every found image filename is added to,
+ * the failures in the summary point into it.
+ * @param[out] edited_imgs The array of every edited image filename.
+ * @param[out] summary The report of the run, NULL to not report.
+ * @returns INFOTO_SUCCESS if successful, otherwise the error of the first
+ * failed image in filename order.
+ */
+infoto_error_enum infoto_process_tree(struct infoto_img_handler *handlers,
+                                      int handlers_len,
+                                      const background_info background,
+                                      const font_info font,
+                                      const infoto_exif_plan *plan,
+                                      const infoto_process_options *opts,
+                                      const char *root,
+                                      const infoto_walk_options *walk,
+                                      string_array *imgs,
+                                      string_array *edited_imgs,
+                                      infoto_process_summary *summary);
+
+/**
+ * Caption an already read image and write it to the given file, timing each
+ * step. Used to serve single jobs on warm handlers.
+ *
+ * @param[in] handler The image handler.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] opts The process options, NULL for defaults.
+ * @param[in] img The input image.
+ * @param[in] out_name The file to write the edited image to.
+ * @param[out] timings The time spent in each step.
+ * @param[out] stage The stage the job failed in.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_process_job(struct infoto_img_handler *handler,
+                                     const background_info background,
+                                     const font_info font,
+                                     const infoto_exif_plan *plan,
+                                     const infoto_process_options *opts,
+                                     const infoto_img_file *img,
+                                     const char *out_name,
+                                     infoto_process_timings *timings,
+                                     infoto_process_stage *stage);
 
 #endif
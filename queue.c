@@ -0,0 +1,114 @@
+#include "queue.h"
+
+#include <stdlib.h>
+
+/**
+ * Initialize a queue.
+ *
+ * @param[out] queue The queue to initialize.
+ * @param[in] cap The max number of items in the queue.
+ * @param[in] producers The number of threads pushing to the queue.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_queue_init(infoto_queue *queue, size_t cap,
+                                    int producers) {
+  queue->items = (void **)malloc(cap * sizeof(void *));
+  if (queue->items == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  queue->cap = cap;
+  queue->head = 0;
+  queue->len = 0;
+  queue->producers = producers;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Push an item, waiting for room.
+ *
+ * @param[in,out] queue The queue.
+ * @param[in] item The item.
+ */
+void infoto_queue_push(infoto_queue *queue, void *item) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->len == queue->cap) {
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+  queue->items[(queue->head + queue->len) % queue->cap] = item;
+  ++queue->len;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Push an item if there is room, without waiting.
+ *
+ * @param[in,out] queue The queue.
+ * @param[in] item The item.
+ * @returns 1 if the item was pushed, 0 if the queue is full.
+ */
+int infoto_queue_try_push(infoto_queue *queue, void *item) {
+  pthread_mutex_lock(&queue->lock);
+  const int pushed = queue->len < queue->cap;
+  if (pushed) {
+    queue->items[(queue->head + queue->len) % queue->cap] = item;
+    ++queue->len;
+    pthread_cond_signal(&queue->not_empty);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return pushed;
+}
+
+/**
+ * Pop the oldest item, waiting for one.
+ *
+ * @param[in,out] queue The queue.
+ * @param[out] item The item.
+ * @returns 1 if an item was popped, 0 if the queue is closed and drained.
+ */
+int infoto_queue_pop(infoto_queue *queue, void **item) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->len == 0 && queue->producers > 0) {
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  if (queue->len == 0) {
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+  *item = queue->items[queue->head];
+  queue->head = (queue->head + 1) % queue->cap;
+  --queue->len;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+  return 1;
+}
+
+/**
+ * Mark one producer as done, the last one closes the queue.
+ *
+ * @param[in,out] queue The queue.
+ */
+void infoto_queue_producer_done(infoto_queue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  if (--queue->producers == 0) {
+    // wake every consumer so they see the queue is closed
+    pthread_cond_broadcast(&queue->not_empty);
+  }
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Free the queue.
+ *
+ * @param[in,out] queue The queue.
+ */
+void infoto_queue_free(infoto_queue *queue) {
+  pthread_cond_destroy(&queue->not_full);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->items);
+  queue->items = NULL;
+}
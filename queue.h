@@ -0,0 +1,77 @@
+#ifndef INFOTO_QUEUE_H
+#define INFOTO_QUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "error_codes.h"
+
+/**
+ * Bounded ring buffer of pointers connecting two groups of threads.
+ * Pushing blocks while the queue is full, popping blocks while it is empty.
+ * The queue closes once every producer is done and it is drained.
+ */
+typedef struct {
+  void **items;
+  size_t cap;
+  size_t head;
+  size_t len;
+  // producers that have not called infoto_queue_producer_done yet
+  int producers;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} infoto_queue;
+
+/**
+ * Initialize a queue.
+ *
+ * @param[out] queue The queue to initialize.
+ * @param[in] cap The max number of items in the queue.
+ * @param[in] producers The number of threads pushing to the queue.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_queue_init(infoto_queue *queue, size_t cap,
+                                    int producers);
+
+/**
+ * Push an item, waiting for room.
+ *
+ * @param[in,out] queue The queue.
+ * @param[in] item The item.
+ */
+void infoto_queue_push(infoto_queue *queue, void *item);
+
+/**
+ * Push an item if there is room, without waiting.
+ *
+ * @param[in,out] queue The queue.
+ * @param[in] item The item.
+ * @returns 1 if the item was pushed, 0 if the queue is full.
+ */
+int infoto_queue_try_push(infoto_queue *queue, void *item);
+
+/**
+ * Pop the oldest item, waiting for one.
+ *
+ * @param[in,out] queue The queue.
+ * @param[out] item The item.
+ * @returns 1 if an item was popped, 0 if the queue is closed and drained.
+ */
+int infoto_queue_pop(infoto_queue *queue, void **item);
+
+/**
+ * Mark one producer as done, the last one closes the queue.
+ *
+ * @param[in,out] queue The queue.
+ */
+void infoto_queue_producer_done(infoto_queue *queue);
+
+/**
+ * Free the queue.
+ *
+ * @param[in,out] queue The queue.
+ */
+void infoto_queue_free(infoto_queue *queue);
+
+#endif
@@ -0,0 +1,289 @@
+#include "row_pipeline.h"
+#include "fill.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Initialize a pipeline.
+ *
+ * @param[out] pipeline The pipeline to initialize.
+ */
+void infoto_row_pipeline_init(infoto_row_pipeline *pipeline) {
+  memset(pipeline, 0, sizeof(infoto_row_pipeline));
+}
+
+/**
+ * Set the margins added around the source image.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in] top The top margin in pixels.
+ * @param[in] bottom The bottom margin in pixels.
+ * @param[in] left The left margin in pixels.
+ * @param[in] right The right margin in pixels.
+ */
+void infoto_row_pipeline_set_margins(infoto_row_pipeline *pipeline, int top,
+                                     int bottom, int left, int right) {
+  pipeline->top = top;
+  pipeline->bottom = bottom;
+  pipeline->left = left;
+  pipeline->right = right;
+}
+
+/**
+ * Append a stage, stages run in the order they were added.
+ * Every stage is removed with infoto_row_pipeline_clear_stages.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in] stage The stage.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_row_pipeline_add_stage(infoto_row_pipeline *pipeline,
+                                                infoto_row_stage stage) {
+  if (pipeline->stages_len >= INFOTO_ROW_PIPELINE_MAX_STAGES) {
+    fprintf(stderr, "too many row pipeline stages.\n");
+    return INFOTO_ERR_IMG_WRITER;
+  }
+  pipeline->stages[pipeline->stages_len++] = stage;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Remove every stage, keeping the batch buffer for the next image.
+ *
+ * @param[in,out] pipeline The pipeline.
+ */
+void infoto_row_pipeline_clear_stages(infoto_row_pipeline *pipeline) {
+  pipeline->stages_len = 0;
+}
+
+/**
+ * Make sure the batch buffer fits a batch of rows of the given size.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in] row_size The size of a row in bytes.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum reserve_buffer(infoto_row_pipeline *pipeline,
+                                        size_t row_size) {
+  const size_t len = row_size * INFOTO_ROW_PIPELINE_BATCH_ROWS;
+  if (pipeline->buffer_cap < len) {
+    uint8_t *tmp = (uint8_t *)realloc(pipeline->buffer, len);
+    if (tmp == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    pipeline->buffer = tmp;
+    pipeline->buffer_cap = len;
+  }
+  for (int i = 0; i < INFOTO_ROW_PIPELINE_BATCH_ROWS; ++i) {
+    pipeline->owned[i] = &pipeline->buffer[i * row_size];
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Stream the rows of one region through the stages into the sink.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in] source The source image.
+ * @param[in] sink The output image.
+ * @param[in] region The region.
+ * @param[in] rows The number of rows in the region.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum run_region(infoto_row_pipeline *pipeline,
+                                    const infoto_row_source *source,
+                                    const infoto_row_sink *sink,
+                                    infoto_row_region region, int rows) {
+  infoto_row_batch batch;
+  batch.rows = pipeline->rows;
+  batch.shared = pipeline->shared;
+  batch.owned = pipeline->owned;
+  batch.region = region;
+  batch.width = source->width + pipeline->left + pipeline->right;
+  batch.num_components = source->num_components;
+  batch.left = pipeline->left;
+  batch.right = pipeline->right;
+  const size_t offset = (size_t)pipeline->left * source->num_components;
+  for (int y = 0; y < rows;) {
+    int count = rows - y < INFOTO_ROW_PIPELINE_BATCH_ROWS
+                    ? rows - y
+                    : INFOTO_ROW_PIPELINE_BATCH_ROWS;
+    // a previous batch may have pointed rows at a shared strip
+    for (int i = 0; i < count; ++i) {
+      pipeline->rows[i] = pipeline->owned[i];
+      pipeline->shared[i] = 0;
+    }
+    if (region == INFOTO_ROW_REGION_BODY) {
+      int read = 0;
+      infoto_error_enum err_code =
+          source->read_rows(source->ctx, pipeline->rows, count, offset, &read);
+      if (err_code != INFOTO_SUCCESS) {
+        return err_code;
+      }
+      if (read <= 0) {
+        fprintf(stderr, "source image ended early.\n");
+        return INFOTO_ERR_IMG_READ;
+      }
+      count = read;
+    }
+    batch.count = count;
+    batch.y = y;
+    for (int s = 0; s < pipeline->stages_len; ++s) {
+      infoto_error_enum err_code =
+          pipeline->stages[s].process(pipeline->stages[s].ctx, &batch);
+      if (err_code != INFOTO_SUCCESS) {
+        return err_code;
+      }
+    }
+    infoto_error_enum err_code =
+        sink->write_rows(sink->ctx, pipeline->rows, count);
+    if (err_code != INFOTO_SUCCESS) {
+      return err_code;
+    }
+    y += count;
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Stream every row of the output image from the source to the sink.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in] source The source image.
+ * @param[in] sink The output image.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_row_pipeline_run(infoto_row_pipeline *pipeline,
+                                          const infoto_row_source *source,
+                                          const infoto_row_sink *sink) {
+  const size_t row_size =
+      (size_t)(source->width + pipeline->left + pipeline->right) *
+      source->num_components;
+  infoto_error_enum err_code = reserve_buffer(pipeline, row_size);
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = run_region(pipeline, source, sink, INFOTO_ROW_REGION_TOP,
+                          pipeline->top);
+  }
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = run_region(pipeline, source, sink, INFOTO_ROW_REGION_BODY,
+                          source->height);
+  }
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = run_region(pipeline, source, sink, INFOTO_ROW_REGION_BOTTOM,
+                          pipeline->bottom);
+  }
+  return err_code;
+}
+
+/**
+ * Free the pipeline's batch buffer.
+ *
+ * @param[in,out] pipeline The pipeline.
+ */
+void infoto_row_pipeline_free(infoto_row_pipeline *pipeline) {
+  free(pipeline->buffer);
+  infoto_row_pipeline_init(pipeline);
+}
+
+/**
+ * Make a row of the batch writable, copying a shared row into the
+ * pipeline's own buffer.
+ *
+ * @param[in,out] batch The batch.
+ * @param[in] i The index of the row.
+ * @returns The writable row.
+ */
+uint8_t *infoto_row_batch_own_row(infoto_row_batch *batch, int i) {
+  if (batch->shared[i]) {
+    memcpy(batch->owned[i], batch->rows[i],
+           (size_t)batch->width * batch->num_components);
+    batch->rows[i] = batch->owned[i];
+    batch->shared[i] = 0;
+  }
+  return batch->rows[i];
+}
+
+/**
+ * Point the batch's rows at the matching rows of a strip.
+ *
+ * @param[in,out] batch The batch.
+ * @param[in] strip The strip.
+ */
+static void point_rows_at_strip(infoto_row_batch *batch,
+                                const uint8_t *strip) {
+  const size_t row_size = (size_t)batch->width * batch->num_components;
+  for (int i = 0; i < batch->count; ++i) {
+    // the sink only reads, stages copy before writing
+    batch->rows[i] = (uint8_t *)&strip[(batch->y + i) * row_size];
+    batch->shared[i] = 1;
+  }
+}
+
+/**
+ * Fill the margins with a plain background.
+ *
+ * @param[in] ctx The infoto_border_stage.
+ * @param[in,out] batch The batch.
+ * @returns INFOTO_SUCCESS.
+ */
+static infoto_error_enum border_stage_process(void *ctx,
+                                              infoto_row_batch *batch) {
+  const infoto_border_stage *border = (const infoto_border_stage *)ctx;
+  if (batch->region != INFOTO_ROW_REGION_BODY) {
+    point_rows_at_strip(batch, border->strip);
+    return INFOTO_SUCCESS;
+  }
+  const int nc = batch->num_components;
+  const size_t right_start = (size_t)(batch->width - batch->right) * nc;
+  for (int i = 0; i < batch->count; ++i) {
+    uint8_t *row = infoto_row_batch_own_row(batch, i);
+    infoto_fill_pixels(row, batch->left, nc, border->color);
+    infoto_fill_pixels(&row[right_start], batch->right, nc, border->color);
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Point the bottom margin rows at the caption strip.
+ *
+ * @param[in] ctx The infoto_caption_stage.
+ * @param[in,out] batch The batch.
+ * @returns INFOTO_SUCCESS.
+ */
+static infoto_error_enum caption_stage_process(void *ctx,
+                                               infoto_row_batch *batch) {
+  const infoto_caption_stage *caption = (const infoto_caption_stage *)ctx;
+  if (batch->region == INFOTO_ROW_REGION_BOTTOM) {
+    point_rows_at_strip(batch, caption->strip);
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Get a stage that fills the margins with a plain background.
+ * Top and bottom rows point into the strip, side margins are filled.
+ *
+ * @param[in] border The border stage's data, must outlive the run.
+ * @returns The stage.
+ */
+infoto_row_stage infoto_border_stage_get(const infoto_border_stage *border) {
+  infoto_row_stage stage;
+  stage.ctx = (void *)border;
+  stage.process = border_stage_process;
+  return stage;
+}
+
+/**
+ * Get a stage that points the bottom margin rows at the caption strip.
+ *
+ * @param[in] caption The caption stage's data, must outlive the run.
+ * @returns The stage.
+ */
+infoto_row_stage infoto_caption_stage_get(const infoto_caption_stage *caption) {
+  infoto_row_stage stage;
+  stage.ctx = (void *)caption;
+  stage.process = caption_stage_process;
+  return stage;
+}
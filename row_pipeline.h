@@ -0,0 +1,204 @@
+#ifndef INFOTO_ROW_PIPELINE_H
+#define INFOTO_ROW_PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error_codes.h"
+
+/* Max number of stages in a pipeline */
+#define INFOTO_ROW_PIPELINE_MAX_STAGES 8
+/* Rows moved through the pipeline per batch */
+#define INFOTO_ROW_PIPELINE_BATCH_ROWS 16
+
+/**
+ * The part of the output image a batch of rows belongs to.
+ */
+typedef enum {
+  INFOTO_ROW_REGION_TOP,
+  INFOTO_ROW_REGION_BODY,
+  INFOTO_ROW_REGION_BOTTOM
+} infoto_row_region;
+
+/**
+ * A batch of output rows passed from the source through every stage to the
+ * sink. Batches never span two regions.
+ */
+typedef struct {
+  // the rows, output width * num_components bytes each
+  uint8_t **rows;
+  // flag per row for if it points at memory a stage shares with other
+  // batches (a cached strip) instead of the pipeline's own buffer
+  uint8_t *shared;
+  // the pipeline's own buffer for each row
+  uint8_t **owned;
+  int count;
+  infoto_row_region region;
+  // index of the first row within its region
+  int y;
+  // output width in pixels
+  int width;
+  int num_components;
+  // side margins in pixels, body rows hold the source image between them
+  int left;
+  int right;
+} infoto_row_batch;
+
+/**
+ * Decoder of the source image's rows.
+ */
+typedef struct {
+  void *ctx;
+  // source image size
+  int width;
+  int height;
+  int num_components;
+  // decode up to count rows, each into rows[i] + offset. read is set to the
+  // number of rows decoded.
+  infoto_error_enum (*read_rows)(void *ctx, uint8_t **rows, int count,
+                                 size_t offset, int *read);
+} infoto_row_source;
+
+/**
+ * A step that edits or replaces the rows of each batch.
+ * A stage may write to rows that are not shared, or point rows at memory it
+ * owns (marking them shared) that stays valid until the image is written.
+ * A stage that writes to a shared row must own it first with
+ * infoto_row_batch_own_row.
+ */
+typedef struct {
+  void *ctx;
+  infoto_error_enum (*process)(void *ctx, infoto_row_batch *batch);
+} infoto_row_stage;
+
+/**
+ * Encoder of the output image's rows. Rows are only read.
+ */
+typedef struct {
+  void *ctx;
+  infoto_error_enum (*write_rows)(void *ctx, uint8_t **rows, int count);
+} infoto_row_sink;
+
+/**
+ * Streams a source image through stages into a sink in reusable row batches.
+ * The output is the source surrounded by margins, decoded straight into the
+ * batch rows so the body is never copied.
+ */
+typedef struct {
+  infoto_row_stage stages[INFOTO_ROW_PIPELINE_MAX_STAGES];
+  int stages_len;
+  // margins around the source image in pixels
+  int top;
+  int bottom;
+  int left;
+  int right;
+  // batch buffer, reused across images
+  uint8_t *buffer;
+  size_t buffer_cap;
+  uint8_t *rows[INFOTO_ROW_PIPELINE_BATCH_ROWS];
+  uint8_t *owned[INFOTO_ROW_PIPELINE_BATCH_ROWS];
+  uint8_t shared[INFOTO_ROW_PIPELINE_BATCH_ROWS];
+} infoto_row_pipeline;
+
+/**
+ * Plain background margins, from a filled background strip.
+ */
+typedef struct {
+  // a strip of at least max(top, bottom) rows of the output width
+  const uint8_t *strip;
+  // the color's components for the side margins
+  uint8_t color[4];
+} infoto_border_stage;
+
+/**
+ * Caption rows, from a rendered caption strip.
+ */
+typedef struct {
+  // a strip of bottom margin rows of the output width
+  const uint8_t *strip;
+} infoto_caption_stage;
+
+/**
+ * Initialize a pipeline.
+ *
+ * @param[out] pipeline The pipeline to initialize.
+ */
+void infoto_row_pipeline_init(infoto_row_pipeline *pipeline);
+
+/**
+ * Set the margins added around the source image.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in] top The top margin in pixels.
+ * @param[in] bottom The bottom margin in pixels.
+ * @param[in] left The left margin in pixels.
+ * @param[in] right The right margin in pixels.
+ */
+void infoto_row_pipeline_set_margins(infoto_row_pipeline *pipeline, int top,
+                                     int bottom, int left, int right);
+
+/**
+ * Append a stage, stages run in the order they were added.
+ * Every stage is removed with infoto_row_pipeline_clear_stages.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in] stage The stage.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_row_pipeline_add_stage(infoto_row_pipeline *pipeline,
+                                                infoto_row_stage stage);
+
+/**
+ * Remove every stage, keeping the batch buffer for the next image.
+ *
+ * @param[in,out] pipeline The pipeline.
+ */
+void infoto_row_pipeline_clear_stages(infoto_row_pipeline *pipeline);
+
+/**
+ * Stream every row of the output image from the source to the sink.
+ *
+ * @param[in,out] pipeline The pipeline.
+ * @param[in] source The source image.
+ * @param[in] sink The output image.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_row_pipeline_run(infoto_row_pipeline *pipeline,
+                                          const infoto_row_source *source,
+                                          const infoto_row_sink *sink);
+
+/**
+ * Free the pipeline's batch buffer.
+ *
+ * @param[in,out] pipeline The pipeline.
+ */
+void infoto_row_pipeline_free(infoto_row_pipeline *pipeline);
+
+/**
+ * Make a row of the batch writable, copying a shared row into the
+ * pipeline's own buffer.
+ *
+ * @param[in,out] batch The batch.
+ * @param[in] i The index of the row.
+ * @returns The writable row.
+ */
+uint8_t *infoto_row_batch_own_row(infoto_row_batch *batch, int i);
+
+/**
+ * Get a stage that fills the margins with a plain background.
+ * Top and bottom rows point into the strip, side margins are filled.
+ *
+ * @param[in] border The border stage's data, must outlive the run.
+ * @returns The stage.
+ */
+infoto_row_stage infoto_border_stage_get(const infoto_border_stage *border);
+
+/**
+ * Get a stage that points the bottom margin rows at the caption strip.
+ *
+ * @param[in] caption The caption stage's data, must outlive the run.
+ * @returns The stage.
+ */
+infoto_row_stage infoto_caption_stage_get(const infoto_caption_stage *caption);
+
+#endif
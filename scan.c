@@ -0,0 +1,414 @@
+#include "scan.h"
+#include "exif.h"
+#include "file_util.h"
+#include "img_file.h"
+#include "str_utils.h"
+#include "walk.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libexif/exif-ifd.h>
+
+#define INFOTO_SCAN_NDJSON_NAME "ndjson"
+#define INFOTO_SCAN_CSV_NAME "csv"
+
+/* number of possible tag values per IFD */
+#define TAG_SPACE 0x10000
+/* flush a worker's rows once it holds this many bytes */
+#define ROW_FLUSH_SIZE (64 * 1024)
+
+/**
+ * Simple growable buffer to collect output rows.
+ */
+struct row_buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+/**
+ * State shared by all scan workers.
+ */
+struct scan_state {
+  const infoto_scan_options *opts;
+  const string_array *files;
+  atomic_size_t next;
+  pthread_mutex_t out_lock;
+};
+
+/**
+ * State owned by a single scan worker.
+ */
+struct scan_worker {
+  struct scan_state *state;
+  pthread_t thread;
+  struct row_buffer rows;
+  // number of files each [ifd][tag] was found in
+  uint32_t *coverage;
+  size_t files_with_exif;
+};
+
+/**
+ * Get the scan format from the given string.
+ *
+ * @param[in] s Name of the format ("ndjson" or "csv").
+ * @param[out] format The format to populate.
+ * @returns 1 if the name was resolved, 0 otherwise.
+ */
+int infoto_scan_format_from_string(const char *s, infoto_scan_format *format) {
+  if (strcmp(INFOTO_SCAN_NDJSON_NAME, s) == 0) {
+    *format = INFOTO_SCAN_NDJSON;
+    return 1;
+  }
+  if (strcmp(INFOTO_SCAN_CSV_NAME, s) == 0) {
+    *format = INFOTO_SCAN_CSV;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Ensure the row buffer can hold n more bytes.
+ *
+ * @param[in,out] buf The row buffer.
+ * @param[in] n The number of bytes to make room for.
+ * @returns 1 if successful, 0 if allocation failed.
+ */
+static int row_reserve(struct row_buffer *buf, size_t n) {
+  if (buf->len + n <= buf->cap) {
+    return 1;
+  }
+  size_t cap = buf->cap == 0 ? ROW_FLUSH_SIZE : buf->cap;
+  while (cap < buf->len + n) {
+    cap *= 2;
+  }
+  char *tmp = (char *)realloc(buf->data, cap);
+  if (tmp == NULL) {
+    return 0;
+  }
+  buf->data = tmp;
+  buf->cap = cap;
+  return 1;
+}
+
+/**
+ * Append raw bytes to the row buffer.
+ *
+ * @param[in,out] buf The row buffer.
+ * @param[in] s The bytes to append.
+ * @param[in] n The number of bytes.
+ */
+static void row_append(struct row_buffer *buf, const char *s, size_t n) {
+  if (!row_reserve(buf, n)) {
+    return;
+  }
+  memcpy(&buf->data[buf->len], s, n);
+  buf->len += n;
+}
+
+/**
+ * Append a null terminated string to the row buffer.
+ *
+ * @param[in,out] buf The row buffer.
+ * @param[in] s The string to append.
+ */
+static void row_append_str(struct row_buffer *buf, const char *s) {
+  row_append(buf, s, strlen(s));
+}
+
+/**
+ * Append a string to the row buffer with JSON string escaping.
+ *
+ * @param[in,out] buf The row buffer.
+ * @param[in] s The string to append.
+ */
+static void row_append_json_str(struct row_buffer *buf, const char *s) {
+  row_append_str(buf, "\"");
+  for (; *s != '\0'; ++s) {
+    const unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      char esc[2] = {'\\', c};
+      row_append(buf, esc, 2);
+    } else if (c < 0x20) {
+      char esc[7];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      row_append(buf, esc, 6);
+    } else {
+      row_append(buf, (const char *)&c, 1);
+    }
+  }
+  row_append_str(buf, "\"");
+}
+
+/**
+ * Append a string to the row buffer as a CSV field.
+ *
+ * @param[in,out] buf The row buffer.
+ * @param[in] s The string to append.
+ */
+static void row_append_csv_str(struct row_buffer *buf, const char *s) {
+  if (strpbrk(s, ",\"\r\n") == NULL) {
+    row_append_str(buf, s);
+    return;
+  }
+  row_append_str(buf, "\"");
+  for (; *s != '\0'; ++s) {
+    if (*s == '"') {
+      row_append_str(buf, "\"");
+    }
+    row_append(buf, s, 1);
+  }
+  row_append_str(buf, "\"");
+}
+
+/**
+ * Append one file -> tag -> value row.
+ *
+ * @param[in,out] buf The row buffer.
+ * @param[in] format The output format.
+ * @param[in] file The file name.
+ * @param[in] info The tag info.
+ */
+static void append_tag_row(struct row_buffer *buf, infoto_scan_format format,
+                           const char *file, const infoto_exif_tag_info *info) {
+  const char *ifd = exif_ifd_get_name(info->ifd);
+  const char *name = info->name != NULL ? info->name : "unknown";
+  if (format == INFOTO_SCAN_NDJSON) {
+    row_append_str(buf, "{\"type\":\"tag\",\"file\":");
+    row_append_json_str(buf, file);
+    row_append_str(buf, ",\"ifd\":");
+    row_append_json_str(buf, ifd);
+    row_append_str(buf, ",\"tag\":");
+    row_append_json_str(buf, name);
+    row_append_str(buf, ",\"value\":");
+    row_append_json_str(buf, info->str_value);
+    row_append_str(buf, "}\n");
+  } else {
+    row_append_str(buf, "tag,");
+    row_append_csv_str(buf, file);
+    row_append_str(buf, ",");
+    row_append_csv_str(buf, ifd);
+    row_append_str(buf, ",");
+    row_append_csv_str(buf, name);
+    row_append_str(buf, ",");
+    row_append_csv_str(buf, info->str_value);
+    row_append_str(buf, "\n");
+  }
+}
+
+/**
+ * Write out the worker's buffered rows.
+ *
+ * @param[in,out] worker The scan worker.
+ */
+static void flush_rows(struct scan_worker *worker) {
+  if (worker->rows.len == 0) {
+    return;
+  }
+  pthread_mutex_lock(&worker->state->out_lock);
+  fwrite(worker->rows.data, 1, worker->rows.len, worker->state->opts->out);
+  pthread_mutex_unlock(&worker->state->out_lock);
+  worker->rows.len = 0;
+}
+
+/**
+ * Scan a single file and record its rows and tag coverage.
+ *
+ * @param[in,out] worker The scan worker.
+ * @param[in] file_name The file to scan.
+ */
+static void scan_file(struct scan_worker *worker, const char *file_name) {
+  infoto_img_file img;
+  if (infoto_img_file_open_metadata(file_name, &img) != INFOTO_SUCCESS) {
+    return;
+  }
+  infoto_exif_tag_info_array tags;
+  if (infoto_read_all_exif_tags(&img, &tags) == INFOTO_SUCCESS) {
+    ++worker->files_with_exif;
+    for (size_t i = 0; i < tags.len; ++i) {
+      const infoto_exif_tag_info *info = &tags.infoto_exif_tag_info_data[i];
+      append_tag_row(&worker->rows, worker->state->opts->format, file_name,
+                     info);
+      ++worker->coverage[(info->ifd * TAG_SPACE) +
+                         (info->value & (TAG_SPACE - 1))];
+    }
+    free_infoto_exif_tag_info_array(&tags);
+  }
+  infoto_img_file_close(&img);
+  if (worker->rows.len >= ROW_FLUSH_SIZE) {
+    flush_rows(worker);
+  }
+}
+
+/**
+ * Scan worker thread, pulls files off the shared index until none are left.
+ *
+ * @param[in,out] arg The scan worker.
+ * @returns NULL
+ */
+static void *scan_worker_run(void *arg) {
+  struct scan_worker *worker = (struct scan_worker *)arg;
+  struct scan_state *state = worker->state;
+  for (;;) {
+    size_t idx = atomic_fetch_add(&state->next, 1);
+    if (idx >= state->files->len) {
+      break;
+    }
+    scan_file(worker, state->files->string_data[idx]);
+  }
+  flush_rows(worker);
+  return NULL;
+}
+
+/**
+ * Write the tag coverage aggregate.
+ *
+ * @param[in] opts The scan options.
+ * @param[in] coverage The merged [ifd][tag] file counts.
+ * @param[in] total The number of files scanned.
+ */
+static void write_coverage(const infoto_scan_options *opts,
+                           const uint32_t *coverage, size_t total) {
+  struct row_buffer buf = {NULL, 0, 0};
+  char num[64];
+  for (int ifd = EXIF_IFD_0; ifd < EXIF_IFD_COUNT; ++ifd) {
+    for (int tag = 0; tag < TAG_SPACE; ++tag) {
+      const uint32_t count = coverage[(ifd * TAG_SPACE) + tag];
+      if (count == 0) {
+        continue;
+      }
+      const char *name = exif_tag_get_name_in_ifd((ExifTag)tag, (ExifIfd)ifd);
+      if (name == NULL) {
+        name = "unknown";
+      }
+      const char *ifd_name = exif_ifd_get_name((ExifIfd)ifd);
+      if (opts->format == INFOTO_SCAN_NDJSON) {
+        row_append_str(&buf, "{\"type\":\"coverage\",\"ifd\":");
+        row_append_json_str(&buf, ifd_name);
+        row_append_str(&buf, ",\"tag\":");
+        row_append_json_str(&buf, name);
+        int n = snprintf(num, sizeof(num),
+                         ",\"files\":%u,\"total\":%zu,\"coverage\":%.4f}\n",
+                         count, total, total ? (double)count / total : 0.0);
+        row_append(&buf, num, n);
+      } else {
+        row_append_str(&buf, "coverage,,");
+        row_append_csv_str(&buf, ifd_name);
+        row_append_str(&buf, ",");
+        row_append_csv_str(&buf, name);
+        int n = snprintf(num, sizeof(num), ",%u/%zu\n", count, total);
+        row_append(&buf, num, n);
+      }
+    }
+  }
+  fwrite(buf.data, 1, buf.len, opts->out);
+  free(buf.data);
+}
+
+/**
+ * Scan every file under the given directory for EXIF tags.
+ * Only the EXIF segment of each file is read, pixel data is never decoded.
+ * A row is written for every file, tag and value, followed by the tag
+ * coverage across all scanned files.
+ *
+ * @param[in] root The directory (or single file) to scan.
+ * @param[in] opts The scan options.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_scan_tree(const char *root,
+                                   const infoto_scan_options *opts) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  string_array files;
+  if (!init_string_array(&files, 1)) {
+    return INFOTO_ERR_MALLOC;
+  }
+  if (is_dir(root)) {
+    infoto_walk_options walk_opts;
+    infoto_walk_options_init(&walk_opts);
+    if (infoto_walk_collect(root, &walk_opts, &files) != INFOTO_SUCCESS) {
+      fprintf(stderr, "reading files from directory failed: %s\n", root);
+    }
+  } else {
+    insert_string_array(&files, strdup(root));
+  }
+  int jobs = opts->jobs;
+  if (jobs <= 0) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (jobs <= 0) {
+    jobs = 1;
+  }
+  if (jobs > files.len && files.len > 0) {
+    jobs = files.len;
+  }
+  struct scan_state state;
+  state.opts = opts;
+  state.files = &files;
+  atomic_init(&state.next, 0);
+  pthread_mutex_init(&state.out_lock, NULL);
+  if (opts->format == INFOTO_SCAN_CSV) {
+    fputs("type,file,ifd,tag,value\n", opts->out);
+  }
+
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  struct scan_worker *workers =
+      (struct scan_worker *)calloc(jobs, sizeof(struct scan_worker));
+  if (workers == NULL) {
+    err_code = INFOTO_ERR_MALLOC;
+  }
+  int started = 0;
+  for (; err_code == INFOTO_SUCCESS && started < jobs; ++started) {
+    struct scan_worker *worker = &workers[started];
+    worker->state = &state;
+    worker->coverage =
+        (uint32_t *)calloc(EXIF_IFD_COUNT * TAG_SPACE, sizeof(uint32_t));
+    if (worker->coverage == NULL) {
+      err_code = INFOTO_ERR_MALLOC;
+      break;
+    }
+    if (pthread_create(&worker->thread, NULL, scan_worker_run, worker) != 0) {
+      free(worker->coverage);
+      err_code = INFOTO_ERR_MALLOC;
+      break;
+    }
+  }
+  size_t files_with_exif = 0;
+  for (int i = 0; i < started; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  // merge every worker's coverage into the first worker's table
+  for (int i = 0; i < started; ++i) {
+    files_with_exif += workers[i].files_with_exif;
+    if (i > 0) {
+      for (size_t j = 0; j < EXIF_IFD_COUNT * TAG_SPACE; ++j) {
+        workers[0].coverage[j] += workers[i].coverage[j];
+      }
+    }
+  }
+  if (err_code == INFOTO_SUCCESS && started > 0) {
+    write_coverage(opts, workers[0].coverage, files.len);
+  }
+  fflush(opts->out);
+  for (int i = 0; i < started; ++i) {
+    free(workers[i].coverage);
+    free(workers[i].rows.data);
+  }
+  free(workers);
+  pthread_mutex_destroy(&state.out_lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed =
+      (end.tv_sec - start.tv_sec) + ((end.tv_nsec - start.tv_nsec) / 1e9);
+  fprintf(stderr, "scanned %zu files (%zu with EXIF) in %.3fs using %d jobs\n",
+          files.len, files_with_exif, elapsed, jobs);
+  infoto_string_array_free_strs(&files);
+  free_string_array(&files);
+  return err_code;
+}
@@ -0,0 +1,47 @@
+#ifndef INFOTO_SCAN_H
+#define INFOTO_SCAN_H
+
+#include <stdio.h>
+
+#include "error_codes.h"
+
+/**
+ * Output formats for the EXIF scan.
+ */
+typedef enum { INFOTO_SCAN_NDJSON, INFOTO_SCAN_CSV } infoto_scan_format;
+
+/**
+ * Options for scanning a directory tree for EXIF tags.
+ */
+typedef struct {
+  // output format of the rows
+  infoto_scan_format format;
+  // number of worker threads, 0 uses the online CPU count
+  int jobs;
+  // stream to write rows to
+  FILE *out;
+} infoto_scan_options;
+
+/**
+ * Get the scan format from the given string.
+ *
+ * @param[in] s Name of the format ("ndjson" or "csv").
+ * @param[out] format The format to populate.
+ * @returns 1 if the name was resolved, 0 otherwise.
+ */
+int infoto_scan_format_from_string(const char *s, infoto_scan_format *format);
+
+/**
+ * Scan every file under the given directory for EXIF tags.
+ * Only the EXIF segment of each file is read, pixel data is never decoded.
+ * A row is written for every file, tag and value, followed by the tag
+ * coverage across all scanned files.
+ *
+ * @param[in] root The directory (or single file) to scan.
+ * @param[in] opts The scan options.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_scan_tree(const char *root,
+                                   const infoto_scan_options *opts);
+
+#endif
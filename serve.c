@@ -0,0 +1,628 @@
+#define _GNU_SOURCE
+
+#include "serve.h"
+#include "img_file.h"
+#include "queue.h"
+#include "str_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Connections waiting for a worker, per worker */
+#define QUEUE_ITEMS_PER_WORKER 4
+/* Connections the kernel holds before they are accepted */
+#define LISTEN_BACKLOG 64
+/* Descriptors held for requests of a connection */
+#define MAX_CONN_FDS 16
+
+#ifndef PATH_MAX
+    #define PATH_MAX 4096
+#endif
+
+/* Longest reply line */
+#define MAX_REPLY (PATH_MAX + 256)
+
+/**
+ * State shared by the listener and the workers.
+ */
+struct serve_state {
+  const background_info *background;
+  const font_info *font;
+  const infoto_exif_plan *plan;
+  const infoto_process_options *process_opts;
+  const infoto_serve_options *opts;
+  // accepted connections
+  infoto_queue conns;
+  // the read end turns readable once the server drains
+  int drain_pipe[2];
+  atomic_size_t succeeded;
+  atomic_size_t failed;
+};
+
+/**
+ * A worker thread, its handler and the connection it serves.
+ */
+struct serve_worker {
+  struct serve_state *state;
+  struct infoto_img_handler *handler;
+  pthread_t thread;
+  int fd;
+  // received bytes not yet handled
+  char buf[INFOTO_SERVE_MAX_LINE];
+  size_t len;
+  // received descriptors not yet used, oldest first
+  int fds[MAX_CONN_FDS];
+  size_t fds_len;
+};
+
+/**
+ * A request parsed from its line.
+ */
+struct serve_job {
+  const char *in;
+  const char *out;
+  int use_fd;
+  background_info background;
+  font_info font;
+};
+
+/**
+ * Initialize serve options with the defaults.
+ *
+ * @param[out] opts The options to initialize.
+ */
+void infoto_serve_options_init(infoto_serve_options *opts) {
+  opts->socket_mode = INFOTO_SERVE_DEFAULT_SOCKET_MODE;
+  opts->idle_timeout_ms = INFOTO_SERVE_DEFAULT_IDLE_TIMEOUT_MS;
+}
+
+/**
+ * Get the milliseconds from one time to another.
+ *
+ * @param[in] from The earlier time.
+ * @param[in] to The later time.
+ * @returns The milliseconds between the times.
+ */
+static double elapsed_ms(const struct timespec *from,
+                         const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e3 +
+         (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/**
+ * Send a whole reply line.
+ *
+ * @param[in] fd The connection.
+ * @param[in] line The line, with its newline.
+ * @param[in] len The number of bytes.
+ */
+static void send_reply(int fd, const char *line, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    // a client that went away must not kill the server with SIGPIPE
+    ssize_t n = send(fd, &line[pos], len - pos, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    pos += n;
+  }
+}
+
+/**
+ * Send an error reply.
+ *
+ * @param[in] fd The connection.
+ * @param[in] stage The stage the job failed in, or "request".
+ * @param[in] error The error code name or message.
+ */
+static void send_error(int fd, const char *stage, const char *error) {
+  char reply[MAX_REPLY];
+  int n = snprintf(reply, sizeof(reply), "error\t%s\t%s\n", stage, error);
+  if (n > 0) {
+    send_reply(fd, reply, (size_t)n < sizeof(reply) ? (size_t)n
+                                                    : sizeof(reply) - 1);
+  }
+}
+
+/**
+ * Parse a whole decimal number within a range.
+ *
+ * @param[in] value The text.
+ * @param[in] min The smallest value accepted.
+ * @param[in] max The largest value accepted.
+ * @param[out] out The number, only set when accepted.
+ * @returns 1 if the text is a number in the range, 0 otherwise.
+ */
+static int parse_int(const char *value, long min, long max, int *out) {
+  char *end;
+  errno = 0;
+  const long n = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || errno != 0 || n < min || n > max) {
+    return 0;
+  }
+  *out = (int)n;
+  return 1;
+}
+
+/**
+ * Apply one key=value field of a request to the job.
+ *
+ * @param[in,out] job The job.
+ * @param[in] field The field, modified in place.
+ * @returns NULL if the field is applied, otherwise the error message.
+ */
+static const char *apply_field(struct serve_job *job, char *field) {
+  if (strcmp(field, "fd") == 0) {
+    job->use_fd = 1;
+    return NULL;
+  }
+  char *value = strchr(field, '=');
+  if (value == NULL) {
+    return "unknown field";
+  }
+  *value++ = '\0';
+  if (strcmp(field, "in") == 0) {
+    job->in = value;
+  } else if (strcmp(field, "out") == 0) {
+    job->out = value;
+  } else if (strcmp(field, "point") == 0) {
+    if (!parse_int(value, 1, INFOTO_SERVE_MAX_POINT, &job->font.point)) {
+      return "bad point";
+    }
+  } else if (strcmp(field, "auto_fit") == 0) {
+    if (!parse_int(value, 0, 1, &job->font.auto_fit)) {
+      return "bad auto_fit";
+    }
+  } else if (strcmp(field, "font_color") == 0) {
+    job->font.color = infoto_get_background_color_from_string(value);
+  } else if (strcmp(field, "background") == 0) {
+    job->background.color = infoto_get_background_color_from_string(value);
+  } else if (strcmp(field, "pixels") == 0) {
+    if (!parse_int(value, 1, INFOTO_SERVE_MAX_PIXELS,
+                   &job->background.pixels)) {
+      return "bad pixels";
+    }
+  } else {
+    return "unknown field";
+  }
+  return NULL;
+}
+
+/**
+ * Run the job of a request line and send the reply.
+ *
+ * @param[in,out] worker The worker serving the connection.
+ * @param[in] line The request line, without its newline, modified in place.
+ */
+static void handle_request(struct serve_worker *worker, char *line) {
+  struct serve_state *state = worker->state;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  struct serve_job job;
+  memset(&job, 0, sizeof(job));
+  job.background = *state->background;
+  job.font = *state->font;
+  char *save = NULL;
+  const char *error = NULL;
+  for (char *field = strtok_r(line, "\t", &save);
+       field != NULL && error == NULL; field = strtok_r(NULL, "\t", &save)) {
+    error = apply_field(&job, field);
+  }
+  // a descriptor sent with a bad line is still used up by it
+  if (error != NULL && job.use_fd && worker->fds_len > 0) {
+    close(worker->fds[0]);
+    --worker->fds_len;
+    memmove(worker->fds, &worker->fds[1], worker->fds_len * sizeof(int));
+  }
+  if (error != NULL) {
+    send_error(worker->fd, "request", error);
+    return;
+  }
+  int in_fd = -1;
+  if (job.use_fd) {
+    if (worker->fds_len == 0) {
+      send_error(worker->fd, "request", "no descriptor sent");
+      return;
+    }
+    in_fd = worker->fds[0];
+    --worker->fds_len;
+    memmove(worker->fds, &worker->fds[1], worker->fds_len * sizeof(int));
+  }
+  if ((in_fd < 0 && job.in == NULL) || (in_fd >= 0 && job.out == NULL)) {
+    send_error(worker->fd, "request",
+               in_fd < 0 ? "missing in" : "missing out");
+    if (in_fd >= 0) {
+      close(in_fd);
+    }
+    return;
+  }
+  const char *name = job.in != NULL ? job.in : job.out;
+  infoto_img_file img;
+  // copied rather than mapped, a client truncating its file can't fault us
+  infoto_error_enum result = in_fd >= 0
+                                 ? infoto_img_file_open_fd(in_fd, name, &img)
+                                 : infoto_img_file_copy(job.in, &img);
+  if (in_fd >= 0) {
+    close(in_fd);
+  }
+  struct timespec read_done;
+  clock_gettime(CLOCK_MONOTONIC, &read_done);
+  if (result != INFOTO_SUCCESS) {
+    atomic_fetch_add(&state->failed, 1);
+    send_error(worker->fd, infoto_process_stage_to_str(INFOTO_STAGE_READ),
+               infoto_err_code_to_str(result));
+    return;
+  }
+  char *edited_img = NULL;
+  if (job.out == NULL) {
+    edited_img = infoto_get_edit_file_name(job.in);
+    if (edited_img == NULL) {
+      infoto_img_file_close(&img);
+      send_error(worker->fd, "request", "no edited name for in");
+      return;
+    }
+  }
+  const char *out = job.out != NULL ? job.out : edited_img;
+  infoto_process_timings timings;
+  infoto_process_stage stage;
+  result = infoto_process_job(worker->handler, job.background, job.font,
+                              state->plan, state->process_opts, &img, out,
+                              &timings, &stage);
+  infoto_img_file_close(&img);
+  struct timespec done;
+  clock_gettime(CLOCK_MONOTONIC, &done);
+  if (result != INFOTO_SUCCESS) {
+    atomic_fetch_add(&state->failed, 1);
+    send_error(worker->fd, infoto_process_stage_to_str(stage),
+               infoto_err_code_to_str(result));
+  } else {
+    atomic_fetch_add(&state->succeeded, 1);
+    char reply[MAX_REPLY];
+    int n = snprintf(reply, sizeof(reply),
+                     "ok\t%s\tread_ms=%.2f\tcaption_ms=%.2f\tencode_ms=%.2f\t"
+                     "write_ms=%.2f\ttotal_ms=%.2f\n",
+                     out, elapsed_ms(&start, &read_done), timings.caption_ms,
+                     timings.encode_ms, timings.write_ms,
+                     elapsed_ms(&start, &done));
+    if (n > 0 && (size_t)n < sizeof(reply)) {
+      send_reply(worker->fd, reply, n);
+    } else {
+      send_error(worker->fd, "request", "reply too long");
+    }
+  }
+  free(edited_img);
+}
+
+/**
+ * Receive bytes and any descriptors sent with them.
+ *
+ * @param[in,out] worker The worker serving the connection.
+ * @returns The number of bytes received, 0 once the client is done, -1 on
+ * error.
+ */
+static ssize_t receive(struct serve_worker *worker) {
+  struct iovec iov;
+  iov.iov_base = &worker->buf[worker->len];
+  iov.iov_len = sizeof(worker->buf) - worker->len;
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * MAX_CONN_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t n;
+  do {
+    n = recvmsg(worker->fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (worker->fds_len < MAX_CONN_FDS) {
+        worker->fds[worker->fds_len++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  return n;
+}
+
+/**
+ * Serve the requests of a connection until the client is done or silent
+ * for the idle timeout, or until the server drains and every received
+ * request is handled.
+ *
+ * @param[in,out] worker The worker, with the connection set.
+ */
+static void serve_connection(struct serve_worker *worker) {
+  worker->len = 0;
+  worker->fds_len = 0;
+  const int idle_ms = worker->state->opts->idle_timeout_ms;
+  if (idle_ms > 0) {
+    // a client that stops reading its replies can't hold the worker either
+    struct timeval send_timeout = {idle_ms / 1000, (idle_ms % 1000) * 1000};
+    setsockopt(worker->fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+               sizeof(send_timeout));
+  }
+  for (;;) {
+    char *newline;
+    while ((newline = (char *)memchr(worker->buf, '\n', worker->len)) !=
+           NULL) {
+      *newline = '\0';
+      handle_request(worker, worker->buf);
+      const size_t used = newline + 1 - worker->buf;
+      worker->len -= used;
+      memmove(worker->buf, newline + 1, worker->len);
+    }
+    if (worker->len == sizeof(worker->buf)) {
+      send_error(worker->fd, "request", "line too long");
+      break;
+    }
+    struct pollfd pfds[2] = {{worker->fd, POLLIN, 0},
+                             {worker->state->drain_pipe[0], POLLIN, 0}};
+    int ready = poll(pfds, 2, idle_ms > 0 ? idle_ms : -1);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    // when draining only what the client already sent is handled
+    if (ready <= 0 || (pfds[1].revents != 0 && pfds[0].revents == 0)) {
+      break;
+    }
+    ssize_t n = receive(worker);
+    if (n <= 0) {
+      break;
+    }
+    worker->len += n;
+  }
+  for (size_t i = 0; i < worker->fds_len; ++i) {
+    close(worker->fds[i]);
+  }
+  close(worker->fd);
+}
+
+/**
+ * Worker thread, serves connections until the queue closes.
+ *
+ * @param[in,out] arg The serve worker.
+ * @returns NULL
+ */
+static void *serve_worker_run(void *arg) {
+  struct serve_worker *worker = (struct serve_worker *)arg;
+  void *next;
+  while (infoto_queue_pop(&worker->state->conns, &next)) {
+    worker->fd = (int)(intptr_t)next;
+    serve_connection(worker);
+  }
+  return NULL;
+}
+
+/**
+ * Create the listening socket, replacing a stale socket file left by a
+ * server that is gone. The socket never blocks in accept.
+ *
+ * @param[in] socket_path The path of the socket.
+ * @param[in] mode The permissions of the socket file.
+ * @returns The listening socket, -1 on error.
+ */
+static int listen_on(const char *socket_path, mode_t mode) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path is too long: %s\n", socket_path);
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "can't create socket: %s\n", strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (lstat(socket_path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "not a socket, leaving it: %s\n", socket_path);
+      close(fd);
+      return -1;
+    }
+    // only a socket nobody answers on is removed
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      fprintf(stderr, "a server is already listening on: %s\n", socket_path);
+      close(fd);
+      return -1;
+    }
+    unlink(socket_path);
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "can't listen on %s: %s\n", socket_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  // nobody can connect before listen, so the mode is in place in time
+  if (chmod(socket_path, mode) != 0 || listen(fd, LISTEN_BACKLOG) != 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+    fprintf(stderr, "can't listen on %s: %s\n", socket_path, strerror(errno));
+    close(fd);
+    unlink(socket_path);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Serve caption jobs on a Unix domain socket until stopped.
+ *
+ * Each request is one line of tab separated key=value fields:
+ *   in=PATH       the input image
+ *   fd            the input is the descriptor sent with the line (SCM_RIGHTS)
+ *   out=PATH      the file to write, the edited name next to the input when
+ *                 left out (required with fd)
+ *   point=N, auto_fit=0|1, font_color=NAME, background=NAME, pixels=N
+ *                 overrides of the config for this job, point from 1 to
+ *                 INFOTO_SERVE_MAX_POINT and pixels from 1 to
+ *                 INFOTO_SERVE_MAX_PIXELS
+ * Each reply is one line, either
+ *   ok<TAB>OUT<TAB>read_ms=..<TAB>caption_ms=..<TAB>encode_ms=..<TAB>
+ *   write_ms=..<TAB>total_ms=..
+ * or
+ *   error<TAB>STAGE<TAB>ERROR
+ * where STAGE is request, with a message as ERROR, for a bad line.
+ *
+ * Connections are served by a pool of workers, one per handler, each
+ * working through its connection's requests in order. A connection that
+ * finds every worker busy and the waiting line full is answered with a
+ * busy error and closed, and a connection silent for the idle timeout is
+ * closed. Input files are copied into memory, never mapped, so a client
+ * truncating one can't fault the server. On stop no new connection is
+ * accepted and every worker finishes the requests it already received
+ * before closing its connection.
+ *
+ * @param[in] handlers The image handlers, one per worker.
+ * @param[in] handlers_len The number of image handlers.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] process_opts The process options, NULL for defaults.
+ * @param[in] socket_path The path of the socket to listen on.
+ * @param[in] opts The serve options.
+ * @param[in] stop The flag set, from a signal handler, to stop serving.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_serve_run(struct infoto_img_handler *handlers,
+                                   int handlers_len,
+                                   const background_info background,
+                                   const font_info font,
+                                   const infoto_exif_plan *plan,
+                                   const infoto_process_options *process_opts,
+                                   const char *socket_path,
+                                   const infoto_serve_options *opts,
+                                   volatile sig_atomic_t *stop) {
+  if (handlers_len <= 0) {
+    return INFOTO_ERR_NULL;
+  }
+  struct serve_state state;
+  memset(&state, 0, sizeof(state));
+  state.background = &background;
+  state.font = &font;
+  state.plan = plan;
+  state.process_opts = process_opts;
+  state.opts = opts;
+  atomic_init(&state.succeeded, 0);
+  atomic_init(&state.failed, 0);
+  if (pipe2(state.drain_pipe, O_CLOEXEC) != 0) {
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  infoto_error_enum result = INFOTO_SUCCESS;
+  const int listen_fd = listen_on(socket_path, opts->socket_mode);
+  if (listen_fd < 0) {
+    result = INFOTO_ERR_OPEN_FILE;
+  }
+  struct serve_worker *workers = NULL;
+  if (result == INFOTO_SUCCESS) {
+    workers = (struct serve_worker *)calloc(handlers_len,
+                                            sizeof(struct serve_worker));
+    if (workers == NULL) {
+      result = INFOTO_ERR_MALLOC;
+    }
+  }
+  int queue_ready = 0;
+  if (result == INFOTO_SUCCESS) {
+    result = infoto_queue_init(
+        &state.conns, (size_t)handlers_len * QUEUE_ITEMS_PER_WORKER, 1);
+    queue_ready = result == INFOTO_SUCCESS;
+  }
+  // the stop signals are only taken inside ppoll below, one arriving between
+  // the check of the flag and the wait would otherwise be lost until the
+  // next connection. Workers never take them.
+  sigset_t stop_signals, old_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+  int started = 0;
+  if (result == INFOTO_SUCCESS) {
+    for (; started < handlers_len; ++started) {
+      workers[started].state = &state;
+      workers[started].handler = &handlers[started];
+      if (pthread_create(&workers[started].thread, NULL, serve_worker_run,
+                         &workers[started]) != 0) {
+        break;
+      }
+    }
+    if (started == 0) {
+      fprintf(stderr, "failed to start the serve workers.\n");
+      result = INFOTO_ERR_MALLOC;
+    } else {
+      fprintf(stderr, "serving on %s, %d workers\n", socket_path, started);
+    }
+  }
+  while (result == INFOTO_SUCCESS && !*stop) {
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    if (ppoll(&pfd, 1, NULL, &old_mask) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "serving failed: %s\n", strerror(errno));
+      result = INFOTO_ERR_OPEN_FILE;
+      break;
+    }
+    int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+      continue;
+    }
+    // never wait on the workers here, or stop would go unnoticed
+    if (!infoto_queue_try_push(&state.conns, (void *)(intptr_t)conn)) {
+      send_error(conn, "request", "server busy");
+      close(conn);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  // stop taking connections, then let the workers drain
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(socket_path);
+  }
+  close(state.drain_pipe[1]);
+  if (queue_ready) {
+    infoto_queue_producer_done(&state.conns);
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  if (started > 0) {
+    fprintf(stderr, "summary: %zu succeeded, %zu failed\n",
+            atomic_load(&state.succeeded), atomic_load(&state.failed));
+  }
+  if (queue_ready) {
+    infoto_queue_free(&state.conns);
+  }
+  close(state.drain_pipe[0]);
+  free(workers);
+  return result;
+}
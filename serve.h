@@ -0,0 +1,89 @@
+#ifndef INFOTO_SERVE_H
+#define INFOTO_SERVE_H
+
+#include <signal.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "error_codes.h"
+#include "exif.h"
+#include "img_utils.h"
+#include "process.h"
+
+/* Longest request line accepted, in bytes */
+#define INFOTO_SERVE_MAX_LINE 8192
+/* Default permissions of the socket, only its owner may connect */
+#define INFOTO_SERVE_DEFAULT_SOCKET_MODE 0600
+/* Default milliseconds a connection may stay silent before it is closed */
+#define INFOTO_SERVE_DEFAULT_IDLE_TIMEOUT_MS 30000
+/* Largest point and pixels a request may ask for */
+#define INFOTO_SERVE_MAX_POINT 1024
+#define INFOTO_SERVE_MAX_PIXELS 4096
+
+/**
+ * Options for serving caption jobs.
+ */
+typedef struct {
+  // permissions of the socket file
+  mode_t socket_mode;
+  // milliseconds a connection may stay silent, 0 for no limit
+  int idle_timeout_ms;
+} infoto_serve_options;
+
+/**
+ * Initialize serve options with the defaults.
+ *
+ * @param[out] opts The options to initialize.
+ */
+void infoto_serve_options_init(infoto_serve_options *opts);
+
+/**
+ * Serve caption jobs on a Unix domain socket until stopped.
+ *
+ * Each request is one line of tab separated key=value fields:
+ *   in=PATH       the input image
+ *   fd            the input is the descriptor sent with the line (SCM_RIGHTS)
+ *   out=PATH      the file to write, the edited name next to the input when
+ *                 left out (required with fd)
+ *   point=N, auto_fit=0|1, font_color=NAME, background=NAME, pixels=N
+ *                 overrides of the config for this job, point from 1 to
+ *                 INFOTO_SERVE_MAX_POINT and pixels from 1 to
+ *                 INFOTO_SERVE_MAX_PIXELS
+ * Each reply is one line, either
+ *   ok<TAB>OUT<TAB>read_ms=..<TAB>caption_ms=..<TAB>encode_ms=..<TAB>
+ *   write_ms=..<TAB>total_ms=..
+ * or
+ *   error<TAB>STAGE<TAB>ERROR
+ * where STAGE is request, with a message as ERROR, for a bad line.
+ *
+ * Connections are served by a pool of workers, one per handler, each
+ * working through its connection's requests in order. A connection that
+ * finds every worker busy and the waiting line full is answered with a
+ * busy error and closed, and a connection silent for the idle timeout is
+ * closed. Input files are copied into memory, never mapped, so a client
+ * truncating one can't fault the server. On stop no new connection is
+ * accepted and every worker finishes the requests it already received
+ * before closing its connection.
+ *
+ * @param[in] handlers The image handlers, one per worker.
+ * @param[in] handlers_len The number of image handlers.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] process_opts The process options, NULL for defaults.
+ * @param[in] socket_path The path of the socket to listen on.
+ * @param[in] opts The serve options.
+ * @param[in] stop The flag set, from a signal handler, to stop serving.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_serve_run(struct infoto_img_handler *handlers,
+                                   int handlers_len,
+                                   const background_info background,
+                                   const font_info font,
+                                   const infoto_exif_plan *plan,
+                                   const infoto_process_options *process_opts,
+                                   const char *socket_path,
+                                   const infoto_serve_options *opts,
+                                   volatile sig_atomic_t *stop);
+
+#endif
@@ -1,11 +1,17 @@
 #include "str_utils.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define EDITED_FILE_NAME "-edited"
 #define EDITED_FILE_NAME_LEN strlen(EDITED_FILE_NAME)
 
+// temp file name constant values
+#define TMP_FILE_NAME "-edited.tmp"
+#define TMP_FILE_NAME_LEN strlen(TMP_FILE_NAME)
+
 /**
  * Convenience function to free all strings within the string array.
  *
@@ -80,3 +86,42 @@ char *infoto_get_edit_file_name(const char *filename) {
          start_of_extension, extension_len);
   return edited_file_name;
 }
+
+/**
+ * Check if the filename is one made by infoto_get_edit_file_name.
+ *
+ * @param[in] filename The filename to check.
+ * @returns 1 if the filename is an edit file name, 0 otherwise.
+ */
+int infoto_is_edit_file_name(const char *filename) {
+  const char *start_of_extension = infoto_get_filename_ext(filename);
+  // the edit marker sits right before the extension
+  size_t file_name_no_ext_len = *start_of_extension == '\0'
+                                    ? strlen(filename)
+                                    : (size_t)(start_of_extension - filename);
+  if (file_name_no_ext_len < EDITED_FILE_NAME_LEN) {
+    return 0;
+  }
+  return memcmp(&filename[file_name_no_ext_len - EDITED_FILE_NAME_LEN],
+                EDITED_FILE_NAME, EDITED_FILE_NAME_LEN) == 0;
+}
+
+/**
+ * Get the temp file name an edit file is written to before it is renamed
+ * into place.
+ *
+ * @param[in] filename The edit file name.
+ * @returns New filename for the temp file, NULL if out of memory.
+ */
+char *infoto_get_tmp_file_name(const char *filename) {
+  // the pid keeps processes writing the same output apart, and the name
+  // still ends in the edit marker so walks and watches pass over it
+  const size_t tmp_file_name_len = strlen(filename) + 24 + TMP_FILE_NAME_LEN;
+  char *tmp_file_name = (char *)malloc(tmp_file_name_len);
+  if (tmp_file_name == NULL) {
+    return NULL;
+  }
+  snprintf(tmp_file_name, tmp_file_name_len, "%s.%ld" TMP_FILE_NAME, filename,
+           (long)getpid());
+  return tmp_file_name;
+}
@@ -39,4 +39,21 @@ int infoto_inc_string_size(char **str, size_t size);
  */
 char *infoto_get_edit_file_name(const char *filename);
 
+/**
+ * Check if the filename is one made by infoto_get_edit_file_name.
+ *
+ * @param[in] filename The filename to check.
+ * @returns 1 if the filename is an edit file name, 0 otherwise.
+ */
+int infoto_is_edit_file_name(const char *filename);
+
+/**
+ * Get the temp file name an edit file is written to before it is renamed
+ * into place.
+ *
+ * @param[in] filename The edit file name.
+ * @returns New filename for the temp file, NULL if out of memory.
+ */
+char *infoto_get_tmp_file_name(const char *filename);
+
 #endif
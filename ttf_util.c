@@ -1,29 +1,711 @@
 #include "ttf_util.h"
 #include "deps/array_template/array_template.h"
+#include "hash_util.h"
 
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-// create functions for glyph string
-generate_array_template(infoto_bitmap_glyphs, FT_Glyph);
+/* Codepoints below this are looked up directly, the rest are hashed */
+#define ASCII_GLYPHS 128
+/* Marks an empty lookup slot */
+#define GLYPH_MISSING -1
+/* Initial number of hashed glyph slots per strike, must be a power of 2 */
+#define GLYPH_SLOTS_INITIAL 64
+/* Initial atlas size in bytes */
+#define ATLAS_INITIAL_CAP 16384
+/* Smallest font size auto fit will pick */
+#define FIT_MIN_SIZE 4
+/* Texts whose lengths round up to the same multiple share a fitted size */
+#define FIT_LENGTH_CLASS 4
+#define ATLAS_MAGIC "INFOATL"
+#define ATLAS_MAGIC_LEN 8
+#define ATLAS_VERSION 1
+/* Codepoints always rendered into a saved strike (printable ASCII) */
+#define ATLAS_CHARSET_FIRST 32
+#define ATLAS_CHARSET_LAST 126
+/* Rasterization can change between FreeType releases */
+#define ATLAS_FREETYPE_VERSION                                                 \
+  (FREETYPE_MAJOR * 10000 + FREETYPE_MINOR * 100 + FREETYPE_PATCH)
+
+/**
+ * Header at the start of the glyph atlas file.
+ * Followed by the strikes, the glyphs of every strike, the kerning pairs of
+ * every strike and then the bitmaps.
+ */
+struct atlas_header {
+  char magic[ATLAS_MAGIC_LEN];
+  uint32_t version;
+  uint32_t freetype_version;
+  // hash of the font file bytes the glyphs were rendered from
+  uint64_t font_hash;
+  // sizes of the records, guard against layout changes
+  uint32_t strike_size;
+  uint32_t glyph_size;
+  uint32_t kern_size;
+  uint32_t strike_count;
+  uint64_t glyph_count;
+  uint64_t kern_count;
+  uint64_t bitmaps_offset;
+  uint64_t bitmaps_size;
+};
+
+/**
+ * The glyphs and metrics of one pixel size in the glyph atlas file.
+ */
+struct atlas_strike {
+  int32_t pixel_size;
+  int32_t has_kerning;
+  // 26.6 fixed point
+  int64_t ascender;
+  int64_t descender;
+  uint32_t glyph_first;
+  uint32_t glyph_count;
+  uint32_t kern_first;
+  uint32_t kern_count;
+};
+
+/**
+ * A glyph in the glyph atlas file, the bitmap is at offset in the bitmaps.
+ */
+struct atlas_glyph {
+  uint32_t codepoint;
+  uint32_t index;
+  int32_t width;
+  int32_t rows;
+  int32_t left;
+  int32_t top;
+  // 26.6 fixed point
+  int64_t advance;
+  uint64_t offset;
+};
+
+/**
+ * A nonzero kerning adjustment between two glyphs of a strike.
+ * Sorted by left then right glyph index.
+ */
+struct atlas_kern {
+  uint32_t left;
+  uint32_t right;
+  // 26.6 fixed point
+  int64_t delta;
+};
+
+/**
+ * A cached glyph, its bitmap lives in the atlas at offset.
+ * Glyphs loaded from a glyph atlas file are read from its mapping instead.
+ */
+struct glyph_entry {
+  uint32_t codepoint;
+  uint32_t index;
+  int width;
+  int rows;
+  int left;
+  int top;
+  // horizontal advance in 26.6 fixed point
+  FT_Pos advance;
+  size_t offset;
+  // flag for if the bitmap is in the glyph atlas file
+  uint8_t mapped;
+};
+
+/**
+ * A glyph placed in a glyph string.
+ */
+struct glyph_position {
+  int32_t entry;
+  // bitmap top left corner in the bounding box
+  int x;
+  int y;
+};
+
+/**
+ * A font size chosen by auto fit.
+ */
+struct fit_entry {
+  uint32_t face_id;
+  size_t length_class;
+  int max_width;
+  int max_height;
+  int max_size;
+  int size;
+};
+
+// create functions for cached glyphs, glyph strings and fitted sizes
+generate_array_template(infoto_glyph_entries, struct glyph_entry);
+generate_array_template(infoto_glyph_positions, struct glyph_position);
+generate_array_template(infoto_fit_entries, struct fit_entry);
+generate_array_template(infoto_atlas_glyphs, struct atlas_glyph);
+generate_array_template(infoto_atlas_kerns, struct atlas_kern);
+
+/**
+ * The glyphs cached for one face at one pixel size.
+ */
+struct glyph_strike {
+  uint32_t face_id;
+  int pixel_size;
+  // 26.6 fixed point
+  FT_Pos ascender;
+  FT_Pos descender;
+  int has_kerning;
+  // kerning pairs of the mapped glyphs, from the glyph atlas file
+  const struct atlas_kern *kerns;
+  size_t kerns_len;
+  // number of glyphs rendered with FreeType
+  size_t rendered;
+  // entry index for each ASCII codepoint
+  int32_t ascii[ASCII_GLYPHS];
+  // open addressing table of entry indices for other codepoints
+  int32_t *slots;
+  size_t slot_cap;
+  size_t slot_len;
+};
+
+/**
+ * A TTF file mapped into memory once and shared read-only.
+ */
+struct infoto_font_file {
+  infoto_img_file file;
+  // identifies the font in glyph atlas files
+  uint64_t hash;
+};
+
+/**
+ * A glyph atlas file mapped into memory, shared read-only.
+ */
+struct infoto_glyph_atlas {
+  char *path;
+  uint64_t font_hash;
+  // mapping of the existing atlas file, NULL if there was none
+  uint8_t *map;
+  size_t map_size;
+  const struct atlas_header *header;
+  const struct atlas_strike *strikes;
+  const struct atlas_glyph *glyphs;
+  const struct atlas_kern *kerns;
+  const uint8_t *bitmaps;
+};
 
 /**
  * Structure for handling TTF library specific functionality.
  */
 struct infoto_font_handler {
+  // FreeType is only set up once a glyph is missing from the glyph atlas
   FT_Library library;
   FT_Face face;
+  // pixel size set on the face
+  int face_size;
+  // the font the face is loaded from
+  const struct infoto_font_file *font_file;
+  // font file mapped by load_font, NULL when the caller owns the font file
+  struct infoto_font_file *owned_file;
+  const struct infoto_glyph_atlas *glyph_atlas;
+  // identifies the loaded face in the glyph cache
+  uint32_t face_id;
+  int pixel_size;
+  // glyph cache, one strike per face and pixel size
+  struct glyph_strike *strikes;
+  size_t strikes_len;
+  // index of the strike for the current face and pixel size
+  size_t strike;
+  infoto_glyph_entries_array entries;
+  // contiguous bitmaps of every cached glyph
+  uint8_t *atlas;
+  size_t atlas_len;
+  size_t atlas_cap;
+  // sizes chosen by auto fit
+  infoto_fit_entries_array fits;
 };
 
 /**
  * Structure to hold glyph info about a string.
  */
 struct infoto_glyph_str {
-  infoto_bitmap_glyphs_array glyphs;
+  const struct infoto_font_handler *handler;
+  infoto_glyph_positions_array glyphs;
+  // bounding box size
+  int width;
+  int height;
 };
 
+/**
+ * Hash a codepoint for the strike's lookup table.
+ *
+ * @param[in] codepoint The codepoint.
+ * @returns The hash value.
+ */
+static uint32_t hash_codepoint(uint32_t codepoint) {
+  return codepoint * 2654435761u;
+}
+
+/**
+ * Load the face from the font file, setting up FreeType on first use, and
+ * set its pixel size.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] size The pixel size.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum ensure_face(struct infoto_font_handler *handler,
+                                     int size) {
+  if (handler->library == NULL && FT_Init_FreeType(&handler->library)) {
+    handler->library = NULL;
+    fprintf(stderr, "failed to initialize free type library.\n");
+    return INFOTO_ERR_TTF_INIT;
+  }
+  if (handler->face == NULL) {
+    const infoto_img_file *file = &handler->font_file->file;
+    // read ttf font. 0 grabs the first font (some ttf files have multiple
+    // fonts). FreeType only reads the memory, it is never written or freed.
+    FT_Error error =
+        FT_New_Memory_Face(handler->library, (const FT_Byte *)file->data,
+                           (FT_Long)file->size, 0, &handler->face);
+    if (error == FT_Err_Unknown_File_Format) {
+      handler->face = NULL;
+      fprintf(stderr,
+              "Font file given could not be opened and read: \"%s\"\n",
+              file->name);
+      return INFOTO_ERR_TTF_UNKNOWN_FILE;
+    } else if (error) {
+      handler->face = NULL;
+      fprintf(stderr, "font file failed to load with code: %s.\n",
+              FT_Error_String(error));
+      return INFOTO_ERR_TTF_GENERIC;
+    }
+    handler->face_size = 0;
+  }
+  if (handler->face_size != size) {
+    // set width and height. 0 width means height param is used for both.
+    if (FT_Set_Pixel_Sizes(handler->face, 0, size)) {
+      fprintf(stderr, "failed to set pixel size for font.\n");
+      return INFOTO_ERR_TTF_PIXEL_SIZE;
+    }
+    handler->face_size = size;
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Find the entry slot for the codepoint in the strike's hashed table.
+ *
+ * @param[in] handler The infoto_font_handler.
+ * @param[in] strike The strike.
+ * @param[in] codepoint The codepoint.
+ * @returns The slot holding the codepoint, or the empty slot it belongs in.
+ */
+static int32_t *find_slot(const struct infoto_font_handler *handler,
+                          const struct glyph_strike *strike,
+                          uint32_t codepoint) {
+  const size_t mask = strike->slot_cap - 1;
+  for (size_t i = hash_codepoint(codepoint) & mask;; i = (i + 1) & mask) {
+    int32_t entry = strike->slots[i];
+    if (entry == GLYPH_MISSING ||
+        handler->entries.infoto_glyph_entries_data[entry].codepoint ==
+            codepoint) {
+      return &strike->slots[i];
+    }
+  }
+}
+
+/**
+ * Grow the strike's hashed table when it is over half full.
+ *
+ * @param[in] handler The infoto_font_handler.
+ * @param[in,out] strike The strike.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum reserve_slot(const struct infoto_font_handler *handler,
+                                      struct glyph_strike *strike) {
+  if ((strike->slot_len + 1) * 2 <= strike->slot_cap) {
+    return INFOTO_SUCCESS;
+  }
+  const size_t cap =
+      strike->slot_cap == 0 ? GLYPH_SLOTS_INITIAL : strike->slot_cap * 2;
+  int32_t *slots = (int32_t *)malloc(cap * sizeof(int32_t));
+  if (slots == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  for (size_t i = 0; i < cap; ++i) {
+    slots[i] = GLYPH_MISSING;
+  }
+  struct glyph_strike grown = *strike;
+  grown.slots = slots;
+  grown.slot_cap = cap;
+  for (size_t i = 0; i < strike->slot_cap; ++i) {
+    int32_t entry = strike->slots[i];
+    if (entry != GLYPH_MISSING) {
+      *find_slot(
+          handler, &grown,
+          handler->entries.infoto_glyph_entries_data[entry].codepoint) = entry;
+    }
+  }
+  free(strike->slots);
+  strike->slots = slots;
+  strike->slot_cap = cap;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Add the entry to the strike's lookup tables.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in,out] strike The strike.
+ * @param[in] entry The index of the entry.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum index_entry(struct infoto_font_handler *handler,
+                                     struct glyph_strike *strike,
+                                     int32_t entry) {
+  const uint32_t codepoint =
+      handler->entries.infoto_glyph_entries_data[entry].codepoint;
+  if (codepoint < ASCII_GLYPHS) {
+    strike->ascii[codepoint] = entry;
+    return INFOTO_SUCCESS;
+  }
+  infoto_error_enum err_code = reserve_slot(handler, strike);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  int32_t *slot = find_slot(handler, strike, codepoint);
+  if (*slot == GLYPH_MISSING) {
+    ++strike->slot_len;
+  }
+  *slot = entry;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Fill the strike from the glyph atlas file, if it has the same font and
+ * pixel size. The bitmaps stay in the atlas file's mapping.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in,out] strike The new strike.
+ * @param[out] found 1 if the strike was in the glyph atlas file, 0 otherwise.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum strike_from_atlas(struct infoto_font_handler *handler,
+                                           struct glyph_strike *strike,
+                                           int *found) {
+  *found = 0;
+  const struct infoto_glyph_atlas *atlas = handler->glyph_atlas;
+  if (atlas == NULL || atlas->map == NULL ||
+      atlas->font_hash != handler->font_file->hash) {
+    return INFOTO_SUCCESS;
+  }
+  for (uint32_t i = 0; i < atlas->header->strike_count; ++i) {
+    const struct atlas_strike *stored = &atlas->strikes[i];
+    if (stored->pixel_size != strike->pixel_size) {
+      continue;
+    }
+    strike->ascender = stored->ascender;
+    strike->descender = stored->descender;
+    strike->has_kerning = stored->has_kerning;
+    strike->kerns = &atlas->kerns[stored->kern_first];
+    strike->kerns_len = stored->kern_count;
+    for (uint32_t g = 0; g < stored->glyph_count; ++g) {
+      const struct atlas_glyph *glyph = &atlas->glyphs[stored->glyph_first + g];
+      struct glyph_entry entry;
+      entry.codepoint = glyph->codepoint;
+      entry.index = glyph->index;
+      entry.width = glyph->width;
+      entry.rows = glyph->rows;
+      entry.left = glyph->left;
+      entry.top = glyph->top;
+      entry.advance = glyph->advance;
+      entry.offset = glyph->offset;
+      entry.mapped = 1;
+      if (!insert_infoto_glyph_entries_array(&handler->entries, entry)) {
+        return INFOTO_ERR_MALLOC;
+      }
+      infoto_error_enum err_code =
+          index_entry(handler, strike, handler->entries.len - 1);
+      if (err_code != INFOTO_SUCCESS) {
+        return err_code;
+      }
+    }
+    *found = 1;
+    return INFOTO_SUCCESS;
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Select (creating if needed) the strike for the current face and size.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum select_strike(struct infoto_font_handler *handler) {
+  for (size_t i = 0; i < handler->strikes_len; ++i) {
+    if (handler->strikes[i].face_id == handler->face_id &&
+        handler->strikes[i].pixel_size == handler->pixel_size) {
+      handler->strike = i;
+      return INFOTO_SUCCESS;
+    }
+  }
+  struct glyph_strike *tmp = (struct glyph_strike *)realloc(
+      handler->strikes,
+      (handler->strikes_len + 1) * sizeof(struct glyph_strike));
+  if (tmp == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  handler->strikes = tmp;
+  struct glyph_strike *strike = &handler->strikes[handler->strikes_len];
+  strike->face_id = handler->face_id;
+  strike->pixel_size = handler->pixel_size;
+  for (int i = 0; i < ASCII_GLYPHS; ++i) {
+    strike->ascii[i] = GLYPH_MISSING;
+  }
+  strike->slots = NULL;
+  strike->slot_cap = 0;
+  strike->slot_len = 0;
+  strike->kerns = NULL;
+  strike->kerns_len = 0;
+  strike->rendered = 0;
+  handler->strike = handler->strikes_len;
+  ++handler->strikes_len;
+  int found = 0;
+  infoto_error_enum err_code = strike_from_atlas(handler, strike, &found);
+  if (err_code == INFOTO_SUCCESS && !found) {
+    // not in the glyph atlas, the metrics come from the face
+    err_code = ensure_face(handler, strike->pixel_size);
+    if (err_code == INFOTO_SUCCESS) {
+      strike->ascender = handler->face->size->metrics.ascender;
+      strike->descender = handler->face->size->metrics.descender;
+      strike->has_kerning = FT_HAS_KERNING(handler->face);
+    }
+  }
+  if (err_code != INFOTO_SUCCESS) {
+    // never leave a half built strike to be selected later
+    free(strike->slots);
+    --handler->strikes_len;
+  }
+  return err_code;
+}
+
+/**
+ * Render the codepoint and copy its bitmap and metrics into the cache.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] codepoint The codepoint to render.
+ * @param[out] out The index of the new entry.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum cache_glyph(struct infoto_font_handler *handler,
+                                     uint32_t codepoint, int32_t *out) {
+  struct glyph_strike *strike = &handler->strikes[handler->strike];
+  infoto_error_enum err_code = ensure_face(handler, strike->pixel_size);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  FT_Error error = FT_Load_Char(handler->face, codepoint, FT_LOAD_RENDER);
+  if (error) {
+    fprintf(stderr, "error code %d for loading char: %c\n", error,
+            (char)codepoint);
+    return INFOTO_ERR_TTF_LOAD_CHAR;
+  }
+  FT_GlyphSlot slot = handler->face->glyph;
+  if (slot->format != FT_GLYPH_FORMAT_BITMAP ||
+      (slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY &&
+       slot->bitmap.rows * slot->bitmap.width != 0)) {
+    fprintf(stderr, "cannot handle other formats from bitmap\n");
+    return INFOTO_ERR_TTF_WRONG_FORMAT;
+  }
+  struct glyph_entry entry;
+  entry.codepoint = codepoint;
+  entry.index = slot->glyph_index;
+  entry.width = slot->bitmap.width;
+  entry.rows = slot->bitmap.rows;
+  entry.left = slot->bitmap_left;
+  entry.top = slot->bitmap_top;
+  entry.advance = slot->advance.x;
+  entry.offset = handler->atlas_len;
+  entry.mapped = 0;
+  // copy the bitmap into the atlas without row padding
+  const size_t bitmap_len = (size_t)entry.width * entry.rows;
+  if (handler->atlas_len + bitmap_len > handler->atlas_cap) {
+    size_t cap =
+        handler->atlas_cap == 0 ? ATLAS_INITIAL_CAP : handler->atlas_cap;
+    while (cap < handler->atlas_len + bitmap_len) {
+      cap *= 2;
+    }
+    uint8_t *tmp = (uint8_t *)realloc(handler->atlas, cap);
+    if (tmp == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    handler->atlas = tmp;
+    handler->atlas_cap = cap;
+  }
+  for (int row = 0; row < entry.rows; ++row) {
+    memcpy(&handler->atlas[entry.offset + (size_t)row * entry.width],
+           &slot->bitmap.buffer[row * slot->bitmap.pitch], entry.width);
+  }
+  if (!insert_infoto_glyph_entries_array(&handler->entries, entry)) {
+    return INFOTO_ERR_MALLOC;
+  }
+  handler->atlas_len += bitmap_len;
+  ++strike->rendered;
+  *out = handler->entries.len - 1;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Get the cache entry for the codepoint, rendering it on first use.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] codepoint The codepoint.
+ * @param[out] out The index of the entry.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum lookup_glyph(struct infoto_font_handler *handler,
+                                      uint32_t codepoint, int32_t *out) {
+  struct glyph_strike *strike = &handler->strikes[handler->strike];
+  if (codepoint < ASCII_GLYPHS) {
+    if (strike->ascii[codepoint] == GLYPH_MISSING) {
+      infoto_error_enum err_code =
+          cache_glyph(handler, codepoint, &strike->ascii[codepoint]);
+      if (err_code != INFOTO_SUCCESS) {
+        return err_code;
+      }
+    }
+    *out = strike->ascii[codepoint];
+    return INFOTO_SUCCESS;
+  }
+  infoto_error_enum err_code = reserve_slot(handler, strike);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  int32_t *slot = find_slot(handler, strike, codepoint);
+  if (*slot == GLYPH_MISSING) {
+    err_code = cache_glyph(handler, codepoint, slot);
+    if (err_code != INFOTO_SUCCESS) {
+      return err_code;
+    }
+    ++strike->slot_len;
+  }
+  *out = *slot;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Compare two kerning pairs by left then right glyph index.
+ *
+ * @param[in] a The first pair.
+ * @param[in] b The second pair.
+ * @returns Negative, zero or positive like strcmp.
+ */
+static int compare_kerns(const void *a, const void *b) {
+  const struct atlas_kern *ka = (const struct atlas_kern *)a;
+  const struct atlas_kern *kb = (const struct atlas_kern *)b;
+  if (ka->left != kb->left) {
+    return ka->left < kb->left ? -1 : 1;
+  }
+  if (ka->right != kb->right) {
+    return ka->right < kb->right ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * Get the grid fitted kerning between two glyphs of the current strike.
+ * Pairs of glyphs from the glyph atlas file are looked up in its kerning
+ * table, any other pair is asked of the face.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] left The left glyph's entry.
+ * @param[in] right The right glyph's entry.
+ * @param[out] delta The horizontal adjustment in 26.6 fixed point.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum get_kerning(struct infoto_font_handler *handler,
+                                     const struct glyph_entry *left,
+                                     const struct glyph_entry *right,
+                                     FT_Pos *delta) {
+  const struct glyph_strike *strike = &handler->strikes[handler->strike];
+  *delta = 0;
+  if (!strike->has_kerning || left->index == 0 || right->index == 0) {
+    return INFOTO_SUCCESS;
+  }
+  if (left->mapped && right->mapped) {
+    struct atlas_kern key;
+    key.left = left->index;
+    key.right = right->index;
+    const struct atlas_kern *found = (const struct atlas_kern *)bsearch(
+        &key, strike->kerns, strike->kerns_len, sizeof(struct atlas_kern),
+        compare_kerns);
+    if (found != NULL) {
+      *delta = found->delta;
+    }
+    return INFOTO_SUCCESS;
+  }
+  infoto_error_enum err_code = ensure_face(handler, strike->pixel_size);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  FT_Vector vec;
+  if (FT_Get_Kerning(handler->face, left->index, right->index,
+                     FT_KERNING_DEFAULT, &vec) == 0) {
+    *delta = vec.x;
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Map the given TTF file into memory.
+ *
+ * @param[in] ttf_file The TTF file to open.
+ * @param[out] file The font file to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_font_file_open(const char *ttf_file,
+                                        struct infoto_font_file **file) {
+  struct infoto_font_file *local =
+      (struct infoto_font_file *)calloc(1, sizeof(struct infoto_font_file));
+  if (local == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  if (infoto_img_file_open(ttf_file, &local->file) != INFOTO_SUCCESS) {
+    fprintf(stderr, "Font file given could not be opened and read: \"%s\"\n",
+            ttf_file);
+    free(local);
+    return INFOTO_ERR_TTF_UNKNOWN_FILE;
+  }
+  // glyph outlines are read in table order, not front to back
+  if (local->file.mapped) {
+    madvise(local->file.data, local->file.size, MADV_RANDOM);
+  }
+  local->hash = infoto_hash64(local->file.data, local->file.size, 0);
+  *file = local;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Unmap the font file.
+ * Every handler that loaded it must be freed first.
+ *
+ * @param[in,out] file The font file to close.
+ */
+void infoto_font_file_close(struct infoto_font_file **file) {
+  infoto_img_file_close(&(*file)->file);
+  free(*file);
+  *file = NULL;
+}
+
+/**
+ * Get the hash of the font file's bytes.
+ *
+ * @param[in] file The font file.
+ * @returns The hash of the font file.
+ */
+uint64_t infoto_font_file_hash(const struct infoto_font_file *file) {
+  return file->hash;
+}
+
 /**
  * Initialize font handler structure for TTF fonts.
  *
@@ -33,13 +715,18 @@ struct infoto_glyph_str {
 infoto_error_enum
 infoto_font_handler_init(struct infoto_font_handler **handler) {
   struct infoto_font_handler *local =
-      (struct infoto_font_handler *)malloc(sizeof(struct infoto_font_handler));
-
-  int error = FT_Init_FreeType(&local->library);
-  if (error) {
+      (struct infoto_font_handler *)calloc(1, sizeof(struct infoto_font_handler));
+  if (local == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  if (!init_infoto_glyph_entries_array(&local->entries, ASCII_GLYPHS)) {
     free(local);
-    fprintf(stderr, "failed to initialize free type library.\n");
-    return INFOTO_ERR_TTF_INIT;
+    return INFOTO_ERR_MALLOC;
+  }
+  if (!init_infoto_fit_entries_array(&local->fits, 1)) {
+    free_infoto_glyph_entries_array(&local->entries);
+    free(local);
+    return INFOTO_ERR_MALLOC;
   }
   *handler = local;
   return INFOTO_SUCCESS;
@@ -56,35 +743,259 @@ infoto_font_handler_init(struct infoto_font_handler **handler) {
 infoto_error_enum
 infoto_font_handler_load_font(struct infoto_font_handler *handler,
                               const char *ttf_file, int size) {
-  // read ttf font. 0 grabs the first font (some ttf files have multiple fonts)
-  FT_Error error = FT_New_Face(handler->library, ttf_file, 0, &handler->face);
-  if (error == FT_Err_Unknown_File_Format) {
-    fprintf(stderr, "Font file given could not be opened and read: \"%s\"\n",
-            ttf_file);
-    return INFOTO_ERR_TTF_UNKNOWN_FILE;
-  } else if (error) {
-    fprintf(stderr, "font file failed to load with code: %s.\n",
-            FT_Error_String(error));
-    return INFOTO_ERR_TTF_GENERIC;
+  struct infoto_font_file *file = NULL;
+  infoto_error_enum err = infoto_font_file_open(ttf_file, &file);
+  if (err != INFOTO_SUCCESS) {
+    return err;
   }
-  // set width and height. 0 width means height param is used for both.
-  error = FT_Set_Pixel_Sizes(handler->face, 0, size);
-  if (error) {
-    fprintf(stderr, "failed to set pixel size for font.\n");
-    return INFOTO_ERR_TTF_PIXEL_SIZE;
+  err = infoto_font_handler_load_font_file(handler, file, size);
+  if (err != INFOTO_SUCCESS) {
+    infoto_font_file_close(&file);
+    return err;
+  }
+  // the old face is gone so the previously owned file can be released
+  if (handler->owned_file != NULL) {
+    infoto_font_file_close(&handler->owned_file);
+  }
+  handler->owned_file = file;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Load the face from a shared font file with the given size.
+ * The handler gets its own face, parsed from the shared memory, so handlers
+ * never contend with each other. The face is only parsed once the glyph
+ * atlas is missing a glyph or size.
+ *
+ * @param[out] handler The infoto_font_handler to load the face into.
+ * @param[in] file The shared font file, must outlive the handler.
+ * @param[in] size The font size.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_font_handler_load_font_file(struct infoto_font_handler *handler,
+                                   const struct infoto_font_file *file,
+                                   int size) {
+  if (handler->face != NULL) {
+    FT_Done_Face(handler->face);
+    handler->face = NULL;
+  }
+  // the face itself is loaded once a glyph or metric is not in the atlas
+  handler->font_file = file;
+  // glyphs of a previously loaded face are never matched again
+  ++handler->face_id;
+  return infoto_font_handler_set_size(handler, size);
+}
+
+/**
+ * Set the pixel size of the loaded font.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] size The font size.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_font_handler_set_size(struct infoto_font_handler *handler, int size) {
+  if (handler->pixel_size == size && handler->strikes_len > 0 &&
+      handler->strikes[handler->strike].face_id == handler->face_id) {
+    return INFOTO_SUCCESS;
+  }
+  handler->pixel_size = size;
+  return select_strike(handler);
+}
+
+/**
+ * Measure the given text at the face's size.
+ *
+ * @param[in] face The loaded face.
+ * @param[in] text The text to measure.
+ * @param[out] width The width of the text.
+ * @param[out] height The font's ascender to descender height.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum measure_face(FT_Face face, const char *text,
+                                      int *width, int *height) {
+  const int use_kerning = FT_HAS_KERNING(face);
+  // pen position in 26.6 fixed point
+  FT_Pos pen = 0;
+  FT_UInt prev_index = 0;
+  for (const char *c = text; *c != '\0'; ++c) {
+    FT_UInt index = FT_Get_Char_Index(face, (unsigned char)*c);
+    if (use_kerning && prev_index != 0 && index != 0) {
+      FT_Vector delta;
+      if (FT_Get_Kerning(face, prev_index, index, FT_KERNING_UNFITTED,
+                         &delta) == 0) {
+        pen += delta.x;
+      }
+    }
+    // advances come back in 16.16 fixed point
+    FT_Fixed advance;
+    FT_Error error = FT_Get_Advance(
+        face, index, FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP, &advance);
+    if (error) {
+      fprintf(stderr, "error code %d for measuring char: %c\n", error, *c);
+      return INFOTO_ERR_TTF_LOAD_CHAR;
+    }
+    pen += advance >> 10;
+    prev_index = index;
   }
+  const FT_Size_Metrics *metrics = &face->size->metrics;
+  *width = (pen + 63) >> 6;
+  *height = (metrics->ascender - metrics->descender + 63) >> 6;
   return INFOTO_SUCCESS;
 }
 
+/**
+ * Measure the given text at the current size from font metrics only.
+ * Advances and kerning are read unhinted and no glyph is rendered.
+ *
+ * @param[in] handler The infoto_font_handler.
+ * @param[in] text The text to measure.
+ * @param[out] width The width of the text.
+ * @param[out] height The font's ascender to descender height.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_font_handler_measure(struct infoto_font_handler *handler,
+                            const char *text, int *width, int *height) {
+  infoto_error_enum err_code = ensure_face(handler, handler->pixel_size);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  return measure_face(handler->face, text, width, height);
+}
+
+/**
+ * Check if the text fits the bounds at the given font size.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] text The text to fit.
+ * @param[in] max_width The max width of the text.
+ * @param[in] max_height The max height of the text.
+ * @param[in] size The font size.
+ * @param[out] fits 1 if the text fits, 0 otherwise.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum fits_at(struct infoto_font_handler *handler,
+                                 const char *text, int max_width,
+                                 int max_height, int size, int *fits) {
+  infoto_error_enum err_code = ensure_face(handler, size);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  int width, height;
+  err_code = measure_face(handler->face, text, &width, &height);
+  *fits = width <= max_width && height <= max_height;
+  return err_code;
+}
+
+/**
+ * Find the largest font size, up to max_size, the text fits in and set it.
+ * The size is binary searched with infoto_font_handler_measure. The result
+ * is cached per text length class and bounds, so later texts of a similar
+ * length are only measured once to confirm they still fit.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] text The text to fit.
+ * @param[in] max_width The max width of the text.
+ * @param[in] max_height The max height of the text.
+ * @param[in] max_size The max font size.
+ * @param[out] size The chosen font size.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_font_handler_fit(struct infoto_font_handler *handler,
+                                          const char *text, int max_width,
+                                          int max_height, int max_size,
+                                          int *size) {
+  const size_t length_class =
+      (strlen(text) + FIT_LENGTH_CLASS - 1) / FIT_LENGTH_CLASS;
+  struct fit_entry *cached = NULL;
+  for (size_t i = 0; i < handler->fits.len; ++i) {
+    struct fit_entry *entry = &handler->fits.infoto_fit_entries_data[i];
+    if (entry->face_id == handler->face_id &&
+        entry->length_class == length_class &&
+        entry->max_width == max_width && entry->max_height == max_height &&
+        entry->max_size == max_size) {
+      cached = entry;
+      break;
+    }
+  }
+  int lo = FIT_MIN_SIZE;
+  int hi = max_size;
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  if (cached != NULL) {
+    // confirm the cached size with a single measurement
+    int fits = 0;
+    err_code = fits_at(handler, text, max_width, max_height, cached->size,
+                       &fits);
+    if (err_code != INFOTO_SUCCESS) {
+      return err_code;
+    }
+    if (fits) {
+      *size = cached->size;
+      return infoto_font_handler_set_size(handler, *size);
+    }
+    hi = cached->size - 1;
+  }
+  // largest size that fits, the smallest size is used if nothing fits
+  int best = FIT_MIN_SIZE;
+  while (lo <= hi) {
+    const int mid = lo + (hi - lo) / 2;
+    int fits = 0;
+    err_code = fits_at(handler, text, max_width, max_height, mid, &fits);
+    if (err_code != INFOTO_SUCCESS) {
+      return err_code;
+    }
+    if (fits) {
+      best = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  if (cached != NULL) {
+    cached->size = best;
+  } else {
+    struct fit_entry entry;
+    entry.face_id = handler->face_id;
+    entry.length_class = length_class;
+    entry.max_width = max_width;
+    entry.max_height = max_height;
+    entry.max_size = max_size;
+    entry.size = best;
+    if (!insert_infoto_fit_entries_array(&handler->fits, entry)) {
+      return INFOTO_ERR_MALLOC;
+    }
+  }
+  *size = best;
+  return infoto_font_handler_set_size(handler, best);
+}
+
 /**
  * Free all internal objects in infoto_font_handler.
  *
  * @param[out] handler The infoto_font_handler to free.
  */
 void infoto_font_handler_free(struct infoto_font_handler **handler) {
-  FT_Done_Face((*handler)->face);
-  FT_Done_FreeType((*handler)->library);
-  free(*handler);
+  struct infoto_font_handler *local = *handler;
+  for (size_t i = 0; i < local->strikes_len; ++i) {
+    free(local->strikes[i].slots);
+  }
+  free(local->strikes);
+  free_infoto_glyph_entries_array(&local->entries);
+  free_infoto_fit_entries_array(&local->fits);
+  free(local->atlas);
+  if (local->face != NULL) {
+    FT_Done_Face(local->face);
+  }
+  if (local->library != NULL) {
+    FT_Done_FreeType(local->library);
+  }
+  // the face reads from the file, so it is closed after the face is done
+  if (local->owned_file != NULL) {
+    infoto_font_file_close(&local->owned_file);
+  }
+  free(local);
   *handler = NULL;
 }
 
@@ -96,56 +1007,65 @@ void infoto_font_handler_free(struct infoto_font_handler **handler) {
  */
 infoto_error_enum infoto_glyph_str_init(struct infoto_glyph_str **str) {
   (*str) = (struct infoto_glyph_str *)malloc(sizeof(struct infoto_glyph_str));
-  return init_infoto_bitmap_glyphs_array(&(*str)->glyphs, 1)
+  if ((*str) == NULL) {
+    return INFOTO_ERR_GLYPH_STR_INIT;
+  }
+  (*str)->handler = NULL;
+  (*str)->width = 0;
+  (*str)->height = 0;
+  return init_infoto_glyph_positions_array(&(*str)->glyphs, 1)
              ? INFOTO_SUCCESS
              : INFOTO_ERR_GLYPH_STR_INIT;
 }
 
 /**
- * Get the width of the string of glyphs.
+ * Get the cache entry at the given index of the glyph string.
+ *
+ * @param[in] str The infoto_glyph_str.
+ * @param[in] idx The index.
+ * @returns The cache entry.
+ */
+static const struct glyph_entry *get_entry(const struct infoto_glyph_str *str,
+                                           size_t idx) {
+  return &str->handler->entries.infoto_glyph_entries_data
+              [str->glyphs.infoto_glyph_positions_data[idx].entry];
+}
+
+/**
+ * Get the bitmap of a cache entry.
+ *
+ * @param[in] handler The infoto_font_handler.
+ * @param[in] entry The cache entry.
+ * @returns The bitmap, rows * width bytes.
+ */
+static const uint8_t *entry_bitmap(const struct infoto_font_handler *handler,
+                                   const struct glyph_entry *entry) {
+  if (entry->mapped) {
+    return &handler->glyph_atlas->bitmaps[entry->offset];
+  }
+  return &handler->atlas[entry->offset];
+}
+
+/**
+ * Get the width of the string of glyphs' bounding box.
  *
  * @param[in] str The infoto_glyph_str to get the width of.
- * @returns The width of the string, -1 if failure.
+ * @returns The width of the string.
  */
 int infoto_glyph_str_get_width(const struct infoto_glyph_str *str) {
-  int width = 0;
-  for (int i = 0; i < str->glyphs.len; ++i) {
-    FT_Glyph out;
-    get_infoto_bitmap_glyphs_array(&str->glyphs, i, &out);
-    if (out == NULL) {
-      return -1;
-    }
-    FT_BitmapGlyph tmp = (FT_BitmapGlyph)out;
-    size_t glyph_width = tmp->bitmap.width;
-    if (glyph_width == 0) {
-      glyph_width = WHITE_SPACE_SIZE;
-    }
-    width += (glyph_width + KERN_SIZE);
-  }
-  return width;
+  return str->width;
 }
 
 /**
- * Get the height of the string of glyphs.
+ * Get the height of the string of glyphs' bounding box.
+ * This covers the font's ascender to descender so the baseline does not
+ * move between strings.
  *
  * @param[in] str The infoto_glyph_str to get the height of.
- * @returns The height of the string, -1 if failure.
+ * @returns The height of the string.
  */
 int infoto_glyph_str_get_height(const struct infoto_glyph_str *str) {
-  int height = 0;
-  for (int i = 0; i < str->glyphs.len; ++i) {
-    FT_Glyph out;
-    get_infoto_bitmap_glyphs_array(&str->glyphs, i, &out);
-    if (out == NULL) {
-      return -1;
-    }
-    FT_BitmapGlyph tmp = (FT_BitmapGlyph)out;
-    size_t glyph_height = tmp->bitmap.rows;
-    if (glyph_height > height) {
-      height = glyph_height;
-    }
-  }
-  return height;
+  return str->height;
 }
 
 /**
@@ -159,51 +1079,47 @@ size_t infoto_glyph_str_len(const struct infoto_glyph_str *str) {
 }
 
 /**
- * Get the glyph at the given index.
+ * Get the glyph at the given index, along with its position.
  *
  * @params[in] str The infoto_glyph_str.
  * @params[in] idx The index.
- * @returns FT_Glyph object, NULL if index out of bounds.
+ * @params[out] glyph The glyph to populate.
+ * @returns 1 if the glyph was found, 0 if index out of bounds.
  */
-FT_Glyph infoto_glyph_str_get_glyph(const struct infoto_glyph_str *str,
-                                    int idx) {
+int infoto_glyph_str_get_glyph(const struct infoto_glyph_str *str, int idx,
+                               infoto_glyph *glyph) {
   if (idx < 0 || idx >= str->glyphs.len) {
-    return NULL;
+    return 0;
   }
-  return str->glyphs.infoto_bitmap_glyphs_data[idx];
-}
-
-/**
- * Add glyph to the glyph string.
- *
- * @param[out] str The infoto_glyph_str to update.
- * @param[in] glyph The glyph to add.
- * @returns INFOTO_SUCCESS if successful, otherwise an error code.
- */
-infoto_error_enum infoto_glyph_str_add(struct infoto_glyph_str *str,
-                                       FT_Glyph glyph) {
-  return insert_infoto_bitmap_glyphs_array(&str->glyphs, glyph)
-             ? INFOTO_SUCCESS
-             : INFOTO_ERR_GLYPH_STR_ADD;
+  const struct glyph_entry *entry = get_entry(str, idx);
+  glyph->buffer = entry_bitmap(str->handler, entry);
+  glyph->width = entry->width;
+  glyph->rows = entry->rows;
+  glyph->left = entry->left;
+  glyph->top = entry->top;
+  glyph->advance = entry->advance >> 6;
+  glyph->index = entry->index;
+  glyph->x = str->glyphs.infoto_glyph_positions_data[idx].x;
+  glyph->y = str->glyphs.infoto_glyph_positions_data[idx].y;
+  return 1;
 }
 
 /**
  * Free glyph str.
+ * The referenced glyphs stay in the font handler's glyph cache.
  *
  * @param[out] str The infoto_glyph_str to free.
  */
 void infoto_glyph_str_free(struct infoto_glyph_str *str) {
-  for (int i = 0; i < str->glyphs.len; ++i) {
-    FT_Glyph tmp;
-    get_infoto_bitmap_glyphs_array(&str->glyphs, i, &tmp);
-    FT_Done_Glyph(tmp);
-  }
-  free_infoto_bitmap_glyphs_array(&str->glyphs);
+  free_infoto_glyph_positions_array(&str->glyphs);
   free(str);
 }
 
 /**
  * Create a glyph string with the given text.
+ * Each character is rendered once per face and pixel size, later uses are
+ * served from the font handler's glyph cache. Glyphs are positioned in a
+ * single pass using the font's advances, bearings and kerning.
  *
  * @param[in] handler The infoto font handler for TTF font info.
  * @param[out] glyph_str The infoto_glyph_str to populate.
@@ -218,24 +1134,638 @@ infoto_create_glyph_str_from_text(struct infoto_font_handler *handler,
     fprintf(stderr, "text was null.\n");
     return INFOTO_ERR_NULL;
   }
-  int text_len = strlen(text);
-  int error = 0;
-  FT_GlyphSlot slot = handler->face->glyph;
-  for (int i = 0; i < text_len; ++i) {
-    error = FT_Load_Char(handler->face, text[i], FT_LOAD_RENDER);
-    if (error) {
-      fprintf(stderr, "error code %d for loading char: %c\n", error, text[i]);
-      return INFOTO_ERR_TTF_LOAD_CHAR;
+  glyph_str->handler = handler;
+  // lay out on the baseline, y grows downward from it
+  const struct glyph_strike *strike = &handler->strikes[handler->strike];
+  int min_x = 0;
+  int max_x = 0;
+  int min_y = -(int)(strike->ascender >> 6);
+  int max_y = -(int)(strike->descender >> 6);
+  // pen position in 26.6 fixed point
+  FT_Pos pen = 0;
+  int32_t prev_idx = GLYPH_MISSING;
+  for (const char *c = text; *c != '\0'; ++c) {
+    int32_t entry_idx;
+    infoto_error_enum err_code =
+        lookup_glyph(handler, (unsigned char)*c, &entry_idx);
+    if (err_code != INFOTO_SUCCESS) {
+      return err_code;
     }
-    FT_Glyph tmp = NULL;
-    error = FT_Get_Glyph(slot, &tmp);
-    if (error == 0) {
-      infoto_glyph_str_add(glyph_str, tmp);
-    } else {
-      fprintf(stderr, "could not get glyph from FT_GlyphSlot. error code = %d",
-              error);
-      return INFOTO_ERR_TTF_GET_GLYPH;
+    // the entries may have moved while caching the glyph
+    const struct glyph_entry *entry =
+        &handler->entries.infoto_glyph_entries_data[entry_idx];
+    if (prev_idx != GLYPH_MISSING) {
+      FT_Pos delta;
+      err_code = get_kerning(
+          handler, &handler->entries.infoto_glyph_entries_data[prev_idx],
+          entry, &delta);
+      if (err_code != INFOTO_SUCCESS) {
+        return err_code;
+      }
+      pen += delta;
+    }
+    struct glyph_position pos;
+    pos.entry = entry_idx;
+    pos.x = (int)((pen + 32) >> 6) + entry->left;
+    pos.y = -entry->top;
+    if (entry->width > 0 && entry->rows > 0) {
+      if (pos.x < min_x) {
+        min_x = pos.x;
+      }
+      if (pos.x + entry->width > max_x) {
+        max_x = pos.x + entry->width;
+      }
+      if (pos.y < min_y) {
+        min_y = pos.y;
+      }
+      if (pos.y + entry->rows > max_y) {
+        max_y = pos.y + entry->rows;
+      }
+    }
+    if (!insert_infoto_glyph_positions_array(&glyph_str->glyphs, pos)) {
+      return INFOTO_ERR_GLYPH_STR_ADD;
+    }
+    pen += entry->advance;
+    prev_idx = entry_idx;
+  }
+  // move positions into the bounding box
+  for (size_t i = 0; i < glyph_str->glyphs.len; ++i) {
+    glyph_str->glyphs.infoto_glyph_positions_data[i].x -= min_x;
+    glyph_str->glyphs.infoto_glyph_positions_data[i].y -= min_y;
+  }
+  glyph_str->width = max_x - min_x;
+  glyph_str->height = max_y - min_y;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Validate the mapped glyph atlas file and set up the table pointers.
+ *
+ * @param[in,out] atlas The atlas with map and map_size set.
+ * @returns 1 if the file is usable for this font, 0 otherwise.
+ */
+static int validate_atlas(struct infoto_glyph_atlas *atlas) {
+  if (atlas->map_size < sizeof(struct atlas_header)) {
+    return 0;
+  }
+  const struct atlas_header *header = (const struct atlas_header *)atlas->map;
+  if (memcmp(header->magic, ATLAS_MAGIC, ATLAS_MAGIC_LEN) != 0 ||
+      header->version != ATLAS_VERSION ||
+      header->freetype_version != ATLAS_FREETYPE_VERSION ||
+      header->strike_size != sizeof(struct atlas_strike) ||
+      header->glyph_size != sizeof(struct atlas_glyph) ||
+      header->kern_size != sizeof(struct atlas_kern) ||
+      header->font_hash != atlas->font_hash) {
+    return 0;
+  }
+  // every count is bounded by the file size before it is multiplied
+  const uint64_t max_records = atlas->map_size / sizeof(struct atlas_kern);
+  if (header->glyph_count > max_records || header->kern_count > max_records) {
+    return 0;
+  }
+  const uint64_t tables_end =
+      sizeof(struct atlas_header) +
+      ((uint64_t)header->strike_count * sizeof(struct atlas_strike)) +
+      (header->glyph_count * sizeof(struct atlas_glyph)) +
+      (header->kern_count * sizeof(struct atlas_kern));
+  if (header->bitmaps_offset < tables_end ||
+      header->bitmaps_offset > atlas->map_size ||
+      header->bitmaps_size > atlas->map_size - header->bitmaps_offset) {
+    return 0;
+  }
+  const struct atlas_strike *strikes =
+      (const struct atlas_strike *)&atlas->map[sizeof(struct atlas_header)];
+  const struct atlas_glyph *glyphs =
+      (const struct atlas_glyph *)&strikes[header->strike_count];
+  const struct atlas_kern *kerns =
+      (const struct atlas_kern *)&glyphs[header->glyph_count];
+  for (uint32_t i = 0; i < header->strike_count; ++i) {
+    const struct atlas_strike *strike = &strikes[i];
+    if (strike->glyph_first > header->glyph_count ||
+        strike->glyph_count > header->glyph_count - strike->glyph_first ||
+        strike->kern_first > header->kern_count ||
+        strike->kern_count > header->kern_count - strike->kern_first) {
+      return 0;
     }
   }
+  for (uint64_t i = 0; i < header->glyph_count; ++i) {
+    const struct atlas_glyph *glyph = &glyphs[i];
+    if (glyph->width < 0 || glyph->rows < 0 ||
+        glyph->offset > header->bitmaps_size ||
+        (uint64_t)glyph->width * (uint64_t)glyph->rows >
+            header->bitmaps_size - glyph->offset) {
+      return 0;
+    }
+  }
+  atlas->header = header;
+  atlas->strikes = strikes;
+  atlas->glyphs = glyphs;
+  atlas->kerns = kerns;
+  atlas->bitmaps = &atlas->map[header->bitmaps_offset];
+  return 1;
+}
+
+/**
+ * Open (or create) the glyph atlas file for the given font.
+ * A missing, corrupt or mismatched (different font, version or FreeType
+ * release) atlas file is treated as empty and replaced on save.
+ *
+ * @param[in] path The glyph atlas file path.
+ * @param[in] font The font file the glyphs are rendered from.
+ * @param[out] atlas The atlas to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_glyph_atlas_open(const char *path,
+                                          const struct infoto_font_file *font,
+                                          struct infoto_glyph_atlas **atlas) {
+  struct infoto_glyph_atlas *local =
+      (struct infoto_glyph_atlas *)calloc(1, sizeof(struct infoto_glyph_atlas));
+  if (local == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  local->path = strdup(path);
+  if (local->path == NULL) {
+    free(local);
+    return INFOTO_ERR_MALLOC;
+  }
+  local->font_hash = font->hash;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map != MAP_FAILED) {
+        local->map = (uint8_t *)map;
+        local->map_size = st.st_size;
+      }
+    }
+    close(fd);
+  }
+  if (local->map != NULL && !validate_atlas(local)) {
+    fprintf(stderr, "ignoring stale or invalid glyph atlas file: %s\n", path);
+    munmap(local->map, local->map_size);
+    local->map = NULL;
+    local->map_size = 0;
+  }
+  *atlas = local;
   return INFOTO_SUCCESS;
 }
+
+/**
+ * Serve glyphs from the glyph atlas file.
+ * Call before the font is loaded. The atlas must outlive the handler.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] atlas The glyph atlas.
+ */
+void infoto_font_handler_use_atlas(struct infoto_font_handler *handler,
+                                   const struct infoto_glyph_atlas *atlas) {
+  handler->glyph_atlas = atlas;
+}
+
+/**
+ * The records of the glyph atlas file being written.
+ */
+struct atlas_writer {
+  struct atlas_strike *strikes;
+  size_t strikes_len;
+  infoto_atlas_glyphs_array glyphs;
+  infoto_atlas_kerns_array kerns;
+  uint8_t *bitmaps;
+  size_t bitmaps_len;
+  size_t bitmaps_cap;
+};
+
+/**
+ * Append a glyph and a copy of its bitmap.
+ *
+ * @param[in,out] writer The atlas writer.
+ * @param[in] glyph The glyph, its offset is replaced.
+ * @param[in] bitmap The glyph's bitmap.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum writer_add_glyph(struct atlas_writer *writer,
+                                          struct atlas_glyph glyph,
+                                          const uint8_t *bitmap) {
+  const size_t len = (size_t)glyph.width * glyph.rows;
+  if (writer->bitmaps_len + len > writer->bitmaps_cap) {
+    size_t cap =
+        writer->bitmaps_cap == 0 ? ATLAS_INITIAL_CAP : writer->bitmaps_cap;
+    while (cap < writer->bitmaps_len + len) {
+      cap *= 2;
+    }
+    uint8_t *tmp = (uint8_t *)realloc(writer->bitmaps, cap);
+    if (tmp == NULL) {
+      return INFOTO_ERR_MALLOC;
+    }
+    writer->bitmaps = tmp;
+    writer->bitmaps_cap = cap;
+  }
+  memcpy(&writer->bitmaps[writer->bitmaps_len], bitmap, len);
+  glyph.offset = writer->bitmaps_len;
+  writer->bitmaps_len += len;
+  return insert_infoto_atlas_glyphs_array(&writer->glyphs, glyph)
+             ? INFOTO_SUCCESS
+             : INFOTO_ERR_MALLOC;
+}
+
+/**
+ * Append a cache entry of the handler.
+ *
+ * @param[in,out] writer The atlas writer.
+ * @param[in] handler The infoto_font_handler.
+ * @param[in] entry The index of the entry.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum
+writer_add_entry(struct atlas_writer *writer,
+                 const struct infoto_font_handler *handler, int32_t entry) {
+  const struct glyph_entry *cached =
+      &handler->entries.infoto_glyph_entries_data[entry];
+  struct atlas_glyph glyph;
+  glyph.codepoint = cached->codepoint;
+  glyph.index = cached->index;
+  glyph.width = cached->width;
+  glyph.rows = cached->rows;
+  glyph.left = cached->left;
+  glyph.top = cached->top;
+  glyph.advance = cached->advance;
+  glyph.offset = 0;
+  return writer_add_glyph(writer, glyph, entry_bitmap(handler, cached));
+}
+
+/**
+ * Find the strike of the given size for the handler's current face.
+ *
+ * @param[in] handler The infoto_font_handler.
+ * @param[in] pixel_size The pixel size of the strike.
+ * @returns The index of the strike, -1 if the handler has none.
+ */
+static ptrdiff_t find_handler_strike(const struct infoto_font_handler *handler,
+                                     int pixel_size) {
+  for (size_t i = 0; i < handler->strikes_len; ++i) {
+    if (handler->strikes[i].face_id == handler->face_id &&
+        handler->strikes[i].pixel_size == pixel_size) {
+      return (ptrdiff_t)i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Append the cache entries of a handler strike whose codepoints the strike
+ * being written does not have yet.
+ *
+ * @param[in,out] writer The atlas writer.
+ * @param[in] handler The infoto_font_handler.
+ * @param[in] strike The handler's strike.
+ * @param[in] glyph_first The first glyph of the strike being written.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum
+writer_merge_entries(struct atlas_writer *writer,
+                     const struct infoto_font_handler *handler,
+                     const struct glyph_strike *strike, size_t glyph_first) {
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  for (size_t i = 0; i < ASCII_GLYPHS + strike->slot_cap &&
+                     err_code == INFOTO_SUCCESS;
+       ++i) {
+    const int32_t entry =
+        i < ASCII_GLYPHS ? strike->ascii[i] : strike->slots[i - ASCII_GLYPHS];
+    if (entry == GLYPH_MISSING) {
+      continue;
+    }
+    const uint32_t codepoint =
+        handler->entries.infoto_glyph_entries_data[entry].codepoint;
+    int written = 0;
+    for (size_t g = glyph_first; g < writer->glyphs.len && !written; ++g) {
+      written =
+          writer->glyphs.infoto_atlas_glyphs_data[g].codepoint == codepoint;
+    }
+    if (!written) {
+      err_code = writer_add_entry(writer, handler, entry);
+    }
+  }
+  return err_code;
+}
+
+/**
+ * Append a strike merged from every handler that has the size. A strike
+ * with freshly rendered glyphs is completed with the atlas charset and its
+ * kerning pairs are read from the face, otherwise they are copied from the
+ * glyph atlas file.
+ *
+ * @param[in,out] writer The atlas writer.
+ * @param[in,out] handlers The infoto_font_handlers.
+ * @param[in] handlers_len The number of handlers.
+ * @param[in] pixel_size The pixel size of the strike.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum
+writer_add_handler_strike(struct atlas_writer *writer,
+                          struct infoto_font_handler **handlers,
+                          size_t handlers_len, int pixel_size) {
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  // the handler whose face gives the kerning pairs, NULL if none rendered
+  struct infoto_font_handler *rendered = NULL;
+  for (size_t h = 0; h < handlers_len && err_code == INFOTO_SUCCESS; ++h) {
+    struct infoto_font_handler *handler = handlers[h];
+    const ptrdiff_t strike_idx = find_handler_strike(handler, pixel_size);
+    if (strike_idx < 0 || handler->strikes[strike_idx].rendered == 0) {
+      continue;
+    }
+    const size_t current = handler->strike;
+    handler->strike = strike_idx;
+    for (uint32_t c = ATLAS_CHARSET_FIRST;
+         c <= ATLAS_CHARSET_LAST && err_code == INFOTO_SUCCESS; ++c) {
+      int32_t entry;
+      err_code = lookup_glyph(handler, c, &entry);
+    }
+    handler->strike = current;
+    if (rendered == NULL) {
+      rendered = handler;
+    }
+  }
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  const struct glyph_strike *first = NULL;
+  struct atlas_strike out;
+  out.glyph_first = writer->glyphs.len;
+  out.kern_first = writer->kerns.len;
+  for (size_t h = 0; h < handlers_len && err_code == INFOTO_SUCCESS; ++h) {
+    const ptrdiff_t strike_idx = find_handler_strike(handlers[h], pixel_size);
+    if (strike_idx < 0) {
+      continue;
+    }
+    const struct glyph_strike *strike = &handlers[h]->strikes[strike_idx];
+    if (first == NULL) {
+      first = strike;
+    }
+    err_code = writer_merge_entries(writer, handlers[h], strike,
+                                    out.glyph_first);
+  }
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  out.pixel_size = pixel_size;
+  out.has_kerning = first->has_kerning;
+  out.ascender = first->ascender;
+  out.descender = first->descender;
+  out.glyph_count = writer->glyphs.len - out.glyph_first;
+  if (out.glyph_count == 0) {
+    // the strike was only used for metrics
+    return INFOTO_SUCCESS;
+  }
+  if (first->has_kerning && rendered == NULL) {
+    // every glyph came from the atlas file, so do its pairs
+    for (size_t i = 0; i < first->kerns_len; ++i) {
+      if (!insert_infoto_atlas_kerns_array(&writer->kerns, first->kerns[i])) {
+        return INFOTO_ERR_MALLOC;
+      }
+    }
+  } else if (first->has_kerning) {
+    err_code = ensure_face(rendered, pixel_size);
+    if (err_code != INFOTO_SUCCESS) {
+      return err_code;
+    }
+    const struct atlas_glyph *glyphs =
+        &writer->glyphs.infoto_atlas_glyphs_data[out.glyph_first];
+    for (uint32_t l = 0; l < out.glyph_count; ++l) {
+      for (uint32_t r = 0; r < out.glyph_count; ++r) {
+        FT_Vector delta;
+        if (glyphs[l].index == 0 || glyphs[r].index == 0 ||
+            FT_Get_Kerning(rendered->face, glyphs[l].index, glyphs[r].index,
+                           FT_KERNING_DEFAULT, &delta) != 0 ||
+            delta.x == 0) {
+          continue;
+        }
+        struct atlas_kern kern;
+        kern.left = glyphs[l].index;
+        kern.right = glyphs[r].index;
+        kern.delta = delta.x;
+        if (!insert_infoto_atlas_kerns_array(&writer->kerns, kern)) {
+          return INFOTO_ERR_MALLOC;
+        }
+      }
+    }
+    // codepoints sharing a glyph give duplicate pairs
+    struct atlas_kern *kerns =
+        &writer->kerns.infoto_atlas_kerns_data[out.kern_first];
+    size_t len = writer->kerns.len - out.kern_first;
+    qsort(kerns, len, sizeof(struct atlas_kern), compare_kerns);
+    size_t unique = 0;
+    for (size_t i = 0; i < len; ++i) {
+      if (unique == 0 || compare_kerns(&kerns[unique - 1], &kerns[i]) != 0) {
+        kerns[unique++] = kerns[i];
+      }
+    }
+    writer->kerns.len = out.kern_first + unique;
+  }
+  out.kern_count = writer->kerns.len - out.kern_first;
+  writer->strikes[writer->strikes_len++] = out;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Append a strike of the glyph atlas file unchanged.
+ *
+ * @param[in,out] writer The atlas writer.
+ * @param[in] atlas The glyph atlas.
+ * @param[in] stored The strike in the glyph atlas file.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum
+writer_add_atlas_strike(struct atlas_writer *writer,
+                        const struct infoto_glyph_atlas *atlas,
+                        const struct atlas_strike *stored) {
+  struct atlas_strike out = *stored;
+  out.glyph_first = writer->glyphs.len;
+  out.kern_first = writer->kerns.len;
+  for (uint32_t i = 0; i < stored->glyph_count; ++i) {
+    const struct atlas_glyph *glyph = &atlas->glyphs[stored->glyph_first + i];
+    infoto_error_enum err_code =
+        writer_add_glyph(writer, *glyph, &atlas->bitmaps[glyph->offset]);
+    if (err_code != INFOTO_SUCCESS) {
+      return err_code;
+    }
+  }
+  for (uint32_t i = 0; i < stored->kern_count; ++i) {
+    if (!insert_infoto_atlas_kerns_array(
+            &writer->kerns, atlas->kerns[stored->kern_first + i])) {
+      return INFOTO_ERR_MALLOC;
+    }
+  }
+  writer->strikes[writer->strikes_len++] = out;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Write the glyph atlas file to a temp file and rename it over the path so
+ * readers never see a partial atlas.
+ *
+ * @param[in] atlas The glyph atlas.
+ * @param[in] writer The records to write.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum write_atlas(const struct infoto_glyph_atlas *atlas,
+                                     const struct atlas_writer *writer) {
+  struct atlas_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ATLAS_MAGIC, ATLAS_MAGIC_LEN);
+  header.version = ATLAS_VERSION;
+  header.freetype_version = ATLAS_FREETYPE_VERSION;
+  header.font_hash = atlas->font_hash;
+  header.strike_size = sizeof(struct atlas_strike);
+  header.glyph_size = sizeof(struct atlas_glyph);
+  header.kern_size = sizeof(struct atlas_kern);
+  header.strike_count = writer->strikes_len;
+  header.glyph_count = writer->glyphs.len;
+  header.kern_count = writer->kerns.len;
+  header.bitmaps_offset =
+      sizeof(struct atlas_header) +
+      (writer->strikes_len * sizeof(struct atlas_strike)) +
+      (writer->glyphs.len * sizeof(struct atlas_glyph)) +
+      (writer->kerns.len * sizeof(struct atlas_kern));
+  header.bitmaps_size = writer->bitmaps_len;
+
+  const size_t path_len = strlen(atlas->path);
+  char *tmp_path = (char *)malloc(path_len + 32);
+  if (tmp_path == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  snprintf(tmp_path, path_len + 32, "%s.tmp.%d", atlas->path, getpid());
+  FILE *file = fopen(tmp_path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "can't open glyph atlas file: %s\n", tmp_path);
+    err_code = INFOTO_ERR_OPEN_FILE;
+  } else {
+    int ok =
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(writer->strikes, sizeof(struct atlas_strike),
+               writer->strikes_len, file) == writer->strikes_len &&
+        fwrite(writer->glyphs.infoto_atlas_glyphs_data,
+               sizeof(struct atlas_glyph), writer->glyphs.len,
+               file) == writer->glyphs.len &&
+        fwrite(writer->kerns.infoto_atlas_kerns_data, sizeof(struct atlas_kern),
+               writer->kerns.len, file) == writer->kerns.len &&
+        fwrite(writer->bitmaps, 1, writer->bitmaps_len, file) ==
+            writer->bitmaps_len;
+    ok = (fflush(file) == 0) && ok;
+    ok = (fsync(fileno(file)) == 0) && ok;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path, atlas->path) != 0) {
+      fprintf(stderr, "failed writing glyph atlas file: %s\n", atlas->path);
+      unlink(tmp_path);
+      err_code = INFOTO_ERR_OPEN_FILE;
+    }
+  }
+  free(tmp_path);
+  return err_code;
+}
+
+/**
+ * Save the glyphs of every handler to the glyph atlas file, merged with each
+ * other and with the sizes already in it. Nothing is written unless FreeType
+ * rendered a glyph, every saved size is completed with printable ASCII.
+ *
+ * @param[in] atlas The glyph atlas.
+ * @param[in,out] handlers The infoto_font_handlers that used the atlas.
+ * @param[in] handlers_len The number of handlers.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_glyph_atlas_save(const struct infoto_glyph_atlas *atlas,
+                        struct infoto_font_handler **handlers,
+                        size_t handlers_len) {
+  int rendered = 0;
+  size_t strikes_cap = 0;
+  for (size_t h = 0; h < handlers_len; ++h) {
+    const struct infoto_font_handler *handler = handlers[h];
+    if (handler->font_file == NULL ||
+        handler->font_file->hash != atlas->font_hash) {
+      return INFOTO_SUCCESS;
+    }
+    for (size_t i = 0; i < handler->strikes_len; ++i) {
+      if (handler->strikes[i].face_id == handler->face_id &&
+          handler->strikes[i].rendered > 0) {
+        rendered = 1;
+      }
+    }
+    strikes_cap += handler->strikes_len;
+  }
+  if (!rendered) {
+    return INFOTO_SUCCESS;
+  }
+  const uint32_t stored_count =
+      atlas->map != NULL ? atlas->header->strike_count : 0;
+  struct atlas_writer writer;
+  memset(&writer, 0, sizeof(writer));
+  writer.strikes = (struct atlas_strike *)malloc(
+      (strikes_cap + stored_count) * sizeof(struct atlas_strike));
+  if (writer.strikes == NULL ||
+      !init_infoto_atlas_glyphs_array(&writer.glyphs, ASCII_GLYPHS)) {
+    free(writer.strikes);
+    return INFOTO_ERR_MALLOC;
+  }
+  if (!init_infoto_atlas_kerns_array(&writer.kerns, ASCII_GLYPHS)) {
+    free(writer.strikes);
+    free_infoto_atlas_glyphs_array(&writer.glyphs);
+    return INFOTO_ERR_MALLOC;
+  }
+  infoto_error_enum err_code = INFOTO_SUCCESS;
+  for (size_t h = 0; h < handlers_len && err_code == INFOTO_SUCCESS; ++h) {
+    const struct infoto_font_handler *handler = handlers[h];
+    for (size_t i = 0; i < handler->strikes_len && err_code == INFOTO_SUCCESS;
+         ++i) {
+      const struct glyph_strike *strike = &handler->strikes[i];
+      // each size is merged once, from the first handler that has it
+      int seen = strike->face_id != handler->face_id;
+      for (size_t p = 0; p < h && !seen; ++p) {
+        seen = find_handler_strike(handlers[p], strike->pixel_size) >= 0;
+      }
+      if (!seen) {
+        err_code = writer_add_handler_strike(&writer, handlers, handlers_len,
+                                             strike->pixel_size);
+      }
+    }
+  }
+  // keep the sizes this run never used
+  for (uint32_t i = 0; i < stored_count && err_code == INFOTO_SUCCESS; ++i) {
+    int written = 0;
+    for (size_t s = 0; s < writer.strikes_len; ++s) {
+      if (writer.strikes[s].pixel_size == atlas->strikes[i].pixel_size) {
+        written = 1;
+        break;
+      }
+    }
+    if (!written) {
+      err_code = writer_add_atlas_strike(&writer, atlas, &atlas->strikes[i]);
+    }
+  }
+  if (err_code == INFOTO_SUCCESS) {
+    err_code = write_atlas(atlas, &writer);
+  }
+  free(writer.strikes);
+  free_infoto_atlas_glyphs_array(&writer.glyphs);
+  free_infoto_atlas_kerns_array(&writer.kerns);
+  free(writer.bitmaps);
+  return err_code;
+}
+
+/**
+ * Unmap the glyph atlas file.
+ * Every handler that used it must be freed first.
+ *
+ * @param[in,out] atlas The glyph atlas to close.
+ */
+void infoto_glyph_atlas_close(struct infoto_glyph_atlas **atlas) {
+  struct infoto_glyph_atlas *local = *atlas;
+  if (local->map != NULL) {
+    munmap(local->map, local->map_size);
+  }
+  free(local->path);
+  free(local);
+  *atlas = NULL;
+}
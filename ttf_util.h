@@ -3,23 +3,92 @@
 
 #include <freetype2/ft2build.h>
 #include FT_FREETYPE_H
+#include <freetype/ftadvanc.h>
 #include <freetype/ftglyph.h>
 
-#include "error_codes.h"
+#include <stdint.h>
 
-#define WHITE_SPACE_SIZE 20
-#define KERN_SIZE 4
+#include "error_codes.h"
+#include "img_file.h"
 
 /**
  * Structure for handling TTF library specific functionality.
+ * A font handler and its glyph strings must only be used by one thread at a
+ * time, give each worker its own handler.
  */
 typedef struct infoto_font_handler infoto_font_handler;
 
+/**
+ * A TTF file mapped into memory once and shared read-only.
+ * Any number of font handlers, on any threads, can load their faces from it.
+ * The font file is owned by the caller and must outlive every handler that
+ * loaded it.
+ */
+typedef struct infoto_font_file infoto_font_file;
+
+/**
+ * Rendered glyphs of a font saved to a versioned file that is mapped on
+ * later runs. Handlers using it serve those glyphs (and their metrics and
+ * kerning) straight from the mapping and only set up FreeType once a
+ * codepoint or size is missing.
+ */
+typedef struct infoto_glyph_atlas infoto_glyph_atlas;
+
 /**
  * Structure to hold glyph info about a string.
+ * Glyphs are references into the font handler's glyph cache, laid out once
+ * from the font's advances and kerning when the string is created.
  */
 typedef struct infoto_glyph_str infoto_glyph_str;
 
+/**
+ * A rendered glyph from the font handler's glyph cache.
+ */
+typedef struct {
+  // 8-bit coverage bitmap, rows * width bytes with no padding.
+  // owned by the glyph cache, valid until more glyphs are cached.
+  const uint8_t *buffer;
+  int width;
+  int rows;
+  // offset from the pen position to the bitmap's left edge and top row
+  int left;
+  int top;
+  // horizontal advance in pixels
+  int advance;
+  // glyph index in the face
+  uint32_t index;
+  // position of the bitmap's top left corner in the glyph string's bounding
+  // box, only set for glyphs from a glyph string
+  int x;
+  int y;
+} infoto_glyph;
+
+/**
+ * Map the given TTF file into memory.
+ *
+ * @param[in] ttf_file The TTF file to open.
+ * @param[out] file The font file to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_font_file_open(const char *ttf_file,
+                                        infoto_font_file **file);
+
+/**
+ * Unmap the font file.
+ * Every handler that loaded it must be freed first.
+ *
+ * @param[in,out] file The font file to close.
+ */
+void infoto_font_file_close(infoto_font_file **file);
+
+/**
+ * Get the hash of the font file's bytes.
+ *
+ * @param[in] file The font file.
+ * @returns The hash of the font file.
+ */
+uint64_t infoto_font_file_hash(const infoto_font_file *file);
+
 /**
  * Initialize font handler structure for TTF fonts.
  *
@@ -30,6 +99,8 @@ infoto_error_enum infoto_font_handler_init(infoto_font_handler **handler);
 
 /**
  * Load TTF font file with the given size.
+ * The handler maps and owns the file, use infoto_font_handler_load_font_file
+ * to share one mapping between handlers.
  *
  * @param[out] handler The infoto_font_handler to load the TTF file into.
  * @param[in] ttf_file The TTF file to load.
@@ -39,6 +110,63 @@ infoto_error_enum infoto_font_handler_init(infoto_font_handler **handler);
 infoto_error_enum infoto_font_handler_load_font(infoto_font_handler *handler,
                                                 const char *ttf_file, int size);
 
+/**
+ * Load the face from a shared font file with the given size.
+ * The handler gets its own face, parsed from the shared memory, so handlers
+ * never contend with each other.
+ *
+ * @param[out] handler The infoto_font_handler to load the face into.
+ * @param[in] file The shared font file, must outlive the handler.
+ * @param[in] size The font size.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum
+infoto_font_handler_load_font_file(infoto_font_handler *handler,
+                                   const infoto_font_file *file, int size);
+
+/**
+ * Set the pixel size of the loaded font.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] size The font size.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_font_handler_set_size(infoto_font_handler *handler,
+                                               int size);
+
+/**
+ * Measure the given text at the current size from font metrics only.
+ * Advances and kerning are read unhinted and no glyph is rendered.
+ *
+ * @param[in] handler The infoto_font_handler.
+ * @param[in] text The text to measure.
+ * @param[out] width The width of the text.
+ * @param[out] height The font's ascender to descender height.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_font_handler_measure(infoto_font_handler *handler,
+                                              const char *text, int *width,
+                                              int *height);
+
+/**
+ * Find the largest font size, up to max_size, the text fits in and set it.
+ * The size is binary searched with infoto_font_handler_measure. The result
+ * is cached per text length class and bounds, so later texts of a similar
+ * length are only measured once to confirm they still fit.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] text The text to fit.
+ * @param[in] max_width The max width of the text.
+ * @param[in] max_height The max height of the text.
+ * @param[in] max_size The max font size.
+ * @param[out] size The chosen font size.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_font_handler_fit(infoto_font_handler *handler,
+                                          const char *text, int max_width,
+                                          int max_height, int max_size,
+                                          int *size);
+
 /**
  * Free all internal objects in infoto_font_handler.
  *
@@ -55,7 +183,7 @@ void infoto_font_handler_free(infoto_font_handler **handler);
 infoto_error_enum infoto_glyph_str_init(infoto_glyph_str **str);
 
 /**
- * Get the width of the string of glyphs.
+ * Get the width of the string of glyphs' bounding box.
  *
  * @param[in] str The infoto_glyph_str to get the width of.
  * @returns The width of the string.
@@ -63,7 +191,9 @@ infoto_error_enum infoto_glyph_str_init(infoto_glyph_str **str);
 int infoto_glyph_str_get_width(const infoto_glyph_str *str);
 
 /**
- * Get the height of the string of glyphs.
+ * Get the height of the string of glyphs' bounding box.
+ * This covers the font's ascender to descender so the baseline does not
+ * move between strings.
  *
  * @param[in] str The infoto_glyph_str to get the height of.
  * @returns The height of the string.
@@ -79,26 +209,19 @@ int infoto_glyph_str_get_height(const infoto_glyph_str *str);
 size_t infoto_glyph_str_len(const struct infoto_glyph_str *str);
 
 /**
- * Get the glyph at the given index.
+ * Get the glyph at the given index, along with its position.
  *
  * @params[in] str The infoto_glyph_str.
  * @params[in] idx The index.
- * @returns FT_Glyph object, NULL if index out of bounds.
+ * @params[out] glyph The glyph to populate.
+ * @returns 1 if the glyph was found, 0 if index out of bounds.
  */
-FT_Glyph infoto_glyph_str_get_glyph(const struct infoto_glyph_str *str,
-                                    int idx);
-
-/**
- * Add glyph to the glyph string.
- *
- * @param[out] str The infoto_glyph_str to update.
- * @param[in] glyph The glyph to add.
- * @returns INFOTO_SUCCESS if successful, otherwise an error code.
- */
-infoto_error_enum infoto_glyph_str_add(infoto_glyph_str *str, FT_Glyph glyph);
+int infoto_glyph_str_get_glyph(const struct infoto_glyph_str *str, int idx,
+                               infoto_glyph *glyph);
 
 /**
  * Free glyph str.
+ * The referenced glyphs stay in the font handler's glyph cache.
  *
  * @param[out] str The infoto_glyph_str to free.
  */
@@ -106,6 +229,9 @@ void infoto_glyph_str_free(infoto_glyph_str *str);
 
 /**
  * Create a glyph string with the given text.
+ * Each character is rendered once per face and pixel size, later uses are
+ * served from the font handler's glyph cache. Glyphs are positioned in a
+ * single pass using the font's advances, bearings and kerning.
  *
  * @param[in] handler The infoto font handler for TTF font info.
  * @param[out] glyph_str The infoto_glyph_str to populate.
@@ -117,4 +243,50 @@ infoto_create_glyph_str_from_text(infoto_font_handler *handler,
                                   infoto_glyph_str *glyph_str,
                                   const char *text);
 
+/**
+ * Open (or create) the glyph atlas file for the given font.
+ * A missing, corrupt or mismatched (different font, version or FreeType
+ * release) atlas file is treated as empty and replaced on save.
+ *
+ * @param[in] path The glyph atlas file path.
+ * @param[in] font The font file the glyphs are rendered from.
+ * @param[out] atlas The atlas to populate.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_glyph_atlas_open(const char *path,
+                                          const infoto_font_file *font,
+                                          infoto_glyph_atlas **atlas);
+
+/**
+ * Serve glyphs from the glyph atlas file.
+ * Call before the font is loaded. The atlas must outlive the handler.
+ *
+ * @param[in,out] handler The infoto_font_handler.
+ * @param[in] atlas The glyph atlas.
+ */
+void infoto_font_handler_use_atlas(infoto_font_handler *handler,
+                                   const infoto_glyph_atlas *atlas);
+
+/**
+ * Save the glyphs of every handler to the glyph atlas file, merged with each
+ * other and with the sizes already in it. Nothing is written unless FreeType
+ * rendered a glyph, every saved size is completed with printable ASCII.
+ *
+ * @param[in] atlas The glyph atlas.
+ * @param[in,out] handlers The infoto_font_handlers that used the atlas.
+ * @param[in] handlers_len The number of handlers.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_glyph_atlas_save(const infoto_glyph_atlas *atlas,
+                                          infoto_font_handler **handlers,
+                                          size_t handlers_len);
+
+/**
+ * Unmap the glyph atlas file.
+ * Every handler that used it must be freed first.
+ *
+ * @param[in,out] atlas The glyph atlas to close.
+ */
+void infoto_glyph_atlas_close(infoto_glyph_atlas **atlas);
+
 #endif
@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+
+#include "walk.h"
+#include "hash_util.h"
+#include "img_file.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Bytes of directory entries read per getdents64 call */
+#define DENTS_BUF_LEN (64 * 1024)
+/* Initial size of the path scratch buffer */
+#define PATH_BUF_INITIAL_CAP 256
+/* Smallest table of visited directories, must be a power of 2 */
+#define VISITED_MIN_SLOTS 64
+/* Seed of the path hash picking a file's shard */
+#define SHARD_SEED 0x696e666f746f5348ULL
+
+/**
+ * Directory entry as returned by getdents64.
+ */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * An open directory its queued subdirectories are opened relative to.
+ */
+struct walk_parent {
+  int fd;
+  // the reading thread and every queued subdirectory, guarded by the lock
+  size_t refs;
+};
+
+/**
+ * A directory waiting to be read.
+ */
+struct walk_dir {
+  char *path;
+  // the directory it is opened in, NULL to open the path itself (the root)
+  struct walk_parent *parent;
+  // offset of the directory's name in the path
+  size_t name_offset;
+  int depth;
+};
+
+/**
+ * A directory already read, found by following links.
+ */
+struct walk_visit {
+  uint64_t dev;
+  uint64_t ino;
+  uint8_t used;
+};
+
+/**
+ * State shared by every walking thread.
+ */
+struct walk_state {
+  const infoto_walk_options *opts;
+  infoto_walk_fn fn;
+  void *ctx;
+  // offset of the path relative to the root in every path
+  size_t rel_offset;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // directories waiting to be read, read last in first out
+  struct walk_dir *dirs;
+  size_t dirs_len;
+  size_t dirs_cap;
+  // threads reading a directory, the walk ends when none are and no
+  // directories are waiting
+  int active;
+  // directories read so far, only kept when following links
+  struct walk_visit *visited;
+  size_t visited_len;
+  size_t visited_slots;
+};
+
+/**
+ * A walking thread with its own buffers.
+ */
+struct walk_worker {
+  struct walk_state *state;
+  pthread_t thread;
+  uint8_t *dents;
+  char *path;
+  size_t path_cap;
+};
+
+/**
+ * Initialize walk options with the defaults, every file of every level.
+ *
+ * @param[out] opts The options to initialize.
+ */
+void infoto_walk_options_init(infoto_walk_options *opts) {
+  memset(opts, 0, sizeof(infoto_walk_options));
+  opts->max_depth = -1;
+}
+
+/**
+ * Check if a path matches any of the glob patterns.
+ *
+ * @param[in] patterns The glob patterns.
+ * @param[in] name The file name.
+ * @param[in] rel The path relative to the root.
+ * @returns 1 if a pattern matches, 0 otherwise.
+ */
+static int matches_any(const string_array *patterns, const char *name,
+                       const char *rel) {
+  for (size_t i = 0; i < patterns->len; ++i) {
+    const char *pattern = patterns->string_data[i];
+    if (strchr(pattern, '/') != NULL) {
+      if (fnmatch(pattern, rel, FNM_PATHNAME) == 0) {
+        return 1;
+      }
+    } else if (fnmatch(pattern, name, 0) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Get the shard of a path. Only the path's bytes are hashed, so every
+ * machine walking the same tree puts a file in the same shard, and adding a
+ * shard only moves files into the new one.
+ *
+ * @param[in] rel The path relative to the root.
+ * @param[in] shard_count The number of shards.
+ * @returns The shard, from 0 to shard_count - 1.
+ */
+int infoto_shard_of(const char *rel, int shard_count) {
+  return infoto_jump_hash(infoto_hash64(rel, strlen(rel), SHARD_SEED),
+                          shard_count);
+}
+
+/**
+ * Check if a path found under the root passes the walk's filters: the depth
+ * limit and the exclude globs for a directory, the include and exclude globs
+ * and the shard for a file. The JPEG magic is checked separately.
+ *
+ * @param[in] opts The walk options.
+ * @param[in] name The file or directory name.
+ * @param[in] rel The path relative to the root.
+ * @param[in] is_dir Flag for if the path is a directory.
+ * @param[in] depth The directory's level below the root, unused for a file.
+ * @returns 1 if the path is kept, 0 if it is left out.
+ */
+int infoto_walk_path_matches(const infoto_walk_options *opts, const char *name,
+                             const char *rel, int is_dir, int depth) {
+  if (is_dir && opts->max_depth >= 0 && depth > opts->max_depth) {
+    return 0;
+  }
+  if (opts->exclude != NULL && matches_any(opts->exclude, name, rel)) {
+    return 0;
+  }
+  if (is_dir) {
+    return 1;
+  }
+  if (opts->include != NULL && opts->include->len > 0 &&
+      !matches_any(opts->include, name, rel)) {
+    return 0;
+  }
+  return opts->shard_count <= 1 ||
+         infoto_shard_of(rel, opts->shard_count) == opts->shard_index;
+}
+
+/**
+ * Check if a file starts with the JPEG magic bytes.
+ *
+ * @param[in] dir_fd The file's directory, AT_FDCWD for a path.
+ * @param[in] name The file name, or path.
+ * @returns 1 if the file looks like a JPEG image, 0 otherwise.
+ */
+int infoto_walk_has_jpeg_magic(int dir_fd, const char *name) {
+  int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  uint8_t magic[3];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  close(fd);
+  return n == sizeof(magic) && magic[0] == 0xFF &&
+         magic[1] == INFOTO_JPEG_MARKER_SOI && magic[2] == 0xFF;
+}
+
+/**
+ * Mark a directory as visited.
+ *
+ * @param[in,out] state The walk state, locked by the caller.
+ * @param[in] st The directory's file status.
+ * @returns 1 if the directory was not visited before, 0 if it was, -1 if
+ * out of memory.
+ */
+static int visit(struct walk_state *state, const struct stat *st) {
+  if (state->visited_len * 2 >= state->visited_slots) {
+    size_t slots = state->visited_slots == 0 ? VISITED_MIN_SLOTS
+                                             : state->visited_slots * 2;
+    struct walk_visit *grown =
+        (struct walk_visit *)calloc(slots, sizeof(struct walk_visit));
+    if (grown == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < state->visited_slots; ++i) {
+      const struct walk_visit *old = &state->visited[i];
+      if (!old->used) {
+        continue;
+      }
+      size_t j = infoto_hash_mix64(old->dev ^ infoto_hash_mix64(old->ino)) &
+                 (slots - 1);
+      while (grown[j].used) {
+        j = (j + 1) & (slots - 1);
+      }
+      grown[j] = *old;
+    }
+    free(state->visited);
+    state->visited = grown;
+    state->visited_slots = slots;
+  }
+  const uint64_t dev = st->st_dev;
+  const uint64_t ino = st->st_ino;
+  const size_t mask = state->visited_slots - 1;
+  size_t i = infoto_hash_mix64(dev ^ infoto_hash_mix64(ino)) & mask;
+  for (; state->visited[i].used; i = (i + 1) & mask) {
+    if (state->visited[i].dev == dev && state->visited[i].ino == ino) {
+      return 0;
+    }
+  }
+  state->visited[i].dev = dev;
+  state->visited[i].ino = ino;
+  state->visited[i].used = 1;
+  ++state->visited_len;
+  return 1;
+}
+
+/**
+ * Drop a reference to an open directory, closing it with the last one.
+ *
+ * @param[in,out] state The walk state.
+ * @param[in] parent The open directory, NULL for none.
+ */
+static void release_parent(struct walk_state *state,
+                           struct walk_parent *parent) {
+  if (parent == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&state->lock);
+  const int last = --parent->refs == 0;
+  pthread_mutex_unlock(&state->lock);
+  if (last) {
+    close(parent->fd);
+    free(parent);
+  }
+}
+
+/**
+ * Queue a directory to be read.
+ *
+ * @param[in,out] state The walk state.
+ * @param[in] path The directory path, owned by the walk on success.
+ * @param[in] parent The open directory it is in, kept open until it is read,
+ * NULL to open the path itself.
+ * @param[in] name_offset The offset of the directory's name in the path.
+ * @param[in] depth The directory's level below the root.
+ * @returns 0 if successful, -1 if out of memory.
+ */
+static int push_dir(struct walk_state *state, char *path,
+                    struct walk_parent *parent, size_t name_offset,
+                    int depth) {
+  pthread_mutex_lock(&state->lock);
+  if (state->dirs_len == state->dirs_cap) {
+    size_t cap = state->dirs_cap == 0 ? 16 : state->dirs_cap * 2;
+    struct walk_dir *grown =
+        (struct walk_dir *)realloc(state->dirs, cap * sizeof(struct walk_dir));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&state->lock);
+      return -1;
+    }
+    state->dirs = grown;
+    state->dirs_cap = cap;
+  }
+  state->dirs[state->dirs_len].path = path;
+  state->dirs[state->dirs_len].parent = parent;
+  state->dirs[state->dirs_len].name_offset = name_offset;
+  state->dirs[state->dirs_len].depth = depth;
+  ++state->dirs_len;
+  if (parent != NULL) {
+    ++parent->refs;
+  }
+  pthread_cond_signal(&state->cond);
+  pthread_mutex_unlock(&state->lock);
+  return 0;
+}
+
+/**
+ * Build the path of an entry in the worker's scratch buffer.
+ *
+ * @param[in,out] worker The walk worker.
+ * @param[in] dir The directory path.
+ * @param[in] dir_len The length of the directory path.
+ * @param[in] name The entry name.
+ * @returns The length of the path, 0 if out of memory.
+ */
+static size_t build_path(struct walk_worker *worker, const char *dir,
+                         size_t dir_len, const char *name) {
+  const size_t name_len = strlen(name);
+  const int separator = dir_len > 0 && dir[dir_len - 1] != '/';
+  const size_t len = dir_len + separator + name_len;
+  if (len + 1 > worker->path_cap) {
+    size_t cap = worker->path_cap * 2;
+    while (cap < len + 1) {
+      cap *= 2;
+    }
+    char *grown = (char *)realloc(worker->path, cap);
+    if (grown == NULL) {
+      return 0;
+    }
+    worker->path = grown;
+    worker->path_cap = cap;
+  }
+  memcpy(worker->path, dir, dir_len);
+  if (separator) {
+    worker->path[dir_len] = '/';
+  }
+  memcpy(&worker->path[dir_len + separator], name, name_len + 1);
+  return len;
+}
+
+/**
+ * Handle one directory entry, queueing directories and passing on files.
+ *
+ * @param[in,out] worker The walk worker.
+ * @param[in] dir The directory being read.
+ * @param[in] self The open directory being read.
+ * @param[in] dir_len The length of the directory path.
+ * @param[in] name The entry name.
+ * @param[in] type The entry's d_type.
+ */
+static void handle_entry(struct walk_worker *worker, const struct walk_dir *dir,
+                         struct walk_parent *self, size_t dir_len,
+                         const char *name, unsigned char type) {
+  const int dir_fd = self->fd;
+  struct walk_state *state = worker->state;
+  const infoto_walk_options *opts = state->opts;
+  struct stat st;
+  // only stat when the file system did not say what the entry is
+  if (type == DT_UNKNOWN) {
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      return;
+    }
+    type = S_ISDIR(st.st_mode)   ? DT_DIR
+           : S_ISREG(st.st_mode) ? DT_REG
+           : S_ISLNK(st.st_mode) ? DT_LNK
+                                 : DT_UNKNOWN;
+  }
+  if (type == DT_LNK) {
+    // dangling links are left out
+    if (!opts->follow_symlinks || fstatat(dir_fd, name, &st, 0) != 0) {
+      return;
+    }
+    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG
+                                                              : DT_UNKNOWN;
+  }
+  if (type != DT_DIR && type != DT_REG) {
+    return;
+  }
+  const size_t len = build_path(worker, dir->path, dir_len, name);
+  if (len == 0) {
+    return;
+  }
+  const char *rel = len > state->rel_offset ? &worker->path[state->rel_offset]
+                                            : name;
+  if (!infoto_walk_path_matches(opts, name, rel, type == DT_DIR,
+                                dir->depth + 1)) {
+    return;
+  }
+  if (type == DT_REG && opts->check_magic &&
+      !infoto_walk_has_jpeg_magic(dir_fd, name)) {
+    return;
+  }
+  char *path = strdup(worker->path);
+  if (path == NULL) {
+    return;
+  }
+  if (type == DT_REG) {
+    state->fn(state->ctx, path);
+  } else if (push_dir(state, path, self, len - strlen(name),
+                      dir->depth + 1) != 0) {
+    free(path);
+  }
+}
+
+/**
+ * Read one directory with getdents64. The directory is opened by name in its
+ * open parent, so the path is never resolved again and its length doesn't
+ * matter, and subdirectories are opened the same way in it.
+ *
+ * @param[in,out] worker The walk worker.
+ * @param[in] dir The directory to read, its reference to the parent is
+ * dropped.
+ */
+static void read_dir(struct walk_worker *worker, const struct walk_dir *dir) {
+  struct walk_state *state = worker->state;
+  int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  // a directory swapped for a link since it was listed is not followed
+  if (dir->parent != NULL && !state->opts->follow_symlinks) {
+    flags |= O_NOFOLLOW;
+  }
+  int fd = openat(dir->parent != NULL ? dir->parent->fd : AT_FDCWD,
+                  &dir->path[dir->name_offset], flags);
+  release_parent(state, dir->parent);
+  if (fd < 0) {
+    fprintf(stderr, "can't open directory: %s\n", dir->path);
+    return;
+  }
+  if (state->opts->follow_symlinks) {
+    // a link back up the tree would be read forever
+    struct stat st;
+    int first = -1;
+    if (fstat(fd, &st) == 0) {
+      pthread_mutex_lock(&state->lock);
+      first = visit(state, &st);
+      pthread_mutex_unlock(&state->lock);
+    }
+    if (first != 1) {
+      close(fd);
+      return;
+    }
+  }
+  struct walk_parent *self =
+      (struct walk_parent *)malloc(sizeof(struct walk_parent));
+  if (self == NULL) {
+    fprintf(stderr, "out of memory, leaving out: %s\n", dir->path);
+    close(fd);
+    return;
+  }
+  self->fd = fd;
+  self->refs = 1;
+  const size_t dir_len = strlen(dir->path);
+  for (;;) {
+    long n = syscall(SYS_getdents64, fd, worker->dents, DENTS_BUF_LEN);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fprintf(stderr, "failed reading directory: %s\n", dir->path);
+    }
+    if (n <= 0) {
+      break;
+    }
+    for (long pos = 0; pos < n;) {
+      const struct linux_dirent64 *entry =
+          (const struct linux_dirent64 *)&worker->dents[pos];
+      pos += entry->d_reclen;
+      const char *name = entry->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      handle_entry(worker, dir, self, dir_len, name, entry->d_type);
+    }
+  }
+  release_parent(state, self);
+}
+
+/**
+ * Walking thread, reads directories until none are left and no other
+ * thread can find more.
+ *
+ * @param[in,out] arg The walk worker.
+ * @returns NULL
+ */
+static void *walk_worker_run(void *arg) {
+  struct walk_worker *worker = (struct walk_worker *)arg;
+  struct walk_state *state = worker->state;
+  pthread_mutex_lock(&state->lock);
+  for (;;) {
+    while (state->dirs_len == 0 && state->active > 0) {
+      pthread_cond_wait(&state->cond, &state->lock);
+    }
+    if (state->dirs_len == 0) {
+      break;
+    }
+    struct walk_dir dir = state->dirs[--state->dirs_len];
+    ++state->active;
+    pthread_mutex_unlock(&state->lock);
+    read_dir(worker, &dir);
+    free(dir.path);
+    pthread_mutex_lock(&state->lock);
+    if (--state->active == 0 && state->dirs_len == 0) {
+      // wake every waiting thread so they see the walk is over
+      pthread_cond_broadcast(&state->cond);
+    }
+  }
+  pthread_mutex_unlock(&state->lock);
+  return NULL;
+}
+
+/**
+ * Walk a directory tree on several threads, calling the function with each
+ * file as soon as it is found. Directories are read with getdents64, each
+ * opened with openat in its already open parent, and the entry type is used
+ * instead of stat when the file system provides it. Directories that can't
+ * be read are reported and skipped.
+ *
+ * @param[in] root The directory to walk.
+ * @param[in] opts The walk options.
+ * @param[in] fn The function called with each file.
+ * @param[in] ctx The context passed to the function.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_walk_tree(const char *root,
+                                   const infoto_walk_options *opts,
+                                   infoto_walk_fn fn, void *ctx) {
+  struct stat st;
+  if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "can't open directory: %s\n", root);
+    return INFOTO_ERR_NO_FILE_ACCESS;
+  }
+  const int jobs = opts->jobs > 0 ? opts->jobs : INFOTO_WALK_DEFAULT_JOBS;
+  struct walk_state state;
+  memset(&state, 0, sizeof(state));
+  state.opts = opts;
+  state.fn = fn;
+  state.ctx = ctx;
+  const size_t root_len = strlen(root);
+  state.rel_offset =
+      root_len + (root_len > 0 && root[root_len - 1] != '/' ? 1 : 0);
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.cond, NULL);
+  struct walk_worker *workers =
+      (struct walk_worker *)calloc(jobs, sizeof(struct walk_worker));
+  char *root_path = strdup(root);
+  infoto_error_enum result = INFOTO_ERR_MALLOC;
+  if (workers != NULL && root_path != NULL &&
+      push_dir(&state, root_path, NULL, 0, 0) == 0) {
+    root_path = NULL;
+    result = INFOTO_SUCCESS;
+  }
+  int started = 0;
+  for (; result == INFOTO_SUCCESS && started < jobs; ++started) {
+    struct walk_worker *worker = &workers[started];
+    worker->state = &state;
+    worker->dents = (uint8_t *)malloc(DENTS_BUF_LEN);
+    worker->path = (char *)malloc(PATH_BUF_INITIAL_CAP);
+    worker->path_cap = PATH_BUF_INITIAL_CAP;
+    if (worker->dents == NULL || worker->path == NULL ||
+        pthread_create(&worker->thread, NULL, walk_worker_run, worker) != 0) {
+      free(worker->dents);
+      free(worker->path);
+      // the threads already started still walk the whole tree
+      if (started == 0) {
+        result = INFOTO_ERR_MALLOC;
+      }
+      break;
+    }
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    free(workers[i].dents);
+    free(workers[i].path);
+  }
+  // only left over when no thread could start
+  for (size_t i = 0; i < state.dirs_len; ++i) {
+    release_parent(&state, state.dirs[i].parent);
+    free(state.dirs[i].path);
+  }
+  free(root_path);
+  free(state.dirs);
+  free(state.visited);
+  free(workers);
+  pthread_cond_destroy(&state.cond);
+  pthread_mutex_destroy(&state.lock);
+  return result;
+}
+
+/**
+ * Collector for infoto_walk_collect.
+ */
+struct walk_collect {
+  string_array *files;
+  pthread_mutex_t lock;
+};
+
+/**
+ * Append a found file to the collected files.
+ *
+ * @param[in,out] ctx The walk_collect.
+ * @param[in] path The file path.
+ */
+static void collect_file(void *ctx, char *path) {
+  struct walk_collect *collect = (struct walk_collect *)ctx;
+  pthread_mutex_lock(&collect->lock);
+  if (!insert_string_array(collect->files, path)) {
+    free(path);
+  }
+  pthread_mutex_unlock(&collect->lock);
+}
+
+/**
+ * Walk a directory tree and collect every file found.
+ *
+ * @param[in] root The directory to walk.
+ * @param[in] opts The walk options.
+ * @param[out] files The array the file paths are appended to.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_walk_collect(const char *root,
+                                      const infoto_walk_options *opts,
+                                      string_array *files) {
+  struct walk_collect collect;
+  collect.files = files;
+  pthread_mutex_init(&collect.lock, NULL);
+  infoto_error_enum result = infoto_walk_tree(root, opts, collect_file,
+                                              &collect);
+  pthread_mutex_destroy(&collect.lock);
+  return result;
+}
@@ -0,0 +1,112 @@
+#ifndef INFOTO_WALK_H
+#define INFOTO_WALK_H
+
+#include "error_codes.h"
+#include "str_utils.h"
+
+/* Default number of threads walking a tree */
+#define INFOTO_WALK_DEFAULT_JOBS 4
+
+/**
+ * Options for walking a directory tree.
+ */
+typedef struct {
+  // glob patterns a file must match one of, NULL or empty for every file.
+  // Patterns with a '/' match the path relative to the root, others the
+  // file name.
+  const string_array *include;
+  // glob patterns of files and directories to leave out, NULL for none
+  const string_array *exclude;
+  // levels of directories below the root to enter, -1 for no limit
+  int max_depth;
+  // flag to follow symbolic links, directories reached twice are skipped
+  int follow_symlinks;
+  // flag to only keep files starting with the JPEG magic bytes
+  int check_magic;
+  // threads reading directories, 0 for INFOTO_WALK_DEFAULT_JOBS
+  int jobs;
+  // only keep the files of this shard, picked by the hash of the path
+  // relative to the root
+  int shard_index;
+  // number of shards, 0 or 1 for every file
+  int shard_count;
+} infoto_walk_options;
+
+/**
+ * Get the shard of a path. Only the path's bytes are hashed, so every
+ * machine walking the same tree puts a file in the same shard, and adding a
+ * shard only moves files into the new one.
+ *
+ * @param[in] rel The path relative to the root.
+ * @param[in] shard_count The number of shards.
+ * @returns The shard, from 0 to shard_count - 1.
+ */
+int infoto_shard_of(const char *rel, int shard_count);
+
+/**
+ * Check if a path found under the root passes the walk's filters: the depth
+ * limit and the exclude globs for a directory, the include and exclude globs
+ * and the shard for a file. The JPEG magic is checked separately.
+ *
+ * @param[in] opts The walk options.
+ * @param[in] name The file or directory name.
+ * @param[in] rel The path relative to the root.
+ * @param[in] is_dir Flag for if the path is a directory.
+ * @param[in] depth The directory's level below the root, unused for a file.
+ * @returns 1 if the path is kept, 0 if it is left out.
+ */
+int infoto_walk_path_matches(const infoto_walk_options *opts, const char *name,
+                             const char *rel, int is_dir, int depth);
+
+/**
+ * Check if a file starts with the JPEG magic bytes.
+ *
+ * @param[in] dir_fd The file's directory, AT_FDCWD for a path.
+ * @param[in] name The file name, or path.
+ * @returns 1 if the file looks like a JPEG image, 0 otherwise.
+ */
+int infoto_walk_has_jpeg_magic(int dir_fd, const char *name);
+
+/**
+ * Function called with every file found, from any walking thread.
+ * It owns the malloc'd path.
+ */
+typedef void (*infoto_walk_fn)(void *ctx, char *path);
+
+/**
+ * Initialize walk options with the defaults, every file of every level.
+ *
+ * @param[out] opts The options to initialize.
+ */
+void infoto_walk_options_init(infoto_walk_options *opts);
+
+/**
+ * Walk a directory tree on several threads, calling the function with each
+ * file as soon as it is found. Directories are read with getdents64, each
+ * opened with openat in its already open parent, and the entry type is used
+ * instead of stat when the file system provides it. Directories that can't
+ * be read are reported and skipped.
+ *
+ * @param[in] root The directory to walk.
+ * @param[in] opts The walk options.
+ * @param[in] fn The function called with each file.
+ * @param[in] ctx The context passed to the function.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_walk_tree(const char *root,
+                                   const infoto_walk_options *opts,
+                                   infoto_walk_fn fn, void *ctx);
+
+/**
+ * Walk a directory tree and collect every file found.
+ *
+ * @param[in] root The directory to walk.
+ * @param[in] opts The walk options.
+ * @param[out] files The array the file paths are appended to.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_walk_collect(const char *root,
+                                      const infoto_walk_options *opts,
+                                      string_array *files);
+
+#endif
@@ -0,0 +1,638 @@
+#define _GNU_SOURCE
+
+#include "watch.h"
+#include "img_file.h"
+#include "queue.h"
+#include "str_utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Bytes of inotify events read at once */
+#define EVENT_BUF_LEN (64 * 1024)
+/* Landed files waiting for a worker, per worker */
+#define QUEUE_ITEMS_PER_WORKER 64
+/* Wait before handing due files to workers that had no room again */
+#define QUEUE_RETRY_MS 5
+/* Events of every watched directory, new directories only when recursive */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_ONLYDIR)
+#define WATCH_RECURSIVE_MASK (WATCH_MASK | IN_CREATE)
+
+/**
+ * A landed file waiting out the debounce time.
+ */
+struct pending_file {
+  char *path;
+  // when the file first landed, for reporting the latency
+  struct timespec landed;
+  // when the file is processed unless it is touched again
+  struct timespec due;
+};
+
+/**
+ * A landed file handed to the workers.
+ */
+struct watch_item {
+  char *path;
+  struct timespec landed;
+};
+
+/**
+ * State of a watch run.
+ */
+struct watch_state {
+  const background_info *background;
+  const font_info *font;
+  const infoto_exif_plan *plan;
+  const infoto_process_options *process_opts;
+  const infoto_watch_options *opts;
+  int fd;
+  // offset of the path relative to the root in every path
+  size_t rel_offset;
+  // watched directory paths, by watch descriptor
+  char **dirs;
+  size_t dirs_cap;
+  size_t dirs_len;
+  // landed files in the order they landed
+  struct pending_file *pending;
+  size_t pending_len;
+  size_t pending_cap;
+  // flag for if the workers had no room for a due file
+  int backed_up;
+  infoto_queue files;
+  atomic_size_t succeeded;
+  atomic_size_t failed;
+};
+
+/**
+ * A worker thread and its handler.
+ */
+struct watch_worker {
+  struct watch_state *state;
+  struct infoto_img_handler *handler;
+  pthread_t thread;
+};
+
+/**
+ * Initialize watch options with the defaults.
+ *
+ * @param[out] opts The options to initialize.
+ */
+void infoto_watch_options_init(infoto_watch_options *opts) {
+  opts->recursive = 0;
+  opts->debounce_ms = INFOTO_WATCH_DEFAULT_DEBOUNCE_MS;
+  opts->walk = NULL;
+}
+
+/**
+ * Get the milliseconds from one time to another.
+ *
+ * @param[in] from The earlier time.
+ * @param[in] to The later time.
+ * @returns The milliseconds between the times.
+ */
+static double elapsed_ms(const struct timespec *from,
+                         const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e3 +
+         (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/**
+ * Join a directory and a name into a new path.
+ *
+ * @param[in] dir The directory.
+ * @param[in] name The name in the directory.
+ * @returns The malloc'd path, NULL if allocation failed.
+ */
+static char *join_path(const char *dir, const char *name) {
+  const size_t dir_len = strlen(dir);
+  const int separator = dir_len > 0 && dir[dir_len - 1] != '/';
+  const size_t len = dir_len + separator + strlen(name) + 1;
+  char *path = (char *)malloc(len);
+  if (path != NULL) {
+    snprintf(path, len, "%s%s%s", dir, separator ? "/" : "", name);
+  }
+  return path;
+}
+
+/**
+ * Check if a file or directory under the root passes the walk filters.
+ *
+ * @param[in] state The watch state.
+ * @param[in] path The path, under the root.
+ * @param[in] is_dir Flag for if the path is a directory.
+ * @returns 1 if the path is kept, 0 if it is left out.
+ */
+static int keep_path(const struct watch_state *state, const char *path,
+                     int is_dir) {
+  const infoto_walk_options *walk = state->opts->walk;
+  if (walk == NULL) {
+    return 1;
+  }
+  const char *rel = strlen(path) > state->rel_offset
+                        ? &path[state->rel_offset]
+                        : path;
+  const char *slash = strrchr(path, '/');
+  const char *name = slash != NULL ? slash + 1 : path;
+  int depth = 1;
+  for (const char *c = rel; *c != '\0'; ++c) {
+    depth += *c == '/';
+  }
+  return infoto_walk_path_matches(walk, name, rel, is_dir, depth);
+}
+
+/**
+ * Caption a landed file next to it. The file is copied rather than mapped,
+ * another process truncating it can't fault us.
+ *
+ * @param[in] worker The watch worker.
+ * @param[in] path The landed file.
+ * @param[out] edited_img The edited image filename.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum process_landed(const struct watch_worker *worker,
+                                        const char *path, char **edited_img) {
+  const struct watch_state *state = worker->state;
+  infoto_img_file img;
+  infoto_error_enum result = infoto_img_file_copy(path, &img);
+  if (result != INFOTO_SUCCESS) {
+    return result;
+  }
+  char *out = infoto_get_edit_file_name(path);
+  if (out == NULL) {
+    infoto_img_file_close(&img);
+    return INFOTO_ERR_MALLOC;
+  }
+  infoto_process_timings timings;
+  infoto_process_stage stage;
+  result = infoto_process_job(worker->handler, *state->background,
+                              *state->font, state->plan, state->process_opts,
+                              &img, out, &timings, &stage);
+  infoto_img_file_close(&img);
+  if (result != INFOTO_SUCCESS) {
+    free(out);
+    return result;
+  }
+  *edited_img = out;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Worker thread, captions landed files until the queue closes.
+ *
+ * @param[in,out] arg The watch worker.
+ * @returns NULL
+ */
+static void *watch_worker_run(void *arg) {
+  struct watch_worker *worker = (struct watch_worker *)arg;
+  struct watch_state *state = worker->state;
+  const infoto_process_options *opts = state->process_opts;
+  void *next;
+  while (infoto_queue_pop(&state->files, &next)) {
+    struct watch_item *item = (struct watch_item *)next;
+    struct stat st;
+    const int have_st = fstatat(AT_FDCWD, item->path, &st, 0) == 0;
+    if (have_st && opts != NULL && opts->journal != NULL &&
+        infoto_journal_is_done(opts->journal, item->path, &st)) {
+      free(item->path);
+      free(item);
+      continue;
+    }
+    char *edited_img = NULL;
+    infoto_error_enum result = process_landed(worker, item->path, &edited_img);
+    struct timespec done;
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    if (result == INFOTO_SUCCESS) {
+      atomic_fetch_add(&state->succeeded, 1);
+      if (have_st && opts != NULL && opts->journal != NULL) {
+        infoto_journal_append(opts->journal, item->path, &st);
+      }
+      // one line per file, flushed so a reader of a pipe sees it right away
+      fprintf(stdout, "Created file: %s (%.1f ms)\n", edited_img,
+              elapsed_ms(&item->landed, &done));
+      fflush(stdout);
+      free(edited_img);
+    } else {
+      atomic_fetch_add(&state->failed, 1);
+      fprintf(stderr, "failed: %s: %s\n", item->path,
+              infoto_err_code_to_str(result));
+    }
+    free(item->path);
+    free(item);
+  }
+  return NULL;
+}
+
+/**
+ * Record a landed file, or push back the due time of one already waiting.
+ *
+ * @param[in,out] state The watch state.
+ * @param[in] path The file, owned by the state afterwards.
+ * @param[in] now The current time.
+ * @param[in] add Flag to add the file when it isn't waiting yet.
+ */
+static void pending_touch(struct watch_state *state, char *path,
+                          const struct timespec *now, int add) {
+  struct timespec due = *now;
+  due.tv_sec += state->opts->debounce_ms / 1000;
+  due.tv_nsec += (long)(state->opts->debounce_ms % 1000) * 1000000;
+  if (due.tv_nsec >= 1000000000) {
+    due.tv_nsec -= 1000000000;
+    ++due.tv_sec;
+  }
+  for (size_t i = 0; i < state->pending_len; ++i) {
+    if (strcmp(state->pending[i].path, path) == 0) {
+      state->pending[i].due = due;
+      free(path);
+      return;
+    }
+  }
+  if (!add) {
+    free(path);
+    return;
+  }
+  if (state->pending_len == state->pending_cap) {
+    const size_t cap = state->pending_cap == 0 ? 16 : state->pending_cap * 2;
+    struct pending_file *grown = (struct pending_file *)realloc(
+        state->pending, cap * sizeof(struct pending_file));
+    if (grown == NULL) {
+      fprintf(stderr, "out of memory, leaving out: %s\n", path);
+      free(path);
+      return;
+    }
+    state->pending = grown;
+    state->pending_cap = cap;
+  }
+  struct pending_file *file = &state->pending[state->pending_len++];
+  file->path = path;
+  file->landed = *now;
+  file->due = due;
+}
+
+/**
+ * Hand the landed files that are due to the workers. While watching this
+ * never waits on the workers, files they have no room for stay waiting so
+ * the inotify events keep being read.
+ *
+ * @param[in,out] state The watch state.
+ * @param[in] now The current time, NULL to hand out every file, waiting for
+ * room.
+ */
+static void dispatch_due(struct watch_state *state,
+                         const struct timespec *now) {
+  const infoto_walk_options *walk = state->opts->walk;
+  size_t kept = 0;
+  state->backed_up = 0;
+  for (size_t i = 0; i < state->pending_len; ++i) {
+    struct pending_file *file = &state->pending[i];
+    // keep landing order, nothing is handed out past a file left waiting
+    if (state->backed_up || (now != NULL && elapsed_ms(now, &file->due) > 0)) {
+      state->pending[kept++] = *file;
+      continue;
+    }
+    struct stat st;
+    struct watch_item *item = NULL;
+    // gone or replaced by something other than a file in the meantime
+    if (fstatat(AT_FDCWD, file->path, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+        (walk == NULL || !walk->check_magic ||
+         infoto_walk_has_jpeg_magic(AT_FDCWD, file->path))) {
+      item = (struct watch_item *)malloc(sizeof(struct watch_item));
+    }
+    if (item == NULL) {
+      free(file->path);
+      continue;
+    }
+    item->path = file->path;
+    item->landed = file->landed;
+    if (now == NULL) {
+      infoto_queue_push(&state->files, item);
+    } else if (!infoto_queue_try_push(&state->files, item)) {
+      free(item);
+      state->backed_up = 1;
+      state->pending[kept++] = *file;
+    }
+  }
+  state->pending_len = kept;
+}
+
+/**
+ * Get the poll timeout until the next landed file is due.
+ *
+ * @param[in] state The watch state.
+ * @param[in] now The current time.
+ * @returns The timeout in milliseconds, -1 when nothing is waiting.
+ */
+static int next_timeout(const struct watch_state *state,
+                        const struct timespec *now) {
+  if (state->pending_len == 0) {
+    return -1;
+  }
+  double wait = elapsed_ms(now, &state->pending[0].due);
+  for (size_t i = 1; i < state->pending_len; ++i) {
+    const double file_wait = elapsed_ms(now, &state->pending[i].due);
+    if (file_wait < wait) {
+      wait = file_wait;
+    }
+  }
+  // the workers are busy, try them again in a moment instead of spinning
+  if (state->backed_up && wait < QUEUE_RETRY_MS) {
+    wait = QUEUE_RETRY_MS;
+  }
+  // round up, waking early would only poll again
+  return wait <= 0 ? 0 : (int)wait + 1;
+}
+
+/**
+ * Watch a directory, and its subdirectories when recursive.
+ *
+ * @param[in,out] state The watch state.
+ * @param[in] dir The directory.
+ * @param[in] queue_files Flag to also record the files already in it, for
+ * directories that appear while watching.
+ * @param[in] now The current time.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum add_watches(struct watch_state *state,
+                                     const char *dir, int queue_files,
+                                     const struct timespec *now) {
+  const uint32_t mask =
+      state->opts->recursive ? WATCH_RECURSIVE_MASK : WATCH_MASK;
+  const int wd = inotify_add_watch(state->fd, dir, mask);
+  if (wd < 0) {
+    fprintf(stderr, "can't watch directory: %s\n", dir);
+    return errno == ENOSPC ? INFOTO_ERR_MALLOC : INFOTO_ERR_OPEN_FILE;
+  }
+  if ((size_t)wd >= state->dirs_cap) {
+    size_t cap = state->dirs_cap == 0 ? 16 : state->dirs_cap;
+    while (cap <= (size_t)wd) {
+      cap *= 2;
+    }
+    char **grown = (char **)realloc(state->dirs, cap * sizeof(char *));
+    if (grown == NULL) {
+      inotify_rm_watch(state->fd, wd);
+      return INFOTO_ERR_MALLOC;
+    }
+    memset(&grown[state->dirs_cap], 0,
+           (cap - state->dirs_cap) * sizeof(char *));
+    state->dirs = grown;
+    state->dirs_cap = cap;
+  }
+  // watching a directory again hands back its descriptor
+  if (state->dirs[wd] == NULL) {
+    ++state->dirs_len;
+  }
+  free(state->dirs[wd]);
+  state->dirs[wd] = strdup(dir);
+  if (!state->opts->recursive && !queue_files) {
+    return INFOTO_SUCCESS;
+  }
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return INFOTO_SUCCESS;
+  }
+  infoto_error_enum result = INFOTO_SUCCESS;
+  struct dirent *entry;
+  while (result == INFOTO_SUCCESS && (entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char *path = join_path(dir, entry->d_name);
+    if (path == NULL) {
+      result = INFOTO_ERR_MALLOC;
+      break;
+    }
+    int type = entry->d_type;
+    struct stat st;
+    if (type == DT_UNKNOWN && fstatat(AT_FDCWD, path, &st,
+                                      AT_SYMLINK_NOFOLLOW) == 0) {
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+    }
+    if (type == DT_DIR && state->opts->recursive) {
+      if (keep_path(state, path, 1)) {
+        result = add_watches(state, path, queue_files, now);
+      }
+      free(path);
+    } else if (type == DT_REG && queue_files &&
+               !infoto_is_edit_file_name(path) && keep_path(state, path, 0)) {
+      pending_touch(state, path, now, 1);
+    } else {
+      free(path);
+    }
+  }
+  closedir(d);
+  return result;
+}
+
+/**
+ * Handle an inotify event.
+ *
+ * @param[in,out] state The watch state.
+ * @param[in] event The event.
+ * @param[in] now The current time.
+ */
+static void handle_event(struct watch_state *state,
+                         const struct inotify_event *event,
+                         const struct timespec *now) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    fprintf(stderr, "watch events were dropped, files may be missed.\n");
+    return;
+  }
+  if (event->wd < 0 || (size_t)event->wd >= state->dirs_cap ||
+      state->dirs[event->wd] == NULL) {
+    return;
+  }
+  if (event->mask & IN_IGNORED) {
+    // the directory was removed or unmounted
+    free(state->dirs[event->wd]);
+    state->dirs[event->wd] = NULL;
+    --state->dirs_len;
+    return;
+  }
+  if (event->len == 0) {
+    return;
+  }
+  char *path = join_path(state->dirs[event->wd], event->name);
+  if (path == NULL) {
+    return;
+  }
+  if (event->mask & IN_ISDIR) {
+    if (state->opts->recursive && (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+        keep_path(state, path, 1)) {
+      add_watches(state, path, 1, now);
+    }
+    free(path);
+    return;
+  }
+  // never caption our own outputs
+  if (infoto_is_edit_file_name(path) || !keep_path(state, path, 0)) {
+    free(path);
+    return;
+  }
+  // a write to a waiting file only holds it back, it lands once closed
+  pending_touch(state, path, now,
+                (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0);
+}
+
+/**
+ * Watch a directory and caption every image that lands in it until stopped.
+ * Files are picked up with inotify when they are closed after writing or
+ * moved in, so the directory is never rescanned. A file is processed once
+ * it has been untouched for the debounce time, by one of the workers, each
+ * with its own handler. Images already in the directory are left alone.
+ * Files and directories the walk filters leave out are ignored. On stop
+ * the landed files are still processed before returning.
+ *
+ * @param[in] handlers The image handlers, one per worker.
+ * @param[in] handlers_len The number of image handlers.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] process_opts The process options, NULL for defaults.
+ * @param[in] root The directory to watch.
+ * @param[in] opts The watch options.
+ * @param[in] stop The flag set, from a signal handler, to stop watching.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_watch_run(struct infoto_img_handler *handlers,
+                                   int handlers_len,
+                                   const background_info background,
+                                   const font_info font,
+                                   const infoto_exif_plan *plan,
+                                   const infoto_process_options *process_opts,
+                                   const char *root,
+                                   const infoto_watch_options *opts,
+                                   volatile sig_atomic_t *stop) {
+  if (handlers_len <= 0) {
+    return INFOTO_ERR_NULL;
+  }
+  struct watch_state state;
+  memset(&state, 0, sizeof(state));
+  state.background = &background;
+  state.font = &font;
+  state.plan = plan;
+  state.process_opts = process_opts;
+  state.opts = opts;
+  const size_t root_len = strlen(root);
+  state.rel_offset =
+      root_len + (root_len > 0 && root[root_len - 1] != '/' ? 1 : 0);
+  atomic_init(&state.succeeded, 0);
+  atomic_init(&state.failed, 0);
+  state.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (state.fd < 0) {
+    fprintf(stderr, "can't start watching: %s\n", strerror(errno));
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  infoto_error_enum result = add_watches(&state, root, 0, &now);
+  struct watch_worker *workers = NULL;
+  if (result == INFOTO_SUCCESS) {
+    workers = (struct watch_worker *)calloc(handlers_len,
+                                            sizeof(struct watch_worker));
+    if (workers == NULL) {
+      result = INFOTO_ERR_MALLOC;
+    }
+  }
+  int queue_ready = 0;
+  if (result == INFOTO_SUCCESS) {
+    result = infoto_queue_init(
+        &state.files, (size_t)handlers_len * QUEUE_ITEMS_PER_WORKER, 1);
+    queue_ready = result == INFOTO_SUCCESS;
+  }
+  // the stop signals are only taken inside ppoll below, one arriving between
+  // the check of the flag and the wait would otherwise be lost until the
+  // next event. Workers never take them.
+  sigset_t stop_signals, old_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+  int started = 0;
+  if (result == INFOTO_SUCCESS) {
+    for (; started < handlers_len; ++started) {
+      workers[started].state = &state;
+      workers[started].handler = &handlers[started];
+      if (pthread_create(&workers[started].thread, NULL, watch_worker_run,
+                         &workers[started]) != 0) {
+        break;
+      }
+    }
+    if (started == 0) {
+      fprintf(stderr, "failed to start the watch workers.\n");
+      result = INFOTO_ERR_MALLOC;
+    } else {
+      fprintf(stderr, "watching %s (%zu directories), %d workers\n", root,
+              state.dirs_len, started);
+    }
+  }
+  char *events = result == INFOTO_SUCCESS ? (char *)malloc(EVENT_BUF_LEN)
+                                          : NULL;
+  if (result == INFOTO_SUCCESS && events == NULL) {
+    result = INFOTO_ERR_MALLOC;
+  }
+  while (result == INFOTO_SUCCESS && !*stop && state.dirs_len > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct pollfd pfd = {state.fd, POLLIN, 0};
+    const int timeout = next_timeout(&state, &now);
+    const struct timespec wait = {timeout / 1000,
+                                  (long)(timeout % 1000) * 1000000};
+    const int ready =
+        ppoll(&pfd, 1, timeout < 0 ? NULL : &wait, &old_mask);
+    if (ready < 0 && errno != EINTR) {
+      fprintf(stderr, "watching failed: %s\n", strerror(errno));
+      result = INFOTO_ERR_OPEN_FILE;
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (;;) {
+      const ssize_t n = read(state.fd, events, EVENT_BUF_LEN);
+      if (n <= 0) {
+        break;
+      }
+      for (ssize_t pos = 0; pos < n;) {
+        const struct inotify_event *event =
+            (const struct inotify_event *)&events[pos];
+        handle_event(&state, event, &now);
+        pos += sizeof(struct inotify_event) + event->len;
+      }
+    }
+    dispatch_due(&state, &now);
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  free(events);
+  // files that already landed are still captioned
+  if (started > 0) {
+    dispatch_due(&state, NULL);
+    infoto_queue_producer_done(&state.files);
+    for (int i = 0; i < started; ++i) {
+      pthread_join(workers[i].thread, NULL);
+    }
+    fprintf(stderr, "summary: %zu succeeded, %zu failed\n",
+            atomic_load(&state.succeeded), atomic_load(&state.failed));
+  }
+  if (queue_ready) {
+    infoto_queue_free(&state.files);
+  }
+  for (size_t i = 0; i < state.pending_len; ++i) {
+    free(state.pending[i].path);
+  }
+  free(state.pending);
+  for (size_t i = 0; i < state.dirs_cap; ++i) {
+    free(state.dirs[i]);
+  }
+  free(state.dirs);
+  free(workers);
+  close(state.fd);
+  return result;
+}
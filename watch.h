@@ -0,0 +1,66 @@
+#ifndef INFOTO_WATCH_H
+#define INFOTO_WATCH_H
+
+#include <signal.h>
+
+#include "config.h"
+#include "error_codes.h"
+#include "exif.h"
+#include "img_utils.h"
+#include "process.h"
+#include "walk.h"
+
+/* Default quiet time after a file lands before it is processed */
+#define INFOTO_WATCH_DEFAULT_DEBOUNCE_MS 20
+
+/**
+ * Options for watching a directory for new images.
+ */
+typedef struct {
+  // flag to also watch subdirectories, including ones created later
+  int recursive;
+  // milliseconds a file must stay untouched before it is processed
+  int debounce_ms;
+  // filters of the files and directories to caption and watch, the same as
+  // a walk of the tree, NULL for every one
+  const infoto_walk_options *walk;
+} infoto_watch_options;
+
+/**
+ * Initialize watch options with the defaults.
+ *
+ * @param[out] opts The options to initialize.
+ */
+void infoto_watch_options_init(infoto_watch_options *opts);
+
+/**
+ * Watch a directory and caption every image that lands in it until stopped.
+ * Files are picked up with inotify when they are closed after writing or
+ * moved in, so the directory is never rescanned. A file is processed once
+ * it has been untouched for the debounce time, by one of the workers, each
+ * with its own handler. Images already in the directory are left alone.
+ * Files and directories the walk filters leave out are ignored. On stop
+ * the landed files are still processed before returning.
+ *
+ * @param[in] handlers The image handlers, one per worker.
+ * @param[in] handlers_len The number of image handlers.
+ * @param[in] background The background info.
+ * @param[in] font The font info.
+ * @param[in] plan The compiled EXIF extraction plan.
+ * @param[in] process_opts The process options, NULL for defaults.
+ * @param[in] root The directory to watch.
+ * @param[in] opts The watch options.
+ * @param[in] stop The flag set, from a signal handler, to stop watching.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_watch_run(struct infoto_img_handler *handlers,
+                                   int handlers_len,
+                                   const background_info background,
+                                   const font_info font,
+                                   const infoto_exif_plan *plan,
+                                   const infoto_process_options *process_opts,
+                                   const char *root,
+                                   const infoto_watch_options *opts,
+                                   volatile sig_atomic_t *stop);
+
+#endif
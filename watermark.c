@@ -0,0 +1,473 @@
+#include "watermark.h"
+#include "blend.h"
+#include "hash_util.h"
+
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INFOTO_WATERMARK_BOTTOM_RIGHT "bottom_right"
+#define INFOTO_WATERMARK_BOTTOM_LEFT "bottom_left"
+#define INFOTO_WATERMARK_TOP_RIGHT "top_right"
+#define INFOTO_WATERMARK_TOP_LEFT "top_left"
+#define INFOTO_WATERMARK_CENTER "center"
+#define INFOTO_WATERMARK_BORDER "border"
+#define INFOTO_WATERMARK_IMAGE "image"
+
+/**
+ * A premultiplied copy of the logo scaled to one size.
+ */
+struct scaled_logo {
+  int width;
+  int height;
+  int num_components;
+  uint8_t *pixels;
+  uint8_t *alpha;
+  // tick of the last use, 0 when the entry is empty
+  uint64_t last_used;
+};
+
+/**
+ * A PNG logo decoded once, with premultiplied copies scaled for the most
+ * recent target sizes.
+ */
+struct infoto_watermark {
+  // decoded logo, straight RGBA
+  uint8_t *rgba;
+  // flag for if the decoded logo is freed with this watermark
+  int owns_rgba;
+  int width;
+  int height;
+  // opacity in 0 to 255
+  unsigned opacity;
+  float scale;
+  watermark_anchor anchor;
+  watermark_placement placement;
+  struct scaled_logo sizes[INFOTO_WATERMARK_MAX_SIZES];
+  uint64_t tick;
+};
+
+/**
+ * Get watermark_anchor enum from the given string.
+ *
+ * @param[in] s Name of the anchor.
+ * @return watermark_anchor from the given string, WATERMARK_BOTTOM_RIGHT is
+ * default if the name cannot be resolved.
+ */
+watermark_anchor infoto_get_watermark_anchor_from_string(const char *s) {
+  if (strcmp(INFOTO_WATERMARK_BOTTOM_LEFT, s) == 0)
+    return WATERMARK_BOTTOM_LEFT;
+  if (strcmp(INFOTO_WATERMARK_TOP_RIGHT, s) == 0)
+    return WATERMARK_TOP_RIGHT;
+  if (strcmp(INFOTO_WATERMARK_TOP_LEFT, s) == 0)
+    return WATERMARK_TOP_LEFT;
+  if (strcmp(INFOTO_WATERMARK_CENTER, s) == 0)
+    return WATERMARK_CENTER;
+  return WATERMARK_BOTTOM_RIGHT;
+}
+
+/**
+ * Get watermark_placement enum from the given string.
+ *
+ * @param[in] s Name of the placement.
+ * @return watermark_placement from the given string, WATERMARK_ON_BORDER is
+ * default if the name cannot be resolved.
+ */
+watermark_placement infoto_get_watermark_placement_from_string(const char *s) {
+  if (strcmp(INFOTO_WATERMARK_IMAGE, s) == 0)
+    return WATERMARK_ON_IMAGE;
+  return WATERMARK_ON_BORDER;
+}
+
+/**
+ * Initialize a watermark, decoding its PNG file.
+ *
+ * @param[in] info The watermark info.
+ * @param[out] watermark The watermark to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_watermark_init(const watermark_info *info,
+                                        infoto_watermark **watermark) {
+  if (info->png_file == NULL) {
+    return INFOTO_ERR_NULL;
+  }
+  png_image image;
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&image, info->png_file)) {
+    fprintf(stderr, "can't read png file %s: %s\n", info->png_file,
+            image.message);
+    return INFOTO_ERR_OPEN_FILE;
+  }
+  // palette, gray and 16-bit logos all come out as 8-bit RGBA
+  image.format = PNG_FORMAT_RGBA;
+  uint8_t *rgba = (uint8_t *)malloc(PNG_IMAGE_SIZE(image));
+  if (rgba == NULL) {
+    png_image_free(&image);
+    return INFOTO_ERR_MALLOC;
+  }
+  if (!png_image_finish_read(&image, NULL, rgba, 0, NULL)) {
+    fprintf(stderr, "can't decode png file %s: %s\n", info->png_file,
+            image.message);
+    free(rgba);
+    return INFOTO_ERR_IMG_READ;
+  }
+  struct infoto_watermark *local =
+      (struct infoto_watermark *)calloc(1, sizeof(struct infoto_watermark));
+  if (local == NULL) {
+    free(rgba);
+    return INFOTO_ERR_MALLOC;
+  }
+  local->rgba = rgba;
+  local->owns_rgba = 1;
+  local->width = image.width;
+  local->height = image.height;
+  float opacity = info->opacity;
+  if (opacity < 0.0f) {
+    opacity = 0.0f;
+  } else if (opacity > 1.0f) {
+    opacity = 1.0f;
+  }
+  local->opacity = (unsigned)(opacity * 255.0f + 0.5f);
+  local->scale = info->scale;
+  local->anchor = info->anchor;
+  local->placement = info->placement;
+  *watermark = local;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Initialize a watermark that shares the decoded logo of another one, with
+ * its own scaled sizes. Each thread places logos with its own copy.
+ *
+ * @param[in] src The watermark to copy, must outlive the copy.
+ * @param[out] watermark The watermark to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_watermark_copy(const infoto_watermark *src,
+                                        infoto_watermark **watermark) {
+  struct infoto_watermark *local =
+      (struct infoto_watermark *)calloc(1, sizeof(struct infoto_watermark));
+  if (local == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  local->rgba = src->rgba;
+  local->owns_rgba = 0;
+  local->width = src->width;
+  local->height = src->height;
+  local->opacity = src->opacity;
+  local->scale = src->scale;
+  local->anchor = src->anchor;
+  local->placement = src->placement;
+  *watermark = local;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Divide by 255 with rounding, exact for x <= 255 * 255.
+ *
+ * @param[in] x The value to divide.
+ * @returns The rounded quotient.
+ */
+static inline uint8_t div255(unsigned x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+/**
+ * Scale the decoded logo into a premultiplied copy with the opacity applied.
+ * Every output pixel averages the box of source pixels it covers, weighted
+ * by alpha so transparent pixels do not darken the edges.
+ *
+ * @param[in] watermark The watermark.
+ * @param[in,out] logo The scaled logo, its size is set by the caller.
+ */
+static void scale_logo(const struct infoto_watermark *watermark,
+                       struct scaled_logo *logo) {
+  const int src_w = watermark->width;
+  const int src_h = watermark->height;
+  const int nc = logo->num_components;
+  for (int y = 0; y < logo->height; ++y) {
+    const int sy0 = (int)((int64_t)y * src_h / logo->height);
+    int sy1 = (int)((int64_t)(y + 1) * src_h / logo->height);
+    if (sy1 <= sy0) {
+      sy1 = sy0 + 1;
+    }
+    for (int x = 0; x < logo->width; ++x) {
+      const int sx0 = (int)((int64_t)x * src_w / logo->width);
+      int sx1 = (int)((int64_t)(x + 1) * src_w / logo->width);
+      if (sx1 <= sx0) {
+        sx1 = sx0 + 1;
+      }
+      uint64_t sums[3] = {0, 0, 0};
+      uint64_t alpha_sum = 0;
+      for (int sy = sy0; sy < sy1; ++sy) {
+        const uint8_t *src = &watermark->rgba[((size_t)sy * src_w + sx0) * 4];
+        for (int sx = sx0; sx < sx1; ++sx, src += 4) {
+          const unsigned a = src[3];
+          sums[0] += src[0] * a;
+          sums[1] += src[1] * a;
+          sums[2] += src[2] * a;
+          alpha_sum += a;
+        }
+      }
+      const uint64_t n = (uint64_t)(sy1 - sy0) * (sx1 - sx0);
+      const uint64_t div = n * 255;
+      const size_t idx = (size_t)y * logo->width + x;
+      const unsigned alpha = (alpha_sum + n / 2) / n;
+      logo->alpha[idx] = div255(alpha * watermark->opacity);
+      unsigned c[3];
+      for (int i = 0; i < 3; ++i) {
+        c[i] = (sums[i] + div / 2) / div;
+      }
+      uint8_t *dst = &logo->pixels[idx * nc];
+      if (nc == 1) {
+        // same luma weights as infoto_pixel_components
+        dst[0] = div255(((c[0] * 77 + c[1] * 150 + c[2] * 29) >> 8) *
+                        watermark->opacity);
+        continue;
+      }
+      for (int i = 0; i < 3 && i < nc; ++i) {
+        dst[i] = div255(c[i] * watermark->opacity);
+      }
+      if (nc == 4) {
+        dst[3] = logo->alpha[idx];
+      }
+    }
+  }
+}
+
+/**
+ * Get the logo scaled to the given size, scaling it on a miss into the least
+ * recently used entry.
+ *
+ * @param[in,out] watermark The watermark.
+ * @param[in] width The logo width.
+ * @param[in] height The logo height.
+ * @param[in] num_components The number of pixel components.
+ * @param[out] out The scaled logo.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+static infoto_error_enum get_scaled(struct infoto_watermark *watermark,
+                                    int width, int height, int num_components,
+                                    const struct scaled_logo **out) {
+  struct scaled_logo *victim = &watermark->sizes[0];
+  for (int i = 0; i < INFOTO_WATERMARK_MAX_SIZES; ++i) {
+    struct scaled_logo *logo = &watermark->sizes[i];
+    if (logo->last_used != 0 && logo->width == width &&
+        logo->height == height && logo->num_components == num_components) {
+      logo->last_used = ++watermark->tick;
+      *out = logo;
+      return INFOTO_SUCCESS;
+    }
+    if (logo->last_used < victim->last_used) {
+      victim = logo;
+    }
+  }
+  const size_t len = (size_t)width * height;
+  uint8_t *pixels = (uint8_t *)realloc(victim->pixels, len * num_components);
+  if (pixels == NULL) {
+    return INFOTO_ERR_MALLOC;
+  }
+  victim->pixels = pixels;
+  uint8_t *alpha = (uint8_t *)realloc(victim->alpha, len);
+  if (alpha == NULL) {
+    victim->last_used = 0;
+    return INFOTO_ERR_MALLOC;
+  }
+  victim->alpha = alpha;
+  victim->width = width;
+  victim->height = height;
+  victim->num_components = num_components;
+  scale_logo(watermark, victim);
+  victim->last_used = ++watermark->tick;
+  *out = victim;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Shrink the logo size to fit within the max size, keeping its aspect ratio.
+ *
+ * @param[in] watermark The watermark.
+ * @param[in] max_width The max logo width.
+ * @param[in] max_height The max logo height.
+ * @param[in,out] width The logo width.
+ * @param[in,out] height The logo height.
+ */
+static void fit_size(const struct infoto_watermark *watermark, int max_width,
+                     int max_height, int *width, int *height) {
+  if (*width > max_width) {
+    *width = max_width;
+    *height = (int)((int64_t)*width * watermark->height / watermark->width);
+  }
+  if (*height > max_height) {
+    *height = max_height;
+    *width = (int)((int64_t)*height * watermark->width / watermark->height);
+  }
+}
+
+/**
+ * Place the logo on an output image, scaling it only when this size was not
+ * scaled before.
+ *
+ * @param[in,out] watermark The watermark.
+ * @param[in] image_width The source image width.
+ * @param[in] image_height The source image height.
+ * @param[in] border The border size around the image in pixels.
+ * @param[in] num_components The number of pixel components.
+ * @param[out] stage The placed logo, valid until the next place.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_watermark_place(infoto_watermark *watermark,
+                                         int image_width, int image_height,
+                                         int border, int num_components,
+                                         infoto_watermark_stage *stage) {
+  memset(stage, 0, sizeof(infoto_watermark_stage));
+  stage->num_components = num_components;
+  const int output_width = image_width + border * 2;
+  int width = (int)(watermark->scale * image_width + 0.5f);
+  int height = (int)((int64_t)width * watermark->height / watermark->width);
+  const int right = watermark->anchor == WATERMARK_BOTTOM_RIGHT ||
+                    watermark->anchor == WATERMARK_TOP_RIGHT;
+  const int left = watermark->anchor == WATERMARK_BOTTOM_LEFT ||
+                   watermark->anchor == WATERMARK_TOP_LEFT;
+  const int bottom = watermark->anchor == WATERMARK_BOTTOM_RIGHT ||
+                     watermark->anchor == WATERMARK_BOTTOM_LEFT;
+  if (watermark->placement == WATERMARK_ON_BORDER) {
+    // centered in the top or bottom border, lined up with the image's sides.
+    // the caption is centered in the bottom border so center uses the top.
+    const int pad = border / 8;
+    fit_size(watermark, output_width, border - pad * 2, &width, &height);
+    stage->region = bottom ? INFOTO_ROW_REGION_BOTTOM : INFOTO_ROW_REGION_TOP;
+    stage->y = (border - height) / 2;
+    if (left) {
+      stage->x = border;
+    } else if (right) {
+      stage->x = border + image_width - width;
+    } else {
+      stage->x = (output_width - width) / 2;
+    }
+  } else {
+    const int pad = (image_width < image_height ? image_width : image_height) /
+                    50;
+    fit_size(watermark, image_width - pad * 2, image_height - pad * 2, &width,
+             &height);
+    stage->region = INFOTO_ROW_REGION_BODY;
+    if (left) {
+      stage->x = border + pad;
+    } else if (right) {
+      stage->x = border + image_width - pad - width;
+    } else {
+      stage->x = border + (image_width - width) / 2;
+    }
+    if (watermark->anchor == WATERMARK_CENTER) {
+      stage->y = (image_height - height) / 2;
+    } else if (bottom) {
+      stage->y = image_height - pad - height;
+    } else {
+      stage->y = pad;
+    }
+  }
+  // never past the sides of the output
+  if (stage->x < 0) {
+    stage->x = 0;
+  } else if (stage->x + width > output_width) {
+    stage->x = output_width - width;
+  }
+  if (width <= 0 || height <= 0) {
+    // no room for the logo, the stage does nothing
+    return INFOTO_SUCCESS;
+  }
+  const struct scaled_logo *logo;
+  infoto_error_enum err_code =
+      get_scaled(watermark, width, height, num_components, &logo);
+  if (err_code != INFOTO_SUCCESS) {
+    return err_code;
+  }
+  stage->pixels = logo->pixels;
+  stage->alpha = logo->alpha;
+  stage->width = width;
+  stage->height = height;
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Hash the decoded logo and its settings, identifying what gets blended.
+ *
+ * @param[in] watermark The watermark.
+ * @returns The hash of the watermark.
+ */
+uint64_t infoto_watermark_hash(const infoto_watermark *watermark) {
+  const int64_t settings[] = {watermark->width, watermark->height,
+                              watermark->opacity,
+                              (int64_t)(watermark->scale * 1e6f),
+                              watermark->anchor, watermark->placement};
+  uint64_t hash = infoto_hash64(settings, sizeof(settings), 0);
+  return infoto_hash64(watermark->rgba,
+                       (size_t)watermark->width * watermark->height * 4, hash);
+}
+
+/**
+ * Free the watermark.
+ *
+ * @param[in,out] watermark The watermark to free.
+ */
+void infoto_watermark_free(infoto_watermark **watermark) {
+  struct infoto_watermark *local = *watermark;
+  if (local == NULL) {
+    return;
+  }
+  for (int i = 0; i < INFOTO_WATERMARK_MAX_SIZES; ++i) {
+    free(local->sizes[i].pixels);
+    free(local->sizes[i].alpha);
+  }
+  if (local->owns_rgba) {
+    free(local->rgba);
+  }
+  free(local);
+  *watermark = NULL;
+}
+
+/**
+ * Blend the placed logo into the batch rows it covers.
+ *
+ * @param[in] ctx The infoto_watermark_stage.
+ * @param[in,out] batch The batch.
+ * @returns INFOTO_SUCCESS.
+ */
+static infoto_error_enum watermark_stage_process(void *ctx,
+                                                 infoto_row_batch *batch) {
+  const infoto_watermark_stage *placed = (const infoto_watermark_stage *)ctx;
+  if (placed->width == 0 || batch->region != placed->region) {
+    return INFOTO_SUCCESS;
+  }
+  const int nc = placed->num_components;
+  const int y0 = placed->y > batch->y ? placed->y : batch->y;
+  const int y1 = placed->y + placed->height < batch->y + batch->count
+                     ? placed->y + placed->height
+                     : batch->y + batch->count;
+  for (int y = y0; y < y1; ++y) {
+    // border rows may point into a shared strip
+    uint8_t *row = infoto_row_batch_own_row(batch, y - batch->y);
+    const size_t logo_row = (size_t)(y - placed->y) * placed->width;
+    infoto_blend_premultiplied(&row[(size_t)placed->x * nc],
+                               &placed->pixels[logo_row * nc],
+                               &placed->alpha[logo_row], placed->width, nc);
+  }
+  return INFOTO_SUCCESS;
+}
+
+/**
+ * Get a stage that blends the placed logo into the rows it covers.
+ *
+ * @param[in] placed The placed logo, must outlive the run.
+ * @returns The stage.
+ */
+infoto_row_stage
+infoto_watermark_stage_get(const infoto_watermark_stage *placed) {
+  infoto_row_stage stage;
+  stage.ctx = (void *)placed;
+  stage.process = watermark_stage_process;
+  return stage;
+}
@@ -0,0 +1,118 @@
+#ifndef INFOTO_WATERMARK_H
+#define INFOTO_WATERMARK_H
+
+#include <stdint.h>
+
+#include "config.h"
+#include "error_codes.h"
+#include "row_pipeline.h"
+
+/* Number of scaled logo sizes kept */
+#define INFOTO_WATERMARK_MAX_SIZES 4
+
+/**
+ * A PNG logo decoded once, with premultiplied copies scaled for the most
+ * recent target sizes.
+ */
+typedef struct infoto_watermark infoto_watermark;
+
+/**
+ * A scaled logo placed on the output image.
+ * Every row of the logo falls in one region of the output.
+ */
+typedef struct {
+  // premultiplied logo with the opacity applied, num_components per pixel
+  const uint8_t *pixels;
+  // alpha with the opacity applied, one value per pixel
+  const uint8_t *alpha;
+  // logo size in pixels, 0 for no logo
+  int width;
+  int height;
+  int num_components;
+  infoto_row_region region;
+  // x in output pixels, y in rows of the region
+  int x;
+  int y;
+} infoto_watermark_stage;
+
+/**
+ * Get watermark_anchor enum from the given string.
+ *
+ * @param[in] s Name of the anchor.
+ * @return watermark_anchor from the given string, WATERMARK_BOTTOM_RIGHT is
+ * default if the name cannot be resolved.
+ */
+watermark_anchor infoto_get_watermark_anchor_from_string(const char *s);
+
+/**
+ * Get watermark_placement enum from the given string.
+ *
+ * @param[in] s Name of the placement.
+ * @return watermark_placement from the given string, WATERMARK_ON_BORDER is
+ * default if the name cannot be resolved.
+ */
+watermark_placement infoto_get_watermark_placement_from_string(const char *s);
+
+/**
+ * Initialize a watermark, decoding its PNG file.
+ *
+ * @param[in] info The watermark info.
+ * @param[out] watermark The watermark to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_watermark_init(const watermark_info *info,
+                                        infoto_watermark **watermark);
+
+/**
+ * Initialize a watermark that shares the decoded logo of another one, with
+ * its own scaled sizes. Each thread places logos with its own copy.
+ *
+ * @param[in] src The watermark to copy, must outlive the copy.
+ * @param[out] watermark The watermark to initialize.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_watermark_copy(const infoto_watermark *src,
+                                        infoto_watermark **watermark);
+
+/**
+ * Place the logo on an output image, scaling it only when this size was not
+ * scaled before.
+ *
+ * @param[in,out] watermark The watermark.
+ * @param[in] image_width The source image width.
+ * @param[in] image_height The source image height.
+ * @param[in] border The border size around the image in pixels.
+ * @param[in] num_components The number of pixel components.
+ * @param[out] stage The placed logo, valid until the next place.
+ * @returns INFOTO_SUCCESS if successful, otherwise an error code.
+ */
+infoto_error_enum infoto_watermark_place(infoto_watermark *watermark,
+                                         int image_width, int image_height,
+                                         int border, int num_components,
+                                         infoto_watermark_stage *stage);
+
+/**
+ * Hash the decoded logo and its settings, identifying what gets blended.
+ *
+ * @param[in] watermark The watermark.
+ * @returns The hash of the watermark.
+ */
+uint64_t infoto_watermark_hash(const infoto_watermark *watermark);
+
+/**
+ * Free the watermark.
+ *
+ * @param[in,out] watermark The watermark to free.
+ */
+void infoto_watermark_free(infoto_watermark **watermark);
+
+/**
+ * Get a stage that blends the placed logo into the rows it covers.
+ *
+ * @param[in] placed The placed logo, must outlive the run.
+ * @returns The stage.
+ */
+infoto_row_stage
+infoto_watermark_stage_get(const infoto_watermark_stage *placed);
+
+#endif